@@ -0,0 +1,54 @@
+//
+// Benchmark helpers implementation
+
+#include "benchUtil.h"
+#include <time.h>
+#include <stdlib.h>
+
+/**
+ * @brief Reads the monotonic clock
+ *
+ * @returns Nanoseconds since an arbitrary fixed point
+ */
+long
+bench_nowNs() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+static int compareDoubles(const void *a, const void *b) {
+	double x = *(const double *)a, y = *(const double *)b;
+	return x < y ? -1 : x > y;
+}
+
+/**
+ * @brief Median of the values, sorts them in place
+ *
+ * @params values Values to take the median of
+ * @params count Number of values, at least 1
+ * @returns Median of the values
+ */
+double
+bench_median(double *values, int count) {
+	qsort(values, count, sizeof(double), &compareDoubles);
+	return count % 2 ? values[count / 2] : (values[count / 2 - 1] + values[count / 2]) / 2;
+}
+
+/**
+ * @brief Median absolute deviation of the values from their median, overwrites the
+ * values with their deviations
+ *
+ * @params values Values to take the deviation of
+ * @params count Number of values, at least 1
+ * @params median Median of the values
+ * @returns Median absolute deviation
+ */
+double
+bench_mad(double *values, int count, double median) {
+	int i;
+	for (i = 0; i < count; i++) {
+		values[i] = values[i] > median ? values[i] - median : median - values[i];
+	}
+	return bench_median(values, count);
+}
@@ -0,0 +1,40 @@
+//
+// Benchmark helpers header
+//
+// Clock and statistics shared by the benchmark tools.
+
+#pragma once
+#ifndef BENCHUTIL_H_
+#define BENCHUTIL_H_
+
+/**
+ * @brief Reads the monotonic clock
+ *
+ * @returns Nanoseconds since an arbitrary fixed point
+ */
+long
+bench_nowNs();
+
+/**
+ * @brief Median of the values, sorts them in place
+ *
+ * @params values Values to take the median of
+ * @params count Number of values, at least 1
+ * @returns Median of the values
+ */
+double
+bench_median(double *values, int count);
+
+/**
+ * @brief Median absolute deviation of the values from their median, overwrites the
+ * values with their deviations
+ *
+ * @params values Values to take the deviation of
+ * @params count Number of values, at least 1
+ * @params median Median of the values
+ * @returns Median absolute deviation
+ */
+double
+bench_mad(double *values, int count, double median);
+
+#endif
@@ -0,0 +1,143 @@
+//
+// Chained HashTable implementation
+
+#include "chainedHashTable.h"
+#include "../collections/hashFunction.h"
+#include <stdlib.h>
+#include <string.h>
+
+/**
+ * @brief Initializes a chained table with the specified number of buckets
+ *
+ * @params bucketCount Number of buckets, never changes
+ * @returns Pointer to an initialized ChainedTable
+ */
+ChainedTable *
+cht_init(int bucketCount) {
+	ChainedTable *table = (ChainedTable *)calloc(1, sizeof(ChainedTable));
+	table->table = (ChainedEntry **)calloc(bucketCount, sizeof(ChainedEntry *));
+	table->limit = bucketCount;
+
+	return table;
+}
+
+/**
+ * @brief Inserts the data into the table with the given key
+ *
+ * @params table ChainedTable to insert into
+ * @params key Key of the element to insert
+ * @params data Data to insert
+ */
+void 
+cht_insert(ChainedTable *table, char *key, void *data) {
+	ChainedEntry *entry = (ChainedEntry *)calloc(1, sizeof(ChainedEntry));
+	entry->key = key;
+	entry->data = data;
+
+	// First insert into the end of the linked list
+	if (table->head == NULL) {
+		table->head = table->tail = entry;
+	}
+	else {
+		table->tail->next = entry;
+		entry->prev = table->tail;
+		table->tail = entry;
+	}
+
+	// Append to the end of the bucket
+	unsigned int index = hf_fnv1a(key) % table->limit;
+	if (table->table[index] == NULL) {
+		table->table[index] = entry;
+	}
+	else {
+		ChainedEntry *bucket = table->table[index];
+		while (bucket->bucket_next != NULL) {
+			bucket = bucket->bucket_next;
+		}
+		bucket->bucket_next = entry;
+		entry->bucket_prev = bucket;
+	}
+	table->elements++;
+}
+
+/**
+ * @brief Searches the table for the element with the key
+ *
+ * @params table ChainedTable to search
+ * @params key Key of the element to find
+ * @returns Data element found
+ */
+void* 
+cht_find(ChainedTable *table, char *key) {
+	if (key == NULL)
+	    return NULL;
+
+	ChainedEntry *bucket = table->table[hf_fnv1a(key) % table->limit];
+	while (bucket != NULL && strcmp(bucket->key, key) != 0) {
+		bucket = bucket->bucket_next;
+	}
+	return bucket != NULL ? bucket->data : NULL;
+}
+
+/**
+ * @brief Removes the specified key from the table
+ *
+ * @params table ChainedTable to search
+ * @params key Key of element to remove
+ */
+void 
+cht_remove(ChainedTable *table, char *key) {
+	if (key == NULL)
+		return;
+
+	unsigned int index = hf_fnv1a(key) % table->limit;
+	ChainedEntry *bucket = table->table[index];
+	while (bucket != NULL && strcmp(bucket->key, key) != 0) {
+		bucket = bucket->bucket_next;
+	}
+	if (bucket == NULL) {
+		return;
+	}
+
+	// Unlink from both the bucket and the insertion order
+	if (bucket->bucket_prev != NULL) {
+		bucket->bucket_prev->bucket_next = bucket->bucket_next;
+	}
+	else {
+		table->table[index] = bucket->bucket_next;
+	}
+	if (bucket->bucket_next != NULL) {
+		bucket->bucket_next->bucket_prev = bucket->bucket_prev;
+	}
+	if (bucket->next != NULL) {
+		bucket->next->prev = bucket->prev;
+	}
+	else {
+		table->tail = bucket->prev;
+	}
+	if (bucket->prev != NULL) {
+		bucket->prev->next = bucket->next;
+	}
+	else {
+		table->head = bucket->next;
+	}
+	table->elements--;
+	free(bucket);
+}
+
+/**
+ * @brief Frees all elements in the table
+ *
+ * @params table ChainedTable to free
+ */
+void 
+cht_free(ChainedTable *table) {
+	ChainedEntry *node = table->head;
+	while (node != NULL) {
+		ChainedEntry *curr = node;
+		node = curr->next;
+		free(curr);
+	}
+	free(table->table);
+	free(table);
+}
@@ -0,0 +1,74 @@
+//
+// Chained HashTable header
+//
+// Copy of the separately chained table collections/hashTable replaced, kept so
+// hashbench can compare against it. Fixed bucket count, one allocation per entry, unkeyed FNV-1a.
+
+#pragma once
+#ifndef CHAINEDHASHTABLE_H_
+#define CHAINEDHASHTABLE_H_
+
+typedef struct _ChainedEntry {
+	char *key;
+	void *data;
+	struct _ChainedEntry *next;
+	struct _ChainedEntry *prev;
+	struct _ChainedEntry *bucket_next;
+	struct _ChainedEntry *bucket_prev;
+} ChainedEntry;
+
+typedef struct _ChainedTable {
+	ChainedEntry **table;
+	ChainedEntry *head;
+	ChainedEntry *tail;
+	int elements;
+	int limit;
+} ChainedTable;
+
+/**
+ * @brief Initializes a chained table with the specified number of buckets
+ *
+ * @params bucketCount Number of buckets, never changes
+ * @returns Pointer to an initialized ChainedTable
+ */
+ChainedTable *
+cht_init(int bucketCount);
+
+/**
+ * @brief Inserts the data into the table with the given key
+ *
+ * @params table ChainedTable to insert into
+ * @params key Key of the element to insert
+ * @params data Data to insert
+ */
+void 
+cht_insert(ChainedTable *table, char *key, void *data);
+
+/**
+ * @brief Searches the table for the element with the key
+ *
+ * @params table ChainedTable to search
+ * @params key Key of the element to find
+ * @returns Data element found
+ */
+void* 
+cht_find(ChainedTable *table, char *key);
+
+/**
+ * @brief Removes the specified key from the table
+ *
+ * @params table ChainedTable to search
+ * @params key Key of element to remove
+ */
+void 
+cht_remove(ChainedTable *table, char *key);
+
+/**
+ * @brief Frees all elements in the table
+ *
+ * @params table ChainedTable to free
+ */
+void 
+cht_free(ChainedTable *table);
+
+#endif
@@ -0,0 +1,124 @@
+//
+// Disconnect storm benchmark
+//
+// Creates 10000 sessions, each kept alive by an anchor member. Then 10000 clients join
+// a few random sessions each, and every client disconnects at once from several
+// threads. The "scan" strategy leaves every session in the registry for each
+// client, the way exit used to walk all sessions. The "joined" strategy leaves only
+// the sessions the client remembers joining, like the per-connection index does.
+// Scans are capped at SCAN_CLIENTS disconnects, they take too long otherwise.
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "../collections/sessionRegistry.h"
+#include "benchUtil.h"
+
+#define SESSIONS 10000
+#define CLIENTS 10000
+#define JOINS_PER_CLIENT 4
+#define SCAN_CLIENTS 200
+
+/**
+ * @brief A client and the sessions it joined
+ */
+typedef struct _Client
+{
+	int joined[JOINS_PER_CLIENT];
+} Client;
+
+/**
+ * @brief Per-thread share of the disconnecting clients
+ */
+typedef struct _Worker
+{
+	pthread_t thread;
+	SessionRegistry *registry;
+	Client *clients;
+	int first;
+	int count;
+	int scan;
+} Worker;
+
+static char sessionNames[SESSIONS][16];
+
+static void *disconnectThread(void *args) {
+	Worker *worker = (Worker *)args;
+	int i, j;
+
+	for (i = worker->first; i < worker->first + worker->count; i++) {
+		Client *client = &worker->clients[i];
+		if (worker->scan) {
+			for (j = 0; j < SESSIONS; j++) {
+				sr_leave(worker->registry, sessionNames[j], client);
+			}
+		}
+		else {
+			for (j = 0; j < JOINS_PER_CLIENT; j++) {
+				sr_leave(worker->registry, sessionNames[client->joined[j]], client);
+			}
+		}
+	}
+
+	return NULL;
+}
+
+/**
+ * @brief Joins the clients, disconnects the given number of them and prints the cost
+ */
+static void runStorm(int threadCount, int disconnects, int scan) {
+	SessionRegistry *registry = sr_init(REGISTRY_DEFAULT_SHARDS);
+	Client *clients = (Client *)calloc(CLIENTS, sizeof(Client));
+	int anchor, i, j;
+	unsigned int seed = 1;
+
+	for (i = 0; i < SESSIONS; i++) {
+		sr_create(registry, sessionNames[i], &anchor, NULL, NULL);
+	}
+	for (i = 0; i < CLIENTS; i++) {
+		for (j = 0; j < JOINS_PER_CLIENT; j++) {
+			clients[i].joined[j] = rand_r(&seed) % SESSIONS;
+			sr_join(registry, sessionNames[clients[i].joined[j]], &clients[i], NULL, NULL);
+		}
+	}
+
+	Worker *workers = (Worker *)calloc(threadCount, sizeof(Worker));
+	double start = bench_nowNs() / 1e9;
+	for (i = 0; i < threadCount; i++) {
+		workers[i].registry = registry;
+		workers[i].clients = clients;
+		workers[i].first = disconnects * i / threadCount;
+		workers[i].count = disconnects * (i + 1) / threadCount - workers[i].first;
+		workers[i].scan = scan;
+		pthread_create(&workers[i].thread, NULL, disconnectThread, &workers[i]);
+	}
+	for (i = 0; i < threadCount; i++) {
+		pthread_join(workers[i].thread, NULL);
+	}
+	double elapsed = bench_nowNs() / 1e9 - start;
+
+	printf("%-8s %8d %12d %14.2f %14.0f\n", scan ? "scan" : "joined", threadCount, disconnects,
+		elapsed * 1e6 / disconnects, disconnects / elapsed);
+
+	free(workers);
+	free(clients);
+	sr_free(registry);
+}
+
+int main(int argc, char **argv) {
+	int threads = argc > 1 ? atoi(argv[1]) : 4;
+	int i;
+
+	for (i = 0; i < SESSIONS; i++) {
+		snprintf(sessionNames[i], sizeof(sessionNames[i]), "room%d", i);
+	}
+
+	printf("%-8s %8s %12s %14s %14s\n", "strategy", "threads", "disconnects", "us/disconnect", "disconnects/s");
+	runStorm(1, SCAN_CLIENTS, 1);
+	runStorm(threads, SCAN_CLIENTS, 1);
+	runStorm(1, CLIENTS, 0);
+	runStorm(threads, CLIENTS, 0);
+
+	return 0;
+}
@@ -0,0 +1,69 @@
+//
+// Wire format codec benchmark
+//
+// Encodes and decodes MESSAGE packets of several payload sizes with both the ASCII
+// "type:size:source:data" format and the binary format, reporting ns/op for each
+// direction, the number of bytes each frame takes on the wire and the bytes the
+// decoded Packet takes in memory.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "../utils/transport.h"
+#include "benchUtil.h"
+
+#define ITERATIONS 1000000
+
+/* Keeps the compiler from discarding the timed work */
+static volatile unsigned long sink;
+
+/**
+ * @brief Times encode and decode of one packet in one format
+ */
+static void benchFormat(Packet *packet, int format, const char *name, int payload) {
+	int len = 0, i;
+
+	double start = bench_nowNs();
+	for (i = 0; i < ITERATIONS; i++) {
+		unsigned char *bytes = encodePacket(packet, format, &len);
+		sink += bytes[len - 1];
+		pool_free(bytes);
+	}
+	double encodeNs = (bench_nowNs() - start) / ITERATIONS;
+
+	unsigned char *bytes = encodePacket(packet, format, &len);
+	Packet *footprint = decodePacket(bytes, len);
+	int packetBytes = sizeof(Packet) + footprint->capacity;
+	pool_free(footprint);
+	start = bench_nowNs();
+	for (i = 0; i < ITERATIONS; i++) {
+		Packet *decoded = decodePacket(bytes, len);
+		sink += decoded->size;
+		pool_free(decoded);
+	}
+	double decodeNs = (bench_nowNs() - start) / ITERATIONS;
+	pool_free(bytes);
+
+	printf("%-8s %8d %12.1f %12.1f %12d %12d\n", name, payload, encodeNs, decodeNs, len, packetBytes);
+}
+
+int main() {
+	int sizes[] = { 0, 16, 128, 1024, 2000 };
+	char contents[MAX_DATA];
+	unsigned int i;
+
+	printf("%-8s %8s %12s %12s %12s %12s\n", "format", "payload", "encode ns", "decode ns", "wire bytes",
+		   "packet bytes");
+	for (i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+		memset(contents, 'x', sizes[i]);
+		contents[sizes[i]] = '\0';
+
+		// MESSAGE data is "<session>;<contents>"
+		Packet *packet = getMessagePacket("benchuser", "room", contents);
+		benchFormat(packet, WIRE_ASCII, "ascii", packet->size);
+		benchFormat(packet, WIRE_BINARY, "binary", packet->size);
+		pool_free(packet);
+	}
+
+	return 0;
+}
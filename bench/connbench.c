@@ -0,0 +1,128 @@
+//
+// Connection capacity benchmark
+//
+// Opens a large number of idle client connections against a running server, sends
+// one QUERY on each and counts how many connections the server actually serves.
+// The server's resident memory is sampled before and after to report the cost of
+// each held connection. Run it once against `server <port> threaded` and once
+// against `server <port> epoll` to compare the serving modes.
+
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "../utils/nethelper.h"
+#include "../utils/transport.h"
+#include "../utils/printHelpers.h"
+#include "benchUtil.h"
+
+/* How long to wait for servers to answer every connection */
+#define REPLY_TIMEOUT_MS 5000
+
+/**
+ * @brief Reads a "<field>: <value> kB" style line from /proc/<pid>/status
+ */
+static long readProcStatus(int pid, const char *field) {
+	char path[64];
+	char line[256];
+	long value = -1;
+	size_t fieldLen = strlen(field);
+
+	snprintf(path, sizeof(path), "/proc/%d/status", pid);
+	FILE *fp = fopen(path, "r");
+	if (fp == NULL) {
+		return -1;
+	}
+	while (fgets(line, sizeof(line), fp) != NULL) {
+		if (strncmp(line, field, fieldLen) == 0 && line[fieldLen] == ':') {
+			value = atol(line + fieldLen + 1);
+			break;
+		}
+	}
+	fclose(fp);
+	return value;
+}
+
+int main(int argc, char **argv) {
+	if (argc != 5) {
+		printf("Usage: connbench <host> <port> <connections> <serverPid>\n");
+		return 0;
+	}
+
+	int count = atoi(argv[3]);
+	int serverPid = atoi(argv[4]);
+
+	// Each connection needs a descriptor on this side too
+	struct rlimit limit;
+	if (getrlimit(RLIMIT_NOFILE, &limit) == 0) {
+		limit.rlim_cur = limit.rlim_max;
+		setrlimit(RLIMIT_NOFILE, &limit);
+	}
+
+	long rssBefore = readProcStatus(serverPid, "VmRSS");
+	if (rssBefore < 0) {
+		fprintf(stderr, "Cannot read /proc/%d/status\n", serverPid);
+		return 1;
+	}
+
+	// Every connection sends the same unauthenticated QUERY, any reply proves it is served
+	Packet *query = getListPacket("connbench");
+	int queryLen;
+	unsigned char *queryBytes = packetToByteArray(query, &queryLen);
+
+	int epollFd = epoll_create1(0);
+	int *sockets = (int *)calloc(count, sizeof(int));
+	int opened = 0, i;
+	for (i = 0; i < count; i++) {
+		sockets[i] = getClientSocket(argv[1], argv[2]);
+		if (sockets[i] < 0) {
+			break;
+		}
+		send(sockets[i], queryBytes, queryLen, 0);
+
+		struct epoll_event event;
+		event.events = EPOLLIN;
+		event.data.fd = sockets[i];
+		epoll_ctl(epollFd, EPOLL_CTL_ADD, sockets[i], &event);
+		opened++;
+	}
+
+	// Count replies until every connection answered or the timeout passes
+	long start = bench_nowNs();
+	struct epoll_event events[256];
+	unsigned char buf[MAX_PACKET_SIZE];
+	int served = 0;
+	while (served < opened && (bench_nowNs() - start) / 1000000 < REPLY_TIMEOUT_MS) {
+		int ready = epoll_wait(epollFd, events, 256, 100);
+		for (i = 0; i < ready; i++) {
+			if (recv(events[i].data.fd, buf, MAX_PACKET_SIZE, 0) > 0) {
+				served++;
+			}
+			epoll_ctl(epollFd, EPOLL_CTL_DEL, events[i].data.fd, NULL);
+		}
+	}
+
+	long rssAfter = readProcStatus(serverPid, "VmRSS");
+	long threads = readProcStatus(serverPid, "Threads");
+
+	printf("connections opened:   %d\n", opened);
+	printf("connections served:   %d\n", served);
+	printf("server threads:       %ld\n", threads);
+	printf("server RSS before:    %ld kB\n", rssBefore);
+	printf("server RSS after:     %ld kB\n", rssAfter);
+	if (served > 0) {
+		printf("RSS per connection:   %.0f bytes\n", (rssAfter - rssBefore) * 1024.0 / served);
+	}
+
+	for (i = 0; i < opened; i++) {
+		close(sockets[i]);
+	}
+	free(sockets);
+	pool_free(query);
+	pool_free(queryBytes);
+	close(epollFd);
+
+	return 0;
+}
@@ -0,0 +1,171 @@
+//
+// Hash flooding benchmark
+//
+// Hashes three key sets with FNV-1a, wyhash and SipHash-1-3: user names, random
+// words, and session names brute forced so their FNV-1a hashes share the low 16 bits,
+// the way a client could flood the session table when the function is known. For each
+// pair it reports the hashing cost, how the keys spread over 1024 buckets and the
+// lookup cost in a HashTable built with that function.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "../collections/hashTable.h"
+#include "../collections/hashFunction.h"
+#include "benchUtil.h"
+
+#define KEY_LENGTH 24
+#define BUCKETS 1024
+#define USER_KEYS 20000
+#define WORD_KEYS 20000
+#define FLOOD_KEYS 4000
+/* Low hash bits shared by every flood key */
+#define FLOOD_MASK 0xFFFF
+#define LOOKUPS 1000000
+
+/* Keeps the compiler from discarding the timed work */
+static volatile unsigned long sink;
+
+static char **allocKeys(int count) {
+	char **keys = (char **)malloc(count * sizeof(char *));
+	int i;
+	for (i = 0; i < count; i++) {
+		keys[i] = (char *)malloc(KEY_LENGTH);
+	}
+	return keys;
+}
+
+static void freeKeys(char **keys, int count) {
+	int i;
+	for (i = 0; i < count; i++) {
+		free(keys[i]);
+	}
+	free(keys);
+}
+
+static char **userKeys(int count) {
+	char **keys = allocKeys(count);
+	int i;
+	for (i = 0; i < count; i++) {
+		snprintf(keys[i], KEY_LENGTH, "user%d", i);
+	}
+	return keys;
+}
+
+/**
+ * @brief Random lowercase words of 4 to 12 letters, duplicates are harmless here
+ */
+static char **wordKeys(int count) {
+	char **keys = allocKeys(count);
+	int i, j;
+	srand(1);
+	for (i = 0; i < count; i++) {
+		int len = 4 + rand() % 9;
+		for (j = 0; j < len; j++) {
+			keys[i][j] = 'a' + rand() % 26;
+		}
+		keys[i][len] = '\0';
+	}
+	return keys;
+}
+
+/**
+ * @brief Session names whose FNV-1a hashes all agree in the FLOOD_MASK bits
+ */
+static char **floodKeys(int count) {
+	char **keys = allocKeys(count);
+	unsigned int target = hf_fnv1a("room") & FLOOD_MASK;
+	char candidate[KEY_LENGTH] = "room";
+	int digits = 1, found = 0, i;
+	memset(candidate + 4, 'a', KEY_LENGTH - 5);
+	candidate[4 + digits] = '\0';
+
+	while (found < count) {
+		if ((hf_fnv1a(candidate) & FLOOD_MASK) == target) {
+			strcpy(keys[found++], candidate);
+		}
+		// Count through the suffixes in base 26, adding a letter when they run out
+		for (i = 4 + digits - 1; i >= 4 && candidate[i] == 'z'; i--) {
+			candidate[i] = 'a';
+		}
+		if (i >= 4) {
+			candidate[i]++;
+		}
+		else {
+			candidate[4 + digits++] = 'a';
+			candidate[4 + digits] = '\0';
+		}
+	}
+	return keys;
+}
+
+/**
+ * @brief Reports hashing cost, bucket spread and table lookup cost for one function
+ */
+static void benchFunction(const char *set, const char *name, HashFunction function, char **keys, int count) {
+	int i;
+
+	double start = bench_nowNs();
+	for (i = 0; i < LOOKUPS; i++) {
+		sink += function(keys[i % count]);
+	}
+	double hashNs = (bench_nowNs() - start) / LOOKUPS;
+
+	// A key's lookup walks its whole bucket in a chained table, so the cost a key
+	// sees on average is the sum of squared bucket lengths over the key count
+	int *buckets = (int *)calloc(BUCKETS, sizeof(int));
+	int longest = 0;
+	double squares = 0;
+	for (i = 0; i < count; i++) {
+		buckets[function(keys[i]) % BUCKETS]++;
+	}
+	for (i = 0; i < BUCKETS; i++) {
+		if (buckets[i] > longest) {
+			longest = buckets[i];
+		}
+		squares += (double)buckets[i] * buckets[i];
+	}
+	free(buckets);
+
+	HashTable *table = ht_initWithHash(16, function);
+	start = bench_nowNs();
+	for (i = 0; i < count; i++) {
+		ht_insert(table, keys[i], keys[i]);
+	}
+	double insertNs = (bench_nowNs() - start) / count;
+
+	start = bench_nowNs();
+	for (i = 0; i < LOOKUPS; i++) {
+		sink += (unsigned long)ht_find(table, keys[i % count]);
+	}
+	double lookupNs = (bench_nowNs() - start) / LOOKUPS;
+	ht_free(table);
+
+	printf("%-8s %-8s %7d %9.1f %8d %10.2f %10.1f %10.1f\n", set, name, count, hashNs,
+		longest, squares / count, insertNs, lookupNs);
+}
+
+static void benchSet(const char *set, char **keys, int count) {
+	benchFunction(set, "fnv1a", hf_fnv1a, keys, count);
+	benchFunction(set, "wyhash", hf_wyhash, keys, count);
+	benchFunction(set, "siphash", hf_siphash, keys, count);
+}
+
+int main() {
+	printf("%-8s %-8s %7s %9s %8s %10s %10s %10s\n", "keys", "hash", "count", "hash ns",
+		"longest", "avg chain", "insert ns", "lookup ns");
+
+	char **keys = userKeys(USER_KEYS);
+	benchSet("users", keys, USER_KEYS);
+	freeKeys(keys, USER_KEYS);
+
+	keys = wordKeys(WORD_KEYS);
+	benchSet("words", keys, WORD_KEYS);
+	freeKeys(keys, WORD_KEYS);
+
+	keys = floodKeys(FLOOD_KEYS);
+	benchSet("flood", keys, FLOOD_KEYS);
+	freeKeys(keys, FLOOD_KEYS);
+
+	return 0;
+}
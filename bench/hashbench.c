@@ -0,0 +1,188 @@
+//
+// Hash table benchmark
+//
+// Times insert, lookup of present keys, lookup of missing keys and remove on the
+// open addressing collections/hashTable against the chained table it replaced, at
+// several key counts. The chained table runs with the 128 buckets the server gives
+// its users table and with one bucket per key, the best case for chaining.
+// Afterwards the open addressing table is churned and checked against the keys.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "../collections/hashTable.h"
+#include "chainedHashTable.h"
+#include "benchUtil.h"
+
+/* Keeps the compiler from discarding the timed work */
+static volatile unsigned long sink;
+
+/**
+ * @brief Builds count keys shaped like user names, prefix "user" or "nouser"
+ */
+static char **makeKeys(const char *prefix, int count) {
+	char **keys = (char **)malloc(count * sizeof(char *));
+	int i;
+	for (i = 0; i < count; i++) {
+		keys[i] = (char *)malloc(32);
+		snprintf(keys[i], 32, "%s%d", prefix, i);
+	}
+	return keys;
+}
+
+static void freeKeys(char **keys, int count) {
+	int i;
+	for (i = 0; i < count; i++) {
+		free(keys[i]);
+	}
+	free(keys);
+}
+
+static void printRow(const char *name, int count, double insertNs, double hitNs, double missNs, double removeNs) {
+	printf("%-16s %8d %10.1f %10.1f %10.1f %10.1f\n", name, count,
+		insertNs / count, hitNs / count, missNs / count, removeNs / count);
+}
+
+/**
+ * @brief Times every operation on the open addressing table, starting from the
+ * default small size so the incremental resizes are included
+ */
+static void benchOpen(char **keys, char **missing, int count) {
+	int i;
+	HashTable *table = ht_init(128);
+
+	double start = bench_nowNs();
+	for (i = 0; i < count; i++) {
+		ht_insert(table, keys[i], keys[i]);
+	}
+	double insertNs = bench_nowNs() - start;
+
+	start = bench_nowNs();
+	for (i = 0; i < count; i++) {
+		sink += (unsigned long)ht_find(table, keys[i]);
+	}
+	double hitNs = bench_nowNs() - start;
+
+	start = bench_nowNs();
+	for (i = 0; i < count; i++) {
+		sink += (unsigned long)ht_find(table, missing[i]);
+	}
+	double missNs = bench_nowNs() - start;
+
+	start = bench_nowNs();
+	for (i = 0; i < count; i++) {
+		ht_remove(table, keys[i]);
+	}
+	double removeNs = bench_nowNs() - start;
+
+	ht_free(table);
+	printRow("open", count, insertNs, hitNs, missNs, removeNs);
+}
+
+/**
+ * @brief Times every operation on the chained table with a fixed bucket count
+ */
+static void benchChained(const char *name, int buckets, char **keys, char **missing, int count) {
+	int i;
+	ChainedTable *table = cht_init(buckets);
+
+	double start = bench_nowNs();
+	for (i = 0; i < count; i++) {
+		cht_insert(table, keys[i], keys[i]);
+	}
+	double insertNs = bench_nowNs() - start;
+
+	start = bench_nowNs();
+	for (i = 0; i < count; i++) {
+		sink += (unsigned long)cht_find(table, keys[i]);
+	}
+	double hitNs = bench_nowNs() - start;
+
+	start = bench_nowNs();
+	for (i = 0; i < count; i++) {
+		sink += (unsigned long)cht_find(table, missing[i]);
+	}
+	double missNs = bench_nowNs() - start;
+
+	start = bench_nowNs();
+	for (i = 0; i < count; i++) {
+		cht_remove(table, keys[i]);
+	}
+	double removeNs = bench_nowNs() - start;
+
+	cht_free(table);
+	printRow(name, count, insertNs, hitNs, missNs, removeNs);
+}
+
+/**
+ * @brief Randomly inserts and removes keys, checking every lookup and the insertion
+ * order against a plain array of what should be present
+ *
+ * @returns 0 if the table always agreed, -1 otherwise
+ */
+static int checkChurn(char **keys, int count) {
+	HashTable *table = ht_init(1);
+	int *present = (int *)calloc(count, sizeof(int));
+	int i, live = 0, errors = 0;
+
+	srand(1);
+	for (i = 0; i < count * 20; i++) {
+		int k = rand() % count;
+		if (present[k]) {
+			ht_remove(table, keys[k]);
+			present[k] = 0;
+			live--;
+		}
+		else {
+			ht_insert(table, keys[k], keys[k]);
+			present[k] = 1;
+			live++;
+		}
+		k = rand() % count;
+		if ((ht_find(table, keys[k]) != NULL) != present[k]) {
+			errors++;
+		}
+	}
+
+	int seen = 0;
+	HashEntry *entry;
+	for (entry = ht_first(table); entry != NULL; entry = ht_next(table, entry)) {
+		if (ht_find(table, entry->key) != entry->data) {
+			errors++;
+		}
+		seen++;
+	}
+	if (seen != live || table->elements != live) {
+		errors++;
+	}
+
+	ht_free(table);
+	free(present);
+	return errors == 0 ? 0 : -1;
+}
+
+int main() {
+	int counts[] = { 100, 1000, 10000, 100000 };
+	unsigned int i;
+
+	printf("%-16s %8s %10s %10s %10s %10s\n", "table", "keys", "insert ns", "hit ns", "miss ns", "remove ns");
+	for (i = 0; i < sizeof(counts) / sizeof(counts[0]); i++) {
+		int count = counts[i];
+		char **keys = makeKeys("user", count);
+		char **missing = makeKeys("nouser", count);
+
+		benchOpen(keys, missing, count);
+		benchChained("chained-128", 128, keys, missing, count);
+		benchChained("chained-sized", count, keys, missing, count);
+
+		freeKeys(keys, count);
+		freeKeys(missing, count);
+	}
+
+	char **keys = makeKeys("user", 5000);
+	int churn = checkChurn(keys, 5000);
+	freeKeys(keys, 5000);
+	printf("churn check: %s\n", churn == 0 ? "ok" : "FAILED");
+
+	return churn == 0 ? 0 : 1;
+}
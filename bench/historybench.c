@@ -0,0 +1,179 @@
+//
+// Session log benchmark
+//
+// Appends MESSAGE packets with 100 byte texts to a session log in a temporary
+// directory, rolling over 4 MiB segments, and reports the append throughput. Then
+// replays the last 100 to 100000 messages into a socket pair drained by another
+// thread, once handing the log's ranges to sendfile the way the server does and once
+// reading them into a buffer and writing that, and reports the time until the
+// reader got the last byte.
+
+#include <sys/socket.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "../utils/sessionLog.h"
+#include "benchUtil.h"
+
+#define TEXT 100
+#define SEGMENT_BYTES (4L*1024*1024)
+#define RUNS 20
+#define COPY_BUFFER (64*1024)
+
+static int sockets[2];
+static long received;
+static int useSendfile;
+static unsigned char copyBuffer[COPY_BUFFER];
+
+static void *readThread(void *args) {
+	unsigned char buf[COPY_BUFFER];
+	ssize_t bytes;
+	while ((bytes = read(sockets[1], buf, sizeof(buf))) > 0) {
+		__atomic_add_fetch(&received, bytes, __ATOMIC_RELEASE);
+	}
+	return NULL;
+}
+
+static int sendRange(int fd, long offset, long len, unsigned long messages, const unsigned char *mapped,
+					 void *context) {
+	long sent = 0;
+	if (useSendfile) {
+		off_t position = offset;
+		while (sent < len) {
+			ssize_t result = sendfile(sockets[0], fd, &position, len - sent);
+			if (result <= 0) {
+				return -1;
+			}
+			sent += result;
+		}
+		return 0;
+	}
+	while (sent < len) {
+		long chunk = len - sent < COPY_BUFFER ? len - sent : COPY_BUFFER;
+		ssize_t result = pread(fd, copyBuffer, chunk, offset + sent);
+		if (result <= 0 || write(sockets[0], copyBuffer, result) != result) {
+			return -1;
+		}
+		sent += result;
+	}
+	return 0;
+}
+
+// Sums up the bytes a replay covers without sending them
+static int countRange(int fd, long offset, long len, unsigned long messages, const unsigned char *mapped,
+					  void *context) {
+	*(long *)context += len;
+	return 0;
+}
+
+static void removeTree(const char *path) {
+	DIR *dir = opendir(path);
+	if (dir == NULL) {
+		unlink(path);
+		return;
+	}
+	struct dirent *entry;
+	while ((entry = readdir(dir)) != NULL) {
+		if (strcmp(entry->d_name, ".") != 0 && strcmp(entry->d_name, "..") != 0) {
+			char child[strlen(path) + strlen(entry->d_name) + 2];
+			sprintf(child, "%s/%s", path, entry->d_name);
+			removeTree(child);
+		}
+	}
+	closedir(dir);
+	rmdir(path);
+}
+
+static void replay(SessionLog *log, long depth) {
+	unsigned long from = log->nextSeq - depth;
+	long bytes = 0;
+	sessionLog_replay(log, from, log->nextSeq, &countRange, &bytes);
+
+	for (useSendfile = 1; useSendfile >= 0; useSendfile--) {
+		double total = 0, best = 0;
+		int run;
+		for (run = 0; run < RUNS; run++) {
+			long target = __atomic_load_n(&received, __ATOMIC_ACQUIRE) + bytes;
+			double start = bench_nowNs();
+			if (sessionLog_replay(log, from, log->nextSeq, &sendRange, NULL) != depth) {
+				printf("replay of %ld messages failed\n", depth);
+				return;
+			}
+			while (__atomic_load_n(&received, __ATOMIC_ACQUIRE) < target) {
+				sched_yield();
+			}
+			double elapsed = bench_nowNs() - start;
+			total += elapsed;
+			if (run == 0 || elapsed < best) {
+				best = elapsed;
+			}
+		}
+		printf("%-9s %9ld %12ld %12.1f %12.1f %10.0f\n", useSendfile ? "sendfile" : "copy", depth, bytes,
+			   total / RUNS / 1e3, best / 1e3, bytes / (total / RUNS / 1e9) / (1024 * 1024));
+	}
+}
+
+int main(int argc, char **argv) {
+	long messages = argc > 1 ? atol(argv[1]) : 200000;
+	char directory[] = "/tmp/historybenchXXXXXX";
+	if (mkdtemp(directory) == NULL) {
+		return 1;
+	}
+
+	SessionLog *log = sessionLog_open(directory, "bench", SEGMENT_BYTES, messages * 2 * TEXT);
+	if (log == NULL) {
+		removeTree(directory);
+		return 1;
+	}
+
+	char header[64], data[TEXT + 8];
+	memset(data, 'x', sizeof(data));
+	memcpy(data, "bench;", 6);
+	data[sizeof(data) - 1] = '\0';
+	struct iovec parts[2];
+	parts[0].iov_base = header;
+	parts[0].iov_len = sprintf(header, "14:%d:client:", (int)sizeof(data));
+	parts[1].iov_base = data;
+	parts[1].iov_len = sizeof(data);
+
+	double start = bench_nowNs();
+	long i;
+	for (i = 0; i < messages; i++) {
+		if (sessionLog_append(log, parts, 2) < 0) {
+			printf("append failed\n");
+			return 1;
+		}
+	}
+	double elapsed = bench_nowNs() - start;
+	long bytes = messages * (parts[0].iov_len + parts[1].iov_len);
+	SessionLogStats stats;
+	sessionLog_getStats(&stats);
+	printf("appended %ld messages of %ld bytes in %.1f ms: %.0f messages/s, %.1f MiB/s, %ld segments\n",
+		   messages, (long)(parts[0].iov_len + parts[1].iov_len), elapsed / 1e6, messages / (elapsed / 1e9),
+		   bytes / (elapsed / 1e9) / (1024 * 1024), stats.segmentsCreated);
+
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, sockets) != 0) {
+		return 1;
+	}
+	pthread_t reader;
+	pthread_create(&reader, NULL, readThread, NULL);
+
+	printf("%-9s %9s %12s %12s %12s %10s\n", "replay", "messages", "bytes", "mean us", "best us", "MiB/s");
+	long depth;
+	for (depth = 100; depth <= messages; depth *= 10) {
+		replay(log, depth);
+	}
+
+	close(sockets[0]);
+	pthread_join(reader, NULL);
+	close(sockets[1]);
+	sessionLog_close(log);
+	removeTree(directory);
+	return 0;
+}
@@ -0,0 +1,139 @@
+//
+// MESSAGE ingress benchmark
+//
+// Drives chatServer_handleRequest in process with 1 KB MESSAGE frames from one
+// client to a session of members connected over socketpairs, the way a backend hands
+// received frames over. Runs once with MESSAGE frames decoded into a Packet and
+// copied for the broadcast, which is how the server handled them before, and once
+// parsed and forwarded in place. Reports time, throughput and payload copies per
+// message.
+
+#include <sys/socket.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "../chatServer.h"
+#include "benchUtil.h"
+
+#define MESSAGES 200000
+#define MEMBERS 8
+#define PAYLOAD 1024
+
+/* Bench side of every member's socketpair */
+static int peers[MEMBERS];
+
+/* The terminal, stdout is taken over by the server's request log */
+static FILE *results;
+
+/**
+ * @brief Reads whatever the server sent to every member
+ */
+static void drainPeers() {
+	unsigned char buf[RECV_BUFFER_SIZE];
+	int member;
+	for (member = 0; member < MEMBERS; member++) {
+		while (recv(peers[member], buf, sizeof(buf), MSG_DONTWAIT) > 0) {
+		}
+	}
+}
+
+/**
+ * @brief Serializes the packet and hands it to the server as one received frame
+ */
+static void request(ThreadInfo *threadInfo, Packet *packet) {
+	int len;
+	unsigned char *frame = encodePacket(packet, WIRE_ASCII, &len);
+	chatServer_handleRequest(threadInfo, frame, len);
+	pool_free(frame);
+	pool_free(packet);
+	drainPeers();
+}
+
+static void run(const char *name, int zeroCopy, ThreadInfo *sender, unsigned char *frame, int frameLen) {
+	int i;
+
+	chatServer_setZeroCopyIngress(zeroCopy);
+	long copiesBefore = payloadCopies();
+	double start = bench_nowNs();
+	for (i = 0; i < MESSAGES; i++) {
+		chatServer_handleRequest(sender, frame, frameLen);
+		drainPeers();
+	}
+	double elapsed = bench_nowNs() - start;
+	long copies = payloadCopies() - copiesBefore;
+
+	fprintf(results, "%-10s %12.1f %14.0f %12.1f %16.2f\n", name, elapsed / MESSAGES,
+		MESSAGES / (elapsed / 1e9), (double)MESSAGES * PAYLOAD / (elapsed / 1e3),
+		(double)copies / MESSAGES);
+}
+
+int main() {
+	ThreadInfo *members[MEMBERS];
+	char names[MEMBERS][MAX_NAME];
+	LinkedList *connections = ll_init();
+	SessionRegistry *sessions = sr_init(REGISTRY_DEFAULT_SHARDS);
+	HashTable *users = ht_init(MEMBERS);
+	int member;
+
+	// The server logs every request, keep that out of the terminal
+	results = fdopen(dup(STDOUT_FILENO), "w");
+	if (results == NULL || freopen("/dev/null", "w", stdout) == NULL) {
+		return 1;
+	}
+
+	for (member = 0; member < MEMBERS; member++) {
+		int sockets[2];
+		if (socketpair(AF_UNIX, SOCK_STREAM, 0, sockets) != 0) {
+			return 1;
+		}
+		peers[member] = sockets[1];
+		snprintf(names[member], MAX_NAME, "member%d", member);
+		ht_insert(users, names[member], "password");
+
+		ThreadInfo *threadInfo = (ThreadInfo *)calloc(1, sizeof(ThreadInfo));
+		threadInfo->socket = sockets[0];
+		threadInfo->clientConnected = 1;
+		threadInfo->connections = connections;
+		threadInfo->sessions = sessions;
+		threadInfo->users = users;
+		pthread_mutex_init(&threadInfo->socketLock, NULL);
+		members[member] = threadInfo;
+
+		request(threadInfo, getLoginPacket(names[member], "password", WIRE_ASCII, 0, 0));
+		if (member == 0) {
+			request(threadInfo, getNewSessionPacket(names[member], "room"));
+		}
+		else {
+			request(threadInfo, getJoinSessionPacket(names[member], "room"));
+		}
+	}
+
+	char contents[PAYLOAD + 1];
+	memset(contents, 'x', PAYLOAD);
+	contents[PAYLOAD] = '\0';
+	Packet *packet = getMessagePacket(names[0], "room", contents);
+	int frameLen;
+	unsigned char *frame = encodePacket(packet, WIRE_ASCII, &frameLen);
+
+	fprintf(results, "%d members, %d byte frames\n", MEMBERS, frameLen);
+	fprintf(results, "%-10s %12s %14s %12s %16s\n", "ingress", "ns/message", "messages/s", "MB/s",
+			"copies/message");
+	run("copying", 0, members[0], frame, frameLen);
+	run("in place", 1, members[0], frame, frameLen);
+
+	pool_free(frame);
+	pool_free(packet);
+	for (member = 0; member < MEMBERS; member++) {
+		request(members[member], getLogoutPacket(names[member]));
+		close(members[member]->socket);
+		close(peers[member]);
+		pthread_mutex_destroy(&members[member]->socketLock);
+		free(members[member]);
+	}
+	sr_free(sessions);
+	ht_free(users);
+	ll_free(connections);
+	free(connections);
+	fclose(results);
+	return 0;
+}
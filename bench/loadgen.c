@@ -0,0 +1,532 @@
+//
+// Load generator
+//
+// Opens many client connections against a running server, logs each one in with
+// generated credentials, spreads them over a number of sessions and sends MESSAGE
+// packets at a target rate from one thread per core. Every message carries the
+// time it was sent, and the members receiving it record the delivery latency.
+// Reports send, acknowledgement and delivery throughput and p50/p99/p999 latency,
+// and how many packets every read from a socket returned, which grows when the server
+// coalesces broadcasts.
+//
+// The server has to know the generated credentials: `loadgen -g <count>` prints
+// them in the passwords file format, for `server -u <file>`. Latency uses the
+// monotonic clock, so loadgen and the server have to run on the same host for it to
+// include the whole round trip rather than only the relative spread.
+
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "../utils/nethelper.h"
+#include "../utils/transport.h"
+#include "../utils/frameBuffer.h"
+#include "benchUtil.h"
+
+/* Latency histogram: 16 linear buckets per power of two, about 6% resolution */
+#define HISTOGRAM_SUB_BITS 4
+#define HISTOGRAM_SUB_BUCKETS (1 << HISTOGRAM_SUB_BITS)
+#define HISTOGRAM_BUCKETS (48 * HISTOGRAM_SUB_BUCKETS)
+
+/* Digits of the send timestamp at the start of every message */
+#define TIMESTAMP_DIGITS 20
+
+/* How long receivers keep counting deliveries after the last send */
+#define DRAIN_MS 1000
+
+#define USAGE "Usage: loadgen [-c connections] [-s sessions] [-r messagesPerSecond] [-d seconds] " \
+	"[-z payloadBytes] [-t threads] [-a] <host> <port>\n       loadgen -g <count>\n"
+
+struct _LoadWorker;
+
+/**
+ * One generated client
+ */
+typedef struct _LoadConnection
+{
+	int socket;
+	char name[MAX_NAME];
+	char *sessionName;
+	FrameBuffer input;
+	/* Type of the last response, used while setting up */
+	int lastType;
+	/* Unsent tail of the last message, new messages wait until it's written */
+	unsigned char *pending;
+	int pendingLen;
+	int pendingSent;
+	/* The server closed the connection, nothing is sent on it anymore */
+	int closed;
+	struct _LoadWorker *worker;
+} LoadConnection;
+
+/**
+ * Thread driving a share of the connections, with its own counters
+ */
+typedef struct _LoadWorker
+{
+	pthread_t thread;
+	int epollFd;
+	LoadConnection **connections;
+	int count;
+	/* Messages per second this worker sends */
+	double rate;
+	long sent;
+	long acked;
+	long delivered;
+	long rejected;
+	/* Sends skipped because every connection still had a message pending */
+	long stalls;
+	/* Reads that returned data and the packets they held, after setup */
+	long reads;
+	long packets;
+	long histogram[HISTOGRAM_BUCKETS];
+} LoadWorker;
+
+static int payloadSize = 64;
+static int wireFormat = WIRE_BINARY;
+static volatile int sending = 1;
+static volatile int running = 1;
+
+/**
+ * @brief Histogram bucket holding a latency
+ */
+static int bucketOf(unsigned long ns) {
+	if (ns < HISTOGRAM_SUB_BUCKETS) {
+		return ns;
+	}
+	int exponent = 63 - __builtin_clzl(ns);
+	int bucket = (exponent - HISTOGRAM_SUB_BITS + 1) * HISTOGRAM_SUB_BUCKETS +
+		(int)((ns >> (exponent - HISTOGRAM_SUB_BITS)) & (HISTOGRAM_SUB_BUCKETS - 1));
+	return bucket < HISTOGRAM_BUCKETS ? bucket : HISTOGRAM_BUCKETS - 1;
+}
+
+/**
+ * @brief Largest latency a bucket holds
+ */
+static unsigned long bucketLimit(int bucket) {
+	if (bucket < HISTOGRAM_SUB_BUCKETS) {
+		return bucket;
+	}
+	int exponent = bucket / HISTOGRAM_SUB_BUCKETS + HISTOGRAM_SUB_BITS - 1;
+	unsigned long sub = bucket % HISTOGRAM_SUB_BUCKETS;
+	return ((HISTOGRAM_SUB_BUCKETS + sub + 1) << (exponent - HISTOGRAM_SUB_BITS)) - 1;
+}
+
+/**
+ * @brief Latency below which the given fraction of the deliveries fall, in ns
+ */
+static unsigned long percentile(long *histogram, long total, double fraction) {
+	long target = (long)(total * fraction);
+	long seen = 0;
+	int bucket;
+	for (bucket = 0; bucket < HISTOGRAM_BUCKETS; bucket++) {
+		seen += histogram[bucket];
+		if (seen > target) {
+			return bucketLimit(bucket);
+		}
+	}
+	return bucketLimit(HISTOGRAM_BUCKETS - 1);
+}
+
+/**
+ * @brief FrameHandler for every packet a connection receives
+ */
+static void handleFrame(void *context, unsigned char *frame, int len) {
+	LoadConnection *conn = (LoadConnection *)context;
+	PacketView view;
+	Packet *decoded = NULL;
+
+	// Frames the view refuses are read from a decoded copy
+	if (viewPacket(frame, len, &view) != 0) {
+		decoded = decodePacket(frame, len);
+		view.type = decoded->type;
+		view.size = decoded->size;
+		view.data = decoded->data;
+	}
+	conn->lastType = view.type;
+	if (conn->worker == NULL) {
+		pool_free(decoded);
+		return;
+	}
+	conn->worker->packets++;
+
+	switch (view.type) {
+		case MESSAGE: {
+			// The data is "<session>;<timestamp><padding>"
+			const unsigned char *data = view.data;
+			const unsigned char *end = view.data + view.size;
+			while (data < end && *data != ';') {
+				data++;
+			}
+			if (end - data <= TIMESTAMP_DIGITS) {
+				conn->worker->rejected++;
+				break;
+			}
+			long sentAt = 0;
+			int i;
+			for (i = 1; i <= TIMESTAMP_DIGITS; i++) {
+				sentAt = sentAt * 10 + (data[i] - '0');
+			}
+			long latency = bench_nowNs() - sentAt;
+			conn->worker->histogram[bucketOf(latency > 0 ? latency : 0)]++;
+			conn->worker->delivered++;
+			break;
+		}
+		case MESSAGE_ACK:
+			conn->worker->acked++;
+			break;
+		default:
+			conn->worker->rejected++;
+			break;
+	}
+	pool_free(decoded);
+}
+
+/**
+ * @brief Reads whatever the socket holds and handles the complete packets
+ *
+ * @returns 0 on success, -1 if the connection closed or broke
+ */
+static int receive(LoadConnection *conn, int flags) {
+	unsigned char buf[RECV_BUFFER_SIZE];
+	while (1) {
+		int bytes = recv(conn->socket, buf, sizeof(buf), flags);
+		if (bytes <= 0) {
+			return bytes < 0 && (errno == EAGAIN || errno == EWOULDBLOCK) ? 0 : -1;
+		}
+		if (conn->worker != NULL) {
+			conn->worker->reads++;
+		}
+		if (fb_feed(&conn->input, buf, bytes, &handleFrame, conn) != 0) {
+			return -1;
+		}
+		if (flags == 0) {
+			return 0;
+		}
+	}
+}
+
+/**
+ * @brief Sends a setup request and waits for the server's answer
+ *
+ * @returns Type of the response, -1 if the connection broke
+ */
+static int request(LoadConnection *conn, Packet *packet) {
+	int len;
+	unsigned char *bytes = encodePacket(packet, wireFormat, &len);
+	int sent = send(conn->socket, bytes, len, MSG_NOSIGNAL);
+	pool_free(bytes);
+	pool_free(packet);
+	if (sent != len) {
+		return -1;
+	}
+
+	conn->lastType = 0;
+	while (conn->lastType == 0) {
+		if (receive(conn, 0) != 0) {
+			return -1;
+		}
+	}
+	return conn->lastType;
+}
+
+/**
+ * @brief Writes as much of the connection's pending message as the socket takes
+ *
+ * @returns 0 on success, -1 if the connection broke
+ */
+static int flushPending(LoadConnection *conn) {
+	while (conn->pendingSent < conn->pendingLen) {
+		int sent = send(conn->socket, conn->pending + conn->pendingSent,
+						conn->pendingLen - conn->pendingSent, MSG_DONTWAIT | MSG_NOSIGNAL);
+		if (sent < 0) {
+			return errno == EAGAIN || errno == EWOULDBLOCK ? 0 : -1;
+		}
+		conn->pendingSent += sent;
+	}
+
+	free(conn->pending);
+	conn->pending = NULL;
+	struct epoll_event event;
+	event.events = EPOLLIN;
+	event.data.ptr = conn;
+	epoll_ctl(conn->worker->epollFd, EPOLL_CTL_MOD, conn->socket, &event);
+	return 0;
+}
+
+/**
+ * @brief Sends one timestamped message to the connection's session
+ */
+static void sendMessage(LoadConnection *conn, char *contents) {
+	char stamp[TIMESTAMP_DIGITS + 1];
+	snprintf(stamp, sizeof(stamp), "%0*ld", TIMESTAMP_DIGITS, bench_nowNs());
+	memcpy(contents, stamp, TIMESTAMP_DIGITS);
+
+	Packet *packet = getMessagePacket(conn->name, conn->sessionName, contents);
+	int len;
+	unsigned char *bytes = encodePacket(packet, wireFormat, &len);
+	pool_free(packet);
+
+	int sent = send(conn->socket, bytes, len, MSG_DONTWAIT | MSG_NOSIGNAL);
+	if (sent < 0) {
+		sent = 0;
+	}
+	if (sent < len) {
+		// Keep the rest and wait for the socket to become writable
+		conn->pending = (unsigned char *)malloc(len);
+		memcpy(conn->pending, bytes, len);
+		conn->pendingLen = len;
+		conn->pendingSent = sent;
+		struct epoll_event event;
+		event.events = EPOLLIN | EPOLLOUT;
+		event.data.ptr = conn;
+		epoll_ctl(conn->worker->epollFd, EPOLL_CTL_MOD, conn->socket, &event);
+	}
+	pool_free(bytes);
+	conn->worker->sent++;
+}
+
+/**
+ * @brief Worker thread, paces its sends and handles every packet its connections receive
+ */
+static void *workerThread(void *args) {
+	LoadWorker *worker = (LoadWorker *)args;
+	struct epoll_event events[256];
+	char *contents = (char *)malloc(payloadSize + 1);
+	memset(contents, 'x', payloadSize);
+	contents[payloadSize] = '\0';
+
+	long start = bench_nowNs();
+	int next = 0;
+	while (running) {
+		if (sending) {
+			long due = (long)((bench_nowNs() - start) / 1e9 * worker->rate) - worker->sent;
+			while (due-- > 0) {
+				// Round robin over the open connections without a message still pending
+				int tries;
+				for (tries = 0; tries < worker->count &&
+					 (worker->connections[next]->pending != NULL || worker->connections[next]->closed); tries++) {
+					next = (next + 1) % worker->count;
+				}
+				if (tries == worker->count) {
+					worker->stalls++;
+					break;
+				}
+				sendMessage(worker->connections[next], contents);
+				next = (next + 1) % worker->count;
+			}
+		}
+
+		int ready = epoll_wait(worker->epollFd, events, 256, 1);
+		int i;
+		for (i = 0; i < ready; i++) {
+			LoadConnection *conn = (LoadConnection *)events[i].data.ptr;
+			int failed = 0;
+			if (events[i].events & EPOLLOUT) {
+				failed = flushPending(conn) != 0;
+			}
+			if (!failed && (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR))) {
+				failed = receive(conn, MSG_DONTWAIT) != 0;
+			}
+			if (failed) {
+				fprintf(stderr, "Connection %s was closed by the server\n", conn->name);
+				epoll_ctl(worker->epollFd, EPOLL_CTL_DEL, conn->socket, NULL);
+				conn->closed = 1;
+			}
+		}
+	}
+
+	free(contents);
+	return NULL;
+}
+
+int main(int argc, char **argv) {
+	int connectionCount = 100;
+	int sessionCount = 10;
+	double rate = 1000;
+	int duration = 10;
+	int threadCount = sysconf(_SC_NPROCESSORS_ONLN);
+	int opt, i;
+
+	while ((opt = getopt(argc, argv, "c:s:r:d:z:t:ag:")) != -1) {
+		switch (opt) {
+			case 'c':
+				connectionCount = atoi(optarg);
+				break;
+			case 's':
+				sessionCount = atoi(optarg);
+				break;
+			case 'r':
+				rate = atof(optarg);
+				break;
+			case 'd':
+				duration = atoi(optarg);
+				break;
+			case 'z':
+				payloadSize = atoi(optarg);
+				break;
+			case 't':
+				threadCount = atoi(optarg);
+				break;
+			case 'a':
+				wireFormat = WIRE_ASCII;
+				break;
+			case 'g':
+				// Credentials in the passwords file format
+				for (i = 0; i < atoi(optarg); i++) {
+					printf("load%d\tpw%d\n", i, i);
+				}
+				return 0;
+			default:
+				printf(USAGE);
+				return 0;
+		}
+	}
+	if (argc - optind != 2 || connectionCount <= 0 || sessionCount <= 0 || rate <= 0 ||
+		duration <= 0 || threadCount <= 0) {
+		printf(USAGE);
+		return 0;
+	}
+	if (payloadSize <= TIMESTAMP_DIGITS || payloadSize > MAX_DATA - MAX_NAME) {
+		fprintf(stderr, "Payload must be %d to %d bytes\n", TIMESTAMP_DIGITS + 1, MAX_DATA - MAX_NAME);
+		return 1;
+	}
+	if (sessionCount > connectionCount) {
+		sessionCount = connectionCount;
+	}
+	if (threadCount > connectionCount) {
+		threadCount = connectionCount;
+	}
+	char *host = argv[optind];
+	char *port = argv[optind + 1];
+
+	// Each connection needs a descriptor
+	struct rlimit limit;
+	if (getrlimit(RLIMIT_NOFILE, &limit) == 0) {
+		limit.rlim_cur = limit.rlim_max;
+		setrlimit(RLIMIT_NOFILE, &limit);
+	}
+
+	char **sessionNames = (char **)calloc(sessionCount, sizeof(char *));
+	for (i = 0; i < sessionCount; i++) {
+		sessionNames[i] = (char *)malloc(32);
+		snprintf(sessionNames[i], 32, "loadroom%d", i);
+	}
+
+	// Log everyone in, the first member of each session creates it
+	LoadConnection *connections = (LoadConnection *)calloc(connectionCount, sizeof(LoadConnection));
+	for (i = 0; i < connectionCount; i++) {
+		LoadConnection *conn = &connections[i];
+		char password[32];
+		snprintf(conn->name, MAX_NAME, "load%d", i);
+		snprintf(password, sizeof(password), "pw%d", i);
+		conn->sessionName = sessionNames[i % sessionCount];
+
+		conn->socket = getClientSocket(host, port);
+		if (conn->socket < 0) {
+			fprintf(stderr, "Connection %d failed\n", i);
+			return 1;
+		}
+		if (request(conn, getLoginPacket(conn->name, password, wireFormat, 0, 0)) != LO_ACK) {
+			fprintf(stderr, "Login failed for %s, start the server with credentials from loadgen -g\n",
+					conn->name);
+			return 1;
+		}
+		int type = i < sessionCount
+			? request(conn, getNewSessionPacket(conn->name, conn->sessionName))
+			: request(conn, getJoinSessionPacket(conn->name, conn->sessionName));
+		if (type != NS_ACK && type != JN_ACK) {
+			fprintf(stderr, "%s could not enter session %s\n", conn->name, conn->sessionName);
+			return 1;
+		}
+	}
+
+	// Hand the connections out to the workers
+	LoadWorker *workers = (LoadWorker *)calloc(threadCount, sizeof(LoadWorker));
+	for (i = 0; i < threadCount; i++) {
+		workers[i].epollFd = epoll_create1(0);
+		workers[i].connections = (LoadConnection **)calloc(connectionCount / threadCount + 1,
+														   sizeof(LoadConnection *));
+		workers[i].rate = rate / threadCount;
+	}
+	for (i = 0; i < connectionCount; i++) {
+		LoadWorker *worker = &workers[i % threadCount];
+		LoadConnection *conn = &connections[i];
+		conn->worker = worker;
+		worker->connections[worker->count++] = conn;
+
+		struct epoll_event event;
+		event.events = EPOLLIN;
+		event.data.ptr = conn;
+		epoll_ctl(worker->epollFd, EPOLL_CTL_ADD, conn->socket, &event);
+	}
+
+	long start = bench_nowNs();
+	for (i = 0; i < threadCount; i++) {
+		pthread_create(&workers[i].thread, NULL, workerThread, &workers[i]);
+	}
+	sleep(duration);
+	sending = 0;
+	double elapsed = (bench_nowNs() - start) / 1e9;
+	usleep(DRAIN_MS * 1000);
+	running = 0;
+
+	// Merge the workers' counters
+	long sent = 0, acked = 0, delivered = 0, rejected = 0, stalls = 0, reads = 0, packets = 0;
+	long *histogram = (long *)calloc(HISTOGRAM_BUCKETS, sizeof(long));
+	for (i = 0; i < threadCount; i++) {
+		pthread_join(workers[i].thread, NULL);
+		sent += workers[i].sent;
+		acked += workers[i].acked;
+		delivered += workers[i].delivered;
+		rejected += workers[i].rejected;
+		stalls += workers[i].stalls;
+		reads += workers[i].reads;
+		packets += workers[i].packets;
+		int bucket;
+		for (bucket = 0; bucket < HISTOGRAM_BUCKETS; bucket++) {
+			histogram[bucket] += workers[i].histogram[bucket];
+		}
+	}
+
+	printf("connections:  %d in %d sessions, %d threads, %d byte payloads, %s frames\n",
+		   connectionCount, sessionCount, threadCount, payloadSize,
+		   wireFormat == WIRE_BINARY ? "binary" : "ascii");
+	printf("sent:         %ld messages, %.0f/s (target %.0f/s)\n", sent, sent / elapsed, rate);
+	printf("acked:        %ld messages, %.0f/s\n", acked, acked / elapsed);
+	printf("delivered:    %ld messages, %.0f/s\n", delivered, delivered / elapsed);
+	printf("rejected:     %ld responses\n", rejected);
+	printf("stalls:       %ld\n", stalls);
+	if (reads > 0) {
+		printf("reads:        %ld, %.2f packets per read\n", reads, (double)packets / reads);
+	}
+	if (delivered > 0) {
+		printf("latency:      p50 %.1f us, p99 %.1f us, p999 %.1f us\n",
+			   percentile(histogram, delivered, 0.5) / 1e3,
+			   percentile(histogram, delivered, 0.99) / 1e3,
+			   percentile(histogram, delivered, 0.999) / 1e3);
+	}
+
+	for (i = 0; i < connectionCount; i++) {
+		close(connections[i].socket);
+		fb_free(&connections[i].input);
+		free(connections[i].pending);
+	}
+	for (i = 0; i < threadCount; i++) {
+		close(workers[i].epollFd);
+		free(workers[i].connections);
+	}
+	for (i = 0; i < sessionCount; i++) {
+		free(sessionNames[i]);
+	}
+	free(sessionNames);
+	free(histogram);
+	free(workers);
+	free(connections);
+	return 0;
+}
@@ -0,0 +1,113 @@
+//
+// Logging benchmark
+//
+// Threads log the server's per-request line with a 64 byte payload, once with
+// printf and fflush the way the request handlers used to and once through the
+// logger. Both write to /dev/null. Threads log back to back, which overruns the
+// logger's rings, and then in bursts of 32 records with a 100 us wait between them,
+// like a server thread handling a batch of requests and going back to poll.
+// Reports the time the logging threads spend in each log call, the time until the
+// logger's writer caught up, and records dropped.
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "../utils/logger.h"
+#include "benchUtil.h"
+
+#define RECORDS 200000
+#define PAYLOAD 64
+/* Records between waits in the paced runs */
+#define BURST 32
+#define WAIT_US 100
+
+/* The terminal, stdout goes to /dev/null */
+static FILE *results;
+
+static char payload[PAYLOAD + 1];
+static int useLogger;
+static int paced;
+
+static void *logThread(void *args) {
+	double *loggingNs = (double *)args;
+	double burstStart = bench_nowNs();
+	int i;
+	for (i = 0; i < RECORDS; i++) {
+		if (paced && i % BURST == 0) {
+			*loggingNs += bench_nowNs() - burstStart;
+			usleep(WAIT_US);
+			burstStart = bench_nowNs();
+		}
+		if (useLogger) {
+			logger_log(LOG_LEVEL_DEBUG, "RECV %d bytes: %.*s\n", PAYLOAD, PAYLOAD, payload);
+		}
+		else {
+			printf("INFO: RECV %d bytes: %.*s\n", PAYLOAD, PAYLOAD, payload);
+			fflush(stdout);
+		}
+	}
+	*loggingNs += bench_nowNs() - burstStart;
+	return NULL;
+}
+
+static void run(const char *name, int threadCount) {
+	pthread_t threads[threadCount];
+	double loggingNs[threadCount];
+	double totalLoggingNs = 0;
+	int i;
+
+	long droppedBefore = logger_dropped();
+	double start = bench_nowNs();
+	for (i = 0; i < threadCount; i++) {
+		loggingNs[i] = 0;
+		pthread_create(&threads[i], NULL, logThread, &loggingNs[i]);
+	}
+	for (i = 0; i < threadCount; i++) {
+		pthread_join(threads[i], NULL);
+		totalLoggingNs += loggingNs[i];
+	}
+	double logged = bench_nowNs() - start;
+	if (useLogger) {
+		logger_flush();
+	}
+	double written = bench_nowNs() - start;
+
+	long records = (long)RECORDS * threadCount;
+	fprintf(results, "%-8s %8d %8s %12.1f %14.0f %12.1f %10ld\n", name, threadCount, paced ? "bursts" : "no",
+			totalLoggingNs / records, records / (logged / 1e9), written / 1e6,
+			logger_dropped() - droppedBefore);
+}
+
+int main(int argc, char **argv) {
+	int maxThreads = argc > 1 ? atoi(argv[1]) : 4;
+	int threads;
+
+	memset(payload, 'x', PAYLOAD);
+	results = fdopen(dup(STDOUT_FILENO), "w");
+	if (results == NULL || freopen("/dev/null", "w", stdout) == NULL) {
+		return 1;
+	}
+	FILE *sink = fopen("/dev/null", "w");
+	if (sink == NULL) {
+		return 1;
+	}
+
+	fprintf(results, "%d records per thread, %d byte payloads\n", RECORDS, PAYLOAD);
+	fprintf(results, "%-8s %8s %8s %12s %14s %12s %10s\n", "output", "threads", "paced", "ns/record",
+			"records/s", "written ms", "dropped");
+	if (logger_start(sink, LOG_LEVEL_DEBUG) != 0) {
+		return 1;
+	}
+	for (paced = 0; paced <= 1; paced++) {
+		for (useLogger = 0; useLogger <= 1; useLogger++) {
+			for (threads = 1; threads <= maxThreads; threads *= 2) {
+				run(useLogger ? "logger" : "printf", threads);
+			}
+		}
+	}
+
+	fclose(results);
+	return 0;
+}
@@ -0,0 +1,105 @@
+//
+// Session membership benchmark
+//
+// Fills one session with a given number of members, then replaces random members
+// (a leave and a rejoin) and checks random members like MESSAGE does for its sender.
+// Runs against the LinkedList sessions used to keep and against MemberSet, at several
+// session sizes.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include "../collections/linkedList.h"
+#include "../collections/memberSet.h"
+#include "benchUtil.h"
+
+#define OPERATIONS 200000
+
+/* Keeps the compiler from discarding the timed work */
+static volatile unsigned long sink;
+
+static int pointerComparer(void *p1, void *p2) {
+	return p1 != p2;
+}
+
+/**
+ * @brief Times churn and membership checks on a linked list of members
+ */
+static void benchList(int *clients, int size) {
+	LinkedList *list = ll_init();
+	int i;
+	for (i = 0; i < size; i++) {
+		ll_insert(list, &clients[i]);
+	}
+
+	// A random member leaves and joins again at the end
+	srand(1);
+	double start = bench_nowNs();
+	for (i = 0; i < OPERATIONS; i++) {
+		int leaving = rand() % size;
+		Node *node = ll_find(list, &clients[leaving], &pointerComparer);
+		ll_remove(list, node);
+		free(node);
+		ll_insert(list, &clients[leaving]);
+	}
+	double churnNs = (bench_nowNs() - start) / OPERATIONS;
+
+	start = bench_nowNs();
+	for (i = 0; i < OPERATIONS; i++) {
+		sink += ll_find(list, &clients[rand() % size], &pointerComparer) != NULL;
+	}
+	double containsNs = (bench_nowNs() - start) / OPERATIONS;
+
+	Node *node = list->head;
+	while (node != NULL) {
+		Node *next = node->next;
+		free(node);
+		node = next;
+	}
+	free(list);
+	printf("%-10s %8d %12.1f %12.1f\n", "list", size, churnNs, containsNs);
+}
+
+/**
+ * @brief Times churn and membership checks on a member set
+ */
+static void benchSet(int *clients, int size) {
+	MemberSet *set = ms_init();
+	int i;
+	for (i = 0; i < size; i++) {
+		ms_insert(set, &clients[i]);
+	}
+
+	srand(1);
+	double start = bench_nowNs();
+	for (i = 0; i < OPERATIONS; i++) {
+		int leaving = rand() % size;
+		ms_remove(set, &clients[leaving]);
+		ms_insert(set, &clients[leaving]);
+	}
+	double churnNs = (bench_nowNs() - start) / OPERATIONS;
+
+	start = bench_nowNs();
+	for (i = 0; i < OPERATIONS; i++) {
+		sink += ms_contains(set, &clients[rand() % size]);
+	}
+	double containsNs = (bench_nowNs() - start) / OPERATIONS;
+
+	ms_free(set);
+	printf("%-10s %8d %12.1f %12.1f\n", "memberset", size, churnNs, containsNs);
+}
+
+int main() {
+	int sizes[] = { 4, 64, 1024, 16384 };
+	unsigned int i;
+
+	printf("%-10s %8s %12s %12s\n", "members", "size", "churn ns", "contains ns");
+	for (i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+		// Only the addresses matter, they stand in for ThreadInfo pointers
+		int *clients = (int *)calloc(sizes[i], sizeof(int));
+		benchList(clients, sizes[i]);
+		benchSet(clients, sizes[i]);
+		free(clients);
+	}
+
+	return 0;
+}
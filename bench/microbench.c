@@ -0,0 +1,571 @@
+//
+// Microbenchmark suite
+//
+// Times the hot primitives in isolation: the ASCII and binary codecs, parseTokens,
+// the hash table and the linked list, over several sizes and key distributions.
+// Every case runs a number of times and reports the median and the median absolute
+// deviation of ns/op, which stay put where means get dragged around by the odd
+// preempted run.
+//
+// Results are printed as JSON, one case per line. Given a baseline file written by
+// an earlier run, every case is compared against it and the ones slower than the
+// threshold are flagged as regressions, which also makes the exit status 1.
+
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "../utils/transport.h"
+#include "../utils/printHelpers.h"
+#include "../collections/hashTable.h"
+#include "../collections/linkedList.h"
+#include "benchUtil.h"
+
+#define DEFAULT_RUNS 15
+#define DEFAULT_THRESHOLD 10.0
+#define MAX_CASES 256
+#define MAX_CASE_NAME 64
+
+/* Operations per run for the fixed cost primitives */
+#define CODEC_OPS 100000
+#define TOKEN_OPS 100000
+
+#define USAGE "Usage: microbench [-r runs] [-f filter] [-b baseline.json] [-t thresholdPercent]\n"
+
+/* Keeps the compiler from discarding the timed work */
+static volatile unsigned long sink;
+
+/**
+ * Statistics of one case
+ */
+typedef struct _CaseResult
+{
+	char name[MAX_CASE_NAME];
+	long ops;
+	int runs;
+	double medianNs;
+	double madNs;
+	double minNs;
+} CaseResult;
+
+/**
+ * @brief One run of a case, returns the elapsed ns and sets the operations done
+ */
+typedef double (*CaseRun)(void *context, long *ops);
+
+static CaseResult results[MAX_CASES];
+static int resultCount;
+static int runs = DEFAULT_RUNS;
+static const char *filter;
+
+/**
+ * @brief Runs a case once to warm up and then runs times, recording its statistics
+ */
+static void measure(const char *name, CaseRun run, void *context) {
+	if (filter != NULL && strstr(name, filter) == NULL) {
+		return;
+	}
+	if (resultCount == MAX_CASES) {
+		fprintf(stderr, "Too many cases, %s skipped\n", name);
+		return;
+	}
+
+	double *samples = (double *)malloc(runs * sizeof(double));
+	long ops = 0;
+	int i;
+	run(context, &ops);
+	for (i = 0; i < runs; i++) {
+		double elapsed = run(context, &ops);
+		samples[i] = elapsed / ops;
+	}
+
+	CaseResult *result = &results[resultCount++];
+	snprintf(result->name, MAX_CASE_NAME, "%s", name);
+	result->ops = ops;
+	result->runs = runs;
+	result->medianNs = bench_median(samples, runs);
+	result->minNs = samples[0];
+	result->madNs = bench_mad(samples, runs, result->medianNs);
+	free(samples);
+
+	fprintf(stderr, "%-40s %10.1f ns/op\n", result->name, result->medianNs);
+}
+
+/*
+ * Codec cases
+ */
+
+typedef struct _CodecContext
+{
+	Packet *packet;
+	int format;
+	unsigned char *bytes;
+	int len;
+} CodecContext;
+
+static double runEncode(void *context, long *ops) {
+	CodecContext *codec = (CodecContext *)context;
+	int i, len;
+	double start = bench_nowNs();
+	for (i = 0; i < CODEC_OPS; i++) {
+		unsigned char *bytes = codec->format == WIRE_BINARY
+			? packetToBinary(codec->packet, &len)
+			: packetToByteArray(codec->packet, &len);
+		sink += bytes[0];
+		pool_free(bytes);
+	}
+	*ops = CODEC_OPS;
+	return bench_nowNs() - start;
+}
+
+static double runDecode(void *context, long *ops) {
+	CodecContext *codec = (CodecContext *)context;
+	int i;
+	double start = bench_nowNs();
+	for (i = 0; i < CODEC_OPS; i++) {
+		Packet *packet = codec->format == WIRE_BINARY
+			? binaryToPacket(codec->bytes, codec->len)
+			: bytesToPacket(codec->bytes, codec->len);
+		sink += packet->size;
+		pool_free(packet);
+	}
+	*ops = CODEC_OPS;
+	return bench_nowNs() - start;
+}
+
+static void benchCodecs() {
+	int sizes[] = { 0, 16, 128, 1024, 2000 };
+	const char *formats[] = { "packetToByteArray", "packetToBinary" };
+	const char *decoders[] = { "bytesToPacket", "binaryToPacket" };
+	char contents[MAX_DATA];
+	char name[MAX_CASE_NAME];
+	unsigned int i;
+	int format;
+
+	for (i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+		memset(contents, 'x', sizes[i]);
+		contents[sizes[i]] = '\0';
+		for (format = 0; format < WIRE_FORMATS; format++) {
+			CodecContext codec;
+			codec.packet = getMessagePacket("benchuser", "room", contents);
+			codec.format = format;
+			codec.bytes = encodePacket(codec.packet, format, &codec.len);
+
+			snprintf(name, sizeof(name), "transport/%s/%d", formats[format], sizes[i]);
+			measure(name, &runEncode, &codec);
+			snprintf(name, sizeof(name), "transport/%s/%d", decoders[format], sizes[i]);
+			measure(name, &runDecode, &codec);
+
+			pool_free(codec.bytes);
+			pool_free(codec.packet);
+		}
+	}
+}
+
+/*
+ * parseTokens cases
+ */
+
+typedef struct _TokenContext
+{
+	char *line;
+	int len;
+	char *work;
+} TokenContext;
+
+static double runTokens(void *context, long *ops) {
+	TokenContext *tokens = (TokenContext *)context;
+	int i, count;
+	double start = bench_nowNs();
+	for (i = 0; i < TOKEN_OPS; i++) {
+		// parseTokens cuts the string up, so every op works on a fresh copy
+		memcpy(tokens->work, tokens->line, tokens->len + 1);
+		char **parts = parseTokens(tokens->work, ",", &count);
+		sink += count;
+		free(parts);
+	}
+	*ops = TOKEN_OPS;
+	return bench_nowNs() - start;
+}
+
+static void benchTokens() {
+	// Three tokens is a LOGIN, more than eight makes parseTokens grow its array
+	int counts[] = { 3, 8, 64 };
+	char name[MAX_CASE_NAME];
+	unsigned int i;
+	int token;
+
+	for (i = 0; i < sizeof(counts) / sizeof(counts[0]); i++) {
+		TokenContext tokens;
+		tokens.line = (char *)malloc(counts[i] * 16);
+		tokens.work = (char *)malloc(counts[i] * 16);
+		tokens.len = 0;
+		for (token = 0; token < counts[i]; token++) {
+			tokens.len += sprintf(tokens.line + tokens.len, token == 0 ? "token%d" : ",token%d", token);
+		}
+
+		snprintf(name, sizeof(name), "parseTokens/%d", counts[i]);
+		measure(name, &runTokens, &tokens);
+
+		free(tokens.line);
+		free(tokens.work);
+	}
+}
+
+/*
+ * Key sets
+ */
+
+#define DISTRIBUTIONS 3
+static const char *distributions[DISTRIBUTIONS] = { "sequential", "random", "prefixed" };
+
+/**
+ * @brief Builds count distinct keys: user names with a counter, random lowercase
+ * strings of 8 to 24 characters, or counters behind a 48 character shared prefix
+ */
+static char **makeKeys(int distribution, int count) {
+	char **keys = (char **)malloc(count * sizeof(char *));
+	int i, j;
+	srand(count * DISTRIBUTIONS + distribution);
+	for (i = 0; i < count; i++) {
+		keys[i] = (char *)malloc(80);
+		if (distribution == 0) {
+			snprintf(keys[i], 80, "user%d", i);
+		}
+		else if (distribution == 1) {
+			// The counter suffix keeps them distinct
+			int len = 8 + rand() % 17;
+			for (j = 0; j < len; j++) {
+				keys[i][j] = 'a' + rand() % 26;
+			}
+			snprintf(keys[i] + len, 80 - len, "%d", i);
+		}
+		else {
+			snprintf(keys[i], 80, "conference-room-with-a-rather-long-shared-prefix-%d", i);
+		}
+	}
+	return keys;
+}
+
+static void freeKeys(char **keys, int count) {
+	int i;
+	for (i = 0; i < count; i++) {
+		free(keys[i]);
+	}
+	free(keys);
+}
+
+/**
+ * @brief Order the keys are looked up or removed in, so no case walks the insertion order
+ */
+static int *shuffledOrder(int count) {
+	int *order = (int *)malloc(count * sizeof(int));
+	int i;
+	for (i = 0; i < count; i++) {
+		order[i] = i;
+	}
+	for (i = count - 1; i > 0; i--) {
+		int j = rand() % (i + 1);
+		int temp = order[i];
+		order[i] = order[j];
+		order[j] = temp;
+	}
+	return order;
+}
+
+/*
+ * Hash table cases
+ */
+
+typedef struct _TableContext
+{
+	char **keys;
+	int *order;
+	int count;
+	HashTable *table;
+} TableContext;
+
+static HashTable *buildTable(TableContext *context) {
+	HashTable *table = ht_init(128);
+	int i;
+	for (i = 0; i < context->count; i++) {
+		ht_insert(table, context->keys[i], context->keys[i]);
+	}
+	return table;
+}
+
+static double runTableInsert(void *context, long *ops) {
+	TableContext *table = (TableContext *)context;
+	HashTable *fresh = ht_init(128);
+	int i;
+	double start = bench_nowNs();
+	for (i = 0; i < table->count; i++) {
+		ht_insert(fresh, table->keys[i], table->keys[i]);
+	}
+	double elapsed = bench_nowNs() - start;
+	ht_free(fresh);
+	*ops = table->count;
+	return elapsed;
+}
+
+static double runTableFind(void *context, long *ops) {
+	TableContext *table = (TableContext *)context;
+	int i;
+	double start = bench_nowNs();
+	for (i = 0; i < table->count; i++) {
+		sink += (unsigned long)ht_find(table->table, table->keys[table->order[i]]);
+	}
+	*ops = table->count;
+	return bench_nowNs() - start;
+}
+
+static double runTableRemove(void *context, long *ops) {
+	TableContext *table = (TableContext *)context;
+	HashTable *full = buildTable(table);
+	int i;
+	double start = bench_nowNs();
+	for (i = 0; i < table->count; i++) {
+		ht_remove(full, table->keys[table->order[i]]);
+	}
+	double elapsed = bench_nowNs() - start;
+	ht_free(full);
+	*ops = table->count;
+	return elapsed;
+}
+
+static void benchTable() {
+	int sizes[] = { 100, 10000, 100000 };
+	char name[MAX_CASE_NAME];
+	unsigned int i;
+	int distribution;
+
+	for (i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+		for (distribution = 0; distribution < DISTRIBUTIONS; distribution++) {
+			TableContext table;
+			table.count = sizes[i];
+			table.keys = makeKeys(distribution, sizes[i]);
+			table.order = shuffledOrder(sizes[i]);
+			table.table = buildTable(&table);
+
+			snprintf(name, sizeof(name), "ht_insert/%s/%d", distributions[distribution], sizes[i]);
+			measure(name, &runTableInsert, &table);
+			snprintf(name, sizeof(name), "ht_find/%s/%d", distributions[distribution], sizes[i]);
+			measure(name, &runTableFind, &table);
+			snprintf(name, sizeof(name), "ht_remove/%s/%d", distributions[distribution], sizes[i]);
+			measure(name, &runTableRemove, &table);
+
+			ht_free(table.table);
+			free(table.order);
+			freeKeys(table.keys, sizes[i]);
+		}
+	}
+}
+
+/*
+ * Linked list cases
+ */
+
+typedef struct _ListContext
+{
+	char **keys;
+	int *order;
+	int count;
+	LinkedList *list;
+} ListContext;
+
+static int stringComparer(void *s1, void *s2) {
+	return strcmp((char *)s1, (char *)s2);
+}
+
+static LinkedList *buildList(ListContext *context) {
+	LinkedList *list = ll_init();
+	int i;
+	for (i = 0; i < context->count; i++) {
+		ll_insert(list, context->keys[i]);
+	}
+	return list;
+}
+
+/**
+ * @brief Frees the nodes and the list, the keys belong to the context
+ */
+static void freeList(LinkedList *list) {
+	Node *node = list->head;
+	while (node != NULL) {
+		Node *next = node->next;
+		free(node);
+		node = next;
+	}
+	free(list);
+}
+
+static double runListInsert(void *context, long *ops) {
+	ListContext *list = (ListContext *)context;
+	LinkedList *fresh = ll_init();
+	int i;
+	double start = bench_nowNs();
+	for (i = 0; i < list->count; i++) {
+		ll_insert(fresh, list->keys[i]);
+	}
+	double elapsed = bench_nowNs() - start;
+	freeList(fresh);
+	*ops = list->count;
+	return elapsed;
+}
+
+static double runListFind(void *context, long *ops) {
+	ListContext *list = (ListContext *)context;
+	int i;
+	double start = bench_nowNs();
+	for (i = 0; i < list->count; i++) {
+		sink += (unsigned long)ll_find(list->list, list->keys[list->order[i]], &stringComparer);
+	}
+	*ops = list->count;
+	return bench_nowNs() - start;
+}
+
+static double runListRemove(void *context, long *ops) {
+	ListContext *list = (ListContext *)context;
+	LinkedList *full = buildList(list);
+	Node **nodes = (Node **)malloc(list->count * sizeof(Node *));
+	Node *node;
+	int i = 0;
+	for (node = full->head; node != NULL; node = node->next) {
+		nodes[i++] = node;
+	}
+
+	// Only the unlinking is timed, the server finds the node first
+	double start = bench_nowNs();
+	for (i = 0; i < list->count; i++) {
+		ll_remove(full, nodes[list->order[i]]);
+	}
+	double elapsed = bench_nowNs() - start;
+
+	for (i = 0; i < list->count; i++) {
+		free(nodes[i]);
+	}
+	free(nodes);
+	free(full);
+	*ops = list->count;
+	return elapsed;
+}
+
+static void benchList() {
+	int sizes[] = { 16, 256, 4096 };
+	char name[MAX_CASE_NAME];
+	unsigned int i;
+
+	for (i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+		// Connections are keyed by user name
+		ListContext list;
+		list.count = sizes[i];
+		list.keys = makeKeys(0, sizes[i]);
+		list.order = shuffledOrder(sizes[i]);
+		list.list = buildList(&list);
+
+		snprintf(name, sizeof(name), "ll_insert/%d", sizes[i]);
+		measure(name, &runListInsert, &list);
+		snprintf(name, sizeof(name), "ll_find/%d", sizes[i]);
+		measure(name, &runListFind, &list);
+		snprintf(name, sizeof(name), "ll_remove/%d", sizes[i]);
+		measure(name, &runListRemove, &list);
+
+		freeList(list.list);
+		free(list.order);
+		freeKeys(list.keys, sizes[i]);
+	}
+}
+
+/*
+ * Baseline comparison
+ */
+
+/**
+ * @brief Finds a case's median in a baseline written by an earlier run
+ *
+ * @returns The median in ns, or -1 if the baseline doesn't have the case
+ */
+static double baselineMedian(FILE *baseline, const char *name) {
+	char line[512];
+	char key[MAX_CASE_NAME + 16];
+	snprintf(key, sizeof(key), "\"name\": \"%s\"", name);
+
+	rewind(baseline);
+	while (fgets(line, sizeof(line), baseline) != NULL) {
+		char *medianField = strstr(line, "\"median_ns\": ");
+		if (strstr(line, key) != NULL && medianField != NULL) {
+			return atof(medianField + strlen("\"median_ns\": "));
+		}
+	}
+	return -1;
+}
+
+int main(int argc, char **argv) {
+	const char *baselinePath = NULL;
+	double threshold = DEFAULT_THRESHOLD;
+	int opt, i;
+
+	while ((opt = getopt(argc, argv, "r:f:b:t:")) != -1) {
+		switch (opt) {
+			case 'r':
+				runs = atoi(optarg);
+				break;
+			case 'f':
+				filter = optarg;
+				break;
+			case 'b':
+				baselinePath = optarg;
+				break;
+			case 't':
+				threshold = atof(optarg);
+				break;
+			default:
+				fprintf(stderr, USAGE);
+				return 2;
+		}
+	}
+	if (runs <= 0 || optind != argc) {
+		fprintf(stderr, USAGE);
+		return 2;
+	}
+
+	FILE *baseline = NULL;
+	if (baselinePath != NULL && (baseline = fopen(baselinePath, "r")) == NULL) {
+		fprintf(stderr, "Cannot open baseline %s\n", baselinePath);
+		return 2;
+	}
+
+	benchCodecs();
+	benchTokens();
+	benchTable();
+	benchList();
+
+	// Machine readable results on stdout, progress went to stderr
+	int regressions = 0;
+	printf("{\n\"runs\": %d,\n\"threshold_pct\": %.1f,\n\"cases\": [\n", runs, threshold);
+	for (i = 0; i < resultCount; i++) {
+		CaseResult *result = &results[i];
+		printf("{\"name\": \"%s\", \"ops\": %ld, \"median_ns\": %.2f, \"mad_ns\": %.2f, \"min_ns\": %.2f",
+			   result->name, result->ops, result->medianNs, result->madNs, result->minNs);
+
+		double base = baseline != NULL ? baselineMedian(baseline, result->name) : -1;
+		if (base > 0) {
+			double change = (result->medianNs - base) / base * 100;
+			int regressed = change > threshold;
+			regressions += regressed;
+			printf(", \"baseline_ns\": %.2f, \"change_pct\": %.1f, \"regression\": %s",
+				   base, change, regressed ? "true" : "false");
+			if (regressed) {
+				fprintf(stderr, "REGRESSION %s: %.2f ns/op, baseline %.2f ns/op (%+.1f%%)\n",
+						result->name, result->medianNs, base, change);
+			}
+		}
+		printf("}%s\n", i + 1 < resultCount ? "," : "");
+	}
+	printf("],\n\"regressions\": %d\n}\n", regressions);
+
+	if (baseline != NULL) {
+		fclose(baseline);
+	}
+	return regressions > 0 ? 1 : 0;
+}
@@ -0,0 +1,90 @@
+//
+// Packet allocation benchmark
+//
+// Repeats the allocations the server makes for one MESSAGE: decoding the request,
+// building the response and encoding it, serializing the broadcast for members on
+// the other wire format and queueing it for every member. Runs once with the pool's
+// free lists bypassed, which allocates like the server did before the pool, and
+// once with them on, reporting time and heap allocations per message.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "../utils/transport.h"
+#include "../utils/sendQueue.h"
+#include "benchUtil.h"
+
+#define MESSAGES 200000
+#define MEMBERS 8
+
+/* Keeps the compiler from discarding the timed work */
+static volatile unsigned long sink;
+
+/**
+ * @brief Handles one MESSAGE frame the way chatServer_message does, minus the sockets
+ */
+static void handleMessage(unsigned char *frame, int frameLen, SendQueue *queues) {
+	Packet *request = decodePacket(frame, frameLen);
+
+	SharedBuffer *frames[WIRE_FORMATS];
+	frames[WIRE_ASCII] = sb_create(frame, frameLen);
+	frames[WIRE_BINARY] = sb_fromPacket(request, WIRE_BINARY);
+	int member;
+	for (member = 0; member < MEMBERS; member++) {
+		sq_push(&queues[member], frames[member & 1], 0);
+	}
+	sb_release(frames[WIRE_ASCII]);
+	sb_release(frames[WIRE_BINARY]);
+
+	Packet *response = allocDataPacket(MESSAGE_ACK, NULL, 0);
+	int responseLen;
+	unsigned char *bytes = encodePacket(response, WIRE_ASCII, &responseLen);
+	sink += bytes[0];
+	pool_free(bytes);
+	pool_free(response);
+	pool_free(request);
+
+	// The members' sockets take the data later
+	for (member = 0; member < MEMBERS; member++) {
+		sq_pop(&queues[member]);
+	}
+}
+
+static void run(const char *name, int caching, unsigned char *frame, int frameLen) {
+	SendQueue queues[MEMBERS];
+	PoolStats before, after;
+	int i;
+
+	memset(queues, 0, sizeof(queues));
+	pool_setCaching(caching);
+	pool_getStats(&before);
+	double start = bench_nowNs();
+	for (i = 0; i < MESSAGES; i++) {
+		handleMessage(frame, frameLen, queues);
+	}
+	double elapsed = bench_nowNs() - start;
+	pool_getStats(&after);
+
+	printf("%-10s %12.1f %16.2f %18.2f\n", name, elapsed / MESSAGES,
+		(double)(after.allocations - before.allocations) / MESSAGES,
+		(double)(after.heapAllocations - before.heapAllocations) / MESSAGES);
+}
+
+int main() {
+	char contents[1025];
+	memset(contents, 'x', sizeof(contents) - 1);
+	contents[sizeof(contents) - 1] = '\0';
+
+	Packet *packet = getMessagePacket("benchuser", "room", contents);
+	int frameLen;
+	unsigned char *frame = encodePacket(packet, WIRE_ASCII, &frameLen);
+
+	printf("%d members, %d byte frames\n", MEMBERS, frameLen);
+	printf("%-10s %12s %16s %18s\n", "pool", "ns/message", "allocs/message", "heap allocs/message");
+	run("bypassed", 0, frame, frameLen);
+	run("cached", 1, frame, frameLen);
+
+	pool_free(frame);
+	pool_free(packet);
+	return 0;
+}
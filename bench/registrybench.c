@@ -0,0 +1,118 @@
+//
+// Session registry contention benchmark
+//
+// Runs N threads against one registry doing a mix of message fan-out (walk a
+// session's members under its shard's read lock), joins and leaves over a fixed
+// set of sessions. Each configuration is run with a single shard, which behaves
+// like one global lock, and with the sharded registry to show how much concurrent
+// handlers stop serializing each other.
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "../collections/sessionRegistry.h"
+#include "benchUtil.h"
+
+#define SESSIONS 64
+#define OPS_PER_THREAD 1000000
+/* Percent of operations that are joins and leaves, the rest are messages */
+#define JOIN_PERCENT 10
+#define LEAVE_PERCENT 10
+
+/**
+ * @brief Per-thread benchmark state
+ */
+typedef struct _Worker
+{
+	pthread_t thread;
+	SessionRegistry *registry;
+	unsigned int seed;
+	char joined[SESSIONS];
+	unsigned long delivered;
+} Worker;
+
+static char sessionNames[SESSIONS][16];
+
+static void *workerThread(void *args) {
+	Worker *worker = (Worker *)args;
+	int i;
+
+	for (i = 0; i < OPS_PER_THREAD; i++) {
+		int op = rand_r(&worker->seed) % 100;
+		int index = rand_r(&worker->seed) % SESSIONS;
+
+		if (op < JOIN_PERCENT && !worker->joined[index]) {
+			sr_join(worker->registry, sessionNames[index], worker, NULL, NULL);
+			worker->joined[index] = 1;
+		}
+		else if (op < JOIN_PERCENT + LEAVE_PERCENT && worker->joined[index]) {
+			sr_leave(worker->registry, sessionNames[index], worker);
+			worker->joined[index] = 0;
+		}
+		else {
+			// Fan-out touches every member like the server's send loop does
+			Session *session = sr_acquire(worker->registry, sessionNames[index]);
+			if (session != NULL) {
+				int member;
+				for (member = 0; member < session->members->count; member++) {
+					worker->delivered += ((Worker *)session->members->members[member])->seed & 1;
+				}
+				sr_release(session);
+			}
+		}
+	}
+
+	return NULL;
+}
+
+/**
+ * @brief Runs one configuration and prints its throughput
+ */
+static void runConfig(int threadCount, int shardCount) {
+	SessionRegistry *registry = sr_init(shardCount);
+	Worker anchor;
+	int i;
+
+	// An anchor member keeps every session alive while workers come and go
+	memset(&anchor, 0, sizeof(anchor));
+	for (i = 0; i < SESSIONS; i++) {
+		sr_create(registry, sessionNames[i], &anchor, NULL, NULL);
+	}
+
+	Worker *workers = (Worker *)calloc(threadCount, sizeof(Worker));
+	double start = bench_nowNs() / 1e9;
+	for (i = 0; i < threadCount; i++) {
+		workers[i].registry = registry;
+		workers[i].seed = i + 1;
+		pthread_create(&workers[i].thread, NULL, workerThread, &workers[i]);
+	}
+	for (i = 0; i < threadCount; i++) {
+		pthread_join(workers[i].thread, NULL);
+	}
+	double elapsed = bench_nowNs() / 1e9 - start;
+
+	double ops = (double)threadCount * OPS_PER_THREAD;
+	printf("%8d %8d %14.0f %12.1f\n", threadCount, registry->shardCount, ops / elapsed,
+		   elapsed * 1e9 / ops);
+
+	free(workers);
+	sr_free(registry);
+}
+
+int main(int argc, char **argv) {
+	int maxThreads = argc > 1 ? atoi(argv[1]) : 8;
+	int i, threads;
+
+	for (i = 0; i < SESSIONS; i++) {
+		snprintf(sessionNames[i], sizeof(sessionNames[i]), "room%d", i);
+	}
+
+	printf("%8s %8s %14s %12s\n", "threads", "shards", "ops/s", "ns/op");
+	for (threads = 1; threads <= maxThreads; threads *= 2) {
+		runConfig(threads, 1);
+		runConfig(threads, REGISTRY_DEFAULT_SHARDS);
+	}
+
+	return 0;
+}
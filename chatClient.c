@@ -6,13 +6,14 @@
 #include <stdio.h>
 #include <string.h>
 #include <time.h>
+#include <errno.h>
+#include <poll.h>
+#include <sys/eventfd.h>
 #include "utils/nethelper.h"
 #include "chatClient.h"
 #include "utils/transport.h"
 #include "utils/printHelpers.h"
 
-#define TIMEOUT_RTT_MULT 3
-
 typedef struct _ThreadSessionInfo {
     SessionInfo *sessionInfo;
     int listeningSession;
@@ -24,73 +25,644 @@ typedef struct _ThreadSessionInfo {
 SessionInfo *chatclient_init()
 {
 	SessionInfo* sess =  (SessionInfo *)calloc(1, sizeof(SessionInfo));
-	pthread_mutex_init(&sess->socketLock, NULL);
+	pthread_mutex_init(&sess->sendLock, NULL);
+	pthread_mutex_init(&sess->pendingLock, NULL);
+	pthread_cond_init(&sess->pendingCond, NULL);
+	pthread_mutex_init(&sess->streamLock, NULL);
 
 	sess->currSessionID = (char **)calloc(MAX_SIMUL_SESSIONS, sizeof(char *));
 	return sess;
 }
 
 /**
- * @brief Listening thread function
+ * @brief Reads what the socket has into the input buffer
+ *
+ * @param sess SessionInfo struct
+ * @returns Bytes read, 0 if the connection closed, -1 on errors
  */
-void *chatClient_listenThread(void *args)
+static int chatClient_fill(SessionInfo *sess)
 {
-    ThreadSessionInfo *threadSess = (ThreadSessionInfo *)args;
-    SessionInfo *sess = threadSess->sessionInfo;
+	unsigned char buf[RECV_BUFFER_SIZE];
+	int bytes;
+	do {
+		bytes = recv(sess->socket, buf, RECV_BUFFER_SIZE, 0);
+	} while (bytes < 0 && errno == EINTR);
+	if (bytes > 0) {
+		fb_append(&sess->inputBuffer, buf, bytes);
+	}
+	return bytes;
+}
 
-	while (sess->threadRun) {
-		unsigned char buf[MAX_PACKET_SIZE];
-		memset(buf, 0, MAX_PACKET_SIZE);
-		
-		// Lock before reading
-		pthread_mutex_lock(&sess->socketLock);
-		int bytes = recv(sess->socket, buf, MAX_PACKET_SIZE, 0);
-
-		if (bytes == -1) {
-			// No data received before timeout, release thread
-			pthread_mutex_unlock(&sess->socketLock);
-			usleep(1000);
+/**
+ * @brief Returns the next packet from the server, reading from the socket until a
+ * complete one is buffered. Only used before the listener thread starts.
+ *
+ * @param sess SessionInfo struct
+ * @param format Returns the wire format of the packet, can be NULL
+ * @returns The packet, NULL if the connection closed or sent malformed data
+ */
+static Packet *chatClient_readPacket(SessionInfo *sess, int *format)
+{
+	while (1) {
+		int frameLen;
+		unsigned char *frame = fb_nextFrame(&sess->inputBuffer, &frameLen);
+		if (frame != NULL) {
+			if (format != NULL) {
+				*format = packetFormat(frame, frameLen);
+			}
+			return decodePacket(frame, frameLen);
+		}
+		if (frameLen < 0) {
+			fprintf(stderr, "Malformed data from server.\n");
+			return NULL;
+		}
+		if (chatClient_fill(sess) <= 0) {
+			return NULL;
+		}
+	}
+}
+
+/**
+ * @brief Prints text broadcast to one of the client's sessions
+ *
+ * @param sess SessionInfo struct
+ * @param session Name of the session
+ * @param sessionLen Length of the name
+ * @param source Client that sent the text
+ * @param text Text to print
+ * @param textLen Length of the text
+ */
+static void chatClient_printText(SessionInfo *sess, const char *session, int sessionLen,
+								 const unsigned char *source, const unsigned char *text, int textLen)
+{
+	// Named after the message, history replayed on a join arrives before the tab is set up
+	printf("\rSession %.*s: %.64s: %.*s\n\r", sessionLen < MAX_NAME ? sessionLen : MAX_NAME, session,
+		   source, textLen > 0 ? textLen : 0, text);
+	if (sess->currSessionID[sess->currSession] != NULL) {
+		printf("Tab %d '%.64s'> ", sess->currSession + 1, sess->currSessionID[sess->currSession]);
+	}
+	else {
+		printf("Tab %d> ", sess->currSession + 1);
+	}
+	fflush(stdout);
+}
+
+/**
+ * @brief Prints a message broadcast to one of the client's sessions
+ *
+ * @param sess SessionInfo struct
+ * @param message MESSAGE packet forwarded by the server
+ */
+static void chatClient_printMessage(SessionInfo *sess, Packet *message)
+{
+	int i;
+	for(i = 0; i < (int)message->size && message->data[i] != ';'; i++);
+
+	// The text ends with the newline it was typed with
+	chatClient_printText(sess, (char *)message->data, i, message->source, message->data + i + 1,
+						 message->size - i - 2);
+}
+
+/**
+ * @brief Prints the line of a chunked message received so far
+ */
+static void chatClient_flushChunkLine(SessionInfo *sess, ChunkedTransfer *transfer)
+{
+	chatClient_printText(sess, transfer->session, strlen(transfer->session), transfer->source,
+						 (unsigned char *)transfer->line, transfer->lineLen);
+	transfer->lineLen = 0;
+}
+
+/**
+ * @brief Adds text without newlines to the line of a chunked message, printing the
+ * line in pieces once it outgrows CHUNK_LINE_LIMIT
+ */
+static void chatClient_appendChunkText(SessionInfo *sess, ChunkedTransfer *transfer, const unsigned char *text, int len)
+{
+	while (len > 0) {
+		int room = CHUNK_LINE_LIMIT - transfer->lineLen;
+		int copied = len < room ? len : room;
+		memcpy(transfer->line + transfer->lineLen, text, copied);
+		transfer->lineLen += copied;
+		text += copied;
+		len -= copied;
+		if (transfer->lineLen == CHUNK_LINE_LIMIT) {
+			chatClient_flushChunkLine(sess, transfer);
+		}
+	}
+}
+
+/**
+ * @brief Ends a chunked message, printing what's left of its last line
+ */
+static void chatClient_endTransfer(SessionInfo *sess, ChunkedTransfer *transfer)
+{
+	if (transfer->lineLen > 0) {
+		chatClient_flushChunkLine(sess, transfer);
+	}
+	free(transfer->session);
+	transfer->session = NULL;
+	transfer->active = 0;
+}
+
+/**
+ * @brief Finds the chunked message a chunk belongs to, starting it on its first
+ * chunk. With every slot taken the oldest message is ended early.
+ */
+static ChunkedTransfer *chatClient_findTransfer(SessionInfo *sess, Packet *chunk, int sessionLen, unsigned int number)
+{
+	ChunkedTransfer *oldest = NULL;
+	int slot;
+	for (slot = 0; slot < MAX_CHUNKED_TRANSFERS; slot++) {
+		ChunkedTransfer *transfer = &sess->transfers[slot];
+		if (!transfer->active) {
+			if (oldest == NULL || oldest->active) {
+				oldest = transfer;
+			}
 			continue;
 		}
-		else if (bytes == 0) {
-		    sess->threadRun = 0;
-		    continue;
+		if (transfer->transfer == number && memcmp(transfer->source, chunk->source, MAX_NAME) == 0 &&
+			(int)strlen(transfer->session) == sessionLen && memcmp(transfer->session, chunk->data, sessionLen) == 0) {
+			return transfer;
 		}
+		if (oldest == NULL || (oldest->active && transfer->started < oldest->started)) {
+			oldest = transfer;
+		}
+	}
 
-		Packet *message = bytesToPacket(buf, bytes);
+	if (oldest->active) {
+		chatClient_endTransfer(sess, oldest);
+	}
+	oldest->active = 1;
+	oldest->transfer = number;
+	oldest->started = sess->transfersStarted++;
+	memcpy(oldest->source, chunk->source, MAX_NAME);
+	oldest->session = strndup((char *)chunk->data, sessionLen);
+	oldest->lineLen = 0;
+	return oldest;
+}
 
-		char *buf2 = (char *)calloc(message->size + 1, sizeof(char));
-		memcpy(buf2, message->data, message->size);
-		buf2[message->size] = '\0';
+/**
+ * @brief Prints the complete lines of a chunk of a larger message, keeping the
+ * line it ends in until the next chunk
+ *
+ * @param sess SessionInfo struct
+ * @param chunk MESSAGE_CHUNK packet forwarded by the server
+ */
+static void chatClient_receiveChunk(SessionInfo *sess, Packet *chunk)
+{
+	// "session;transfer;last;text"
+	int size = chunk->size, sessionLen, pos;
+	for (sessionLen = 0; sessionLen < size && chunk->data[sessionLen] != ';'; sessionLen++);
+	unsigned int number = 0;
+	for (pos = sessionLen + 1; pos < size && chunk->data[pos] >= '0' && chunk->data[pos] <= '9'; pos++) {
+		number = number * 10 + (chunk->data[pos] - '0');
+	}
+	if (pos + 2 >= size || chunk->data[pos] != ';' || chunk->data[pos + 2] != ';') {
+		fprintf(stderr, "\rMalformed message chunk from %.64s\n", chunk->source);
+		return;
+	}
+	int last = chunk->data[pos + 1] == '1';
+	const unsigned char *text = chunk->data + pos + 3;
+	int textLen = size - pos - 3;
+
+	ChunkedTransfer *transfer = chatClient_findTransfer(sess, chunk, sessionLen, number);
+	int start = 0, end;
+	for (end = 0; end < textLen; end++) {
+		if (text[end] == '\n') {
+			chatClient_appendChunkText(sess, transfer, text + start, end - start);
+			chatClient_flushChunkLine(sess, transfer);
+			start = end + 1;
+		}
+	}
+	chatClient_appendChunkText(sess, transfer, text + start, textLen - start);
+	if (last) {
+		chatClient_endTransfer(sess, transfer);
+	}
+}
 
-		int i, j, k = 0;
-		char buf3[256];
-		for(i = 0; i < message->size && buf2[i] != ';'; i++) {
-		    buf3[i] = buf2[i];
+/**
+ * @brief Finds the stream of a session. Expects streamLock to be held.
+ *
+ * @param sess SessionInfo struct
+ * @param name Session name
+ * @param nameLen Length of the name
+ * @returns The stream, NULL if the client has none for the session
+ */
+static SessionStream *chatClient_findStream(SessionInfo *sess, const char *name, int nameLen)
+{
+	int slot;
+	for (slot = 0; slot < MAX_SESSION_STREAMS; slot++) {
+		SessionStream *stream = &sess->streams[slot];
+		if (stream->name != NULL && (int)strlen(stream->name) == nameLen &&
+			memcmp(stream->name, name, nameLen) == 0) {
+			return stream;
 		}
-		buf3[i] = '\0';
+	}
+	return NULL;
+}
 
-		for (j = 0; j < MAX_SIMUL_SESSIONS; j++) {
-			if(sess->currSessionID[j] != NULL) {
-				if(strcmp(buf3, sess->currSessionID[j]) == 0) {
-				    k = j;
+/**
+ * @brief Frees a session's stream
+ *
+ * @param sess SessionInfo struct
+ * @param name Session name
+ */
+static void chatClient_dropStream(SessionInfo *sess, char *name)
+{
+	if (name == NULL) {
+		return;
+	}
+	pthread_mutex_lock(&sess->streamLock);
+	SessionStream *stream = chatClient_findStream(sess, name, strlen(name));
+	if (stream != NULL) {
+		compression_free(stream->inflater);
+		free(stream->name);
+		stream->inflater = NULL;
+		stream->name = NULL;
+	}
+	pthread_mutex_unlock(&sess->streamLock);
+}
+
+/**
+ * @brief Starts a new stream for a session about to be joined or created, the
+ * server restarts its stream when the client joins
+ *
+ * @param sess SessionInfo struct
+ * @param name Session name
+ */
+static void chatClient_resetStream(SessionInfo *sess, char *name)
+{
+	if (!sess->compression) {
+		return;
+	}
+	pthread_mutex_lock(&sess->streamLock);
+	SessionStream *stream = chatClient_findStream(sess, name, strlen(name));
+	int slot;
+	for (slot = 0; stream == NULL && slot < MAX_SESSION_STREAMS; slot++) {
+		if (sess->streams[slot].name == NULL) {
+			stream = &sess->streams[slot];
+		}
+	}
+	if (stream == NULL) {
+		// Reuse the stream of a session no tab shows anymore
+		for (slot = 0; stream == NULL && slot < MAX_SESSION_STREAMS; slot++) {
+			int tab, shown = 0;
+			for (tab = 0; tab < MAX_SIMUL_SESSIONS; tab++) {
+				if (sess->currSessionID[tab] != NULL &&
+					strcmp(sess->currSessionID[tab], sess->streams[slot].name) == 0) {
+					shown = 1;
 				}
 			}
+			if (!shown) {
+				stream = &sess->streams[slot];
+				compression_free(stream->inflater);
+				free(stream->name);
+				stream->inflater = NULL;
+				stream->name = NULL;
+			}
 		}
+	}
+
+	if (stream != NULL && stream->name == NULL) {
+		stream->inflater = compression_createInflater();
+		stream->name = stream->inflater != NULL ? strdup(name) : NULL;
+	}
+	else if (stream != NULL) {
+		compression_reset(stream->inflater);
+	}
+	pthread_mutex_unlock(&sess->streamLock);
+}
+
+/**
+ * @brief Inflates a compressed message with its session's stream
+ *
+ * @param sess SessionInfo struct
+ * @param packet MESSAGE_DEFLATE packet forwarded by the server
+ * @returns The MESSAGE it holds, NULL if it couldn't be inflated
+ */
+static Packet *chatClient_inflateMessage(SessionInfo *sess, Packet *packet)
+{
+	int nameLen = 0;
+	while (nameLen < (int)packet->size && packet->data[nameLen] != ';') {
+		nameLen++;
+	}
+	if (nameLen == (int)packet->size) {
+		return NULL;
+	}
+
+	Packet *message = allocPacket(MAX_DATA);
+	message->type = MESSAGE;
+	memcpy(message->source, packet->source, MAX_NAME);
+	memcpy(message->data, packet->data, nameLen + 1);
+
+	int textLen = -1;
+	pthread_mutex_lock(&sess->streamLock);
+	SessionStream *stream = chatClient_findStream(sess, (char *)packet->data, nameLen);
+	if (stream != NULL) {
+		textLen = compression_inflate(stream->inflater, packet->data + nameLen + 1, packet->size - nameLen - 1,
+									  message->data + nameLen + 1, MAX_DATA - nameLen - 1);
+	}
+	pthread_mutex_unlock(&sess->streamLock);
+
+	if (textLen < 0) {
+		fprintf(stderr, "\rCould not inflate a message from session %.*s\n", nameLen, packet->data);
+		pool_free(message);
+		return NULL;
+	}
+	message->size = nameLen + 1 + textLen;
+	return message;
+}
+
+/**
+ * @brief Unlinks a pending request. Expects pendingLock to be held.
+ */
+static void chatClient_unlinkPending(SessionInfo *sess, PendingRequest *pending)
+{
+	PendingRequest *prev = NULL, *curr = sess->pendingHead;
+	while (curr != NULL && curr != pending) {
+		prev = curr;
+		curr = curr->next;
+	}
+	if (curr == NULL) {
+		return;
+	}
+	if (prev == NULL) {
+		sess->pendingHead = curr->next;
+	}
+	else {
+		prev->next = curr->next;
+	}
+	if (sess->pendingTail == curr) {
+		sess->pendingTail = prev;
+	}
+	sess->pendingCount--;
+	// Senders may be waiting for a free slot
+	pthread_cond_broadcast(&sess->pendingCond);
+}
 
-		printf("\rSession %.64s: %.64s: %.*s\n\rTab %d '%.64s'> ", sess->currSessionID[k],
-			   message->source, message->size - i - 2, message->data + i + 1, sess->currSession + 1, sess->currSessionID[sess->currSession]);
+/**
+ * @brief Completes a request with its response. Messages the server refused are
+ * printed, other responses nobody waits for are dropped. Expects pendingLock to be held and the request to be unlinked.
+ */
+static void chatClient_completePending(SessionInfo *sess, PendingRequest *pending, Packet *response)
+{
+	if (!pending->async) {
+		pending->response = response;
+		pending->done = 1;
+		pthread_cond_broadcast(&sess->pendingCond);
+		return;
+	}
+	if (response != NULL && response->type == MESSAGE_NCK) {
+		printf("\rError sending message: %.*s\n", response->size, response->data);
 		fflush(stdout);
-		free(message);
-		free(buf2);
+	}
+	if (response != NULL) {
+		pool_free(response);
+	}
+	free(pending);
+}
 
-		pthread_mutex_unlock(&sess->socketLock);
+/**
+ * @brief Hands a packet from the server to the request it answers, or prints it if
+ * it's a broadcast
+ *
+ * @param sess SessionInfo struct
+ * @param packet Packet received, ownership is taken
+ */
+static void chatClient_dispatch(SessionInfo *sess, Packet *packet)
+{
+	if (packet->type == MESSAGE) {
+		chatClient_printMessage(sess, packet);
+		pool_free(packet);
+		return;
+	}
+	if (packet->type == MESSAGE_CHUNK) {
+		chatClient_receiveChunk(sess, packet);
+		pool_free(packet);
+		return;
+	}
+	if (packet->type == MESSAGE_DEFLATE) {
+		Packet *message = chatClient_inflateMessage(sess, packet);
+		pool_free(packet);
+		// The server sends the client's own messages back so its inflater keeps up
+		if (message != NULL && strncmp((char *)message->source, sess->clientID, MAX_NAME) != 0) {
+			chatClient_printMessage(sess, message);
+		}
+		if (message != NULL) {
+			pool_free(message);
+		}
+		return;
 	}
 
+	pthread_mutex_lock(&sess->pendingLock);
+	// The server answers in order, without ids the oldest request is the one answered
+	PendingRequest *pending = sess->pendingHead;
+	if (sess->requestIds) {
+		while (pending != NULL && pending->id != packet->id) {
+			pending = pending->next;
+		}
+	}
+	if (pending == NULL) {
+		pthread_mutex_unlock(&sess->pendingLock);
+		pool_free(packet);
+		return;
+	}
+	chatClient_unlinkPending(sess, pending);
+	chatClient_completePending(sess, pending, packet);
+	pthread_mutex_unlock(&sess->pendingLock);
+}
+
+/**
+ * @brief Fails every pending request, once no more responses can arrive
+ */
+static void chatClient_failPending(SessionInfo *sess)
+{
+	pthread_mutex_lock(&sess->pendingLock);
+	while (sess->pendingHead != NULL) {
+		PendingRequest *pending = sess->pendingHead;
+		chatClient_unlinkPending(sess, pending);
+		chatClient_completePending(sess, pending, NULL);
+	}
+	pthread_mutex_unlock(&sess->pendingLock);
+}
+
+/**
+ * @brief Tags the request with the next id, registers it as pending and sends it.
+ * Waits while MAX_PENDING_REQUESTS requests are outstanding.
+ *
+ * @param sess SessionInfo struct
+ * @param request Request to send, it is freed
+ * @param async 1 if nobody waits for the response
+ * @returns The pending request, NULL if it couldn't be sent
+ */
+static PendingRequest *chatClient_send(SessionInfo *sess, Packet *request, int async)
+{
+	PendingRequest *pending = (PendingRequest *)calloc(1, sizeof(PendingRequest));
+	pending->async = async;
+
+	pthread_mutex_lock(&sess->pendingLock);
+	while (sess->pendingCount >= MAX_PENDING_REQUESTS && sess->threadRun) {
+		pthread_cond_wait(&sess->pendingCond, &sess->pendingLock);
+	}
+	if (!sess->threadRun) {
+		// The listener stopped, nothing would complete the request
+		pthread_mutex_unlock(&sess->pendingLock);
+		pool_free(request);
+		free(pending);
+		return NULL;
+	}
+	// 0 means no id on the wire
+	if (++sess->nextRequestId == 0) {
+		sess->nextRequestId = 1;
+	}
+	pending->id = sess->nextRequestId;
+	if (sess->pendingTail != NULL) {
+		sess->pendingTail->next = pending;
+	}
+	else {
+		sess->pendingHead = pending;
+	}
+	sess->pendingTail = pending;
+	sess->pendingCount++;
+	pthread_mutex_unlock(&sess->pendingLock);
+
+	request->id = sess->requestIds ? pending->id : 0;
+	int messageLen;
+	unsigned char *message = encodePacket(request, sess->wireFormat, &messageLen);
+
+	// Registered before sending, the response may arrive before send returns
+	pthread_mutex_lock(&sess->sendLock);
+	int sent = send(sess->socket, message, messageLen, MSG_NOSIGNAL);
+	pthread_mutex_unlock(&sess->sendLock);
+
+	pool_free(request);
+	pool_free(message);
+
+	if (sent != messageLen) {
+		pthread_mutex_lock(&sess->pendingLock);
+		chatClient_unlinkPending(sess, pending);
+		pthread_mutex_unlock(&sess->pendingLock);
+		free(pending);
+		return NULL;
+	}
+	return pending;
+}
+
+/**
+ * @brief Sends a request and waits for its response. Other requests can be sent and
+ * answered meanwhile.
+ *
+ * @param sess SessionInfo struct
+ * @param request Request to send, it is freed
+ * @returns The response packet, NULL if none arrived within RESPONSE_TIMEOUT seconds
+ */
+static Packet *chatClient_request(SessionInfo *sess, Packet *request)
+{
+	PendingRequest *pending = chatClient_send(sess, request, 0);
+	if (pending == NULL) {
+		return NULL;
+	}
+
+	struct timespec deadline;
+	clock_gettime(CLOCK_REALTIME, &deadline);
+	deadline.tv_sec += RESPONSE_TIMEOUT;
+
+	pthread_mutex_lock(&sess->pendingLock);
+	while (!pending->done) {
+		if (pthread_cond_timedwait(&sess->pendingCond, &sess->pendingLock, &deadline) != 0) {
+			break;
+		}
+	}
+	if (!pending->done) {
+		// Stays pending so a late response is still matched to it, then dropped
+		pending->async = 1;
+		pthread_mutex_unlock(&sess->pendingLock);
+		return NULL;
+	}
+	pthread_mutex_unlock(&sess->pendingLock);
+
+	Packet *response = pending->response;
+	free(pending);
+	return response;
+}
+
+/**
+ * @brief Listening thread function, the only reader of the socket after login. Sleeps
+ * in poll until the server sends something or logout signals wakeFd, and hands every
+ * complete packet to the request waiting for it.
+ */
+void *chatClient_listenThread(void *args)
+{
+    ThreadSessionInfo *threadSess = (ThreadSessionInfo *)args;
+    SessionInfo *sess = threadSess->sessionInfo;
+
+	struct pollfd fds[2];
+	fds[0].fd = sess->socket;
+	fds[0].events = POLLIN;
+	fds[1].fd = sess->wakeFd;
+	fds[1].events = POLLIN;
+
+	while (sess->threadRun) {
+		if (poll(fds, 2, -1) < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			break;
+		}
+		if (fds[1].revents != 0) {
+			// Logging out
+			break;
+		}
+		if (fds[0].revents == 0) {
+			continue;
+		}
+		if (chatClient_fill(sess) <= 0) {
+			// The server closed the connection
+			break;
+		}
+
+		int frameLen;
+		unsigned char *frame;
+		while ((frame = fb_nextFrame(&sess->inputBuffer, &frameLen)) != NULL) {
+			chatClient_dispatch(sess, decodePacket(frame, frameLen));
+		}
+		if (frameLen < 0) {
+			fprintf(stderr, "Malformed data from server.\n");
+			break;
+		}
+	}
+
+	// Requests still waiting won't get a response
+	pthread_mutex_lock(&sess->pendingLock);
+	sess->threadRun = 0;
+	pthread_mutex_unlock(&sess->pendingLock);
+	chatClient_failPending(sess);
 	free(args);
 	return NULL;
 }
 
+/**
+ * @brief Checks the LO_ACK for a capability the server accepted
+ *
+ * @param loginAck LO_ACK packet, the name followed by comma separated capabilities
+ * @param capability Capability to look for
+ * @returns 1 if the server accepted it, 0 otherwise
+ */
+static int chatClient_accepted(Packet *loginAck, const char *capability)
+{
+	int capabilityLen = strlen(capability);
+	int start = MAX_NAME, end;
+	while (start < (int)loginAck->size) {
+		for (end = start; end < (int)loginAck->size && loginAck->data[end] != ','; end++);
+		if (end - start == capabilityLen && memcmp(loginAck->data + start, capability, capabilityLen) == 0) {
+			return 1;
+		}
+		start = end + 1;
+	}
+	return 0;
+}
+
 /**
  * @brief Logs into the server with the given clientID, password, and host.
  * Initializes the socket as well and saves the info into sess
@@ -110,79 +682,59 @@ int chatclient_login(SessionInfo *sess, char *clientId, char *password,
 		sess->socket = getClientSocket(serverIP, serverPort);
 	}
 
-	// Lock the socket
-	pthread_mutex_lock(&sess->socketLock);
-
-	// Get a login packet
-	Packet *loginPacket = getLoginPacket(clientId, password);
+	// Get a login packet, offering the binary format, request ids and compression.
+	// The login itself is always ASCII so servers without binary support can still
+	// read it.
+	Packet *loginPacket = getLoginPacket(clientId, password, WIRE_BINARY, 1, 1);
+	sess->wireFormat = WIRE_ASCII;
 
 	// Convert it to a string
 	int messageLen;
 	unsigned char *message = packetToByteArray(loginPacket, &messageLen);
 
-	// RTT clock
-	struct timespec start, end;
-	clock_gettime(CLOCK_REALTIME, &start);
-	send(sess->socket, message, messageLen, 0);
+	send(sess->socket, message, messageLen, MSG_NOSIGNAL);
 
 	// Receive a response from the server
-	unsigned char buf[MAX_PACKET_SIZE];
-	int received = recv(sess->socket, buf, MAX_PACKET_SIZE, 0);
-	// Stop RTT
-	clock_gettime(CLOCK_REALTIME, &end);
-
-	sess->waitPeriod.tv_sec = end.tv_sec - start.tv_sec;
-	sess->waitPeriod.tv_usec = TIMEOUT_RTT_MULT *
-					 ((end.tv_nsec - start.tv_nsec) / 1000);
-
-	if (sess->waitPeriod.tv_usec == 0) sess->waitPeriod.tv_usec = 2500;
-
-	// Set the socket timeout to a multiple of the RTT
-	if (setsockopt(sess->socket, SOL_SOCKET, SO_RCVTIMEO, (const char*)&sess->waitPeriod, sizeof(struct timeval)) < 0)
-	{
-		printLastError("Error at setsockopt(): %s\n");
-		return -1;
-	}
-	if (setsockopt(sess->socket, SOL_SOCKET, SO_SNDTIMEO, (const char*)&sess->waitPeriod, sizeof(struct timeval)) < 0)
-	{
-		printLastError("Error at setsockopt(): %s\n");
-		return -1;
-	} 
+	int responseFormat;
+	Packet *responsePacket = chatClient_readPacket(sess, &responseFormat);
 
 	// Free allocated packets and string!
-	free(loginPacket);
-	free(message);
+	pool_free(loginPacket);
+	pool_free(message);
 
-	if (received < 0) {
+	if (responsePacket == NULL) {
 	    fprintf(stderr, "No data received.\n");
-	    pthread_mutex_unlock(&sess->socketLock);
 	    return -1;
 	}
-	// Convert the string response back into a packet format
-	Packet *responsePacket = bytesToPacket(buf, received);
+	// The server answers in binary if it accepted the binary format
+	sess->wireFormat = responseFormat;
 
 	int returnVal;
 	if (responsePacket->type == LO_ACK) {
-		memcpy(sess->clientID, responsePacket->data, responsePacket->size);
+		// Servers list the capabilities they accepted after the name
+		sess->requestIds = chatClient_accepted(responsePacket, REQUEST_IDS_CAPABILITY);
+		sess->compression = chatClient_accepted(responsePacket, COMPRESSION_CAPABILITY);
+		memcpy(sess->clientID, responsePacket->data, responsePacket->size < MAX_NAME ? responsePacket->size : MAX_NAME);
+		sess->clientID[MAX_NAME - 1] = '\0';
 		sess->currSessionID[sess->currSession] = NULL;
 	    returnVal = 0;
 
+		// Logout signals the listener through wakeFd to stop it
+		sess->wakeFd = eventfd(0, EFD_CLOEXEC);
 		sess->threadRun = 1;
 		ThreadSessionInfo *ti = (ThreadSessionInfo *)calloc(1, sizeof(ThreadSessionInfo));
 		ti->sessionInfo = sess;
 		ti->listeningSession = sess->currSession;
 		pthread_create(&sess->listeningThread, NULL, chatClient_listenThread,
 				ti);
-		pthread_detach(sess->listeningThread);
+		sess->listening = 1;
 	} else {
 		printf("Login error: %.*s", responsePacket->size, responsePacket->data);
 		//TODO: Handle error messages
 		returnVal = -1;
 	}
 
-	free(responsePacket);
-	// Unlock socket and return
-	pthread_mutex_unlock(&sess->socketLock);
+	pool_free(responsePacket);
 	return returnVal;
 }
 
@@ -202,27 +754,22 @@ int chatclient_logout(SessionInfo *sess)
 		// No session value, nothing to do
 		return -1;
 	}
-	// Lock the socket
-	pthread_mutex_lock(&sess->socketLock);
-
 	// Get a logout packet
 	Packet *logoutPacket = getLogoutPacket(sess->clientID);
 
 	// Convert it to a string
 	int messageLen;
-	unsigned char *message = packetToByteArray(logoutPacket, &messageLen);
+	unsigned char *message = encodePacket(logoutPacket, sess->wireFormat, &messageLen);
 
-	send(sess->socket, message, messageLen, 0);
+	pthread_mutex_lock(&sess->sendLock);
+	send(sess->socket, message, messageLen, MSG_NOSIGNAL);
+	pthread_mutex_unlock(&sess->sendLock);
 
 	// Free allocated packets and string!
-	free(logoutPacket);
-	free(message);
-
-	sess->threadRun = 0;
+	pool_free(logoutPacket);
+	pool_free(message);
 
 	chatclient_finish(sess);
-	// Unlock the socket
-	pthread_mutex_unlock(&sess->socketLock);
 	return 0;
 }
 
@@ -243,40 +790,24 @@ int chatclient_joinSession(SessionInfo *sess, char *sessionID)
 		// No session value, nothing to do
 		return -1;
 	}
-	// Lock the socket
-	pthread_mutex_lock(&sess->socketLock);
 
 	Packet *joinSessionPacket = getJoinSessionPacket(sess->clientID, sessionID);
+	chatClient_resetStream(sess, sessionID);
 
-	// Convert it to a string
-	int messageLen;
-	unsigned char *message = packetToByteArray(joinSessionPacket, &messageLen);
-
-	send(sess->socket, message, messageLen, 0);
+	// Send the request and wait for the response
+	Packet *responsePacket = chatClient_request(sess, joinSessionPacket);
 
-	// Free allocated packets and strings
-	free(joinSessionPacket);
-	free(message);
-
-	// Receive a response from the server
-	unsigned char buf[MAX_PACKET_SIZE];
-	int received = recv(sess->socket, buf, MAX_PACKET_SIZE, 0);
-
-	if (received < 0) {
+	if (responsePacket == NULL) {
 	    fprintf(stderr, "No data received.\n");
-	    pthread_mutex_unlock(&sess->socketLock);
 	    return -1;
 	}
 
-	// Convert the response back into a packet
-	Packet *responsePacket = bytesToPacket(buf, received);
-
 	int returnVal;
 	if (responsePacket->type == JN_ACK) {
 		if(sess->currSessionID[sess->currSession] != NULL) {
 		    free(sess->currSessionID[sess->currSession]);
 		}
-		sess->currSessionID[sess->currSession] = (char *)calloc(responsePacket->size, sizeof(char));
+		sess->currSessionID[sess->currSession] = (char *)calloc(responsePacket->size + 1, sizeof(char));
 		memcpy(sess->currSessionID[sess->currSession], responsePacket->data, responsePacket->size);
 		printf("Joined session: %s\n", sess->currSessionID[sess->currSession]);
 		returnVal = 0;
@@ -287,8 +818,7 @@ int chatclient_joinSession(SessionInfo *sess, char *sessionID)
 		returnVal = -1;
 	}
 
-	free(responsePacket);
-	pthread_mutex_unlock(&sess->socketLock);
+	pool_free(responsePacket);
 	return returnVal;
 }
 
@@ -308,34 +838,20 @@ int chatclient_leaveSession(SessionInfo *sess)
 		// No session value, nothing to do
 		return -1;
 	}
-	// Lock network socket before processing
-	pthread_mutex_lock(&sess->socketLock);
 
 	Packet *leaveSessPacket = getLeaveSessionPacket(sess->clientID, sess->currSessionID[sess->currSession]);
 
-	int messageLen;
-	unsigned char *message = packetToByteArray(leaveSessPacket, &messageLen);
+	// Send the request and wait for the response
+	Packet *responsePacket = chatClient_request(sess, leaveSessPacket);
 
-	send(sess->socket, message, messageLen, 0);
-
-	free(leaveSessPacket);
-	free(message);
-
-	// Receive a response from the server
-	unsigned char buf[MAX_PACKET_SIZE];
-	int received = recv(sess->socket, buf, MAX_PACKET_SIZE, 0);
-
-	if (received < 0) {
+	if (responsePacket == NULL) {
 	    fprintf(stderr, "No data received.\n");
-		pthread_mutex_unlock(&sess->socketLock);
 	    return -1;
 	}
 
-	// Convert the string response back into a packet format
-	Packet *responsePacket = bytesToPacket(buf, received);
-
 	int returnVal;
 	if(responsePacket->type == LS_ACK) {
+		chatClient_dropStream(sess, sess->currSessionID[sess->currSession]);
 		free(sess->currSessionID[sess->currSession]);
 		sess->currSessionID[sess->currSession] = NULL;
 		returnVal = 0;
@@ -345,8 +861,7 @@ int chatclient_leaveSession(SessionInfo *sess)
 		returnVal = -1;
 	}
 
-	free(responsePacket);
-	pthread_mutex_unlock(&sess->socketLock);
+	pool_free(responsePacket);
 	return returnVal;
 }
 
@@ -371,37 +886,24 @@ int chatclient_createSession(SessionInfo *sess, char *sessionID)
 	    // User already in session
 		return -1;
 	}
-	// Lock socket before processing
-	pthread_mutex_lock(&sess->socketLock);
 
 	Packet *newSessPacket = getNewSessionPacket(sess->clientID, sessionID);
+	chatClient_resetStream(sess, sessionID);
 
-	int messageLen;
-	unsigned char *message = packetToByteArray(newSessPacket, &messageLen);
-
-	send(sess->socket, message, messageLen, 0);
-
-	free(newSessPacket);
-	free(message);
-
-	// Receive a response from the server
-	unsigned char buf[MAX_PACKET_SIZE];
-	int received = recv(sess->socket, buf, MAX_PACKET_SIZE, 0);
+	// Send the request and wait for the response
+	Packet *responsePacket = chatClient_request(sess, newSessPacket);
 
-	if (received < 0) {
+	if (responsePacket == NULL) {
 	    fprintf(stderr, "No data received.\n");
-		pthread_mutex_unlock(&sess->socketLock);
 	    return -1;
 	}
-	// Convert the string response back into a packet format
-	Packet *responsePacket = bytesToPacket(buf, received);
 
 	int returnVal;
 	if (responsePacket->type == NS_ACK) {
 		if (sess->currSessionID[sess->currSession] != NULL) {
 			free(sess->currSessionID[sess->currSession]);
 		}
-		sess->currSessionID[sess->currSession] = (char *)calloc(responsePacket->size, sizeof(char));
+		sess->currSessionID[sess->currSession] = (char *)calloc(responsePacket->size + 1, sizeof(char));
 		memcpy(sess->currSessionID[sess->currSession], responsePacket->data, responsePacket->size);
 		printf("Session created: %s\n", sess->currSessionID[sess->currSession]);
 	    returnVal = 0;
@@ -412,8 +914,7 @@ int chatclient_createSession(SessionInfo *sess, char *sessionID)
 		returnVal = -1;
 	}
 
-	free(responsePacket);
-	pthread_mutex_unlock(&sess->socketLock);
+	pool_free(responsePacket);
 	return returnVal;
 }
 
@@ -433,30 +934,16 @@ int chatclient_list(SessionInfo *sess)
 		//No session value, nothing to do
 		return -1;
 	}
-	// Lock network socket
-	pthread_mutex_lock(&sess->socketLock);
 
 	Packet *queryPacket = getListPacket(sess->clientID);
 
-	int messageLen;
-	unsigned char *ret = packetToByteArray(queryPacket, &messageLen);
-
-	send(sess->socket, ret, messageLen, 0);
-
-	free(queryPacket);
-	free(ret);
-
-	//Receive response
-	unsigned char buf[MAX_PACKET_SIZE];
-	int received = recv(sess->socket, buf, MAX_PACKET_SIZE, 0);
+	// Send the request and wait for the response
+	Packet *responsePacket = chatClient_request(sess, queryPacket);
 
-	if (received < 0) {
+	if (responsePacket == NULL) {
 		fprintf(stderr, "No data received.\n");
-		pthread_mutex_unlock(&sess->socketLock);
 		return -1;
 	}
-	// Convert back to packet
-	Packet *responsePacket = bytesToPacket(buf, received);
 	int returnVal;
 	if(responsePacket->type != QU_ACK) {
 		printf("Error listing sessions: %.*s\n", responsePacket->size, responsePacket->data);
@@ -467,19 +954,17 @@ int chatclient_list(SessionInfo *sess)
 		returnVal = 0;
 	}
 
-	free(responsePacket);
-	pthread_mutex_unlock(&sess->socketLock);
+	pool_free(responsePacket);
 	return returnVal;
 }
 
 /**
- * @brief Sends a message to the server in the current session
+ * @brief Prints the server's counters and latency histograms
  * 
  * @param sess SessionInfo struct
- * @param message Message to send
  * @returns 0 if successful, -1 otherwise
  */
-int chatclient_sendMessage(SessionInfo *sess, char *message)
+int chatclient_stats(SessionInfo *sess)
 {
 	if (sess->socket <= 0) {
 		// Socket not initialized, nothing to do
@@ -489,46 +974,142 @@ int chatclient_sendMessage(SessionInfo *sess, char *message)
 		//No session value, nothing to do
 		return -1;
 	}
-	// Lock network socket
-	pthread_mutex_lock(&sess->socketLock);
-
-	Packet *messagePacket = getMessagePacket(sess->clientID, sess->currSessionID[sess->currSession], message);
-
-	int messageLen;
-	unsigned char *ret = packetToByteArray(messagePacket, &messageLen);
-
-	send(sess->socket, ret, messageLen, 0);
 
-	free(messagePacket);
-	free(ret);
+	Packet *statsPacket = getStatsPacket(sess->clientID);
 
-	// Receive a response from the server
-	unsigned char buf[MAX_PACKET_SIZE];
-	int received = recv(sess->socket, buf, MAX_PACKET_SIZE, 0);
+	// Send the request and wait for the response
+	Packet *responsePacket = chatClient_request(sess, statsPacket);
 
-	if (received < 0) {
-	    fprintf(stderr, "No data received.\n");
-		pthread_mutex_unlock(&sess->socketLock);
-	    return -1;
+	if (responsePacket == NULL) {
+		fprintf(stderr, "No data received.\n");
+		return -1;
 	}
-	// Convert the string response back into a packet format
-	Packet *responsePacket = bytesToPacket(buf, received);
-
 	int returnVal;
-	if (responsePacket->type != MESSAGE_ACK) {
-		printf("Error sending message: %.*s", responsePacket->size, responsePacket->data);
-		//TODO: Handle error messages
+	if(responsePacket->type != ST_ACK) {
+		printf("Error getting stats: %.*s\n", responsePacket->size, responsePacket->data);
 		returnVal = -1;
-	} 
+	}
 	else {
-	    returnVal = 0;
+		printf("%.*s", responsePacket->size, responsePacket->data);
+		returnVal = 0;
 	}
 
-	free(responsePacket);
-	pthread_mutex_unlock(&sess->socketLock);
+	pool_free(responsePacket);
 	return returnVal;
 }
 
+/**
+ * @brief Sends a message to the server in the current session without waiting for
+ * the server to acknowledge it. Failures reported by the server are printed when
+ * they arrive.
+ * 
+ * @param sess SessionInfo struct
+ * @param message Message to send
+ * @returns 0 if the message was sent, -1 otherwise
+ */
+int chatclient_sendMessage(SessionInfo *sess, char *message)
+{
+	if (sess->socket <= 0) {
+		// Socket not initialized, nothing to do
+		return -1;
+	}
+	if (strcmp(sess->clientID, "") == 0) {
+		//No session value, nothing to do
+		return -1;
+	}
+
+	Packet *messagePacket = getMessagePacket(sess->clientID, sess->currSessionID[sess->currSession], message);
+
+	// Pasted lines go out back to back, the listener matches the acknowledgements
+	if (chatClient_send(sess, messagePacket, 1) == NULL) {
+		return -1;
+	}
+	return 0;
+}
+
+/**
+ * @brief Sends one chunk of a chunked message without waiting for the server to
+ * acknowledge it
+ *
+ * @returns 0 if the chunk was sent, -1 otherwise
+ */
+static int chatClient_sendChunk(SessionInfo *sess, char *session, unsigned int transfer, int last,
+								const char *text, int len)
+{
+	Packet *chunk = getMessageChunkPacket(sess->clientID, session, transfer, last, text, len);
+	return chatClient_send(sess, chunk, 1) != NULL ? 0 : -1;
+}
+
+/**
+ * @brief Sends a message of any size to the current session, read from the input
+ * until a line holding only the terminator or the end of the input. The message
+ * goes out in chunks as it is read, so it is never held in memory whole.
+ * 
+ * @param sess SessionInfo struct
+ * @param input Stream to read the message from
+ * @param terminator Line that ends the message, without its newline
+ * @returns Bytes sent, -1 if the message couldn't be sent
+ */
+long chatclient_sendStream(SessionInfo *sess, FILE *input, const char *terminator)
+{
+	if (sess->socket <= 0) {
+		// Socket not initialized, nothing to do
+		return -1;
+	}
+	char *session = sess->currSessionID[sess->currSession];
+	if (strcmp(sess->clientID, "") == 0 || session == NULL) {
+		// Not in a session, nothing to do
+		return -1;
+	}
+	int capacity = messageChunkCapacity(session);
+	if (capacity <= 0) {
+		return -1;
+	}
+
+	// Like requests, chunks go out back to back and at most MAX_PENDING_REQUESTS
+	// wait for their acknowledgements, which bounds what a paste keeps in flight
+	unsigned int transfer = ++sess->nextTransfer;
+	char *chunk = (char *)malloc(capacity);
+	char *line = (char *)malloc(capacity + 1);
+	int chunkLen = 0, atLineStart = 1, failed = 0;
+	long sent = 0;
+	int terminatorLen = strlen(terminator);
+
+	// Lines longer than a chunk are read in pieces
+	while (fgets(line, capacity + 1, input) != NULL) {
+		int lineLen = strlen(line);
+		if (atLineStart && strncmp(line, terminator, terminatorLen) == 0 &&
+			(line[terminatorLen] == '\n' || line[terminatorLen] == '\0')) {
+			break;
+		}
+		atLineStart = line[lineLen - 1] == '\n';
+
+		int copied = 0;
+		while (copied < lineLen) {
+			int piece = lineLen - copied < capacity - chunkLen ? lineLen - copied : capacity - chunkLen;
+			memcpy(chunk + chunkLen, line + copied, piece);
+			chunkLen += piece;
+			copied += piece;
+			if (chunkLen == capacity) {
+				// The rest of the input is still read, so it isn't taken for commands
+				if (!failed && chatClient_sendChunk(sess, session, transfer, 0, chunk, chunkLen) < 0) {
+					failed = 1;
+				}
+				sent += chunkLen;
+				chunkLen = 0;
+			}
+		}
+	}
+
+	if (!failed && chatClient_sendChunk(sess, session, transfer, 1, chunk, chunkLen) < 0) {
+		failed = 1;
+	}
+	sent += chunkLen;
+	free(chunk);
+	free(line);
+	return failed ? -1 : sent;
+}
+
 /**
  * @brief Cleans up the session
  * 
@@ -536,7 +1117,31 @@ int chatclient_sendMessage(SessionInfo *sess, char *message)
  */
 void chatclient_finish(SessionInfo *session)
 {
+	if (session->listening) {
+		// Wake the listener out of poll and wait for it before closing its socket
+		uint64_t wake = 1;
+		if (write(session->wakeFd, &wake, sizeof(wake)) < 0) {
+			printLastError("Error waking the listener: %s\n");
+		}
+		pthread_join(session->listeningThread, NULL);
+		close(session->wakeFd);
+		session->listening = 0;
+	}
 	if(session->socket > 0) {
 		close(session->socket);
+		session->socket = 0;
+	}
+	fb_free(&session->inputBuffer);
+	int slot;
+	for (slot = 0; slot < MAX_CHUNKED_TRANSFERS; slot++) {
+		free(session->transfers[slot].session);
+		session->transfers[slot].session = NULL;
+		session->transfers[slot].active = 0;
+	}
+	for (slot = 0; slot < MAX_SESSION_STREAMS; slot++) {
+		compression_free(session->streams[slot].inflater);
+		free(session->streams[slot].name);
+		session->streams[slot].inflater = NULL;
+		session->streams[slot].name = NULL;
 	}
 }
@@ -10,20 +10,108 @@
 #include <netinet/in.h>
 #include <unistd.h>
 #include <pthread.h>
+#include <stdio.h>
 #include "utils/transport.h"
+#include "utils/frameBuffer.h"
+#include "utils/compression.h"
 
 #define MAX_SIMUL_SESSIONS 4
 
+/* Requests sent without waiting for their responses before senders have to wait */
+#define MAX_PENDING_REQUESTS 128
+
+/* Seconds to wait for a response before giving up on it */
+#define RESPONSE_TIMEOUT 5
+
+/* Session streams the client keeps inflaters for, more than one per tab in case
+ * joining a session in a tab that has one doesn't leave it */
+#define MAX_SESSION_STREAMS (2*MAX_SIMUL_SESSIONS)
+
+/**
+ * A session's compressed messages and the inflater reading them
+ */
+typedef struct _SessionStream
+{
+	/* Session name, NULL while the slot is free */
+	char *name;
+	CompressionStream *inflater;
+} SessionStream;
+
+/* Chunked messages received at once, a new one beyond that ends the oldest */
+#define MAX_CHUNKED_TRANSFERS 8
+
+/* Longest line of a chunked message held back, longer lines are printed in pieces */
+#define CHUNK_LINE_LIMIT 4096
+
+/**
+ * A chunked message being received. Complete lines are printed as soon as their
+ * chunk arrives, only the line still being received is kept.
+ */
+typedef struct _ChunkedTransfer
+{
+	int active;
+	unsigned int transfer;
+	/* Order the transfers started in */
+	unsigned long started;
+	unsigned char source[MAX_NAME];
+	char *session;
+	char line[CHUNK_LINE_LIMIT];
+	int lineLen;
+} ChunkedTransfer;
+
+/**
+ * A request waiting for its response
+ */
+typedef struct _PendingRequest
+{
+	unsigned int id;
+	/* Nobody waits, the listener reports failures and frees it */
+	int async;
+	/* Set with the response once it arrived, response stays NULL if it never will */
+	int done;
+	Packet *response;
+	struct _PendingRequest *next;
+} PendingRequest;
+
 typedef struct _SessionInfo
 {
 	int socket;
 	char clientID[MAX_NAME];
-	pthread_mutex_t socketLock;
+	/* Serializes writes to the socket, so requests go out while the listener reads */
+	pthread_mutex_t sendLock;
 	int threadRun;
 	char **currSessionID;
+	/* After login the listening thread is the only reader of the socket */
 	pthread_t listeningThread;
+	int listening;
+	/* eventfd that wakes the listening thread out of poll when logging out */
+	int wakeFd;
 	int currSession;
-	struct timeval waitPeriod;
+	/* Wire format the server accepted at login, WIRE_ASCII or WIRE_BINARY */
+	int wireFormat;
+	/* Received bytes not yet handled, only touched by the socket's reader */
+	FrameBuffer inputBuffer;
+	/* The server copies request ids into responses, negotiated at login. Without
+	 * them responses are matched to requests in the order they were sent. */
+	int requestIds;
+	/* Requests waiting for responses, oldest first, guarded by pendingLock */
+	PendingRequest *pendingHead;
+	PendingRequest *pendingTail;
+	int pendingCount;
+	unsigned int nextRequestId;
+	pthread_mutex_t pendingLock;
+	/* Signaled when a request completes or a pending slot frees up */
+	pthread_cond_t pendingCond;
+	/* The server sends messages compressed, negotiated at login */
+	int compression;
+	/* Inflaters of the sessions joined, guarded by streamLock */
+	SessionStream streams[MAX_SESSION_STREAMS];
+	pthread_mutex_t streamLock;
+	/* Chunked messages being received, only touched by the listening thread */
+	ChunkedTransfer transfers[MAX_CHUNKED_TRANSFERS];
+	unsigned long transfersStarted;
+	/* Number of the last chunked message sent */
+	unsigned int nextTransfer;
 } SessionInfo;
 
 /**
@@ -88,14 +176,36 @@ int chatclient_createSession(SessionInfo *sess, char *sessionID);
 int chatclient_list(SessionInfo *sess);
 
 /**
- * @brief Sends a message to the server in the current session
+ * @brief Prints the server's counters and latency histograms
  * 
  * @param sess SessionInfo struct
- * @param message Message to send
  * @returns 0 if successful, -1 otherwise
  */
+int chatclient_stats(SessionInfo *sess);
+
+/**
+ * @brief Sends a message to the server in the current session without waiting for
+ * the server to acknowledge it. Failures reported by the server are printed when
+ * they arrive.
+ * 
+ * @param sess SessionInfo struct
+ * @param message Message to send
+ * @returns 0 if the message was sent, -1 otherwise
+ */
 int chatclient_sendMessage(SessionInfo *sess, char *message);
 
+/**
+ * @brief Sends a message of any size to the current session, read from the input
+ * until a line holding only the terminator or the end of the input. The message
+ * goes out in chunks as it is read, so it is never held in memory whole.
+ * 
+ * @param sess SessionInfo struct
+ * @param input Stream to read the message from
+ * @param terminator Line that ends the message, without its newline
+ * @returns Bytes sent, -1 if the message couldn't be sent
+ */
+long chatclient_sendStream(SessionInfo *sess, FILE *input, const char *terminator);
+
 /**
  * @brief Cleans up the session
  * 
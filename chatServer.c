@@ -3,6 +3,8 @@
 
 
 #include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/sendfile.h>
 #include <arpa/inet.h>
 #include <netinet/in.h>
 #include <netdb.h>
@@ -12,11 +14,19 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stdarg.h>
+#include <time.h>
 #include "utils/transport.h"
 #include "utils/nethelper.h"
 #include "utils/printHelpers.h"
+#include "utils/metrics.h"
+#include "utils/logger.h"
+#include "utils/compression.h"
+#include "utils/sessionLog.h"
 #include "collections/linkedList.h"
 #include "collections/hashTable.h"
+#include "collections/sessionRegistry.h"
+#include "collections/historyRing.h"
 #include "chatServer.h"
 
 /**
@@ -46,6 +56,12 @@ int stringComparer(void *s1, void *s2) {
 }
 
 const char *notAuthenticatedError = "Not logged in.";
+const char *sessionNameTooLong = "Session name is too long.";
+
+/* Guards the list of logged in clients, sessions are guarded by their registry shard */
+static pthread_mutex_t loginLock = PTHREAD_MUTEX_INITIALIZER;
+
+static int chatServer_compressionAllowed();
 
 /**
  * @brief Checks the request packet for a valid login request, sets the threadInfo to logged in if successful
@@ -55,7 +71,7 @@ const char *notAuthenticatedError = "Not logged in.";
  * @returns ResponsePacket to send to client
  */
 Packet *chatServer_login(ThreadInfo *threadInfo, Packet *requestPacket) {
-	Packet *responsePacket = (Packet *)calloc(1, sizeof(Packet));
+	Packet *responsePacket;
 
 	//Create local string
 	char *buf = (char *)calloc(requestPacket->size + 1, sizeof(char));
@@ -70,22 +86,43 @@ Packet *chatServer_login(ThreadInfo *threadInfo, Packet *requestPacket) {
 	// Compare their password with the passwords file
 	if(password != NULL && strcmp(password, tokens[1]) == 0) {
 		// Verify current user isn't logged in already
+		pthread_mutex_lock(&loginLock);
 		if (ll_find(threadInfo->connections, tokens[0], &stringComparer) == NULL) {
-			responsePacket->type = LO_ACK;
+			// Clients announce the capabilities they support after the password
+			int part;
+			for (part = 2; part < parts; part++) {
+				if (strcmp(tokens[part], WIRE_BINARY_CAPABILITY) == 0) {
+					threadInfo->wireFormat = WIRE_BINARY;
+				}
+				else if (strcmp(tokens[part], REQUEST_IDS_CAPABILITY) == 0) {
+					threadInfo->requestIds = 1;
+				}
+				else if (strcmp(tokens[part], COMPRESSION_CAPABILITY) == 0) {
+					threadInfo->compression = chatServer_compressionAllowed();
+				}
+			}
 			memcpy(threadInfo->clientID, requestPacket->source, MAX_NAME);
+			// Accepted capabilities follow the name, comma separated
+			char accepted[64];
+			int acceptedLen = snprintf(accepted, sizeof(accepted), "%s%s%s",
+									   threadInfo->requestIds ? REQUEST_IDS_CAPABILITY : "",
+									   threadInfo->requestIds && threadInfo->compression ? "," : "",
+									   threadInfo->compression ? COMPRESSION_CAPABILITY : "");
+			responsePacket = allocPacket(MAX_NAME + acceptedLen);
+			responsePacket->type = LO_ACK;
+			responsePacket->size = MAX_NAME + acceptedLen;
 			memcpy(responsePacket->data, requestPacket->source, MAX_NAME);
-			responsePacket->size = MAX_NAME;
+			memcpy(responsePacket->data + MAX_NAME, accepted, acceptedLen);
 			ll_insert(threadInfo->connections, buf);
 		}
 		else {
-		    responsePacket->type = LO_NAK;
-		    responsePacket->size = 0;
+		    responsePacket = allocDataPacket(LO_NAK, NULL, 0);
 			free(buf);
 		}
+		pthread_mutex_unlock(&loginLock);
 	}
 	else {
-		responsePacket->type = LO_NAK;
-		responsePacket->size = 0;
+		responsePacket = allocDataPacket(LO_NAK, NULL, 0);
 		free(buf);
 	}
 
@@ -94,6 +131,37 @@ Packet *chatServer_login(ThreadInfo *threadInfo, Packet *requestPacket) {
 	return responsePacket;
 }
 
+/**
+ * @brief Records that the client joined a session, taking ownership of the name
+ */
+static void chatServer_rememberSession(ThreadInfo *threadInfo, char *sessionName) {
+	if (threadInfo->joinedSessions == NULL) {
+		threadInfo->joinedSessions = ht_init(4);
+	}
+	if (ht_find(threadInfo->joinedSessions, sessionName) != NULL) {
+		free(sessionName);
+		return;
+	}
+	ht_insert(threadInfo->joinedSessions, sessionName, sessionName);
+}
+
+/**
+ * @brief Removes a session from the client's joined sessions
+ *
+ * @returns 0 if the client was in it, -1 if not
+ */
+static int chatServer_forgetSession(ThreadInfo *threadInfo, char *sessionName) {
+	char *key = threadInfo->joinedSessions != NULL
+		? (char *)ht_find(threadInfo->joinedSessions, sessionName)
+		: NULL;
+	if (key == NULL) {
+		return -1;
+	}
+	ht_remove(threadInfo->joinedSessions, key);
+	free(key);
+	return 0;
+}
+
 /** 
  * @brief Closes the connection to the client and removes them from all connected sessions
  *
@@ -104,66 +172,609 @@ Packet *chatServer_login(ThreadInfo *threadInfo, Packet *requestPacket) {
 Packet *chatServer_exit(ThreadInfo *threadInfo, Packet *requestPacket) {
     threadInfo->clientConnected = 0;
 
-    HashEntry *entry = threadInfo->sessions->head;
-	while(entry != NULL) {
-	    LinkedList *session = entry->data;
-	    Node *client = ll_find(session, threadInfo, &threadInfoComparer);
-		if (client != NULL) {
-		    ll_remove(session, client);
-		    free(client);
+    // Only the sessions the client joined are touched, not the whole registry
+    if (threadInfo->joinedSessions != NULL) {
+        HashEntry *entry;
+        for (entry = ht_first(threadInfo->joinedSessions); entry != NULL;
+             entry = ht_next(threadInfo->joinedSessions, entry)) {
+            sr_leave(threadInfo->sessions, entry->key, threadInfo);
+            free(entry->key);
+        }
+        ht_free(threadInfo->joinedSessions);
+        threadInfo->joinedSessions = NULL;
+    }
+
+    pthread_mutex_lock(&loginLock);
+    Node *client = ll_find(threadInfo->connections, threadInfo->clientID, &stringComparer);
+    if (client != NULL) {
+        ll_remove(threadInfo->connections, client);
+        free(client->data);
+        free(client);
+    }
+    pthread_mutex_unlock(&loginLock);
+    // Mark the connection as logged out so a later disconnect doesn't exit twice
+    memset(threadInfo->clientID, 0, MAX_NAME);
+
+    return NULL;
+}
+
+/**
+ * @brief Monotonic time in ns, for handler latencies
+ */
+static long chatServer_clock() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
 
-			if(session->count == 0) {
-			    ht_remove(threadInfo->sessions, entry->key);
+/* History kept per session, and the budget all sessions share */
+static int historyMessages = HISTORY_DEFAULT_MESSAGES;
+static int historyBytes = HISTORY_DEFAULT_BYTES;
+static long historyBudget = HISTORY_DEFAULT_BUDGET;
+/* Bytes the history rings of all sessions allocated */
+static long historyAllocated;
+static long historyEvictions;
+/* Sessions' logs, NULL when history isn't kept on disk */
+static char *historyDirectory;
+static long historySegmentBytes = HISTORY_DEFAULT_SEGMENT;
+static long historyRetainBytes = HISTORY_DEFAULT_RETAIN;
+/* Bytes of replayed logs that went out with sendfile */
+static long historySendfileBytes;
+/* Held while a session's log is opened and the session created, so a log is never
+ * opened while a session still appends to it */
+static pthread_mutex_t logOpenLock = PTHREAD_MUTEX_INITIALIZER;
+/* Sessions with state, for finding the coldest ones */
+static pthread_mutex_t historyBudgetLock = PTHREAD_MUTEX_INITIALIZER;
+static struct _SessionState *historySessions;
+
+/**
+ * Server state of a session, created with its first message and freed with it
+ */
+typedef struct _SessionState
+{
+	/* Deflate stream shared by the members that accepted compression, created with
+	 * the first compressed message. compressLock is held from compressing a message
+	 * until it's queued for every member, so members get the frames in the order
+	 * they were compressed. */
+	pthread_mutex_t compressLock;
+	CompressionStream *stream;
+	/* Session joins the stream was last restarted for */
+	unsigned long joins;
+	/* Most recent messages, replayed to clients that join, guarded by historyLock.
+	 * With a history directory they go to the session's log instead, opened when
+	 * the session is created. */
+	pthread_mutex_t historyLock;
+	HistoryRing history;
+	SessionLog *log;
+	/* Messages added to the history so far. Only changes under the shard's read
+	 * lock, so a join reads it with the shard write-locked. */
+	unsigned long recorded;
+	/* When the last message arrived, the coldest sessions lose their history first */
+	long lastActive;
+	/* On the list of sessions with state, guarded by historyBudgetLock */
+	struct _SessionState *prev;
+	struct _SessionState *next;
+} SessionState;
+
+/**
+ * @brief Sets how much history every session keeps and the budget for all of them
+ *
+ * @params messages Messages kept per session, 0 turns history off
+ * @params bytes Bytes kept per session
+ * @params budget Bytes all sessions' history may take together
+ */
+void chatServer_configureHistory(int messages, int bytes, long budget) {
+	historyMessages = messages;
+	historyBytes = bytes;
+	historyBudget = budget;
+}
+
+/**
+ * @brief Keeps every session's messages in a log on disk, which outlives the server
+ * and replaces the in-memory history
+ *
+ * @params directory Directory holding the logs
+ * @params segmentBytes Size a log's segment rolls over at
+ * @params retainBytes Size of a log above which its oldest segments are deleted
+ * @returns 0 on success, -1 if the directory can't be created
+ */
+int chatServer_configureLog(const char *directory, long segmentBytes, long retainBytes) {
+	if (mkdir(directory, 0755) != 0 && errno != EEXIST) {
+		return -1;
+	}
+	historyDirectory = strdup(directory);
+	historySegmentBytes = segmentBytes;
+	historyRetainBytes = retainBytes;
+	return 0;
+}
+
+/**
+ * @brief Creates a session's state, it isn't attached to the session yet
+ *
+ * @params log The session's log, or NULL
+ */
+static SessionState *chatServer_newSessionState(SessionLog *log) {
+	SessionState *state = (SessionState *)calloc(1, sizeof(SessionState));
+	pthread_mutex_init(&state->compressLock, NULL);
+	pthread_mutex_init(&state->historyLock, NULL);
+	hr_init(&state->history, historyMessages, historyBytes);
+	state->log = log;
+	return state;
+}
+
+/**
+ * @brief Frees a state that was never attached to a session
+ */
+static void chatServer_destroySessionState(SessionState *state) {
+	pthread_mutex_destroy(&state->compressLock);
+	pthread_mutex_destroy(&state->historyLock);
+	compression_free(state->stream);
+	sessionLog_close(state->log);
+	free(state);
+}
+
+/**
+ * @brief Frees a session's state along with the session. The shard is write-locked,
+ * so no broadcast or join uses the state meanwhile.
+ */
+static void chatServer_freeSessionState(void *context) {
+	SessionState *state = (SessionState *)context;
+	pthread_mutex_lock(&historyBudgetLock);
+	if (state->prev != NULL) {
+		state->prev->next = state->next;
+	}
+	else {
+		historySessions = state->next;
+	}
+	if (state->next != NULL) {
+		state->next->prev = state->prev;
+	}
+	__atomic_sub_fetch(&historyAllocated, hr_clear(&state->history), __ATOMIC_RELAXED);
+	pthread_mutex_unlock(&historyBudgetLock);
+
+	chatServer_destroySessionState(state);
+}
+
+/**
+ * @brief Puts a state that was just attached to its session on the list of sessions
+ * with state
+ */
+static void chatServer_listSessionState(Session *session, SessionState *state) {
+	session->freeContext = &chatServer_freeSessionState;
+	pthread_mutex_lock(&historyBudgetLock);
+	state->next = historySessions;
+	if (historySessions != NULL) {
+		historySessions->prev = state;
+	}
+	historySessions = state;
+	pthread_mutex_unlock(&historyBudgetLock);
+}
+
+/**
+ * @brief Finds the session's state, creating it for the first message. Expects the
+ * session to be acquired.
+ */
+static SessionState *chatServer_sessionState(Session *session) {
+	SessionState *state = (SessionState *)__atomic_load_n(&session->context, __ATOMIC_ACQUIRE);
+	if (state != NULL) {
+		return state;
+	}
+
+	// Broadcasts only hold the read lock, another one may have created it meanwhile
+	state = chatServer_newSessionState(NULL);
+	void *existing = NULL;
+	if (!__atomic_compare_exchange_n(&session->context, &existing, state, 0,
+									 __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+		chatServer_destroySessionState(state);
+		return (SessionState *)existing;
+	}
+	chatServer_listSessionState(session, state);
+	return state;
+}
+
+/**
+ * @brief sr_create callback, attaches the state made for the new session
+ */
+static void chatServer_attachSessionState(Session *session, void *context) {
+	session->context = context;
+	chatServer_listSessionState(session, (SessionState *)context);
+}
+
+/**
+ * @brief Compresses a message's text with its session's stream. On success the
+ * stream stays locked until the caller queued the packet for every member.
+ *
+ * @params session Session the message goes to, acquired
+ * @params request MESSAGE request
+ * @params nameLen Length of the session name in front of the ';'
+ * @params locked Set to the state whose compressLock is held
+ * @returns MESSAGE_DEFLATE packet, NULL if the message has to go out uncompressed
+ */
+static Packet *chatServer_compressMessage(Session *session, PacketView *request, int nameLen,
+										  SessionState **locked) {
+	int textLen = request->size - nameLen - 1;
+	int capacity = nameLen + 1 + compression_bound(textLen);
+	if (capacity > MAX_DATA) {
+		return NULL;
+	}
+	SessionState *state = chatServer_sessionState(session);
+
+	pthread_mutex_lock(&state->compressLock);
+	if (state->stream == NULL) {
+		state->stream = compression_createDeflater();
+		if (state->stream == NULL) {
+			pthread_mutex_unlock(&state->compressLock);
+			return NULL;
+		}
+	}
+	// Members that joined since the last message start with an empty history
+	else if (state->joins != session->joins) {
+		compression_reset(state->stream);
+	}
+	state->joins = session->joins;
+
+	Packet *packet = allocPacket(capacity);
+	packet->type = MESSAGE_DEFLATE;
+	memcpy(packet->source, request->source, request->sourceLen);
+	memcpy(packet->data, request->data, nameLen + 1);
+
+	long start = chatServer_clock();
+	int compressedLen = compression_deflate(state->stream, request->data + nameLen + 1, textLen,
+											packet->data + nameLen + 1);
+	long ns = chatServer_clock() - start;
+	if (compressedLen < 0) {
+		pthread_mutex_unlock(&state->compressLock);
+		pool_free(packet);
+		return NULL;
+	}
+	packet->size = nameLen + 1 + compressedLen;
+	metrics_recordCompression(textLen, compressedLen, ns);
+	*locked = state;
+	return packet;
+}
+
+/**
+ * @brief Counts bytes a history ring is about to allocate against the budget
+ *
+ * @returns 1 if they fit, 0 if they would exceed it and weren't counted
+ */
+static int chatServer_chargeHistory(int bytes) {
+	if (__atomic_add_fetch(&historyAllocated, bytes, __ATOMIC_RELAXED) > historyBudget) {
+		__atomic_sub_fetch(&historyAllocated, bytes, __ATOMIC_RELAXED);
+		return 0;
+	}
+	return 1;
+}
+
+/**
+ * @brief Frees the history of the sessions that went longest without a message
+ * until the budget has room for the needed bytes
+ *
+ * @params keep Session that needs the room, its history is never evicted
+ * @params needed Bytes it needs
+ */
+static void chatServer_evictHistory(SessionState *keep, int needed) {
+	pthread_mutex_lock(&historyBudgetLock);
+	while (__atomic_load_n(&historyAllocated, __ATOMIC_RELAXED) + needed > historyBudget) {
+		SessionState *coldest = NULL, *state;
+		for (state = historySessions; state != NULL; state = state->next) {
+			if (state != keep && __atomic_load_n(&state->history.capacity, __ATOMIC_RELAXED) > 0 &&
+				(coldest == NULL || __atomic_load_n(&state->lastActive, __ATOMIC_RELAXED) <
+				 __atomic_load_n(&coldest->lastActive, __ATOMIC_RELAXED))) {
+				coldest = state;
 			}
 		}
-		entry = entry->next;
+		if (coldest == NULL) {
+			break;
+		}
+		pthread_mutex_lock(&coldest->historyLock);
+		int freed = hr_clear(&coldest->history);
+		pthread_mutex_unlock(&coldest->historyLock);
+		__atomic_sub_fetch(&historyAllocated, freed, __ATOMIC_RELAXED);
+		__atomic_add_fetch(&historyEvictions, 1, __ATOMIC_RELAXED);
 	}
+	pthread_mutex_unlock(&historyBudgetLock);
+}
 
-    Node *client = ll_find(threadInfo->connections, threadInfo->clientID, &stringComparer);
-    ll_remove(threadInfo->connections, client);
+/**
+ * @brief Opens the log of a session about to be created. Reading a long log takes a
+ * while, so no shard lock is held. Expects logOpenLock to be held.
+ *
+ * @returns The session's log, NULL if it can't be opened
+ */
+static SessionLog *chatServer_openSessionLog(char *name) {
+	SessionLog *log = sessionLog_open(historyDirectory, name, historySegmentBytes, historyRetainBytes);
+	if (log == NULL) {
+		// The session falls back to the in-memory history
+		logger_log(LOG_LEVEL_WARN, "Cannot open the log of session %s in %s\n", name, historyDirectory);
+	}
+	return log;
+}
 
-    return NULL;
+/**
+ * @brief Appends a message to the session's log as an ASCII MESSAGE packet without a
+ * request id, which clients of either wire format read
+ *
+ * @returns 0 if the message was appended, -1 otherwise
+ */
+static int chatServer_logMessage(Session *session, SessionLog *log, PacketView *request) {
+	char header[ASCII_MAX_HEADER + 1];
+	struct iovec parts[2];
+	parts[0].iov_base = header;
+	parts[0].iov_len = sprintf(header, "%d:%d:%.*s:", MESSAGE, request->size, request->sourceLen,
+							   (char *)request->source);
+	parts[1].iov_base = (void *)request->data;
+	parts[1].iov_len = request->size;
+	if (sessionLog_append(log, parts, 2) < 0) {
+		logger_log(LOG_LEVEL_WARN, "Cannot append to the log of session %s\n", session->name);
+		return -1;
+	}
+	return 0;
 }
 
 /**
- * @brief Joins the client to the specified session
+ * @brief Adds a message to its session's history. Expects the session to be acquired.
+ *
+ * @params session Session the message went to
+ * @params request MESSAGE request
+ */
+static void chatServer_recordHistory(Session *session, PacketView *request) {
+	int recordBytes = hr_recordSize(request->sourceLen, request->size);
+	if (historyDirectory == NULL && (historyMessages <= 0 || recordBytes > historyBytes)) {
+		return;
+	}
+	SessionState *state = chatServer_sessionState(session);
+
+	pthread_mutex_lock(&state->historyLock);
+	if (state->log != NULL) {
+		if (chatServer_logMessage(session, state->log, request) == 0) {
+			state->recorded++;
+		}
+		pthread_mutex_unlock(&state->historyLock);
+		return;
+	}
+	if (historyMessages <= 0 || recordBytes > historyBytes) {
+		pthread_mutex_unlock(&state->historyLock);
+		return;
+	}
+	int growth = hr_growth(&state->history, recordBytes);
+	if (growth > 0 && !chatServer_chargeHistory(growth)) {
+		// Over the budget, colder sessions give up their history first
+		pthread_mutex_unlock(&state->historyLock);
+		chatServer_evictHistory(state, growth);
+		pthread_mutex_lock(&state->historyLock);
+		growth = hr_growth(&state->history, recordBytes);
+		if (growth > 0 && !chatServer_chargeHistory(growth)) {
+			// Still no room, the ring keeps its size and drops its oldest messages
+			growth = 0;
+		}
+	}
+	if (hr_append(&state->history, request->source, request->sourceLen, request->data, request->size,
+				  growth > 0) == 0) {
+		state->recorded++;
+	}
+	__atomic_store_n(&state->lastActive, chatServer_clock(), __ATOMIC_RELAXED);
+	pthread_mutex_unlock(&state->historyLock);
+}
+
+/**
+ * A range of a session's log replayed to a joining client
+ */
+typedef struct _LogRange
+{
+	/* Duplicate of the segment's file, still readable once the segment is deleted */
+	int fd;
+	long offset;
+	long len;
+	unsigned long messages;
+} LogRange;
+
+/**
+ * The JN_ACK and history sent to a joining client in one write, followed by the
+ * ranges of the session's log
+ */
+typedef struct _JoinReplay
+{
+	ThreadInfo *threadInfo;
+	Packet *response;
+	unsigned char *buffer;
+	int len;
+	int capacity;
+	SessionState *state;
+	/* Messages added to the history before the join, the later ones reach the
+	 * client as broadcasts */
+	unsigned long cut;
+	/* Messages of the ring still to replay */
+	int remaining;
+	LogRange *ranges;
+	int rangeCount;
+	int rangeCapacity;
+} JoinReplay;
+
+/**
+ * @brief Serializes a packet onto the end of the replay
+ */
+static void chatServer_appendReplay(JoinReplay *replay, Packet *packet) {
+	int frameLen;
+	unsigned char *frame = encodePacket(packet, replay->threadInfo->wireFormat, &frameLen);
+	if (replay->len + frameLen > replay->capacity) {
+		replay->capacity = replay->capacity * 2 > replay->len + frameLen ? replay->capacity * 2 : replay->len + frameLen;
+		replay->buffer = (unsigned char *)realloc(replay->buffer, replay->capacity);
+	}
+	memcpy(replay->buffer + replay->len, frame, frameLen);
+	replay->len += frameLen;
+	metrics_recordSent(packet->type, frameLen);
+	pool_free(frame);
+}
+
+/**
+ * @brief hr_forEach visitor, adds a message from the history to the replay until the
+ * ones from after the join are reached
+ */
+static void chatServer_replayMessage(const unsigned char *source, int sourceLen, const unsigned char *data,
+									 int len, void *context) {
+	JoinReplay *replay = (JoinReplay *)context;
+	if (replay->remaining <= 0) {
+		return;
+	}
+	replay->remaining--;
+	Packet *message = allocPacket(len);
+	message->type = MESSAGE;
+	message->size = len;
+	memcpy(message->source, source, sourceLen < MAX_NAME ? sourceLen : MAX_NAME - 1);
+	memcpy(message->data, data, len);
+	chatServer_appendReplay(replay, message);
+	pool_free(message);
+}
+
+/**
+ * @brief sessionLog_replay visitor, keeps a range of a log's segment to send once
+ * the history is unlocked
+ */
+static int chatServer_replaySegment(int fd, long offset, long len, unsigned long messages,
+									const unsigned char *mapped, void *context) {
+	JoinReplay *replay = (JoinReplay *)context;
+	if (replay->rangeCount == replay->rangeCapacity) {
+		replay->rangeCapacity = replay->rangeCapacity > 0 ? replay->rangeCapacity * 2 : 4;
+		replay->ranges = (LogRange *)realloc(replay->ranges, replay->rangeCapacity * sizeof(LogRange));
+	}
+	LogRange *range = &replay->ranges[replay->rangeCount];
+	range->fd = dup(fd);
+	if (range->fd < 0) {
+		return -1;
+	}
+	range->offset = offset;
+	range->len = len;
+	range->messages = messages;
+	replay->rangeCount++;
+	return 0;
+}
+
+/**
+ * @brief sr_join callback, the shard is still write-locked. Notes how many messages
+ * the session's history holds, nothing is added to it until the shard is unlocked,
+ * and holds back broadcasts to the client until its history is sent.
+ */
+static void chatServer_joinedSession(Session *session, void *context) {
+	JoinReplay *replay = (JoinReplay *)context;
+	if (historyDirectory != NULL || historyMessages > 0) {
+		replay->state = chatServer_sessionState(session);
+		replay->cut = replay->state->recorded;
+	}
+
+	pthread_mutex_lock(&replay->threadInfo->socketLock);
+	replay->threadInfo->replaying = 1;
+	pthread_mutex_unlock(&replay->threadInfo->socketLock);
+}
+
+/**
+ * @brief Moves the broadcasts held back during a join behind the history
+ */
+static void chatServer_endReplay(ThreadInfo *threadInfo) {
+	pthread_mutex_lock(&threadInfo->socketLock);
+	threadInfo->replaying = 0;
+	if (threadInfo->heldQueue.head != NULL) {
+		int wasEmpty = threadInfo->sendQueue.head == NULL;
+		sq_append(&threadInfo->sendQueue, &threadInfo->heldQueue);
+		metrics_recordQueueDepth(threadInfo->sendQueue.bytes);
+		if (wasEmpty && threadInfo->wantWrite != NULL) {
+			threadInfo->wantWrite(threadInfo);
+		}
+	}
+	pthread_mutex_unlock(&threadInfo->socketLock);
+}
+
+/**
+ * @brief Sends the JN_ACK followed by the session's history once the shard is
+ * unlocked. The history is only locked while it's copied, the log's ranges are sent
+ * from duplicates of their files afterwards. The client is a member by now, so the
+ * session stays.
+ */
+static void chatServer_replayHistory(JoinReplay *replay) {
+	SessionState *state = replay->state;
+	chatServer_appendReplay(replay, replay->response);
+
+	if (state != NULL) {
+		pthread_mutex_lock(&state->historyLock);
+		// Messages added since the join went to the client as broadcasts
+		unsigned long newer = state->recorded - replay->cut;
+		SessionLog *log = state->log;
+		if (log != NULL) {
+			unsigned long first = sessionLog_first(log);
+			unsigned long to = log->nextSeq - newer;
+			if (historyMessages > 0 && to > first) {
+				unsigned long from = to - first > (unsigned long)historyMessages ? to - historyMessages : first;
+				sessionLog_replay(log, from, to, &chatServer_replaySegment, replay);
+			}
+		}
+		else {
+			replay->remaining = state->history.count - (int)newer;
+			hr_forEach(&state->history, &chatServer_replayMessage, replay);
+		}
+		pthread_mutex_unlock(&state->historyLock);
+	}
+
+	// The log's packets are sent from the page cache after the JN_ACK
+	chatServer_send(replay->threadInfo, replay->buffer, replay->len);
+	int i;
+	for (i = 0; i < replay->rangeCount; i++) {
+		LogRange *range = &replay->ranges[i];
+		metrics_recordSentPackets(MESSAGE, range->messages, range->len);
+		chatServer_sendFile(replay->threadInfo, range->fd, range->offset, range->len);
+		close(range->fd);
+	}
+	chatServer_endReplay(replay->threadInfo);
+}
+
+/**
+ * @brief Joins the client to the specified session and replays the session's
+ * recent messages to it
  *
  * @params threadInfo ThreadInfo struct
  * @params requestPacket Client request packet
- * @returns ResponsePacket to send to client
+ * @returns ResponsePacket to send to client, NULL if the JN_ACK was sent with the history
  */
 Packet *chatServer_sessionJoin(ThreadInfo *threadInfo, Packet *requestPacket) {
-	Packet *responsePacket = (Packet *)calloc(1, sizeof(Packet));
+	Packet *responsePacket;
 
 	// Ensure that the clientID is set for this request (logged in)
 	if(memcmp(threadInfo->clientID, requestPacket->source, MAX_NAME) != 0) {
-		responsePacket->type = NS_NAK;
-		memcpy(responsePacket->data, notAuthenticatedError, strlen(notAuthenticatedError));
-		responsePacket->size = strlen(notAuthenticatedError);
+		responsePacket = allocDataPacket(NS_NAK, notAuthenticatedError, strlen(notAuthenticatedError));
+	}
+	else if (requestPacket->size > MAX_SESSION_NAME) {
+		responsePacket = allocDataPacket(JN_NAK, sessionNameTooLong, strlen(sessionNameTooLong));
 	}
 	else {
 		char* sessionName = (char *)calloc(requestPacket->size + 1, sizeof(char));
 		memcpy(sessionName, requestPacket->data, requestPacket->size);
 		sessionName[requestPacket->size] = '\0';
-		// Check whether or not the session actually exists
-		LinkedList *session = (LinkedList *)ht_find(threadInfo->sessions, sessionName);
-		if (session == NULL) {
-			responsePacket->type = JN_NAK;
+		// Join to session, if it actually exists. The JN_ACK goes out together with
+		// the session's history, ahead of anything broadcast after the join.
+		JoinReplay replay;
+		memset(&replay, 0, sizeof(replay));
+		replay.threadInfo = threadInfo;
+		replay.response = allocDataPacket(JN_ACK, sessionName, strlen(sessionName));
+		replay.response->id = requestPacket->id;
+		int result = sr_join(threadInfo->sessions, sessionName, threadInfo, &chatServer_joinedSession, &replay);
+		if (result < 0) {
 			const char *sessNonexistent = "Session does not exist.";
-			memcpy(responsePacket->data, sessNonexistent, strlen(sessNonexistent));
-			responsePacket->size = strlen(sessNonexistent);
+			responsePacket = allocDataPacket(JN_NAK, sessNonexistent, strlen(sessNonexistent));
+			free(sessionName);
+		}
+		else if (result > 0) {
+			// Already in the session, it has seen the history
+			responsePacket = allocDataPacket(JN_ACK, sessionName, strlen(sessionName));
+			free(sessionName);
 		}
 		else {
-			// Join to session
-			threadInfo->sessionID = sessionName;
-			ll_insert(session, (void *)threadInfo);
-
-			responsePacket->type = JN_ACK;
-			memcpy(responsePacket->data, sessionName, strlen(sessionName));
-			responsePacket->size = strlen(sessionName);
-			printf("Client at socket %d joined session %s\n", threadInfo->socket, sessionName);
-			fflush(stdout);
+			chatServer_replayHistory(&replay);
+			responsePacket = NULL;
+			logger_log(LOG_LEVEL_INFO, "Client at socket %d joined session %s\n", threadInfo->socket, sessionName);
+			chatServer_rememberSession(threadInfo, sessionName);
 		}
+		pool_free(replay.response);
+		free(replay.buffer);
+		free(replay.ranges);
 	}
 
 	return responsePacket;
@@ -177,42 +788,27 @@ Packet *chatServer_sessionJoin(ThreadInfo *threadInfo, Packet *requestPacket) {
  * @returns ResponsePacket to send to client
  */
 Packet *chatServer_sessionLeave(ThreadInfo *threadInfo, Packet *requestPacket) {
-	Packet *responsePacket = (Packet *)calloc(1, sizeof(Packet));
+	Packet *responsePacket;
 
 	// Ensure that the clientID is set for this request (logged in)
 	if(memcmp(threadInfo->clientID, requestPacket->source, MAX_NAME) != 0) {
-		responsePacket->type = NS_NAK;
-		memcpy(responsePacket->data, notAuthenticatedError, strlen(notAuthenticatedError));
-		responsePacket->size = strlen(notAuthenticatedError);
+		responsePacket = allocDataPacket(NS_NAK, notAuthenticatedError, strlen(notAuthenticatedError));
 	}
 	else {
 		char* sessionName = (char *)calloc(requestPacket->size + 1, sizeof(char));
 		memcpy(sessionName, requestPacket->data, requestPacket->size);
 		sessionName[requestPacket->size] = '\0';
 
-		//Check if the session exists
-		if (ht_find(threadInfo->sessions, sessionName) == NULL) {
-		    responsePacket->type = LS_NACK;
-		    const char *sessNoExist = "Session does not exist.";
-		    memcpy(responsePacket->data, sessNoExist, strlen(sessNoExist));
-		    responsePacket->size = strlen(sessNoExist);
+		// A session the client is in can't disappear, so its own list is enough
+		if (chatServer_forgetSession(threadInfo, sessionName) != 0) {
+		    const char *notInSession = "Not in session.";
+		    responsePacket = allocDataPacket(LS_NACK, notInSession, strlen(notInSession));
 		}
 		else {
-		    LinkedList *currSession = (LinkedList *)ht_find(threadInfo->sessions, threadInfo->sessionID);
-			Node *curr = ll_find(currSession, threadInfo, &threadInfoComparer);
-			// TODO: Necessary to check curr == NULL?
-			ll_remove(currSession, curr);
-			free(curr);
-			free(threadInfo->sessionID);
-			threadInfo->sessionID = NULL;
-			printf("Left. %d remaining.\n", currSession->count);
-			//Delete if empty
-			if (currSession->count == 0) {
-				ht_remove(threadInfo->sessions, threadInfo->sessionID);
-				free(currSession);
-			}
-			responsePacket->type = LS_ACK;
-			responsePacket->size = 0;
+			// The registry deletes the session once it's empty
+			sr_leave(threadInfo->sessions, sessionName, threadInfo);
+			logger_log(LOG_LEVEL_INFO, "Client at socket %d left session %s\n", threadInfo->socket, sessionName);
+			responsePacket = allocDataPacket(LS_ACK, NULL, 0);
 		}
 
 		free(sessionName);
@@ -229,45 +825,94 @@ Packet *chatServer_sessionLeave(ThreadInfo *threadInfo, Packet *requestPacket) {
  * @returns ResponsePacket to send to client
  */
 Packet *chatServer_sessionCreate(ThreadInfo *threadInfo, Packet *requestPacket) {
-	Packet *responsePacket = (Packet *)calloc(1, sizeof(Packet));
+	Packet *responsePacket;
 
 	// Ensure that the clientID is set for this request (logged in)
 	if(memcmp(threadInfo->clientID, requestPacket->source, MAX_NAME) != 0) {
-		responsePacket->type = NS_NAK;
-		memcpy(responsePacket->data, notAuthenticatedError, strlen(notAuthenticatedError));
-		responsePacket->size = strlen(notAuthenticatedError);
+		responsePacket = allocDataPacket(NS_NAK, notAuthenticatedError, strlen(notAuthenticatedError));
+	}
+	else if (requestPacket->size > MAX_SESSION_NAME) {
+		responsePacket = allocDataPacket(NS_NAK, sessionNameTooLong, strlen(sessionNameTooLong));
 	}
 	else {
 		char* sessionName = (char *)calloc(requestPacket->size + 1, sizeof(char));
 		memcpy(sessionName, requestPacket->data, requestPacket->size);
 		sessionName[requestPacket->size] = '\0';
 
-		// Check if there's another session with the same name
-		if (ht_find(threadInfo->sessions, sessionName) != NULL) {
-			responsePacket->type = NS_NAK;
+		// A recreated session picks up its log from before. The log is opened before
+		// the session exists, creates hold logOpenLock so it's opened only while no
+		// session with the name is around to append to it.
+		SessionState *state = NULL;
+		if (historyDirectory != NULL) {
+			pthread_mutex_lock(&logOpenLock);
+			Session *existing = sr_acquire(threadInfo->sessions, sessionName);
+			if (existing != NULL) {
+				sr_release(existing);
+			}
+			else {
+				state = chatServer_newSessionState(chatServer_openSessionLog(sessionName));
+			}
+		}
+
+		// Create the session and join it, unless there's another session with the same name
+		int result = -1;
+		if (historyDirectory == NULL || state != NULL) {
+			result = sr_create(threadInfo->sessions, sessionName, threadInfo,
+							   state != NULL ? &chatServer_attachSessionState : NULL, state);
+		}
+		if (historyDirectory != NULL) {
+			pthread_mutex_unlock(&logOpenLock);
+		}
+		if (result != 0) {
+			if (state != NULL) {
+				chatServer_destroySessionState(state);
+			}
 			const char *sessExists = "Session already exists.";
-			memcpy(responsePacket->data, sessExists, strlen(sessExists));
-			responsePacket->size = strlen(sessExists);
+			responsePacket = allocDataPacket(NS_NAK, sessExists, strlen(sessExists));
+			free(sessionName);
 		}
 		else {
-			// Create the session
-			LinkedList *connectedClients = ll_init();
-			ht_insert(threadInfo->sessions, sessionName, (void *)connectedClients);
-
-			// Join to session
-			threadInfo->sessionID = sessionName;
-			ll_insert(connectedClients, (void *)threadInfo);
-						
-			responsePacket->type = NS_ACK;
-			memcpy(responsePacket->data, sessionName, requestPacket->size);
-			responsePacket->size = requestPacket->size;
+			responsePacket = allocDataPacket(NS_ACK, sessionName, requestPacket->size);
 
-			printf("Created session %s from client at sock %d\n", sessionName, threadInfo->socket);
+			logger_log(LOG_LEVEL_INFO, "Created session %s from client at sock %d\n", sessionName, threadInfo->socket);
+			chatServer_rememberSession(threadInfo, sessionName);
 		}
 	}
 	return responsePacket;
 }
 
+/**
+ * @brief Output of a QUERY being built
+ */
+typedef struct _QueryContext
+{
+	unsigned char *ptr;
+	int len;
+} QueryContext;
+
+/**
+ * @brief sr_forEach visitor, appends a session and its clients to the QUERY response
+ */
+static void chatServer_querySession(Session *session, void *context) {
+	QueryContext *query = (QueryContext *)context;
+	const char *sessFormat = "'%s': %d users\n";
+	char buf[2048];
+	int bytes = snprintf(buf, sizeof(buf), sessFormat, session->name, session->members->count);
+
+	// List the session's clients
+	int member;
+	for (member = 0; member < session->members->count && bytes < (int)sizeof(buf); member++) {
+	    ThreadInfo *sessTi = (ThreadInfo *)session->members->members[member];
+	    bytes += snprintf(buf + bytes, sizeof(buf) - bytes, "\t%.64s\n", sessTi->clientID);
+	}
+
+	// Sessions that don't fit the response anymore are left out
+	if (bytes < (int)sizeof(buf) && query->len + bytes <= MAX_DATA) {
+		memcpy(query->ptr + query->len, buf, bytes);
+		query->len += bytes;
+	}
+}
+
 /**
  * @brief Finds all the current sessions and returns it to the client
  *
@@ -276,109 +921,971 @@ Packet *chatServer_sessionCreate(ThreadInfo *threadInfo, Packet *requestPacket)
  * @returns ResponsePacket to send to client
  */
 Packet *chatServer_sessionQuery(ThreadInfo *threadInfo, Packet *requestPacket) {
-	Packet *responsePacket = (Packet *)calloc(1, sizeof(Packet));
+	Packet *responsePacket;
 
 	if (memcmp(threadInfo->clientID, requestPacket->source, MAX_NAME) != 0) {
-	    responsePacket->type = QU_NACK;
-		memcpy(responsePacket->data, notAuthenticatedError, strlen(notAuthenticatedError));
-		responsePacket->size = strlen(notAuthenticatedError);
+	    responsePacket = allocDataPacket(QU_NACK, notAuthenticatedError, strlen(notAuthenticatedError));
 	}
 	else {
-		responsePacket->type = QU_ACK;
-	    HashEntry *node = threadInfo->sessions->head;
-
-	    const char *sessFormat = "'%s': %d users\n";
-	    int len = 0;
-		char buf[2048]; // TODO: Possible buffer overflow possible here
-	    unsigned char *ptr = responsePacket->data;
-		// Traverse the HashTable's linked list
-	    while (node != NULL)
-	    {
-			// Traverse the session's linked list
-			LinkedList *session = (LinkedList *)node->data;
-			int bytes = sprintf(buf, sessFormat, node->key, session->count);
-
-			Node *sessNode = session->head;
-			while(sessNode != NULL) {
-			    ThreadInfo *sessTi = (ThreadInfo *)sessNode->data;
-			    bytes += sprintf(buf + bytes, "\t%.64s\n", sessTi->clientID);
-			    sessNode = sessNode->next;
-			}
+		// Build the listing on the stack so the response is only as large as it
+		unsigned char listing[MAX_DATA];
+		QueryContext context = { listing, 0 };
+		sr_forEach(threadInfo->sessions, &chatServer_querySession, &context);
+		responsePacket = allocDataPacket(QU_ACK, listing, context.len);
+	}
 
-			memcpy(ptr, buf, bytes);
-			ptr += bytes;
-			len += bytes;
+	return responsePacket;
+}
 
-			node = node->next;
-		}
-		responsePacket->size = len;
+/**
+ * @brief Appends formatted text to a response being built, text past MAX_DATA is cut off
+ */
+static void chatServer_append(QueryContext *out, const char *format, ...) {
+	if (out->len >= MAX_DATA) {
+		return;
 	}
+	va_list args;
+	va_start(args, format);
+	int bytes = vsnprintf((char *)out->ptr + out->len, MAX_DATA - out->len, format, args);
+	va_end(args);
+	out->len += bytes < MAX_DATA - out->len ? bytes : MAX_DATA - out->len - 1;
+}
 
-	return responsePacket;
+/**
+ * @brief Appends a histogram's count and percentiles to the STATS response
+ */
+static void chatServer_appendHistogram(QueryContext *out, const char *name, long *histogram) {
+	chatServer_append(out, "%s: n=%ld p50<=%lu p99<=%lu p999<=%lu\n", name, metrics_count(histogram),
+					  metrics_percentile(histogram, 0.5), metrics_percentile(histogram, 0.99),
+					  metrics_percentile(histogram, 0.999));
 }
 
 /**
- * @brief Broadcasts the client's message to the session
+ * @brief sr_forEach visitor, counts the sessions
+ */
+static void chatServer_countSession(Session *session, void *context) {
+	(*(int *)context)++;
+}
+
+/**
+ * @brief Reports the server's counters and latency histograms. Percentiles are the
+ * upper bounds of power of two buckets.
  *
  * @params threadInfo ThreadInfo struct
  * @params requestPacket Client request packet
+ * @returns ResponsePacket to send to client
+ */
+Packet *chatServer_stats(ThreadInfo *threadInfo, Packet *requestPacket) {
+	static const char *handlerNames[METRICS_HANDLERS] = {
+		"login", "exit", "sessionJoin", "sessionLeave", "sessionCreate", "sessionQuery",
+		"message", "stats", "unknown"
+	};
+
+	if (memcmp(threadInfo->clientID, requestPacket->source, MAX_NAME) != 0) {
+	    return allocDataPacket(ST_NACK, notAuthenticatedError, strlen(notAuthenticatedError));
+	}
+
+	Metrics metrics;
+	metrics_collect(&metrics);
+	SendQueueStats queues;
+	sq_getStats(&queues);
+	int sessionCount = 0;
+	sr_forEach(threadInfo->sessions, &chatServer_countSession, &sessionCount);
+	pthread_mutex_lock(&loginLock);
+	int loggedIn = threadInfo->connections->count;
+	pthread_mutex_unlock(&loginLock);
+
+	unsigned char report[MAX_DATA];
+	QueryContext out = { report, 0 };
+	int type, handler;
+	chatServer_append(&out, "connections: %ld open, %ld opened, %d logged in\n",
+					  metrics.connectionsOpened - metrics.connectionsClosed,
+					  metrics.connectionsOpened, loggedIn);
+	chatServer_append(&out, "sessions: %d\n", sessionCount);
+	chatServer_append(&out, "bytes: %ld in, %ld out\n", metrics.bytesIn, metrics.bytesOut);
+	chatServer_append(&out, "packets in:");
+	for (type = 0; type < METRICS_PACKET_TYPES; type++) {
+		if (metrics.packetsIn[type] > 0) {
+			chatServer_append(&out, " %s=%ld", packetTypeName(type), metrics.packetsIn[type]);
+		}
+	}
+	chatServer_append(&out, "\npackets out:");
+	for (type = 0; type < METRICS_PACKET_TYPES; type++) {
+		if (metrics.packetsOut[type] > 0) {
+			chatServer_append(&out, " %s=%ld", packetTypeName(type), metrics.packetsOut[type]);
+		}
+	}
+	chatServer_append(&out, "\n");
+	chatServer_appendHistogram(&out, "fan-out members", metrics.fanOut);
+	chatServer_append(&out, "send queues: %ld bytes in %ld packets, peak %ld bytes\n",
+					  queues.queuedBytes, queues.queuedPackets, queues.peakQueuedBytes);
+	chatServer_appendHistogram(&out, "queue depth bytes", metrics.queueDepth);
+	chatServer_append(&out, "history: %ld of %ld bytes allocated, %ld sessions evicted\n",
+					  __atomic_load_n(&historyAllocated, __ATOMIC_RELAXED), historyBudget,
+					  __atomic_load_n(&historyEvictions, __ATOMIC_RELAXED));
+	if (historyDirectory != NULL) {
+		SessionLogStats logStats;
+		sessionLog_getStats(&logStats);
+		chatServer_append(&out, "log: %ld messages, %ld bytes appended, %ld segments created, %ld deleted, "
+						  "%ld messages replayed, %ld of %ld bytes with sendfile\n",
+						  logStats.appendedMessages, logStats.appendedBytes, logStats.segmentsCreated,
+						  logStats.segmentsDeleted, logStats.replayedMessages,
+						  __atomic_load_n(&historySendfileBytes, __ATOMIC_RELAXED), logStats.replayedBytes);
+	}
+	chatServer_append(&out, "compression: %ld messages, %ld -> %ld bytes, %ld bytes saved, %ld us CPU\n",
+					  metrics.compressedMessages, metrics.compressionBytesIn, metrics.compressionBytesOut,
+					  metrics.compressionSaved, metrics.compressionNs / 1000);
+	for (handler = 0; handler < METRICS_HANDLERS; handler++) {
+		char name[64];
+		snprintf(name, sizeof(name), "%s ns", handlerNames[handler]);
+		chatServer_appendHistogram(&out, name, metrics.handlerLatency[handler]);
+	}
+
+	return allocDataPacket(ST_ACK, report, out.len);
+}
+
+/* MESSAGE frames are parsed and forwarded in place, see chatServer_setZeroCopyIngress */
+static int zeroCopyIngress = 1;
+
+/**
+ * @brief Selects how MESSAGE requests are handled. Off decodes them into a Packet and
+ * copies every broadcast frame, the way the server did before, for comparisons.
+ *
+ * @params enabled 1 to parse MESSAGE frames in place, 0 to decode them
+ */
+void chatServer_setZeroCopyIngress(int enabled) {
+	zeroCopyIngress = enabled;
+}
+
+/**
+ * @brief Checks that a request comes from the client logged in on the connection
+ */
+static int chatServer_isLoggedInSource(ThreadInfo *threadInfo, PacketView *request) {
+	return request->sourceLen < MAX_NAME &&
+		memcmp(threadInfo->clientID, request->source, request->sourceLen) == 0 &&
+		threadInfo->clientID[request->sourceLen] == '\0';
+}
+
+/**
+ * @brief Broadcasts the client's message to the session. Chunks of larger messages
+ * are forwarded the same way as soon as they arrive, the server never holds more
+ * than the chunk.
+ *
+ * @params threadInfo ThreadInfo struct
+ * @params request Client request, parsed in place from buf
  * @params buf Original byte buffer for the packet
  * @params bytes Size of the byte buffer
  * @returns ResponsePacket to send to client
  */
-Packet *chatServer_message(ThreadInfo *threadInfo, Packet *requestPacket, unsigned char *buf, int bytes) {
-	Packet *responsePacket = (Packet *)calloc(1, sizeof(Packet));
+Packet *chatServer_message(ThreadInfo *threadInfo, PacketView *request, unsigned char *buf, int bytes) {
+	Packet *responsePacket;
 
-	if (memcmp(threadInfo->clientID, requestPacket->source, MAX_NAME) != 0) {
-	    responsePacket->type = MESSAGE_NCK;
-		memcpy(responsePacket->data, notAuthenticatedError, strlen(notAuthenticatedError));
-		responsePacket->size = strlen(notAuthenticatedError);
+	if (!chatServer_isLoggedInSource(threadInfo, request)) {
+	    responsePacket = allocDataPacket(MESSAGE_NCK, notAuthenticatedError, strlen(notAuthenticatedError));
 	}
 	else {
-		char *string = (char *)calloc(requestPacket->size + 1, sizeof(char));
-		memcpy(string, requestPacket->data, requestPacket->size);
-		string[requestPacket->size] = '\0';
-
-		// Parse out the session from the first part
-		char buf2[256]; // TODO: Possible buffer overflow for large session names
+		// Parse out the session from the first part, the data is "<session>;<contents>".
+		// Only the name is copied, to terminate it for the registry lookup. Sessions
+		// with longer names can't exist, those messages match no session.
+		const char *string = (const char *)request->data;
+		char name[MAX_SESSION_NAME + 1];
 		int i;
-		for (i = 0; string[i] != ';' && string[i] != '\0'; i++) {
-			buf2[i] = string[i];
-		}
-		buf2[i] = '\0';
-		
-		// Find the session for the sessionID
-		LinkedList *session = ht_find(threadInfo->sessions, buf2);
-		if (session == NULL || ll_find(session, threadInfo, NULL) == NULL) {
-		    responsePacket->type = MESSAGE_NCK;
+		for (i = 0; i < (int)request->size && string[i] != ';' && string[i] != '\0'; i++);
+		int contentLen = i < (int)request->size ? (int)request->size - i - 1 : 0;
+		memcpy(name, string, i <= MAX_SESSION_NAME ? i : 0);
+		name[i <= MAX_SESSION_NAME ? i : 0] = '\0';
+
+		// Find the session for the sessionID, its members stay put until it's released
+		Session *session = i <= MAX_SESSION_NAME ? sr_acquire(threadInfo->sessions, name) : NULL;
+		if (session == NULL || !ms_contains(session->members, threadInfo)) {
+			if (session != NULL) {
+				sr_release(session);
+			}
 		    const char *notInSession = "Cannot send message, not in session";
-		    memcpy(responsePacket->data, notInSession, strlen(notInSession));
-		    responsePacket->size = strlen(notInSession);
+		    responsePacket = allocDataPacket(MESSAGE_NCK, notInSession, strlen(notInSession));
 		}
 		else {
 		    // Traverse the list, for each one forward the message
 			// to the socket on the other side
-			printf("Client %.64s sending size %d, \"%.*s\"\n", requestPacket->source, requestPacket->size, requestPacket->size, requestPacket->data);
-		    fflush(stdout);
-		    Node *curr = session->head;
-		    while (curr != NULL)
+			logger_log(LOG_LEVEL_DEBUG, "Client %.*s sending size %d, \"%.*s\"\n", request->sourceLen, request->source, request->size, request->size, request->data);
+
+			// Whole messages are kept for clients that join later
+			if (request->type == MESSAGE) {
+				chatServer_recordHistory(session, request);
+			}
+
+			// The frame is serialized once per wire format and every member shares
+			// it. Members on the sender's format get the original bytes, straight
+			// from the receive buffer unless one of them has to queue them. The
+			// sender's request id stays in them, so members that didn't accept ids
+			// get a serialized frame without it.
+			int senderFormat = packetFormat(buf, bytes);
+			SharedBuffer *original = NULL;
+			SharedBuffer *frames[WIRE_FORMATS] = { NULL };
+			Packet *decoded = NULL;
+			ThreadInfo *backedUp = NULL;
+			if (!zeroCopyIngress) {
+				original = sb_create(buf, bytes);
+			}
+
+			// Members that accepted compression get the text compressed once for the
+			// session. A compressing sender gets its own message back too, its
+			// inflater has to see every message the other members' do. Messages no
+			// other member wants compressed skip the stream on every side, and so do
+			// chunks of larger messages.
+			Packet *compressed = NULL;
+			SharedBuffer *compressedFrames[WIRE_FORMATS] = { NULL };
+			SessionState *compressor = NULL;
+			long compressedSaved = 0;
+			int member;
+			for (member = 0; member < session->members->count && request->type == MESSAGE &&
+					 i < (int)request->size; member++) {
+				ThreadInfo *ti = (ThreadInfo *)session->members->members[member];
+				if (ti->compression && ti->socket != threadInfo->socket) {
+					compressed = chatServer_compressMessage(session, request, i, &compressor);
+					break;
+				}
+			}
+
+			int recipients = 0;
+		    for (member = 0; member < session->members->count; member++)
 		    {
-				ThreadInfo *ti = (ThreadInfo *)curr->data;
-				
+				ThreadInfo *ti = (ThreadInfo *)session->members->members[member];
+				int result = 0;
+
+				if (ti->compression && compressed != NULL) {
+					if (compressedFrames[ti->wireFormat] == NULL) {
+						compressedFrames[ti->wireFormat] = sb_fromPacket(compressed, ti->wireFormat);
+					}
+					int frameLen = compressedFrames[ti->wireFormat]->len;
+					if (ti->socket != threadInfo->socket) {
+						recipients++;
+						compressedSaved += contentLen - (int)(compressed->size - i - 1);
+					}
+					else {
+						// The echo only costs bytes
+						compressedSaved -= frameLen;
+					}
+					metrics_recordSent(MESSAGE_DEFLATE, frameLen);
+					result = chatServer_sendShared(ti, compressedFrames[ti->wireFormat]);
+				}
 				// Avoid sending the message back to self, will cause issues with the expected response
-				if (ti->socket != threadInfo->socket)
+				else if (ti->socket != threadInfo->socket)
 				{
-					printf("Sending %.*s to socket %d\n", bytes-i-1, string+i, ti->socket);
-					pthread_mutex_lock(&ti->socketLock);
-					send(ti->socket, buf, bytes, 0);
-					pthread_mutex_unlock(&ti->socketLock);
+					logger_log(LOG_LEVEL_DEBUG, "Sending %.*s to socket %d\n", contentLen, string + i + 1, ti->socket);
+					recipients++;
+					if (ti->wireFormat == senderFormat && (request->id == 0 || ti->requestIds)) {
+						metrics_recordSent(request->type, bytes);
+						result = chatServer_sendFrame(ti, buf, bytes, &original);
+					}
+					else {
+						if (frames[ti->wireFormat] == NULL) {
+							if (decoded == NULL) {
+								decoded = decodePacket(buf, bytes);
+								decoded->id = 0;
+							}
+							frames[ti->wireFormat] = sb_fromPacket(decoded, ti->wireFormat);
+						}
+						metrics_recordSent(request->type, frames[ti->wireFormat]->len);
+						result = chatServer_sendShared(ti, frames[ti->wireFormat]);
+					}
 				}
-				curr = curr->next;
+				if (result == SEND_QUEUE_FULL && ti->socket != threadInfo->socket) {
+					backedUp = ti;
+				}
+			}
+
+			if (compressor != NULL) {
+				pthread_mutex_unlock(&compressor->compressLock);
+				metrics_recordCompressionSaved(compressedSaved);
+			}
+			if (compressed != NULL) {
+				pool_free(compressed);
+			}
+			metrics_recordFanOut(recipients);
+			sb_release(original);
+			int format;
+			for (format = 0; format < WIRE_FORMATS; format++) {
+				sb_release(frames[format]);
+				sb_release(compressedFrames[format]);
+			}
+			if (decoded != NULL) {
+				pool_free(decoded);
+			}
+			// Stop reading from the sender until the slow member catches up
+			if (backedUp != NULL) {
+				chatServer_pauseReading(threadInfo, backedUp);
 			}
-			responsePacket->type = MESSAGE_ACK;
-			responsePacket->size = 0;
+			sr_release(session);
+			responsePacket = allocDataPacket(MESSAGE_ACK, NULL, 0);
 		}
-		free(string);
 	}
 	return responsePacket;
 }
+
+
+/* Unsent bytes each connection may hold, and what happens past that */
+static int sendQueueLimit = SEND_QUEUE_DEFAULT_LIMIT;
+static int overflowPolicy = OVERFLOW_DISCONNECT;
+
+/* Senders paused by OVERFLOW_BACKPRESSURE, all resumed when a backed up queue drains */
+static pthread_mutex_t pausedLock = PTHREAD_MUTEX_INITIALIZER;
+static LinkedList pausedConnections;
+
+/**
+ * @brief Function for comparing two pointers
+ */
+static int pointerComparer(void *p1, void *p2) {
+	return p1 != p2;
+}
+
+/**
+ * @brief Compressed messages are only offered when the send queue never drops
+ * frames, a member that missed one couldn't inflate the ones after it
+ */
+static int chatServer_compressionAllowed() {
+	return overflowPolicy != OVERFLOW_DROP_OLDEST;
+}
+
+/**
+ * @brief Sets the send queue limit and the overflow policy for every connection
+ *
+ * @params limitBytes Maximum number of unsent bytes per connection
+ * @params policy OVERFLOW_DROP_OLDEST, OVERFLOW_DISCONNECT or OVERFLOW_BACKPRESSURE
+ */
+void chatServer_configureSendQueue(int limitBytes, int policy) {
+	sendQueueLimit = limitBytes;
+	overflowPolicy = policy;
+}
+
+/* Broadcast coalescing, off while the window is 0 */
+static long coalesceWindowNs;
+static int coalesceMaxBytes = COALESCE_DEFAULT_BYTES;
+
+/* Connections holding broadcasts, oldest deadline first since every window is the
+ * same length. Lock order is coalesceLock, then a connection's socketLock. */
+static pthread_mutex_t coalesceLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t coalesceCond;
+static ThreadInfo *coalesceHead;
+static ThreadInfo *coalesceTail;
+
+/**
+ * @brief Appends a connection to the flusher's list. Expects coalesceLock to be held.
+ */
+static void chatServer_listCoalescing(ThreadInfo *threadInfo) {
+	threadInfo->coalesceListed = 1;
+	threadInfo->coalesceNext = NULL;
+	if (coalesceTail != NULL) {
+		coalesceTail->coalesceNext = threadInfo;
+	}
+	else {
+		coalesceHead = threadInfo;
+		pthread_cond_signal(&coalesceCond);
+	}
+	coalesceTail = threadInfo;
+}
+
+/**
+ * @brief Takes a connection off the flusher's list. Expects coalesceLock to be held.
+ */
+static void chatServer_unlistCoalescing(ThreadInfo *threadInfo) {
+	ThreadInfo *prev = NULL, *curr = coalesceHead;
+	while (curr != NULL && curr != threadInfo) {
+		prev = curr;
+		curr = curr->coalesceNext;
+	}
+	if (curr == NULL) {
+		return;
+	}
+	if (prev == NULL) {
+		coalesceHead = curr->coalesceNext;
+	}
+	else {
+		prev->coalesceNext = curr->coalesceNext;
+	}
+	if (coalesceTail == curr) {
+		coalesceTail = prev;
+	}
+	curr->coalesceListed = 0;
+}
+
+/**
+ * @brief Flusher thread, hands every connection's held broadcasts to its backend once
+ * the connection's window closed
+ */
+static void *chatServer_coalesceThread(void *args) {
+	pthread_mutex_lock(&coalesceLock);
+	while (1) {
+		ThreadInfo *threadInfo = coalesceHead;
+		if (threadInfo == NULL) {
+			pthread_cond_wait(&coalesceCond, &coalesceLock);
+			continue;
+		}
+
+		long now = chatServer_clock();
+		long deadline = __atomic_load_n(&threadInfo->coalesceDeadline, __ATOMIC_RELAXED);
+		if (deadline > now) {
+			struct timespec wake;
+			wake.tv_sec = deadline / 1000000000L;
+			wake.tv_nsec = deadline % 1000000000L;
+			pthread_cond_timedwait(&coalesceCond, &coalesceLock, &wake);
+			continue;
+		}
+
+		chatServer_unlistCoalescing(threadInfo);
+		pthread_mutex_lock(&threadInfo->socketLock);
+		if (threadInfo->coalescing) {
+			if (threadInfo->coalesceDeadline <= now) {
+				threadInfo->coalescing = 0;
+				if (threadInfo->wantWrite != NULL) {
+					threadInfo->wantWrite(threadInfo);
+				}
+			}
+			else {
+				// Flushed early and holding again since, wait for the new window
+				chatServer_listCoalescing(threadInfo);
+			}
+		}
+		pthread_mutex_unlock(&threadInfo->socketLock);
+	}
+	return NULL;
+}
+
+/**
+ * @brief Holds broadcasts to each connection for up to a window so the backend writes
+ * the frames that piled up with one writev. A window of 0 sends them right away.
+ * Applies to the threaded and epoll backends, io_uring already submits the sends of a
+ * whole completion batch at once.
+ *
+ * @params windowUs Longest time a broadcast is held, in microseconds
+ * @params maxBytes Held bytes that flush a connection before its window closes
+ * @returns 0 on success, -1 if the flusher thread couldn't be started
+ */
+int chatServer_configureCoalescing(int windowUs, int maxBytes) {
+	coalesceMaxBytes = maxBytes > 0 ? maxBytes : COALESCE_DEFAULT_BYTES;
+	if (windowUs <= 0) {
+		coalesceWindowNs = 0;
+		return 0;
+	}
+
+	// Deadlines come from chatServer_clock, the monotonic clock
+	pthread_condattr_t attr;
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&coalesceCond, &attr);
+	pthread_condattr_destroy(&attr);
+
+	pthread_t flusher;
+	if (pthread_create(&flusher, NULL, chatServer_coalesceThread, NULL) != 0) {
+		return -1;
+	}
+	pthread_detach(flusher);
+	coalesceWindowNs = windowUs * 1000L;
+	return 0;
+}
+
+/**
+ * @brief Resumes every paused sender once a queue crossed below half the limit.
+ * Must be called without any socketLock held.
+ */
+static void chatServer_resumeIfDrained(int bytesBefore, int bytesAfter) {
+	int lowWater = sendQueueLimit / 2;
+	if (bytesBefore <= lowWater || bytesAfter > lowWater ||
+		__atomic_load_n(&pausedConnections.count, __ATOMIC_RELAXED) == 0) {
+		return;
+	}
+
+	pthread_mutex_lock(&pausedLock);
+	Node *node = pausedConnections.head;
+	while (node != NULL) {
+		Node *next = node->next;
+		ThreadInfo *paused = (ThreadInfo *)node->data;
+		paused->readPaused = 0;
+		if (paused->readStateChanged != NULL) {
+			paused->readStateChanged(paused);
+		}
+		ll_remove(&pausedConnections, node);
+		free(node);
+		node = next;
+	}
+	pthread_mutex_unlock(&pausedLock);
+}
+
+/**
+ * @brief Stops reading from a client whose messages back up other connections
+ *
+ * @params threadInfo ThreadInfo struct of the sending connection
+ * @params recipient ThreadInfo struct of the connection whose queue is full
+ */
+void chatServer_pauseReading(ThreadInfo *threadInfo, ThreadInfo *recipient) {
+	pthread_mutex_lock(&pausedLock);
+
+	// The recipient may have drained since the send, it resumes nobody after this check
+	pthread_mutex_lock(&recipient->socketLock);
+	int backedUp = recipient->sendQueue.bytes > sendQueueLimit / 2;
+	pthread_mutex_unlock(&recipient->socketLock);
+
+	if (backedUp && !threadInfo->readPaused) {
+		threadInfo->readPaused = 1;
+		ll_insert(&pausedConnections, threadInfo);
+		sq_recordPause();
+		if (threadInfo->readStateChanged != NULL) {
+			threadInfo->readStateChanged(threadInfo);
+		}
+	}
+	pthread_mutex_unlock(&pausedLock);
+}
+
+/**
+ * @brief Sends part of a file with sendfile until the socket's send buffer is full.
+ * sendfile has no MSG_DONTWAIT, this relies on connection sockets being non-blocking.
+ *
+ * @returns Bytes sent, -1 with errno set if the socket failed
+ */
+static int chatServer_sendFileBytes(int socket, int fd, long offset, int len) {
+	off_t position = offset;
+	int sent = 0;
+	while (sent < len) {
+		ssize_t result = sendfile(socket, fd, &position, len - sent);
+		if (result < 0) {
+			if (errno == EINTR) continue;
+			if (sent > 0 || errno == EAGAIN || errno == EWOULDBLOCK) break;
+			return -1;
+		}
+		if (result == 0) {
+			break;
+		}
+		sent += result;
+	}
+	__atomic_add_fetch(&historySendfileBytes, sent, __ATOMIC_RELAXED);
+	return sent;
+}
+
+/**
+ * @brief Sends what the socket takes without blocking and queues the rest, applying
+ * the overflow policy. Queues a reference to *shared, creating it from buf first if
+ * it's still NULL, or a copy of the unsent rest of buf when shared is NULL. Packets
+ * that may be held are broadcasts, they're queued whole while coalescing is on or
+ * the client's history is sent, any other packet ends the connection's window and
+ * goes out together with the held ones. When fd is a file holding the bytes at
+ * fileOffset, they're sent from the file with sendfile and only what has to be
+ * queued is read from it.
+ */
+static int chatServer_queueBytes(ThreadInfo *threadInfo, SharedBuffer **shared,
+								 unsigned char *buf, int len, int hold, int fd, long fileOffset) {
+	SendQueue *queue = &threadInfo->sendQueue;
+	int result = len;
+	int sent = 0;
+	int broadcast = hold;
+	// Backends writing queued data themselves already batch their sends
+	hold = hold && coalesceWindowNs > 0 && !threadInfo->deferredWrites;
+
+	pthread_mutex_lock(&threadInfo->socketLock);
+	if (threadInfo->sendFailed) {
+		pthread_mutex_unlock(&threadInfo->socketLock);
+		return -1;
+	}
+	if (broadcast && threadInfo->replaying) {
+		// Waits for the history of the session the client joins
+		queue = &threadInfo->heldQueue;
+		hold = 0;
+	}
+
+	// With nothing queued ahead of it the packet can go straight to the socket
+	if (queue->head == NULL && queue == &threadInfo->sendQueue && !threadInfo->deferredWrites && !hold) {
+		if (fd >= 0) {
+			sent = chatServer_sendFileBytes(threadInfo->socket, fd, fileOffset, len);
+		}
+		else {
+			sent = send(threadInfo->socket, buf, len, MSG_DONTWAIT | MSG_NOSIGNAL);
+		}
+		if (sent < 0) {
+			if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+				// The receive side notices the dead socket and closes the connection
+				threadInfo->sendFailed = 1;
+				pthread_mutex_unlock(&threadInfo->socketLock);
+				return -1;
+			}
+			sent = 0;
+		}
+		if (sent == len) {
+			pthread_mutex_unlock(&threadInfo->socketLock);
+			return len;
+		}
+	}
+
+	int remaining = len - sent;
+	if (queue->bytes + remaining > sendQueueLimit) {
+		switch (overflowPolicy) {
+			case OVERFLOW_DROP_OLDEST: {
+				int dropped = sq_dropOldest(queue, sendQueueLimit - remaining);
+				while (dropped-- > 0) {
+					sq_recordOverflow(0);
+				}
+				// A partly sent packet has to be finished to keep the stream intact
+				if (sent == 0 && queue->bytes + remaining > sendQueueLimit) {
+					sq_recordOverflow(0);
+					pthread_mutex_unlock(&threadInfo->socketLock);
+					return -1;
+				}
+				break;
+			}
+			case OVERFLOW_BACKPRESSURE:
+				result = SEND_QUEUE_FULL;
+				break;
+			default:
+				// Shut the socket down, the owning backend closes the connection
+				threadInfo->sendFailed = 1;
+				sq_clear(&threadInfo->sendQueue);
+				sq_clear(&threadInfo->heldQueue);
+				shutdown(threadInfo->socket, SHUT_RDWR);
+				sq_recordOverflow(1);
+				pthread_mutex_unlock(&threadInfo->socketLock);
+				return -1;
+		}
+	}
+
+	int wasEmpty = queue->head == NULL;
+	if (shared == NULL) {
+		SharedBuffer *copy = fd >= 0 ? sb_fromFile(fd, fileOffset + sent, remaining) : sb_create(buf + sent, remaining);
+		if (copy == NULL) {
+			// The client got part of the packet, the stream can't go on
+			threadInfo->sendFailed = 1;
+			shutdown(threadInfo->socket, SHUT_RDWR);
+			pthread_mutex_unlock(&threadInfo->socketLock);
+			return -1;
+		}
+		sq_push(queue, copy, 0);
+		sb_release(copy);
+	}
+	else {
+		if (*shared == NULL) {
+			*shared = sb_create(buf, len);
+		}
+		sq_push(queue, *shared, sent);
+	}
+	metrics_recordQueueDepth(queue->bytes);
+	if (queue == &threadInfo->heldQueue) {
+		pthread_mutex_unlock(&threadInfo->socketLock);
+		return result;
+	}
+
+	int startWindow = wasEmpty && hold;
+	if (startWindow) {
+		threadInfo->coalescing = 1;
+		__atomic_store_n(&threadInfo->coalesceDeadline, chatServer_clock() + coalesceWindowNs,
+						 __ATOMIC_RELAXED);
+	}
+	else if (threadInfo->coalescing && (!hold || queue->bytes >= coalesceMaxBytes)) {
+		// Ends the window early, the flusher skips the connection
+		threadInfo->coalescing = 0;
+		if (threadInfo->wantWrite != NULL) {
+			threadInfo->wantWrite(threadInfo);
+		}
+	}
+	else if (wasEmpty && threadInfo->wantWrite != NULL) {
+		threadInfo->wantWrite(threadInfo);
+	}
+	int list = startWindow && !threadInfo->coalesceListed;
+	pthread_mutex_unlock(&threadInfo->socketLock);
+
+	// Listed without socketLock held, the flusher takes the locks in the other order
+	if (list) {
+		pthread_mutex_lock(&coalesceLock);
+		if (!threadInfo->coalesceListed) {
+			chatServer_listCoalescing(threadInfo);
+		}
+		pthread_mutex_unlock(&coalesceLock);
+	}
+	return result;
+}
+
+/**
+ * @brief Sends bytes to the client through the connection's I/O backend
+ *
+ * @params threadInfo ThreadInfo struct of the receiving connection
+ * @params buf Bytes to send
+ * @params len Number of bytes to send
+ * @returns Number of bytes sent or queued, -1 on error
+ */
+int chatServer_send(ThreadInfo *threadInfo, unsigned char *buf, int len) {
+	return chatServer_queueBytes(threadInfo, NULL, buf, len, 0, -1, 0);
+}
+
+/**
+ * @brief Sends a shared, already serialized broadcast to the client without blocking.
+ * Whatever the socket doesn't take right away is queued as a reference to the buffer
+ * and the queue's overflow policy applies. With coalescing on the whole packet is
+ * queued and held for the coalescing window.
+ *
+ * @params threadInfo ThreadInfo struct of the receiving connection
+ * @params buffer Serialized packet
+ * @returns Number of bytes sent or queued, SEND_QUEUE_FULL if the sender should be
+ * paused, -1 if the packet was discarded
+ */
+int chatServer_sendShared(ThreadInfo *threadInfo, SharedBuffer *buffer) {
+	return chatServer_queueBytes(threadInfo, &buffer, buffer->data, buffer->len, 1, -1, 0);
+}
+
+/**
+ * @brief Sends a serialized broadcast the caller doesn't own to the client without
+ * blocking. The bytes go to the socket as they are, they're only copied into a
+ * shared buffer when some of them have to be queued, and that copy is kept in
+ * *shared for the next recipient. With coalescing on the packet is always queued and
+ * held for the coalescing window.
+ *
+ * @params threadInfo ThreadInfo struct of the receiving connection
+ * @params buf Serialized packet, only valid for the duration of the call
+ * @params len Length of the packet
+ * @params shared Copy of buf shared by the recipients, NULL until one needs it.
+ * The caller releases it.
+ * @returns Number of bytes sent or queued, SEND_QUEUE_FULL if the sender should be
+ * paused, -1 if the packet was discarded
+ */
+int chatServer_sendFrame(ThreadInfo *threadInfo, unsigned char *buf, int len, SharedBuffer **shared) {
+	return chatServer_queueBytes(threadInfo, shared, buf, len, 1, -1, 0);
+}
+
+/**
+ * @brief Sends bytes of a file to the client without blocking. What the socket takes
+ * right away goes out with sendfile and never passes through user space, the rest is
+ * read from the file and queued.
+ *
+ * @params threadInfo ThreadInfo struct of the receiving connection
+ * @params fd File to send from
+ * @params offset Offset of the bytes in the file
+ * @params len Number of bytes to send
+ * @returns Number of bytes sent or queued, -1 on error
+ */
+int chatServer_sendFile(ThreadInfo *threadInfo, int fd, long offset, int len) {
+	return chatServer_queueBytes(threadInfo, NULL, NULL, len, 0, fd, offset);
+}
+
+/**
+ * @brief Writes as much of the connection's send queue as the socket accepts without
+ * blocking. Called by the backend when the socket becomes writable.
+ *
+ * @params threadInfo ThreadInfo struct of the writable connection
+ * @returns 1 if data is still queued, 0 otherwise
+ */
+int chatServer_flushSendQueue(ThreadInfo *threadInfo) {
+	pthread_mutex_lock(&threadInfo->socketLock);
+	int before = threadInfo->sendQueue.bytes;
+	if (!threadInfo->sendFailed && sq_write(&threadInfo->sendQueue, threadInfo->socket) < 0) {
+		threadInfo->sendFailed = 1;
+		sq_clear(&threadInfo->sendQueue);
+	}
+	int after = threadInfo->sendQueue.bytes;
+	int pending = threadInfo->sendQueue.head != NULL;
+	if (!pending) {
+		// Held broadcasts went out with the rest of the queue
+		threadInfo->coalescing = 0;
+	}
+	pthread_mutex_unlock(&threadInfo->socketLock);
+
+	chatServer_resumeIfDrained(before, after);
+	return pending;
+}
+
+/**
+ * @brief Called by backends after they sent queued data themselves, resumes paused
+ * senders once the queue drained far enough
+ *
+ * @params threadInfo ThreadInfo struct of the connection that sent data
+ * @params bytesBefore Queued bytes before the data was sent
+ */
+void chatServer_sendQueueDrained(ThreadInfo *threadInfo, int bytesBefore) {
+	pthread_mutex_lock(&threadInfo->socketLock);
+	int after = threadInfo->sendQueue.bytes;
+	pthread_mutex_unlock(&threadInfo->socketLock);
+
+	chatServer_resumeIfDrained(bytesBefore, after);
+}
+
+/* Requests handled so far, reported with the allocator metrics */
+static long requestsHandled;
+
+/**
+ * @brief Returns the number of requests handled since the server started
+ */
+long chatServer_requestCount() {
+	return __atomic_load_n(&requestsHandled, __ATOMIC_RELAXED);
+}
+
+/**
+ * @brief Encodes the response in the client's wire format, tagged with the id of the
+ * request it answers, sends it and frees it
+ */
+static void chatServer_respond(ThreadInfo *threadInfo, Packet *responsePacket, unsigned int requestId) {
+	if (responsePacket != NULL) {
+		responsePacket->id = requestId;
+		int responseLength;
+		unsigned char *response = encodePacket(responsePacket, threadInfo->wireFormat, &responseLength);
+		metrics_recordSent(responsePacket->type, responseLength);
+		chatServer_send(threadInfo, response, responseLength);
+		pool_free(response);
+		pool_free(responsePacket);
+	}
+}
+
+/**
+ * @brief Parses a raw request, dispatches it to the matching chatServer_* handler and
+ * sends the response back to the client
+ *
+ * @params threadInfo ThreadInfo struct of the requesting connection
+ * @params buf Byte buffer of the request
+ * @params bytes Size of the byte buffer
+ */
+void chatServer_handleRequest(ThreadInfo *threadInfo, unsigned char *buf, int bytes) {
+	logger_log(LOG_LEVEL_DEBUG, "RECV %d bytes: %.*s\n", bytes, bytes, buf);
+	__atomic_add_fetch(&requestsHandled, 1, __ATOMIC_RELAXED);
+
+	Packet *responsePacket;
+	PacketView view;
+	int handler;
+
+	// Messages are routed straight out of the receive buffer
+	if (zeroCopyIngress && viewPacket(buf, bytes, &view) == 0 &&
+		(view.type == MESSAGE || view.type == MESSAGE_CHUNK)) {
+		metrics_recordReceived(view.type, bytes);
+		long start = chatServer_clock();
+		responsePacket = chatServer_message(threadInfo, &view, buf, bytes);
+		metrics_recordHandler(HANDLER_MESSAGE, chatServer_clock() - start);
+		chatServer_respond(threadInfo, responsePacket, view.id);
+		return;
+	}
+
+	// Convert the request to a packet
+	Packet *requestPacket = decodePacket(buf, bytes);
+
+	metrics_recordReceived(requestPacket->type, bytes);
+	long start = chatServer_clock();
+	switch(requestPacket->type) {
+		case LOGIN:
+		    handler = HANDLER_LOGIN;
+		    responsePacket = chatServer_login(threadInfo, requestPacket);
+		    break;
+		case EXIT:
+		    handler = HANDLER_EXIT;
+		    responsePacket = chatServer_exit(threadInfo, requestPacket);
+		    break;
+		case JOIN:
+		    handler = HANDLER_JOIN;
+		    responsePacket = chatServer_sessionJoin(threadInfo, requestPacket);
+		    break;
+		case LEAVE_SESS:
+		    handler = HANDLER_LEAVE;
+		    responsePacket = chatServer_sessionLeave(threadInfo, requestPacket);
+		    break;
+		case NEW_SESS:
+		    handler = HANDLER_CREATE;
+		    responsePacket = chatServer_sessionCreate(threadInfo, requestPacket);
+		    break;
+		case QUERY:
+			handler = HANDLER_QUERY;
+			responsePacket = chatServer_sessionQuery(threadInfo, requestPacket);
+			break;
+		case STATS:
+			handler = HANDLER_STATS;
+			responsePacket = chatServer_stats(threadInfo, requestPacket);
+			break;
+		case MESSAGE:
+		case MESSAGE_CHUNK:
+			view.type = requestPacket->type;
+			view.size = requestPacket->size;
+			view.id = requestPacket->id;
+			view.source = requestPacket->source;
+			view.sourceLen = strnlen((char *)requestPacket->source, MAX_NAME);
+			view.data = requestPacket->data;
+		    handler = HANDLER_MESSAGE;
+		    responsePacket = chatServer_message(threadInfo, &view, buf, bytes);
+		    break;
+		default:
+			handler = HANDLER_UNKNOWN;
+			char* unknownMessage = "Unknown request.";
+			responsePacket = allocDataPacket(UNKNOWN, unknownMessage, strlen(unknownMessage));
+			break;
+	}
+	metrics_recordHandler(handler, chatServer_clock() - start);
+	unsigned int requestId = requestPacket->id;
+	pool_free(requestPacket);
+
+	chatServer_respond(threadInfo, responsePacket, requestId);
+}
+
+/**
+ * @brief FrameHandler adapter, handles one complete packet for the connection
+ */
+static void chatServer_frameHandler(void *context, unsigned char *frame, int len) {
+	ThreadInfo *threadInfo = (ThreadInfo *)context;
+
+	// Ignore anything pipelined after an EXIT
+	if (threadInfo->clientConnected) {
+		chatServer_handleRequest(threadInfo, frame, len);
+	}
+}
+
+/**
+ * @brief Cuts received bytes into packets and handles each complete one in order.
+ * A trailing partial packet is kept until the rest of it arrives.
+ *
+ * @params threadInfo ThreadInfo struct of the receiving connection
+ * @params bytes Bytes received from the socket
+ * @params len Number of bytes received
+ * @returns 0 on success, -1 if the stream is malformed and the connection should be closed
+ */
+int chatServer_handleStream(ThreadInfo *threadInfo, unsigned char *bytes, int len) {
+	return fb_feed(&threadInfo->inputBuffer, bytes, len, chatServer_frameHandler, threadInfo);
+}
+
+/**
+ * @brief Counts a connection a backend accepted
+ *
+ * @params threadInfo ThreadInfo struct of the new connection
+ */
+void chatServer_connect(ThreadInfo *threadInfo) {
+	metrics_recordConnect();
+}
+
+/**
+ * @brief Removes a connection that dropped without sending EXIT from all of its sessions
+ *
+ * @params threadInfo ThreadInfo struct of the dropped connection
+ */
+void chatServer_disconnect(ThreadInfo *threadInfo) {
+	metrics_recordDisconnect();
+	// chatServer_exit clears the clientID, so only logged in clients are left to clean up
+	if (threadInfo->clientID[0] != '\0') {
+	    chatServer_exit(threadInfo, NULL);
+	}
+	threadInfo->clientConnected = 0;
+	fb_free(&threadInfo->inputBuffer);
+
+	pthread_mutex_lock(&pausedLock);
+	if (threadInfo->readPaused) {
+		Node *node = ll_find(&pausedConnections, threadInfo, &pointerComparer);
+		ll_remove(&pausedConnections, node);
+		free(node);
+		threadInfo->readPaused = 0;
+	}
+	pthread_mutex_unlock(&pausedLock);
+
+	// The flusher must not touch the connection once the backend frees it
+	pthread_mutex_lock(&coalesceLock);
+	if (threadInfo->coalesceListed) {
+		chatServer_unlistCoalescing(threadInfo);
+	}
+	pthread_mutex_unlock(&coalesceLock);
+
+	// Nothing more is sent, senders waiting on this queue can go on
+	pthread_mutex_lock(&threadInfo->socketLock);
+	int before = threadInfo->sendQueue.bytes;
+	threadInfo->sendFailed = 1;
+	threadInfo->coalescing = 0;
+	sq_clear(&threadInfo->sendQueue);
+	sq_clear(&threadInfo->heldQueue);
+	int after = threadInfo->sendQueue.bytes;
+	pthread_mutex_unlock(&threadInfo->socketLock);
+
+	chatServer_resumeIfDrained(before, after);
+}
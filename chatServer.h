@@ -19,11 +19,33 @@
 #include "utils/transport.h"
 #include "utils/nethelper.h"
 #include "utils/printHelpers.h"
+#include "utils/frameBuffer.h"
+#include "utils/sharedBuffer.h"
+#include "utils/sendQueue.h"
 #include "collections/linkedList.h"
 #include "collections/hashTable.h"
+#include "collections/sessionRegistry.h"
 
 #define MAX_SIMUL_SESSIONS_PER_CLIENT 4
 
+/* Returned by chatServer_sendShared when the packet was queued past the limit under
+ * OVERFLOW_BACKPRESSURE, the sender should be paused */
+#define SEND_QUEUE_FULL -2
+
+/* Default number of held broadcast bytes that ends a coalescing window early */
+#define COALESCE_DEFAULT_BYTES (16*1024)
+
+/* Default history replayed to joining clients: messages and bytes per session, and
+ * the bytes all sessions' history may take together */
+#define HISTORY_DEFAULT_MESSAGES 100
+#define HISTORY_DEFAULT_BYTES (64*1024)
+#define HISTORY_DEFAULT_BUDGET (16L*1024*1024)
+
+/* Default size a session log's segment rolls over at, and the size of a log above
+ * which its oldest segments are deleted */
+#define HISTORY_DEFAULT_SEGMENT (4L*1024*1024)
+#define HISTORY_DEFAULT_RETAIN (64L*1024*1024)
+
 /**
  * @brief Data structure for storing relevant per-thread data
  */
@@ -33,13 +55,51 @@ typedef struct _ThreadInfo
 	socklen_t clientAddrLen;
 	int socket;
 	char clientID[MAX_NAME];
-	char *sessionID;
+	/* Names of the sessions the client is in, created on the first join. Keys are
+	 * owned by the table and only the connection's own requests touch it. */
+	HashTable *joinedSessions;
 	pthread_t thread;
 	pthread_mutex_t socketLock;
 	int clientConnected;
+	/* Wire format negotiated at login, WIRE_ASCII or WIRE_BINARY */
+	int wireFormat;
+	/* The client accepted request ids at login, it may see them on broadcasts too */
+	int requestIds;
+	/* The client accepted compressed messages at login */
+	int compression;
+	/* Partial packet left over from the last read */
+	FrameBuffer inputBuffer;
 	LinkedList *connections;
-	HashTable *sessions;
+	SessionRegistry *sessions;
 	HashTable *users;
+	/* Outgoing data the socket hasn't accepted yet, guarded by socketLock */
+	SendQueue sendQueue;
+	/* While a joined session's history is sent, broadcasts wait in heldQueue and
+	 * are moved behind it afterwards. Guarded by socketLock. */
+	int replaying;
+	SendQueue heldQueue;
+	/* Writing failed or the queue overflowed, later sends are discarded */
+	int sendFailed;
+	/* Reading is paused until backed up send queues drain */
+	int readPaused;
+	/* The backend writes queued data itself instead of the sender writing inline */
+	int deferredWrites;
+	/* Backend hook, called with socketLock held when queued data has to wait for
+	 * the socket to become writable */
+	void (*wantWrite)(struct _ThreadInfo *threadInfo);
+	/* Backend hook, called when readPaused changes */
+	void (*readStateChanged)(struct _ThreadInfo *threadInfo);
+	/* Broadcast frames wait in the send queue until coalesceDeadline, guarded by
+	 * socketLock. The backend isn't asked to write them before. */
+	int coalescing;
+	long coalesceDeadline;
+	/* On the coalescing flusher's list, guarded by its lock */
+	int coalesceListed;
+	struct _ThreadInfo *coalesceNext;
+	/* Eventfd waking the connection's thread, threaded mode only */
+	int wakeFd;
+	/* Backend specific per-connection state */
+	void *backendData;
 } ThreadInfo;
 
 /**
@@ -70,11 +130,12 @@ Packet *chatServer_login(ThreadInfo *threadInfo, Packet *requestPacket);
 Packet *chatServer_exit(ThreadInfo *threadInfo, Packet *requestPacket);
 
 /**
- * @brief Joins the client to the specified session
+ * @brief Joins the client to the specified session and replays the session's
+ * recent messages to it
  *
  * @params threadInfo ThreadInfo struct
  * @params requestPacket Client request packet
- * @returns ResponsePacket to send to client
+ * @returns ResponsePacket to send to client, NULL if the JN_ACK was sent with the history
  */
 Packet *chatServer_sessionJoin(ThreadInfo *threadInfo, Packet *requestPacket);
 
@@ -106,14 +167,196 @@ Packet *chatServer_sessionCreate(ThreadInfo *threadInfo, Packet *requestPacket);
 Packet *chatServer_sessionQuery(ThreadInfo *threadInfo, Packet *requestPacket);
 
 /**
- * @brief Broadcasts the client's message to the session
+ * @brief Reports the server's counters and latency histograms. Percentiles are the
+ * upper bounds of power of two buckets.
  *
  * @params threadInfo ThreadInfo struct
  * @params requestPacket Client request packet
+ * @returns ResponsePacket to send to client
+ */
+Packet *chatServer_stats(ThreadInfo *threadInfo, Packet *requestPacket);
+
+/**
+ * @brief Broadcasts the client's message to the session. Chunks of larger messages
+ * are forwarded the same way as soon as they arrive, the server never holds more
+ * than the chunk.
+ *
+ * @params threadInfo ThreadInfo struct
+ * @params request Client request, parsed in place from buf
  * @params buf Original byte buffer for the packet
  * @params bytes Size of the byte buffer
  * @returns ResponsePacket to send to client
  */
-Packet *chatServer_message(ThreadInfo *threadInfo, Packet *requestPacket, unsigned char *buf, int bytes);
+Packet *chatServer_message(ThreadInfo *threadInfo, PacketView *request, unsigned char *buf, int bytes);
+
+/**
+ * @brief Selects how MESSAGE requests are handled. Off decodes them into a Packet and
+ * copies every broadcast frame, the way the server did before, for comparisons.
+ *
+ * @params enabled 1 to parse MESSAGE frames in place, 0 to decode them
+ */
+void chatServer_setZeroCopyIngress(int enabled);
+
+/**
+ * @brief Sends bytes to the client through the connection's I/O backend
+ *
+ * @params threadInfo ThreadInfo struct of the receiving connection
+ * @params buf Bytes to send
+ * @params len Number of bytes to send
+ * @returns Number of bytes sent or queued, -1 on error
+ */
+int chatServer_send(ThreadInfo *threadInfo, unsigned char *buf, int len);
+
+/**
+ * @brief Sends a shared, already serialized broadcast to the client without blocking.
+ * Whatever the socket doesn't take right away is queued as a reference to the buffer
+ * and the queue's overflow policy applies. With coalescing on the whole packet is
+ * queued and held for the coalescing window.
+ *
+ * @params threadInfo ThreadInfo struct of the receiving connection
+ * @params buffer Serialized packet
+ * @returns Number of bytes sent or queued, SEND_QUEUE_FULL if the sender should be
+ * paused, -1 if the packet was discarded
+ */
+int chatServer_sendShared(ThreadInfo *threadInfo, SharedBuffer *buffer);
+
+/**
+ * @brief Sends a serialized broadcast the caller doesn't own to the client without
+ * blocking. The bytes go to the socket as they are, they're only copied into a
+ * shared buffer when some of them have to be queued, and that copy is kept in
+ * *shared for the next recipient. With coalescing on the packet is always queued and
+ * held for the coalescing window.
+ *
+ * @params threadInfo ThreadInfo struct of the receiving connection
+ * @params buf Serialized packet, only valid for the duration of the call
+ * @params len Length of the packet
+ * @params shared Copy of buf shared by the recipients, NULL until one needs it.
+ * The caller releases it.
+ * @returns Number of bytes sent or queued, SEND_QUEUE_FULL if the sender should be
+ * paused, -1 if the packet was discarded
+ */
+int chatServer_sendFrame(ThreadInfo *threadInfo, unsigned char *buf, int len, SharedBuffer **shared);
+
+/**
+ * @brief Sends bytes of a file to the client without blocking. What the socket takes
+ * right away goes out with sendfile and never passes through user space, the rest is
+ * read from the file and queued.
+ *
+ * @params threadInfo ThreadInfo struct of the receiving connection
+ * @params fd File to send from
+ * @params offset Offset of the bytes in the file
+ * @params len Number of bytes to send
+ * @returns Number of bytes sent or queued, -1 on error
+ */
+int chatServer_sendFile(ThreadInfo *threadInfo, int fd, long offset, int len);
+
+/**
+ * @brief Sets the send queue limit and the overflow policy for every connection
+ *
+ * @params limitBytes Maximum number of unsent bytes per connection
+ * @params policy OVERFLOW_DROP_OLDEST, OVERFLOW_DISCONNECT or OVERFLOW_BACKPRESSURE
+ */
+void chatServer_configureSendQueue(int limitBytes, int policy);
+
+/**
+ * @brief Holds broadcasts to each connection for up to a window so the backend writes
+ * the frames that piled up with one writev. A window of 0 sends them right away.
+ * Applies to the threaded and epoll backends, io_uring already submits the sends of a
+ * whole completion batch at once.
+ *
+ * @params windowUs Longest time a broadcast is held, in microseconds
+ * @params maxBytes Held bytes that flush a connection before its window closes
+ * @returns 0 on success, -1 if the flusher thread couldn't be started
+ */
+int chatServer_configureCoalescing(int windowUs, int maxBytes);
+
+/**
+ * @brief Sets how much history every session keeps and the budget for all of them.
+ * Once the budget is used up the sessions that went longest without a message lose
+ * their history first.
+ *
+ * @params messages Messages kept per session, 0 turns history off
+ * @params bytes Bytes kept per session
+ * @params budget Bytes all sessions' history may take together
+ */
+void chatServer_configureHistory(int messages, int bytes, long budget);
+
+/**
+ * @brief Keeps every session's messages in a log on disk, which outlives the server
+ * and replaces the in-memory history. Clients that join get the last messages from
+ * the log.
+ *
+ * @params directory Directory holding the logs
+ * @params segmentBytes Size a log's segment rolls over at
+ * @params retainBytes Size of a log above which its oldest segments are deleted
+ * @returns 0 on success, -1 if the directory can't be created
+ */
+int chatServer_configureLog(const char *directory, long segmentBytes, long retainBytes);
+
+/**
+ * @brief Writes as much of the connection's send queue as the socket accepts without
+ * blocking. Called by the backend when the socket becomes writable.
+ *
+ * @params threadInfo ThreadInfo struct of the writable connection
+ * @returns 1 if data is still queued, 0 otherwise
+ */
+int chatServer_flushSendQueue(ThreadInfo *threadInfo);
+
+/**
+ * @brief Called by backends after they sent queued data themselves, resumes paused
+ * senders once the queue drained far enough
+ *
+ * @params threadInfo ThreadInfo struct of the connection that sent data
+ * @params bytesBefore Queued bytes before the data was sent
+ */
+void chatServer_sendQueueDrained(ThreadInfo *threadInfo, int bytesBefore);
+
+/**
+ * @brief Stops reading from a client whose messages back up other connections
+ *
+ * @params threadInfo ThreadInfo struct of the sending connection
+ * @params recipient ThreadInfo struct of the connection whose queue is full
+ */
+void chatServer_pauseReading(ThreadInfo *threadInfo, ThreadInfo *recipient);
+
+/**
+ * @brief Parses a raw request, dispatches it to the matching chatServer_* handler and
+ * sends the response back to the client
+ *
+ * @params threadInfo ThreadInfo struct of the requesting connection
+ * @params buf Byte buffer of the request
+ * @params bytes Size of the byte buffer
+ */
+void chatServer_handleRequest(ThreadInfo *threadInfo, unsigned char *buf, int bytes);
+
+/**
+ * @brief Returns the number of requests handled since the server started
+ */
+long chatServer_requestCount();
+
+/**
+ * @brief Cuts received bytes into packets and handles each complete one in order.
+ * A trailing partial packet is kept until the rest of it arrives.
+ *
+ * @params threadInfo ThreadInfo struct of the receiving connection
+ * @params bytes Bytes received from the socket
+ * @params len Number of bytes received
+ * @returns 0 on success, -1 if the stream is malformed and the connection should be closed
+ */
+int chatServer_handleStream(ThreadInfo *threadInfo, unsigned char *bytes, int len);
+
+/**
+ * @brief Counts a connection a backend accepted
+ *
+ * @params threadInfo ThreadInfo struct of the new connection
+ */
+void chatServer_connect(ThreadInfo *threadInfo);
+
+/**
+ * @brief Removes a connection that dropped without sending EXIT from all of its sessions
+ *
+ * @params threadInfo ThreadInfo struct of the dropped connection
+ */
+void chatServer_disconnect(ThreadInfo *threadInfo);
 
 #endif
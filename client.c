@@ -16,6 +16,9 @@ enum STATE
 	insession,
 };
 
+/* Line that ends a /paste */
+#define PASTE_TERMINATOR "."
+
 void show_help();
 
 int main()
@@ -115,6 +118,26 @@ int main()
 					printf("Error listing sessions\n");
 				}
 			}
+			else if (strcmp(token, "stats") == 0 && tokenCount == 1)
+			{
+				int ret = chatclient_stats(sess);
+				if (ret != 0) {
+					printf("Error getting stats\n");
+				}
+			}
+			else if (strcmp(token, "paste") == 0 && tokenCount == 1)
+			{
+				if (currentState != insession) {
+					printf("Not in a session.\n");
+				}
+				else {
+					// Everything up to a line with just the terminator is one message
+					printf("Pasting, end with a line holding only %s\n", PASTE_TERMINATOR);
+					if (chatclient_sendStream(sess, stdin, PASTE_TERMINATOR) < 0) {
+						printf("Error sending message.\n");
+					}
+				}
+			}
 			else if (strcmp(token, "switchtab") == 0 && (tokenCount == 1 || tokenCount == 2)) {
 				// Accept either /switchtab to cycle through, or /switchtab <tab> to jump to specified
 			    int sessionVal;
@@ -191,5 +214,7 @@ void show_help()
 	printf("\t/createsession <sessionID>\n");
 	printf("\t/switchtab <tab (optional)>\n");
 	printf("\t/list\n");
+	printf("\t/stats\n");
+	printf("\t/paste (send the following lines as one message, up to a line with only %s)\n", PASTE_TERMINATOR);
 	printf("\t/quit\n");
 }
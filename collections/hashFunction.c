@@ -0,0 +1,215 @@
+//
+// Hash function implementation
+
+#include "hashFunction.h"
+#include <stdint.h>
+#include <string.h>
+#include <stdio.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/random.h>
+
+const unsigned int fnv_prime = 0x01000193;
+const unsigned int fnv_seed = 0x811C9DC5;
+
+/* wyhash's default secret, the seed is what varies per process */
+static const uint64_t wySecret[4] = {
+	0x2d358dccaa6c78a5ULL, 0x8bb84b93962eacc9ULL, 0x4b33a62ed433d4a3ULL, 0x4d5a2da51de1aa47ULL
+};
+
+static uint64_t sipKey[2];
+static uint64_t wySeed;
+static pthread_once_t keyOnce = PTHREAD_ONCE_INIT;
+
+/**
+ * @brief Draws the per-process keys, falling back to the clock and pid when the kernel
+ * has no entropy to give
+ */
+static void hf_initKeys() {
+	uint64_t seed[3];
+	if (getrandom(seed, sizeof(seed), 0) != sizeof(seed)) {
+		fprintf(stderr, "getrandom failed, hash keys are predictable\n");
+		struct timespec ts;
+		clock_gettime(CLOCK_REALTIME, &ts);
+		seed[0] = ts.tv_nsec * 0x9E3779B97F4A7C15ULL ^ getpid();
+		seed[1] = ts.tv_sec * 0xC2B2AE3D27D4EB4FULL ^ seed[0];
+		seed[2] = seed[0] ^ seed[1] << 1;
+	}
+	sipKey[0] = seed[0];
+	sipKey[1] = seed[1];
+	wySeed = seed[2];
+}
+
+/**
+ * @brief Loads 8 bytes as a little endian integer
+ */
+static inline uint64_t hf_read64(const unsigned char *p) {
+	uint64_t v;
+	memcpy(&v, p, sizeof(v));
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+	v = __builtin_bswap64(v);
+#endif
+	return v;
+}
+
+static inline uint64_t hf_read32(const unsigned char *p) {
+	uint32_t v;
+	memcpy(&v, p, sizeof(v));
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+	v = __builtin_bswap32(v);
+#endif
+	return v;
+}
+
+#define ROTL(x, b) (((x) << (b)) | ((x) >> (64 - (b))))
+
+#define SIPROUND \
+	do { \
+		v0 += v1; v1 = ROTL(v1, 13); v1 ^= v0; v0 = ROTL(v0, 32); \
+		v2 += v3; v3 = ROTL(v3, 16); v3 ^= v2; \
+		v0 += v3; v3 = ROTL(v3, 21); v3 ^= v0; \
+		v2 += v1; v1 = ROTL(v1, 17); v1 ^= v2; v2 = ROTL(v2, 32); \
+	} while (0)
+
+/**
+ * @brief SipHash with one compression and three finalization rounds
+ */
+static uint64_t hf_siphash13(const unsigned char *data, size_t len, const uint64_t key[2]) {
+	uint64_t v0 = 0x736f6d6570736575ULL ^ key[0];
+	uint64_t v1 = 0x646f72616e646f6dULL ^ key[1];
+	uint64_t v2 = 0x6c7967656e657261ULL ^ key[0];
+	uint64_t v3 = 0x7465646279746573ULL ^ key[1];
+	const unsigned char *end = data + (len & ~(size_t)7);
+
+	for (; data != end; data += 8) {
+		uint64_t m = hf_read64(data);
+		v3 ^= m;
+		SIPROUND;
+		v0 ^= m;
+	}
+
+	// Last block holds the remaining bytes and the length in the top byte
+	uint64_t b = (uint64_t)len << 56;
+	switch (len & 7) {
+		case 7: b |= (uint64_t)data[6] << 48; /* fall through */
+		case 6: b |= (uint64_t)data[5] << 40; /* fall through */
+		case 5: b |= (uint64_t)data[4] << 32; /* fall through */
+		case 4: b |= (uint64_t)data[3] << 24; /* fall through */
+		case 3: b |= (uint64_t)data[2] << 16; /* fall through */
+		case 2: b |= (uint64_t)data[1] << 8; /* fall through */
+		case 1: b |= (uint64_t)data[0];
+	}
+	v3 ^= b;
+	SIPROUND;
+	v0 ^= b;
+
+	v2 ^= 0xff;
+	SIPROUND;
+	SIPROUND;
+	SIPROUND;
+	return v0 ^ v1 ^ v2 ^ v3;
+}
+
+/**
+ * @brief 64x64 to 128 bit multiply, folded back to 64 bits
+ */
+static inline uint64_t hf_wymix(uint64_t a, uint64_t b) {
+	__uint128_t r = (__uint128_t)a * b;
+	return (uint64_t)r ^ (uint64_t)(r >> 64);
+}
+
+/**
+ * @brief wyhash final4
+ */
+static uint64_t hf_wyhash64(const unsigned char *p, size_t len, uint64_t seed) {
+	uint64_t a, b;
+	seed ^= hf_wymix(seed ^ wySecret[0], wySecret[1]);
+
+	if (len <= 16) {
+		if (len >= 4) {
+			size_t mid = (len >> 3) << 2;
+			a = (hf_read32(p) << 32) | hf_read32(p + mid);
+			b = (hf_read32(p + len - 4) << 32) | hf_read32(p + len - 4 - mid);
+		}
+		else if (len > 0) {
+			a = ((uint64_t)p[0] << 16) | ((uint64_t)p[len >> 1] << 8) | p[len - 1];
+			b = 0;
+		}
+		else {
+			a = b = 0;
+		}
+	}
+	else {
+		size_t i = len;
+		if (i >= 48) {
+			uint64_t see1 = seed, see2 = seed;
+			do {
+				seed = hf_wymix(hf_read64(p) ^ wySecret[1], hf_read64(p + 8) ^ seed);
+				see1 = hf_wymix(hf_read64(p + 16) ^ wySecret[2], hf_read64(p + 24) ^ see1);
+				see2 = hf_wymix(hf_read64(p + 32) ^ wySecret[3], hf_read64(p + 40) ^ see2);
+				p += 48;
+				i -= 48;
+			} while (i >= 48);
+			seed ^= see1 ^ see2;
+		}
+		while (i > 16) {
+			seed = hf_wymix(hf_read64(p) ^ wySecret[1], hf_read64(p + 8) ^ seed);
+			i -= 16;
+			p += 16;
+		}
+		a = hf_read64(p + i - 16);
+		b = hf_read64(p + i - 8);
+	}
+
+	a ^= wySecret[1];
+	b ^= seed;
+	__uint128_t r = (__uint128_t)a * b;
+	a = (uint64_t)r;
+	b = (uint64_t)(r >> 64);
+	return hf_wymix(a ^ wySecret[0] ^ len, b ^ wySecret[1]);
+}
+
+/**
+ * @brief SipHash-1-3 with the per-process key. Use it for keys clients choose, like
+ * session names, where a known function lets them build colliding keys on purpose.
+ *
+ * @params key Key to hash
+ * @returns Low 32 bits of the 64 bit SipHash
+ */
+unsigned int
+hf_siphash(const char *key) {
+	pthread_once(&keyOnce, hf_initKeys);
+	return (unsigned int)hf_siphash13((const unsigned char *)key, strlen(key), sipKey);
+}
+
+/**
+ * @brief wyhash seeded with the per-process key. Several times faster than SipHash on
+ * short keys but not designed to hold up against someone probing for collisions, so
+ * only use it for keys the server controls, like the user list it loads.
+ *
+ * @params key Key to hash
+ * @returns Low 32 bits of the 64 bit wyhash
+ */
+unsigned int
+hf_wyhash(const char *key) {
+	pthread_once(&keyOnce, hf_initKeys);
+	return (unsigned int)hf_wyhash64((const unsigned char *)key, strlen(key), wySeed);
+}
+
+/**
+ * @brief Unkeyed FNV-1a, kept for comparison in the benchmarks. Colliding keys for it
+ * are easy to generate, don't use it for a table clients can insert into.
+ *
+ * @params key Key to hash
+ * @returns uint32_t of the hash
+ */
+unsigned int
+hf_fnv1a(const char *key) {
+	const char *ptr = key;
+	unsigned int hash = fnv_seed;
+	while (*ptr) {
+		hash = (hash ^ (unsigned char)*ptr++) * fnv_prime;
+	}
+	return hash;
+}
@@ -0,0 +1,48 @@
+//
+// Hash function header
+//
+// String hashes for HashTable. Both keyed hashes use a key drawn at random once per
+// process, so hash values differ between runs and can't be precomputed offline.
+
+
+#pragma once
+#ifndef HASHFUNCTION_H_
+#define HASHFUNCTION_H_
+
+/**
+ * @brief Hashes a NUL terminated key to 32 bits
+ */
+typedef unsigned int (*HashFunction)(const char *key);
+
+/**
+ * @brief SipHash-1-3 with the per-process key. Use it for keys clients choose, like
+ * session names, where a known function lets them build colliding keys on purpose.
+ *
+ * @params key Key to hash
+ * @returns Low 32 bits of the 64 bit SipHash
+ */
+unsigned int
+hf_siphash(const char *key);
+
+/**
+ * @brief wyhash seeded with the per-process key. Several times faster than SipHash on
+ * short keys but not designed to hold up against someone probing for collisions, so
+ * only use it for keys the server controls, like the user list it loads.
+ *
+ * @params key Key to hash
+ * @returns Low 32 bits of the 64 bit wyhash
+ */
+unsigned int
+hf_wyhash(const char *key);
+
+/**
+ * @brief Unkeyed FNV-1a, kept for comparison in the benchmarks. Colliding keys for it
+ * are easy to generate, don't use it for a table clients can insert into.
+ *
+ * @params key Key to hash
+ * @returns uint32_t of the hash
+ */
+unsigned int
+hf_fnv1a(const char *key);
+
+#endif
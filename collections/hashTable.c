@@ -1,46 +1,247 @@
 //
-// HashTable with LinkedList implementation
+// Open addressing HashTable implementation
+//
+// Entries live in one array and are linked in insertion order. A separate index of
+// control bytes and entry numbers is probed a group of HT_GROUP_SIZE control bytes at
+// a time. When the index fills up a bigger one is allocated and the old one is moved
+// over a few slots per insert or remove, so no single call rehashes the whole table.
 
 #include "hashTable.h"
 #include <stdlib.h>
 #include <string.h>
+#include <stdint.h>
+
+/* Control byte values, full slots hold the low 7 bits of the hash */
+#define CTRL_EMPTY 0x80
+#define CTRL_DELETED 0xFE
+
+/* Old index slots moved per insert or remove during a resize */
+#define MIGRATE_STEP 16
+
+#define LSBS 0x0101010101010101ULL
+#define MSBS 0x8080808080808080ULL
+
+/**
+ * @brief Loads a group of control bytes, byte i of the group in bits 8i..8i+7
+ */
+static uint64_t ht_loadGroup(const unsigned char *control) {
+	uint64_t group;
+	memcpy(&group, control, sizeof(group));
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+	group = __builtin_bswap64(group);
+#endif
+	return group;
+}
+
+/**
+ * @brief Marks the high bit of every byte equal to h2. May also mark a byte right
+ * after a real match, candidates are confirmed against the stored hash.
+ */
+static uint64_t ht_matchByte(uint64_t group, unsigned char h2) {
+	uint64_t x = group ^ (LSBS * h2);
+	return (x - LSBS) & ~x & MSBS;
+}
+
+/**
+ * @brief Marks the high bit of every empty byte
+ */
+static uint64_t ht_matchEmpty(uint64_t group) {
+	return group & ~(group << 6) & MSBS;
+}
+
+/**
+ * @brief Marks the high bit of every empty or deleted byte
+ */
+static uint64_t ht_matchFree(uint64_t group) {
+	return group & MSBS;
+}
+
+static void ht_indexInit(HashIndex *index, int limit) {
+	index->limit = limit;
+	index->used = 0;
+	index->deleted = 0;
+	index->control = (unsigned char *)malloc(limit);
+	memset(index->control, CTRL_EMPTY, limit);
+	index->slots = (int *)malloc(limit * sizeof(int));
+}
 
-const unsigned int fnv_prime = 0x01000193;
-const unsigned int fnv_seed = 0x811C9DC5;
+static void ht_indexFree(HashIndex *index) {
+	free(index->control);
+	free(index->slots);
+	memset(index, 0, sizeof(*index));
+}
 
 /**
- * @brief Calculates the hash of the input key using the FNV-1a hash algorithm
+ * @brief Finds the index slot holding the key
  *
- * @params input Key to hash
- * @returns uint32_t of the hash
+ * @returns Slot number, -1 if the key isn't in this index
  */
-unsigned int 
-hash(char *input) {
-	char *ptr = input;
-	unsigned int hash = fnv_seed;
-	while (*ptr) {
-		hash = (*ptr++^fnv_seed) * fnv_prime;
+static int ht_indexFind(HashTable *table, HashIndex *index, char *key, unsigned int hashed) {
+	if (index->limit == 0) {
+		return -1;
 	}
-	return hash;
+
+	unsigned char h2 = hashed & 0x7F;
+	int groupMask = index->limit / HT_GROUP_SIZE - 1;
+	int group = (hashed >> 7) & groupMask;
+	int step;
+
+	// Triangular probing visits every group of a power of two sized index
+	for (step = 1; step <= groupMask + 1; step++) {
+		uint64_t ctrl = ht_loadGroup(index->control + group * HT_GROUP_SIZE);
+		uint64_t matches = ht_matchByte(ctrl, h2);
+		while (matches != 0) {
+			int slot = group * HT_GROUP_SIZE + __builtin_ctzll(matches) / 8;
+			HashEntry *entry = &table->entries[index->slots[slot]];
+			if (index->control[slot] == h2 && entry->hash == hashed && strcmp(entry->key, key) == 0) {
+				return slot;
+			}
+			matches &= matches - 1;
+		}
+		// Keys are never placed past a group that still has an empty slot
+		if (ht_matchEmpty(ctrl) != 0) {
+			return -1;
+		}
+		group = (group + step) & groupMask;
+	}
+	return -1;
+}
+
+/**
+ * @brief Places an entry number in the first free slot of its probe sequence
+ */
+static void ht_indexInsert(HashIndex *index, unsigned int hashed, int entry) {
+	int groupMask = index->limit / HT_GROUP_SIZE - 1;
+	int group = (hashed >> 7) & groupMask;
+	int step = 1;
+
+	uint64_t free;
+	while ((free = ht_matchFree(ht_loadGroup(index->control + group * HT_GROUP_SIZE))) == 0) {
+		group = (group + step++) & groupMask;
+	}
+
+	int slot = group * HT_GROUP_SIZE + __builtin_ctzll(free) / 8;
+	if (index->control[slot] == CTRL_DELETED) {
+		index->deleted--;
+	}
+	else {
+		index->used++;
+	}
+	index->control[slot] = hashed & 0x7F;
+	index->slots[slot] = entry;
+}
+
+/**
+ * @brief Clears a slot. It can go back to empty when its group has an empty slot,
+ * since then no probe ever continued past the group.
+ */
+static void ht_indexErase(HashIndex *index, int slot) {
+	int groupStart = slot - slot % HT_GROUP_SIZE;
+	if (ht_matchEmpty(ht_loadGroup(index->control + groupStart)) != 0) {
+		index->control[slot] = CTRL_EMPTY;
+		index->used--;
+	}
+	else {
+		index->control[slot] = CTRL_DELETED;
+		index->deleted++;
+	}
+}
+
+/**
+ * @brief Moves up to count slots of the old index into the current one, freeing the
+ * old index once it's empty
+ */
+static void ht_migrate(HashTable *table, int count) {
+	HashIndex *old = &table->oldIndex;
+	while (old->limit != 0 && count-- > 0) {
+		int slot = table->migrated++;
+		if (!(old->control[slot] & CTRL_EMPTY)) {
+			int entry = old->slots[slot];
+			ht_indexInsert(&table->index, table->entries[entry].hash, entry);
+			// Moved keys must not be found in the old index again
+			old->control[slot] = CTRL_DELETED;
+		}
+		if (table->migrated == old->limit) {
+			ht_indexFree(old);
+			table->migrated = 0;
+		}
+	}
+}
+
+/**
+ * @brief Starts an incremental resize once the index is 7/8 full, counting deleted
+ * slots. The new index is sized for twice the live elements, so heavy churn rebuilds
+ * at the same size instead of growing.
+ */
+static void ht_reserve(HashTable *table) {
+	HashIndex *index = &table->index;
+	if ((index->used + 1) * 8 <= index->limit * 7) {
+		return;
+	}
+
+	int limit = HT_GROUP_SIZE;
+	while (limit < (table->elements + 1) * 2) {
+		limit <<= 1;
+	}
+
+	// Only one resize runs at a time. A shrink can leave too many old slots to move
+	// before the small new index fills, so then everything is rebuilt in one pass.
+	if (table->oldIndex.limit != 0) {
+		ht_indexFree(&table->oldIndex);
+		ht_indexFree(index);
+		ht_indexInit(index, limit);
+		table->migrated = 0;
+		int entry;
+		for (entry = table->head; entry >= 0; entry = table->entries[entry].next) {
+			ht_indexInsert(index, table->entries[entry].hash, entry);
+		}
+		return;
+	}
+
+	table->oldIndex = *index;
+	table->migrated = 0;
+	ht_indexInit(index, limit);
 }
 
 /**
  * @brief Initializes a hash table with the specified capacity
  *
- * @params bucketCount Specified number of buckets for the hash table
+ * @params bucketCount Number of elements expected, the table grows past it as needed
  * @returns Pointer to an initialized HashTable
  */
 HashTable *
 ht_init(int bucketCount) {
+	return ht_initWithHash(bucketCount, hf_siphash);
+}
+
+/**
+ * @brief Initializes a hash table that hashes keys with the given function. ht_init
+ * uses hf_siphash, pick a faster function only when clients can't choose the keys.
+ *
+ * @params bucketCount Number of elements expected, the table grows past it as needed
+ * @params hashFunction Function hashing the keys
+ * @returns Pointer to an initialized HashTable
+ */
+HashTable *
+ht_initWithHash(int bucketCount, HashFunction hashFunction) {
 	HashTable *table = (HashTable *)calloc(1, sizeof(HashTable));
-	table->table = (HashEntry **)calloc(bucketCount, sizeof(HashEntry *));
-	table->limit = bucketCount;
+	table->hashFunction = hashFunction;
+	table->capacity = bucketCount > 0 ? bucketCount : 1;
+	table->entries = (HashEntry *)malloc(table->capacity * sizeof(HashEntry));
+	table->freeList = table->head = table->tail = -1;
+
+	int limit = HT_GROUP_SIZE;
+	while (limit * 7 < table->capacity * 8) {
+		limit <<= 1;
+	}
+	ht_indexInit(&table->index, limit);
 
 	return table;
 }
 
 /**
- * @brief Inserts the data into the hash table with the given key
+ * @brief Inserts the data into the hash table with the given key, replacing the data
+ * if the key is already present. The key is not copied.
  *
  * @params table HashTable to insert into
  * @params key Key of the element to insert
@@ -48,43 +249,57 @@ ht_init(int bucketCount) {
  */
 void 
 ht_insert(HashTable *table, char *key, void *data) {
-	HashEntry *entry = (HashEntry *)calloc(1, sizeof(HashEntry));
-	entry->key = key;
-	entry->data = data;
+	unsigned int hashedKey = table->hashFunction(key);
 
-	// Calculate the hash
-	unsigned int hashedKey = hash(key);
+	int slot = ht_indexFind(table, &table->index, key, hashedKey);
+	HashIndex *index = &table->index;
+	if (slot < 0) {
+		index = &table->oldIndex;
+		slot = ht_indexFind(table, index, key, hashedKey);
+	}
+	if (slot >= 0) {
+		table->entries[index->slots[slot]].data = data;
+		return;
+	}
 
-	// First insert into the end of the linked list
-	if (table->head == NULL) {
-		table->head = table->tail = entry;
+	ht_reserve(table);
+
+	// Reuse a removed entry before growing the array
+	int entry = table->freeList;
+	if (entry >= 0) {
+		table->freeList = table->entries[entry].prev;
 	}
 	else {
-		table->tail->next = entry;
-		entry->prev = table->tail;
-		table->tail = entry;
+		if (table->allocated == table->capacity) {
+			table->capacity *= 2;
+			table->entries = (HashEntry *)realloc(table->entries, table->capacity * sizeof(HashEntry));
+		}
+		entry = table->allocated++;
 	}
 
-	// Determine the position in the hash table
-	unsigned int index = hashedKey%table->limit;
-	// If the bucket is empty, put it as the head
-	if (table->table[index] == NULL) {
-		table->table[index] = entry;
+	// Append to the end of the insertion order
+	HashEntry *newEntry = &table->entries[entry];
+	newEntry->key = key;
+	newEntry->data = data;
+	newEntry->hash = hashedKey;
+	newEntry->next = -1;
+	newEntry->prev = table->tail;
+	if (table->tail >= 0) {
+		table->entries[table->tail].next = entry;
 	}
 	else {
-		// Otherwise traverse until the end
-		HashEntry *bucket = table->table[index];
-		while (bucket->bucket_next != NULL) {
-			bucket = bucket->bucket_next;
-		}
-		bucket->bucket_next = entry;
+		table->head = entry;
 	}
-	// Increment the element count
+	table->tail = entry;
+
+	ht_indexInsert(&table->index, hashedKey, entry);
 	table->elements++;
+	ht_migrate(table, MIGRATE_STEP);
 }
 
 /**
- * @brief Searches the hash table for the element with the key
+ * @brief Searches the hash table for the element with the key. Never modifies the
+ * table, so concurrent lookups only need a shared lock.
  *
  * @params table HashTable to search
  * @params key Key of the element to find
@@ -94,25 +309,18 @@ void*
 ht_find(HashTable *table, char *key) {
 	if (key == NULL)
 	    return NULL;
-	// Calculate the hash
-	unsigned int hashedKey = hash(key);
+	unsigned int hashedKey = table->hashFunction(key);
 
-	// Determine the position in the hash table
-	unsigned int index = hashedKey%table->limit;
-	// If the bucket is empty, put it as the head
-	if (table->table[index] == NULL) {
-		return NULL;
+	int slot = ht_indexFind(table, &table->index, key, hashedKey);
+	if (slot >= 0) {
+		return table->entries[table->index.slots[slot]].data;
 	}
-	else {
-		// Otherwise traverse until found or null
-		HashEntry *bucket = table->table[index];
-		while (bucket != NULL && strcmp(bucket->key, key) != 0) {
-			bucket = bucket->bucket_next;
-		}
-
-		if (bucket == NULL) return NULL;
-		return bucket->data;
+	// Keys not moved yet by a running resize are still in the old index
+	slot = ht_indexFind(table, &table->oldIndex, key, hashedKey);
+	if (slot >= 0) {
+		return table->entries[table->oldIndex.slots[slot]].data;
 	}
+	return NULL;
 }
 
 /**
@@ -125,49 +333,72 @@ void
 ht_remove(HashTable *table, char *key) {
 	if (key == NULL)
 		return;
+	unsigned int hashedKey = table->hashFunction(key);
+
+	HashIndex *index = &table->index;
+	int slot = ht_indexFind(table, index, key, hashedKey);
+	if (slot < 0) {
+		index = &table->oldIndex;
+		slot = ht_indexFind(table, index, key, hashedKey);
+	}
+	if (slot < 0) {
+		return;
+	}
 
-	// Calculate hash
-	unsigned int hashedKey = hash(key);
-	// Get index, bounded by table limit
-	unsigned int index = hashedKey % table->limit;
+	int entry = index->slots[slot];
+	ht_indexErase(index, slot);
 
-	// Element at index empty, does not exist
-	if(table->table[index] == NULL) return;
+	// Unlink from the insertion order. next is kept so iterators can step past it.
+	HashEntry *removed = &table->entries[entry];
+	if (removed->prev >= 0) {
+		table->entries[removed->prev].next = removed->next;
+	}
 	else {
-		// Traverse the bucket
-		HashEntry *bucket = table->table[index];
-		
-		while(bucket != NULL && strcmp(bucket->key, key) != 0) {
-			bucket = bucket->bucket_next;
-		}
+		table->head = removed->next;
+	}
+	if (removed->next >= 0) {
+		table->entries[removed->next].prev = removed->prev;
+	}
+	else {
+		table->tail = removed->prev;
+	}
+	removed->key = NULL;
+	removed->data = NULL;
+	removed->prev = table->freeList;
+	table->freeList = entry;
 
-		// Swap both the bucket pointers, and the linked list pointers
-		if (bucket != NULL) {
-			if (bucket->bucket_prev != NULL) {
-				bucket->bucket_prev->bucket_next = bucket->next;
-			}
-			else {
-				table->table[index] = NULL;
-			}
-			if (bucket->bucket_next != NULL) {
-				bucket->bucket_next->bucket_prev = bucket->prev;
-			}
-			if (bucket->next != NULL) {
-				bucket->next->prev = bucket->prev;
-			}
-			if (bucket->prev != NULL) {
-				bucket->prev->next = bucket->next;
-			}
-			if (table->head == bucket) {
-				table->head = bucket->next;
-			}
-			if (table->tail == bucket) {
-				table->tail = bucket->prev;
-			}
-			free(bucket);
-			return;
-		}
+	table->elements--;
+	ht_migrate(table, MIGRATE_STEP);
+}
+
+/**
+ * @brief Returns the oldest element for iterating in insertion order. Entry pointers
+ * stay valid until the next insert.
+ *
+ * @params table HashTable to iterate
+ * @returns First HashEntry, NULL if the table is empty
+ */
+HashEntry *
+ht_first(HashTable *table) {
+	return table->head >= 0 ? &table->entries[table->head] : NULL;
+}
+
+/**
+ * @brief Returns the element inserted after the given one. The given entry may have
+ * been removed since it was returned, as long as nothing was inserted.
+ *
+ * @params table HashTable to iterate
+ * @params entry Current HashEntry
+ * @returns Next HashEntry, NULL at the end
+ */
+HashEntry *
+ht_next(HashTable *table, HashEntry *entry) {
+	int next = entry->next;
+	// Skip entries that were removed after the caller got to them
+	while (next >= 0 && table->entries[next].key == NULL) {
+		next = table->entries[next].next;
 	}
+	return next >= 0 ? &table->entries[next] : NULL;
 }
 
 /**
@@ -178,13 +409,8 @@ ht_remove(HashTable *table, char *key) {
 void 
 ht_free(HashTable *table) {
 	//TODO: Maybe have a free delegate since the void * data may not be pointing to malloced memory
-    HashEntry *node = table->head;
-
-	while(node != NULL) {
-	    HashEntry *curr = node;
-	    node = curr->next;
-
-	    free(curr);
-	}
+	ht_indexFree(&table->index);
+	ht_indexFree(&table->oldIndex);
+	free(table->entries);
 	free(table);
-}
\ No newline at end of file
+}
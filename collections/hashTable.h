@@ -1,48 +1,81 @@
 //
-// HashTable with LinkedList header
+// Open addressing HashTable header
 
 
 #pragma once
 #ifndef HASHTABLE_H_
 #define HASHTABLE_H_
 
+#include "hashFunction.h"
+
+/* Control bytes examined per probe step */
+#define HT_GROUP_SIZE 8
+
 typedef struct _HashEntry {
 	char *key;
 	void *data;
-	struct _HashEntry *next;
-	struct _HashEntry *prev;
-	struct _HashEntry *bucket_next;
-	struct _HashEntry *bucket_prev;
+	/* Full hash of the key, compared before the key and reused when resizing */
+	unsigned int hash;
+	/* Neighbours in insertion order, -1 for none. Free entries chain through prev. */
+	int next;
+	int prev;
 } HashEntry;
 
+/**
+ * @brief Open addressing index into the entries array. Each slot has a control byte
+ * that is empty, deleted, or the low 7 bits of the entry's hash, so a probe only
+ * touches an entry when those bits match.
+ */
+typedef struct _HashIndex {
+	unsigned char *control;
+	int *slots;
+	int limit;
+	/* Full and deleted slots, deleted ones still lengthen probes */
+	int used;
+	int deleted;
+} HashIndex;
+
 typedef struct _HashTable {
-	HashEntry **table;
-	HashEntry *head;
-	HashEntry *tail;
+	/* Entries stored contiguously, linked in insertion order */
+	HashEntry *entries;
+	int capacity;
+	/* Entries handed out so far, free ones are reused first */
+	int allocated;
+	int freeList;
+	int head;
+	int tail;
 	int elements;
-	int limit;
+	HashIndex index;
+	/* Index being drained into the new one during an incremental resize */
+	HashIndex oldIndex;
+	/* Slots of oldIndex already moved */
+	int migrated;
+	HashFunction hashFunction;
 } HashTable;
 
 /**
- * @brief Calculates the hash of the input key using the FNV-1a hash algorithm
+ * @brief Initializes a hash table with the specified capacity
  *
- * @params input Key to hash
- * @returns uint32_t of the hash
+ * @params bucketCount Number of elements expected, the table grows past it as needed
+ * @returns Pointer to an initialized HashTable
  */
-unsigned int 
-hash(char *input);
+HashTable *
+ht_init(int bucketCount);
 
 /**
- * @brief Initializes a hash table with the specified capacity
+ * @brief Initializes a hash table that hashes keys with the given function. ht_init
+ * uses hf_siphash, pick a faster function only when clients can't choose the keys.
  *
- * @params bucketCount Specified number of buckets for the hash table
+ * @params bucketCount Number of elements expected, the table grows past it as needed
+ * @params hashFunction Function hashing the keys
  * @returns Pointer to an initialized HashTable
  */
 HashTable *
-ht_init(int bucketCount);
+ht_initWithHash(int bucketCount, HashFunction hashFunction);
 
 /**
- * @brief Inserts the data into the hash table with the given key
+ * @brief Inserts the data into the hash table with the given key, replacing the data
+ * if the key is already present. The key is not copied.
  *
  * @params table HashTable to insert into
  * @params key Key of the element to insert
@@ -52,7 +85,8 @@ void
 ht_insert(HashTable *table, char *key, void *data);
 
 /**
- * @brief Searches the hash table for the element with the key
+ * @brief Searches the hash table for the element with the key. Never modifies the
+ * table, so concurrent lookups only need a shared lock.
  *
  * @params table HashTable to search
  * @params key Key of the element to find
@@ -70,6 +104,27 @@ ht_find(HashTable *table, char *key);
 void 
 ht_remove(HashTable *table, char *key);
 
+/**
+ * @brief Returns the oldest element for iterating in insertion order. Entry pointers
+ * stay valid until the next insert.
+ *
+ * @params table HashTable to iterate
+ * @returns First HashEntry, NULL if the table is empty
+ */
+HashEntry *
+ht_first(HashTable *table);
+
+/**
+ * @brief Returns the element inserted after the given one. The given entry may have
+ * been removed since it was returned, as long as nothing was inserted.
+ *
+ * @params table HashTable to iterate
+ * @params entry Current HashEntry
+ * @returns Next HashEntry, NULL at the end
+ */
+HashEntry *
+ht_next(HashTable *table, HashEntry *entry);
+
 /**
  * @brief Frees all elements in the hash table
  *
@@ -78,4 +133,4 @@ ht_remove(HashTable *table, char *key);
 void 
 ht_free(HashTable *table);
 
-#endif
\ No newline at end of file
+#endif
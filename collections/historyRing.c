@@ -0,0 +1,195 @@
+//
+// History ring implementation
+
+
+#include "historyRing.h"
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+/**
+ * @brief Copies bytes into the ring at an offset past start, wrapping around the end
+ */
+static void hr_write(HistoryRing *ring, int offset, const unsigned char *bytes, int len) {
+	int position = (ring->start + offset) % ring->capacity;
+	int first = len < ring->capacity - position ? len : ring->capacity - position;
+	memcpy(ring->buffer + position, bytes, first);
+	memcpy(ring->buffer, bytes + first, len - first);
+}
+
+/**
+ * @brief Copies bytes out of the ring from an offset past start, wrapping around the end
+ */
+static void hr_read(HistoryRing *ring, int offset, unsigned char *bytes, int len) {
+	int position = (ring->start + offset) % ring->capacity;
+	int first = len < ring->capacity - position ? len : ring->capacity - position;
+	memcpy(bytes, ring->buffer + position, first);
+	memcpy(bytes + first, ring->buffer, len - first);
+}
+
+/**
+ * @brief Length of the record at an offset past start
+ */
+static int hr_recordAt(HistoryRing *ring, int offset) {
+	uint32_t recordBytes;
+	hr_read(ring, offset, (unsigned char *)&recordBytes, sizeof(recordBytes));
+	return (int)recordBytes;
+}
+
+/**
+ * @brief Drops the oldest record
+ */
+static void hr_dropOldest(HistoryRing *ring) {
+	int recordBytes = hr_recordAt(ring, 0);
+	ring->start = (ring->start + recordBytes) % ring->capacity;
+	ring->used -= recordBytes;
+	ring->count--;
+}
+
+/**
+ * @brief Moves the records into a buffer of the new capacity, oldest at the front
+ */
+static void hr_resize(HistoryRing *ring, int capacity) {
+	unsigned char *buffer = (unsigned char *)malloc(capacity);
+	if (ring->used > 0) {
+		hr_read(ring, 0, buffer, ring->used);
+	}
+	free(ring->buffer);
+	ring->buffer = buffer;
+	ring->capacity = capacity;
+	ring->start = 0;
+}
+
+/**
+ * @brief Initializes an empty ring, no buffer is allocated until a message arrives
+ *
+ * @params ring HistoryRing to initialize
+ * @params maxRecords Most messages kept
+ * @params maxBytes Most bytes the buffer grows to
+ */
+void
+hr_init(HistoryRing *ring, int maxRecords, int maxBytes) {
+	memset(ring, 0, sizeof(HistoryRing));
+	ring->maxRecords = maxRecords;
+	ring->maxBytes = maxBytes;
+}
+
+/**
+ * @brief Bytes a message takes in the ring
+ */
+int
+hr_recordSize(int sourceLen, int len) {
+	return HISTORY_RECORD_HEADER + sourceLen + len;
+}
+
+/**
+ * @brief Bytes the buffer would grow by to take a record without dropping any
+ *
+ * @params ring HistoryRing to add to
+ * @params recordBytes Size of the record, from hr_recordSize
+ * @returns Bytes to allocate, 0 if the record fits or the buffer can't grow
+ */
+int
+hr_growth(HistoryRing *ring, int recordBytes) {
+	int needed = ring->used + recordBytes;
+	if (needed <= ring->capacity || ring->capacity >= ring->maxBytes) {
+		return 0;
+	}
+	int capacity = ring->capacity > 0 ? ring->capacity * 2 : HISTORY_RING_MIN_CAPACITY;
+	while (capacity < needed && capacity < ring->maxBytes) {
+		capacity *= 2;
+	}
+	if (capacity > ring->maxBytes) {
+		capacity = ring->maxBytes;
+	}
+	return capacity - ring->capacity;
+}
+
+/**
+ * @brief Adds a message, dropping the oldest ones to make room
+ *
+ * @params ring HistoryRing to add to
+ * @params source Client that sent the message
+ * @params sourceLen Length of the source, below 256
+ * @params data Message data
+ * @params len Length of the data
+ * @params grow 1 to grow the buffer by hr_growth first
+ * @returns 0 if the message was added, -1 if it doesn't fit
+ */
+int
+hr_append(HistoryRing *ring, const unsigned char *source, int sourceLen, const unsigned char *data, int len, int grow) {
+	int recordBytes = hr_recordSize(sourceLen, len);
+	if (grow) {
+		int growth = hr_growth(ring, recordBytes);
+		if (growth > 0) {
+			hr_resize(ring, ring->capacity + growth);
+		}
+	}
+	if (recordBytes > ring->capacity || ring->maxRecords <= 0) {
+		return -1;
+	}
+
+	while (ring->count >= ring->maxRecords || ring->used + recordBytes > ring->capacity) {
+		hr_dropOldest(ring);
+	}
+	uint32_t header = (uint32_t)recordBytes;
+	unsigned char sourceByte = (unsigned char)sourceLen;
+	hr_write(ring, ring->used, (unsigned char *)&header, sizeof(header));
+	hr_write(ring, ring->used + sizeof(header), &sourceByte, 1);
+	hr_write(ring, ring->used + HISTORY_RECORD_HEADER, source, sourceLen);
+	hr_write(ring, ring->used + HISTORY_RECORD_HEADER + sourceLen, data, len);
+	ring->used += recordBytes;
+	ring->count++;
+	return 0;
+}
+
+/**
+ * @brief Calls the visitor on every message, oldest first
+ *
+ * @params ring HistoryRing to walk
+ * @params visitor Called once per message, the bytes are only valid during the call
+ * @params context Passed through to the visitor
+ */
+void
+hr_forEach(HistoryRing *ring, void (*visitor)(const unsigned char *source, int sourceLen,
+											   const unsigned char *data, int len, void *context),
+		   void *context) {
+	// Records that wrap around the end are copied out to hand them over in one piece
+	unsigned char *scratch = NULL;
+	int offset = 0;
+	while (offset < ring->used) {
+		int recordBytes = hr_recordAt(ring, offset);
+		int position = (ring->start + offset) % ring->capacity;
+		const unsigned char *record = ring->buffer + position;
+		if (position + recordBytes > ring->capacity) {
+			if (scratch == NULL) {
+				scratch = (unsigned char *)malloc(ring->capacity);
+			}
+			hr_read(ring, offset, scratch, recordBytes);
+			record = scratch;
+		}
+		int sourceLen = record[sizeof(uint32_t)];
+		visitor(record + HISTORY_RECORD_HEADER, sourceLen, record + HISTORY_RECORD_HEADER + sourceLen,
+				recordBytes - HISTORY_RECORD_HEADER - sourceLen, context);
+		offset += recordBytes;
+	}
+	free(scratch);
+}
+
+/**
+ * @brief Drops every message and frees the buffer
+ *
+ * @params ring HistoryRing to clear
+ * @returns Bytes freed
+ */
+int
+hr_clear(HistoryRing *ring) {
+	int freed = ring->capacity;
+	free(ring->buffer);
+	ring->buffer = NULL;
+	ring->capacity = 0;
+	ring->start = 0;
+	ring->used = 0;
+	ring->count = 0;
+	return freed;
+}
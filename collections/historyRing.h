@@ -0,0 +1,93 @@
+//
+// History ring header
+//
+// Most recent messages of a session, kept back to back in one contiguous buffer
+// that wraps around. The oldest messages are dropped to make room once the ring
+// holds its maximum number of messages or bytes. The buffer starts small and
+// doubles up to the byte limit, so quiet sessions don't hold the full limit.
+
+
+#pragma once
+#ifndef HISTORYRING_H_
+#define HISTORYRING_H_
+
+/* Bytes a ring allocates for its first message */
+#define HISTORY_RING_MIN_CAPACITY 1024
+
+/* Record length and source length in front of every message */
+#define HISTORY_RECORD_HEADER 5
+
+typedef struct _HistoryRing
+{
+	/* Records from start on, wrapping around the end of the buffer */
+	unsigned char *buffer;
+	int capacity;
+	int start;
+	int used;
+	int count;
+	int maxRecords;
+	int maxBytes;
+} HistoryRing;
+
+/**
+ * @brief Initializes an empty ring, no buffer is allocated until a message arrives
+ *
+ * @params ring HistoryRing to initialize
+ * @params maxRecords Most messages kept
+ * @params maxBytes Most bytes the buffer grows to
+ */
+void
+hr_init(HistoryRing *ring, int maxRecords, int maxBytes);
+
+/**
+ * @brief Bytes a message takes in the ring
+ */
+int
+hr_recordSize(int sourceLen, int len);
+
+/**
+ * @brief Bytes the buffer would grow by to take a record without dropping any
+ *
+ * @params ring HistoryRing to add to
+ * @params recordBytes Size of the record, from hr_recordSize
+ * @returns Bytes to allocate, 0 if the record fits or the buffer can't grow
+ */
+int
+hr_growth(HistoryRing *ring, int recordBytes);
+
+/**
+ * @brief Adds a message, dropping the oldest ones to make room
+ *
+ * @params ring HistoryRing to add to
+ * @params source Client that sent the message
+ * @params sourceLen Length of the source, below 256
+ * @params data Message data
+ * @params len Length of the data
+ * @params grow 1 to grow the buffer by hr_growth first
+ * @returns 0 if the message was added, -1 if it doesn't fit
+ */
+int
+hr_append(HistoryRing *ring, const unsigned char *source, int sourceLen, const unsigned char *data, int len, int grow);
+
+/**
+ * @brief Calls the visitor on every message, oldest first
+ *
+ * @params ring HistoryRing to walk
+ * @params visitor Called once per message, the bytes are only valid during the call
+ * @params context Passed through to the visitor
+ */
+void
+hr_forEach(HistoryRing *ring, void (*visitor)(const unsigned char *source, int sourceLen,
+											   const unsigned char *data, int len, void *context),
+		   void *context);
+
+/**
+ * @brief Drops every message and frees the buffer
+ *
+ * @params ring HistoryRing to clear
+ * @returns Bytes freed
+ */
+int
+hr_clear(HistoryRing *ring);
+
+#endif
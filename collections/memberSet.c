@@ -0,0 +1,172 @@
+//
+// Member set implementation
+
+
+#include "memberSet.h"
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+/* Members the set starts with room for, the index has twice as many slots */
+#define MEMBERSET_INITIAL_CAPACITY 4
+
+/**
+ * @brief Home slot of a pointer. Allocations are aligned, so the low bits carry no
+ * information and the multiply spreads the rest.
+ */
+static inline int ms_home(MemberSet *set, void *member) {
+	uint64_t h = (uint64_t)(uintptr_t)member * 0x9E3779B97F4A7C15ULL;
+	return (int)(h >> 32) & set->slotMask;
+}
+
+/**
+ * @brief Finds the index slot holding the member
+ *
+ * @returns Slot number, -1 if the member isn't in the set
+ */
+static int ms_findSlot(MemberSet *set, void *member) {
+	int slot = ms_home(set, member);
+	while (set->slots[slot] >= 0) {
+		if (set->members[set->slots[slot]] == member) {
+			return slot;
+		}
+		slot = (slot + 1) & set->slotMask;
+	}
+	return -1;
+}
+
+/**
+ * @brief Puts a member's position in the first empty slot of its probe sequence
+ */
+static void ms_placeSlot(MemberSet *set, int position) {
+	int slot = ms_home(set, set->members[position]);
+	while (set->slots[slot] >= 0) {
+		slot = (slot + 1) & set->slotMask;
+	}
+	set->slots[slot] = position;
+}
+
+/**
+ * @brief Doubles the member array and rebuilds the index at twice its size
+ */
+static void ms_grow(MemberSet *set) {
+	set->capacity *= 2;
+	set->members = (void **)realloc(set->members, set->capacity * sizeof(void *));
+
+	free(set->slots);
+	set->slotMask = set->capacity * 2 - 1;
+	set->slots = (int *)malloc(set->capacity * 2 * sizeof(int));
+	memset(set->slots, 0xFF, set->capacity * 2 * sizeof(int));
+
+	int i;
+	for (i = 0; i < set->count; i++) {
+		ms_placeSlot(set, i);
+	}
+}
+
+/**
+ * @brief Empties a slot, moving later members of the probe run back so lookups never
+ * stop early at the hole
+ */
+static void ms_eraseSlot(MemberSet *set, int hole) {
+	int slot = hole;
+	while (1) {
+		slot = (slot + 1) & set->slotMask;
+		if (set->slots[slot] < 0) {
+			break;
+		}
+		// Members whose home lies cyclically in (hole, slot] must stay behind the hole
+		int home = ms_home(set, set->members[set->slots[slot]]);
+		if (((slot - home) & set->slotMask) >= ((slot - hole) & set->slotMask)) {
+			set->slots[hole] = set->slots[slot];
+			hole = slot;
+		}
+	}
+	set->slots[hole] = -1;
+}
+
+/**
+ * @brief Initializes an empty member set
+ */
+MemberSet *
+ms_init() {
+	MemberSet *set = (MemberSet *)calloc(1, sizeof(MemberSet));
+	set->capacity = MEMBERSET_INITIAL_CAPACITY;
+	set->members = (void **)malloc(set->capacity * sizeof(void *));
+	set->slotMask = set->capacity * 2 - 1;
+	set->slots = (int *)malloc(set->capacity * 2 * sizeof(int));
+	memset(set->slots, 0xFF, set->capacity * 2 * sizeof(int));
+	return set;
+}
+
+/**
+ * @brief Adds the member to the set
+ *
+ * @params set MemberSet to insert into
+ * @params member Pointer to add
+ * @returns 0 if it was added, -1 if it was already in the set
+ */
+int
+ms_insert(MemberSet *set, void *member) {
+	if (ms_findSlot(set, member) >= 0) {
+		return -1;
+	}
+	if (set->count == set->capacity) {
+		ms_grow(set);
+	}
+	set->members[set->count] = member;
+	ms_placeSlot(set, set->count);
+	set->count++;
+	return 0;
+}
+
+/**
+ * @brief Removes the member from the set. The last member takes its place, so the
+ * iteration order changes.
+ *
+ * @params set MemberSet to remove from
+ * @params member Pointer to remove
+ * @returns 0 if it was removed, -1 if it wasn't in the set
+ */
+int
+ms_remove(MemberSet *set, void *member) {
+	int slot = ms_findSlot(set, member);
+	if (slot < 0) {
+		return -1;
+	}
+	int position = set->slots[slot];
+	ms_eraseSlot(set, slot);
+
+	// Fill the gap with the last member and point its slot at the new position
+	int last = --set->count;
+	if (position != last) {
+		int lastSlot = ms_findSlot(set, set->members[last]);
+		set->members[position] = set->members[last];
+		set->slots[lastSlot] = position;
+	}
+	return 0;
+}
+
+/**
+ * @brief Checks whether the member is in the set
+ *
+ * @params set MemberSet to search
+ * @params member Pointer to look for
+ * @returns 1 if it's in the set, 0 if not
+ */
+int
+ms_contains(MemberSet *set, void *member) {
+	return ms_findSlot(set, member) >= 0;
+}
+
+/**
+ * @brief Frees the set, not the members
+ *
+ * @params set MemberSet to free
+ */
+void
+ms_free(MemberSet *set) {
+	free(set->members);
+	free(set->slots);
+	free(set);
+}
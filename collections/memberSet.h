@@ -0,0 +1,69 @@
+//
+// Member set header
+//
+// Set of pointers with O(1) insert, remove and contains. Members are kept packed in
+// an array for iterating, and a small open addressing index maps each pointer to
+// its position in the array.
+
+
+#pragma once
+#ifndef MEMBERSET_H_
+#define MEMBERSET_H_
+
+typedef struct _MemberSet
+{
+	/* Members packed at the front, removal moves the last one into the gap */
+	void **members;
+	int count;
+	int capacity;
+	/* Positions into members by pointer hash, -1 for empty slots */
+	int *slots;
+	int slotMask;
+} MemberSet;
+
+/**
+ * @brief Initializes an empty member set
+ */
+MemberSet *
+ms_init();
+
+/**
+ * @brief Adds the member to the set
+ *
+ * @params set MemberSet to insert into
+ * @params member Pointer to add
+ * @returns 0 if it was added, -1 if it was already in the set
+ */
+int
+ms_insert(MemberSet *set, void *member);
+
+/**
+ * @brief Removes the member from the set. The last member takes its place, so the
+ * iteration order changes.
+ *
+ * @params set MemberSet to remove from
+ * @params member Pointer to remove
+ * @returns 0 if it was removed, -1 if it wasn't in the set
+ */
+int
+ms_remove(MemberSet *set, void *member);
+
+/**
+ * @brief Checks whether the member is in the set
+ *
+ * @params set MemberSet to search
+ * @params member Pointer to look for
+ * @returns 1 if it's in the set, 0 if not
+ */
+int
+ms_contains(MemberSet *set, void *member);
+
+/**
+ * @brief Frees the set, not the members
+ *
+ * @params set MemberSet to free
+ */
+void
+ms_free(MemberSet *set);
+
+#endif
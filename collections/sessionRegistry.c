@@ -0,0 +1,268 @@
+//
+// Sharded session registry implementation
+
+
+#define _GNU_SOURCE
+#include "sessionRegistry.h"
+#include <stdlib.h>
+#include <string.h>
+
+/**
+ * @brief Picks the shard for a session name. Uses the top bits of the mixed hash so
+ * the shard doesn't correlate with the bucket the shard's table puts the name in.
+ */
+static RegistryShard *sr_shardFor(SessionRegistry *registry, char *name) {
+	unsigned int mixed = hf_siphash(name) * 0x9E3779B1u;
+	return &registry->shards[(mixed >> 16) & (registry->shardCount - 1)];
+}
+
+/**
+ * @brief Frees a session that was removed from its shard
+ */
+static void sr_freeSession(Session *session) {
+	if (session->context != NULL) {
+		session->freeContext(session->context);
+	}
+	ms_free(session->members);
+	free(session->name);
+	free(session);
+}
+
+/**
+ * @brief Removes the member from a session of a write-locked shard, deleting the
+ * session once it's empty
+ *
+ * @returns 0 if the member was removed, -1 if it wasn't in the session
+ */
+static int sr_removeMember(RegistryShard *shard, Session *session, void *member) {
+	if (ms_remove(session->members, member) < 0) {
+		return -1;
+	}
+
+	if (session->members->count == 0) {
+		ht_remove(shard->sessions, session->name);
+		sr_freeSession(session);
+	}
+	return 0;
+}
+
+/**
+ * @brief Initializes an empty registry
+ *
+ * @params shardCount Number of shards, rounded up to a power of two
+ * @returns Pointer to an initialized SessionRegistry
+ */
+SessionRegistry *
+sr_init(int shardCount) {
+	SessionRegistry *registry = (SessionRegistry *)calloc(1, sizeof(SessionRegistry));
+	registry->shardCount = 1;
+	while (registry->shardCount < shardCount) {
+		registry->shardCount <<= 1;
+	}
+	registry->shards = (RegistryShard *)calloc(registry->shardCount, sizeof(RegistryShard));
+
+	// Prefer writers, a steady stream of broadcasts must not starve joins and leaves
+	pthread_rwlockattr_t attr;
+	pthread_rwlockattr_init(&attr);
+	pthread_rwlockattr_setkind_np(&attr, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+
+	int i;
+	for (i = 0; i < registry->shardCount; i++) {
+		pthread_rwlock_init(&registry->shards[i].lock, &attr);
+		registry->shards[i].sessions = ht_init(REGISTRY_SHARD_BUCKETS);
+	}
+	pthread_rwlockattr_destroy(&attr);
+
+	return registry;
+}
+
+/**
+ * @brief Creates a session with the member as its first client
+ *
+ * @params registry SessionRegistry to add to
+ * @params name Session name, copied
+ * @params member Client creating the session
+ * @params created Called with the shard still write-locked once the session is in,
+ * before anything can be broadcast to it, may be NULL
+ * @params context Passed through to created
+ * @returns 0 on success, -1 if a session with the name exists
+ */
+int
+sr_create(SessionRegistry *registry, char *name, void *member,
+		  void (*created)(Session *session, void *context), void *context) {
+	RegistryShard *shard = sr_shardFor(registry, name);
+
+	pthread_rwlock_wrlock(&shard->lock);
+	if (ht_find(shard->sessions, name) != NULL) {
+		pthread_rwlock_unlock(&shard->lock);
+		return -1;
+	}
+
+	Session *session = (Session *)calloc(1, sizeof(Session));
+	session->name = strdup(name);
+	session->members = ms_init();
+	session->shard = shard;
+	session->joins = 1;
+	session->sequence = __atomic_fetch_add(&registry->nextSequence, 1, __ATOMIC_RELAXED);
+	ms_insert(session->members, member);
+	ht_insert(shard->sessions, session->name, session);
+	if (created != NULL) {
+		created(session, context);
+	}
+	pthread_rwlock_unlock(&shard->lock);
+
+	return 0;
+}
+
+/**
+ * @brief Adds the member to an existing session
+ *
+ * @params registry SessionRegistry to search
+ * @params name Session name
+ * @params member Client joining the session
+ * @params joined Called with the shard still write-locked once the member is in,
+ * so nothing can be broadcast to the session in between, may be NULL
+ * @params context Passed through to joined
+ * @returns 0 on success, 1 if the member already is in the session, -1 if the
+ * session doesn't exist
+ */
+int
+sr_join(SessionRegistry *registry, char *name, void *member,
+		void (*joined)(Session *session, void *context), void *context) {
+	RegistryShard *shard = sr_shardFor(registry, name);
+
+	int result = -1;
+
+	pthread_rwlock_wrlock(&shard->lock);
+	Session *session = (Session *)ht_find(shard->sessions, name);
+	if (session != NULL && ms_insert(session->members, member) != 0) {
+		result = 1;
+	}
+	else if (session != NULL) {
+		session->joins++;
+		if (joined != NULL) {
+			joined(session, context);
+		}
+		result = 0;
+	}
+	pthread_rwlock_unlock(&shard->lock);
+
+	return result;
+}
+
+/**
+ * @brief Removes the member from the session, deleting the session once it's empty
+ *
+ * @params registry SessionRegistry to search
+ * @params name Session name
+ * @params member Client leaving the session
+ * @returns 0 on success, -1 if the session doesn't exist or the member isn't in it
+ */
+int
+sr_leave(SessionRegistry *registry, char *name, void *member) {
+	if (name == NULL) {
+		return -1;
+	}
+	RegistryShard *shard = sr_shardFor(registry, name);
+	int result = -1;
+
+	pthread_rwlock_wrlock(&shard->lock);
+	Session *session = (Session *)ht_find(shard->sessions, name);
+	if (session != NULL) {
+		result = sr_removeMember(shard, session, member);
+	}
+	pthread_rwlock_unlock(&shard->lock);
+
+	return result;
+}
+
+/**
+ * @brief Finds a session and read-locks its shard. The members can't change until
+ * sr_release is called.
+ *
+ * @params registry SessionRegistry to search
+ * @params name Session name
+ * @returns Session, or NULL without any lock held if it doesn't exist
+ */
+Session *
+sr_acquire(SessionRegistry *registry, char *name) {
+	RegistryShard *shard = sr_shardFor(registry, name);
+
+	pthread_rwlock_rdlock(&shard->lock);
+	Session *session = (Session *)ht_find(shard->sessions, name);
+	if (session == NULL) {
+		pthread_rwlock_unlock(&shard->lock);
+	}
+	return session;
+}
+
+/**
+ * @brief Unlocks a session returned by sr_acquire
+ *
+ * @params session Session to release
+ */
+void
+sr_release(Session *session) {
+	pthread_rwlock_unlock(&session->shard->lock);
+}
+
+/**
+ * @brief Calls the visitor on every session, oldest first, with all shards read-locked
+ *
+ * @params registry SessionRegistry to walk
+ * @params visitor Called once per session
+ * @params context Passed through to the visitor
+ */
+void
+sr_forEach(SessionRegistry *registry, void (*visitor)(Session *session, void *context), void *context) {
+	HashEntry **cursors = (HashEntry **)calloc(registry->shardCount, sizeof(HashEntry *));
+	int i;
+
+	// Shards are always locked in index order
+	for (i = 0; i < registry->shardCount; i++) {
+		pthread_rwlock_rdlock(&registry->shards[i].lock);
+		cursors[i] = ht_first(registry->shards[i].sessions);
+	}
+
+	// Each shard lists its sessions in creation order, merge them by sequence
+	while (1) {
+		int oldest = -1;
+		for (i = 0; i < registry->shardCount; i++) {
+			if (cursors[i] != NULL && (oldest < 0 ||
+				((Session *)cursors[i]->data)->sequence < ((Session *)cursors[oldest]->data)->sequence)) {
+				oldest = i;
+			}
+		}
+		if (oldest < 0) {
+			break;
+		}
+		visitor((Session *)cursors[oldest]->data, context);
+		cursors[oldest] = ht_next(registry->shards[oldest].sessions, cursors[oldest]);
+	}
+
+	for (i = registry->shardCount - 1; i >= 0; i--) {
+		pthread_rwlock_unlock(&registry->shards[i].lock);
+	}
+	free(cursors);
+}
+
+/**
+ * @brief Frees the registry and every session in it
+ *
+ * @params registry SessionRegistry to free
+ */
+void
+sr_free(SessionRegistry *registry) {
+	int i;
+	for (i = 0; i < registry->shardCount; i++) {
+		HashEntry *entry = ht_first(registry->shards[i].sessions);
+		while (entry != NULL) {
+			sr_freeSession((Session *)entry->data);
+			entry = ht_next(registry->shards[i].sessions, entry);
+		}
+		ht_free(registry->shards[i].sessions);
+		pthread_rwlock_destroy(&registry->shards[i].lock);
+	}
+	free(registry->shards);
+	free(registry);
+}
@@ -0,0 +1,147 @@
+//
+// Sharded session registry header
+
+
+#pragma once
+#ifndef SESSIONREGISTRY_H_
+#define SESSIONREGISTRY_H_
+
+#include <pthread.h>
+#include "memberSet.h"
+#include "hashTable.h"
+
+/* Default number of shards, must be a power of two */
+#define REGISTRY_DEFAULT_SHARDS 16
+/* Hash buckets per shard */
+#define REGISTRY_SHARD_BUCKETS 16
+
+struct _RegistryShard;
+
+/**
+ * @brief A chat session and the clients in it. Only valid while its shard is locked.
+ */
+typedef struct _Session
+{
+	char *name;
+	MemberSet *members;
+	/* Creation order, sessions are listed oldest first */
+	unsigned long sequence;
+	/* Bumped every time a client creates or joins the session */
+	unsigned long joins;
+	/* State the server keeps per session, freed with freeContext along with it.
+	 * Set while holding the shard's read lock, so it must be set atomically. */
+	void *context;
+	void (*freeContext)(void *context);
+	struct _RegistryShard *shard;
+} Session;
+
+/**
+ * @brief A slice of the sessions, guarded by its own reader-writer lock
+ */
+typedef struct _RegistryShard
+{
+	pthread_rwlock_t lock;
+	HashTable *sessions;
+} RegistryShard;
+
+/**
+ * @brief Sessions sharded by name hash. Broadcasts to a session take its shard's
+ * read lock, so creating, joining and leaving sessions in one shard doesn't stall
+ * fan-out in the others.
+ */
+typedef struct _SessionRegistry
+{
+	RegistryShard *shards;
+	int shardCount;
+	unsigned long nextSequence;
+} SessionRegistry;
+
+/**
+ * @brief Initializes an empty registry
+ *
+ * @params shardCount Number of shards, rounded up to a power of two
+ * @returns Pointer to an initialized SessionRegistry
+ */
+SessionRegistry *
+sr_init(int shardCount);
+
+/**
+ * @brief Creates a session with the member as its first client
+ *
+ * @params registry SessionRegistry to add to
+ * @params name Session name, copied
+ * @params member Client creating the session
+ * @params created Called with the shard still write-locked once the session is in,
+ * before anything can be broadcast to it, may be NULL
+ * @params context Passed through to created
+ * @returns 0 on success, -1 if a session with the name exists
+ */
+int
+sr_create(SessionRegistry *registry, char *name, void *member,
+		  void (*created)(Session *session, void *context), void *context);
+
+/**
+ * @brief Adds the member to an existing session
+ *
+ * @params registry SessionRegistry to search
+ * @params name Session name
+ * @params member Client joining the session
+ * @params joined Called with the shard still write-locked once the member is in,
+ * so nothing can be broadcast to the session in between, may be NULL
+ * @params context Passed through to joined
+ * @returns 0 on success, 1 if the member already is in the session, -1 if the
+ * session doesn't exist
+ */
+int
+sr_join(SessionRegistry *registry, char *name, void *member,
+		void (*joined)(Session *session, void *context), void *context);
+
+/**
+ * @brief Removes the member from the session, deleting the session once it's empty
+ *
+ * @params registry SessionRegistry to search
+ * @params name Session name
+ * @params member Client leaving the session
+ * @returns 0 on success, -1 if the session doesn't exist or the member isn't in it
+ */
+int
+sr_leave(SessionRegistry *registry, char *name, void *member);
+
+/**
+ * @brief Finds a session and read-locks its shard. The members can't change until
+ * sr_release is called.
+ *
+ * @params registry SessionRegistry to search
+ * @params name Session name
+ * @returns Session, or NULL without any lock held if it doesn't exist
+ */
+Session *
+sr_acquire(SessionRegistry *registry, char *name);
+
+/**
+ * @brief Unlocks a session returned by sr_acquire
+ *
+ * @params session Session to release
+ */
+void
+sr_release(Session *session);
+
+/**
+ * @brief Calls the visitor on every session, oldest first, with all shards read-locked
+ *
+ * @params registry SessionRegistry to walk
+ * @params visitor Called once per session
+ * @params context Passed through to the visitor
+ */
+void
+sr_forEach(SessionRegistry *registry, void (*visitor)(Session *session, void *context), void *context);
+
+/**
+ * @brief Frees the registry and every session in it
+ *
+ * @params registry SessionRegistry to free
+ */
+void
+sr_free(SessionRegistry *registry);
+
+#endif
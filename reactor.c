@@ -0,0 +1,249 @@
+//
+// Epoll reactor implementation
+
+#define _GNU_SOURCE
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "utils/transport.h"
+#include "utils/printHelpers.h"
+#include "utils/logger.h"
+#include "chatServer.h"
+#include "reactor.h"
+
+/**
+ * @brief Per-worker state, each worker owns one epoll instance
+ */
+typedef struct _ReactorWorker
+{
+	pthread_t thread;
+	int epollFd;
+	int listenSocket;
+	SessionRegistry *sessions;
+	LinkedList *connections;
+	HashTable *users;
+} ReactorWorker;
+
+/**
+ * @brief Raises the open file limit to the hard limit so the reactor can hold
+ * more than the default 1024 sockets
+ */
+static void reactor_raiseFileLimit() {
+	struct rlimit limit;
+	if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < limit.rlim_max) {
+		limit.rlim_cur = limit.rlim_max;
+		if (setrlimit(RLIMIT_NOFILE, &limit) != 0) {
+			printLastError("Error at setrlimit(): %s\n");
+		}
+	}
+}
+
+/**
+ * @brief Re-registers the connection for the events it currently waits on: input
+ * unless reading is paused, writability while data is queued and not held for
+ * coalescing. Called with the connection's socketLock held.
+ */
+static void reactor_updateEvents(ThreadInfo *threadInfo) {
+	ReactorWorker *worker = (ReactorWorker *)threadInfo->backendData;
+	struct epoll_event event;
+	event.events = EPOLLRDHUP;
+	if (!threadInfo->readPaused) {
+		event.events |= EPOLLIN;
+	}
+	if (threadInfo->sendQueue.head != NULL && !threadInfo->coalescing) {
+		event.events |= EPOLLOUT;
+	}
+	event.data.ptr = threadInfo;
+	epoll_ctl(worker->epollFd, EPOLL_CTL_MOD, threadInfo->socket, &event);
+}
+
+/**
+ * @brief Locks the connection and re-registers its events, also the hook for pausing
+ * and resuming reads
+ */
+static void reactor_refreshEvents(ThreadInfo *threadInfo) {
+	pthread_mutex_lock(&threadInfo->socketLock);
+	reactor_updateEvents(threadInfo);
+	pthread_mutex_unlock(&threadInfo->socketLock);
+}
+
+/**
+ * @brief Accepts every pending connection on the listening socket and registers
+ * them with the worker's epoll instance
+ */
+static void reactor_accept(ReactorWorker *worker) {
+	while (1) {
+		struct sockaddr_in clientInfo;
+		socklen_t clientLen = sizeof(clientInfo);
+
+		// Connection sockets never block, other workers send to them while holding locks
+		int sock = accept4(worker->listenSocket, (struct sockaddr *)&clientInfo, &clientLen, SOCK_NONBLOCK);
+		if (sock < 0) {
+			// EAGAIN means another worker took it, or the backlog is drained
+			if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+				printLastError("Error at accept(): %s\n");
+			}
+			return;
+		}
+
+		ThreadInfo *threadInfo = (ThreadInfo *)calloc(1, sizeof(ThreadInfo));
+		threadInfo->socket = sock;
+		threadInfo->clientAddr = clientInfo;
+		threadInfo->clientAddrLen = clientLen;
+		threadInfo->thread = worker->thread;
+		threadInfo->sessions = worker->sessions;
+		threadInfo->connections = worker->connections;
+		threadInfo->users = worker->users;
+		threadInfo->clientConnected = 1;
+		threadInfo->backendData = worker;
+		threadInfo->wantWrite = reactor_updateEvents;
+		threadInfo->readStateChanged = reactor_refreshEvents;
+		pthread_mutex_init(&threadInfo->socketLock, NULL);
+
+		struct epoll_event event;
+		event.events = EPOLLIN | EPOLLRDHUP;
+		event.data.ptr = threadInfo;
+		if (epoll_ctl(worker->epollFd, EPOLL_CTL_ADD, sock, &event) != 0) {
+			printLastError("Error at epoll_ctl(): %s\n");
+			pthread_mutex_destroy(&threadInfo->socketLock);
+			close(sock);
+			free(threadInfo);
+			continue;
+		}
+		chatServer_connect(threadInfo);
+	}
+}
+
+/**
+ * @brief Unregisters and closes a connection, removing it from its sessions
+ */
+static void reactor_close(ReactorWorker *worker, ThreadInfo *threadInfo) {
+	epoll_ctl(worker->epollFd, EPOLL_CTL_DEL, threadInfo->socket, NULL);
+	chatServer_disconnect(threadInfo);
+	close(threadInfo->socket);
+	pthread_mutex_destroy(&threadInfo->socketLock);
+	free(threadInfo);
+}
+
+/**
+ * @brief Worker thread function, waits on epoll and serves readable sockets
+ */
+static void *reactor_workerThread(void *args) {
+	ReactorWorker *worker = (ReactorWorker *)args;
+	struct epoll_event events[REACTOR_MAX_EVENTS];
+	unsigned char buf[RECV_BUFFER_SIZE];
+
+	while (1) {
+		int ready = epoll_wait(worker->epollFd, events, REACTOR_MAX_EVENTS, -1);
+		if (ready < 0) {
+			if (errno == EINTR) continue;
+			printLastError("Error at epoll_wait(): %s\n");
+			break;
+		}
+
+		int i;
+		for (i = 0; i < ready; i++) {
+			// The listening socket is registered with a NULL pointer
+			if (events[i].data.ptr == NULL) {
+				reactor_accept(worker);
+				continue;
+			}
+
+			ThreadInfo *threadInfo = (ThreadInfo *)events[i].data.ptr;
+			if (events[i].events & EPOLLOUT) {
+				// Stop waiting for writability once the queue is drained
+				if (!chatServer_flushSendQueue(threadInfo)) {
+					reactor_refreshEvents(threadInfo);
+				}
+			}
+			if (!(events[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR))) {
+				continue;
+			}
+
+			int bytes = recv(threadInfo->socket, buf, RECV_BUFFER_SIZE, MSG_DONTWAIT);
+
+			if (bytes < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+				continue;
+			}
+			if (bytes <= 0) {
+				reactor_close(worker, threadInfo);
+				continue;
+			}
+
+			// Close on a malformed stream, or once the client sent EXIT
+			if (chatServer_handleStream(threadInfo, buf, bytes) != 0 ||
+				!threadInfo->clientConnected) {
+				reactor_close(worker, threadInfo);
+			}
+		}
+	}
+
+	return NULL;
+}
+
+/**
+ * @brief Runs the server in event-loop mode. A fixed set of worker threads each own an
+ * epoll instance and share the listening socket, so every connection is served by one
+ * worker instead of a dedicated thread. Never returns unless setup fails.
+ *
+ * @params listenSocket Bound and listening server socket
+ * @params workerCount Number of worker threads to start
+ * @params sessions Registry of the chat room sessions
+ * @params connections Linked list of logged in clients
+ * @params users Hash table for username/passwords
+ * @returns -1 if the reactor could not be started
+ */
+int reactor_run(int listenSocket, int workerCount, SessionRegistry *sessions,
+				LinkedList *connections, HashTable *users) {
+	reactor_raiseFileLimit();
+
+	// Workers race to accept, the listening socket must never block them
+	int flags = fcntl(listenSocket, F_GETFL, 0);
+	if (fcntl(listenSocket, F_SETFL, flags | O_NONBLOCK) != 0) {
+		printLastError("Error at fcntl(): %s\n");
+		return -1;
+	}
+
+	ReactorWorker *workers = (ReactorWorker *)calloc(workerCount, sizeof(ReactorWorker));
+	int i;
+	for (i = 0; i < workerCount; i++) {
+		ReactorWorker *worker = &workers[i];
+		worker->listenSocket = listenSocket;
+		worker->sessions = sessions;
+		worker->connections = connections;
+		worker->users = users;
+		worker->epollFd = epoll_create1(0);
+		if (worker->epollFd < 0) {
+			printLastError("Error at epoll_create1(): %s\n");
+			return -1;
+		}
+
+		// EPOLLEXCLUSIVE wakes a single worker per incoming connection
+		struct epoll_event event;
+		event.events = EPOLLIN | EPOLLEXCLUSIVE;
+		event.data.ptr = NULL;
+		if (epoll_ctl(worker->epollFd, EPOLL_CTL_ADD, listenSocket, &event) != 0) {
+			printLastError("Error at epoll_ctl(): %s\n");
+			return -1;
+		}
+	}
+
+	logger_log(LOG_LEVEL_INFO, "Serving with %d epoll workers\n", workerCount);
+
+	for (i = 1; i < workerCount; i++) {
+		pthread_create(&workers[i].thread, NULL, reactor_workerThread, &workers[i]);
+		pthread_detach(workers[i].thread);
+	}
+	// The calling thread becomes the first worker
+	workers[0].thread = pthread_self();
+	reactor_workerThread(&workers[0]);
+
+	return -1;
+}
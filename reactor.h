@@ -0,0 +1,32 @@
+//
+// Epoll reactor header
+
+#pragma once
+#ifndef REACTOR_H_
+#define REACTOR_H_
+
+#include "collections/linkedList.h"
+#include "collections/hashTable.h"
+#include "chatServer.h"
+
+/* Default number of reactor worker threads when none is specified */
+#define REACTOR_DEFAULT_WORKERS 4
+/* Maximum number of events to pull out of epoll in one wait */
+#define REACTOR_MAX_EVENTS 256
+
+/**
+ * @brief Runs the server in event-loop mode. A fixed set of worker threads each own an
+ * epoll instance and share the listening socket, so every connection is served by one
+ * worker instead of a dedicated thread. Never returns unless setup fails.
+ *
+ * @params listenSocket Bound and listening server socket
+ * @params workerCount Number of worker threads to start
+ * @params sessions Registry of the chat room sessions
+ * @params connections Linked list of logged in clients
+ * @params users Hash table for username/passwords
+ * @returns -1 if the reactor could not be started
+ */
+int reactor_run(int listenSocket, int workerCount, SessionRegistry *sessions,
+				LinkedList *connections, HashTable *users);
+
+#endif
@@ -1,22 +1,31 @@
 //
 // Server Interface implementation
  
+#define _GNU_SOURCE
 #include <sys/socket.h>
+#include <sys/eventfd.h>
 #include <arpa/inet.h>
 #include <netinet/in.h>
 #include <netdb.h>
 #include <errno.h>
 #include <unistd.h>
 #include <pthread.h>
+#include <signal.h>
+#include <poll.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include "utils/transport.h"
 #include "utils/nethelper.h"
 #include "utils/printHelpers.h"
+#include "utils/logger.h"
 #include "collections/linkedList.h"
 #include "collections/hashTable.h"
+#include "collections/sessionRegistry.h"
 #include "chatServer.h"
+#include "reactor.h"
+#include "uring.h"
 
 
 /* Mutex lock to guard the runtime thread buffer */
@@ -24,10 +33,12 @@ pthread_mutex_t connectionsMutex = PTHREAD_MUTEX_INITIALIZER;
 /* Signaling condition for awaiting threads on the runtime thread buffer */
 pthread_cond_t connectionsCond = PTHREAD_COND_INITIALIZER;
 
-/* Linked List for all pthread connections */
+/* Set of all pthread connections */
+MemberSet *threads;
+/* Linked List of logged in clients */
 LinkedList *connections;
-/* Hash table for the chat room sessions */
-HashTable *sessions;
+/* Registry of the chat room sessions */
+SessionRegistry *sessions;
 /* Hash table for username/passwords */
 HashTable *users;
 
@@ -46,16 +57,158 @@ ThreadInfo *getThreadInfo();
  */
 void releaseThread(ThreadInfo *thread);
 
+/**
+ * @brief Wakes a connection's thread from another thread
+ */
+void wakeThread(ThreadInfo *threadInfo);
+
+/**
+ * @brief Prints the send queue metrics every time the server receives SIGUSR1
+ */
+void *statsThread(void *args);
+
 /* Maximum number of simultaneous connections */
 #define MAX_CONNECTIONS 16
 #define MAX_USERS_PER_SESSION 32
 
+#define USAGE "Usage: server [-q queueBytes] [-p drop|disconnect|backpressure] [-u usersFile] [-l debug|info|warn|error|off] [-c coalesceUs] [-b coalesceBytes] [-n historyMessages] [-m historyBytes] [-g historyBudget] [-d historyDir] [-s segmentBytes] [-r retainBytes] <port> [threaded|epoll [workers]|uring]\n"
+
 int main(int argc, char **argv) {
-	if(argc != 2) {
-		printf("Usage: server <port>\n");
+	int queueLimit = SEND_QUEUE_DEFAULT_LIMIT;
+	int overflowPolicy = OVERFLOW_DISCONNECT;
+	char *usersFile = "passwords.txt";
+	int logLevel = LOG_LEVEL_INFO;
+	int coalesceUs = 0;
+	int coalesceBytes = COALESCE_DEFAULT_BYTES;
+	int historyMessages = HISTORY_DEFAULT_MESSAGES;
+	int historyBytes = HISTORY_DEFAULT_BYTES;
+	long historyBudget = HISTORY_DEFAULT_BUDGET;
+	char *historyDir = NULL;
+	long segmentBytes = HISTORY_DEFAULT_SEGMENT;
+	long retainBytes = HISTORY_DEFAULT_RETAIN;
+	int opt;
+	while ((opt = getopt(argc, argv, "q:p:u:l:c:b:n:m:g:d:s:r:")) != -1) {
+		switch (opt) {
+			case 'q':
+				queueLimit = atoi(optarg);
+				if (queueLimit <= 0) {
+					queueLimit = SEND_QUEUE_DEFAULT_LIMIT;
+				}
+				break;
+			case 'p':
+				if (strcmp(optarg, "drop") == 0) {
+					overflowPolicy = OVERFLOW_DROP_OLDEST;
+				}
+				else if (strcmp(optarg, "disconnect") == 0) {
+					overflowPolicy = OVERFLOW_DISCONNECT;
+				}
+				else if (strcmp(optarg, "backpressure") == 0) {
+					overflowPolicy = OVERFLOW_BACKPRESSURE;
+				}
+				else {
+					printf("Unknown overflow policy '%s'. " USAGE, optarg);
+					return 0;
+				}
+				break;
+			case 'u':
+				usersFile = optarg;
+				break;
+			case 'l':
+				logLevel = logger_parseLevel(optarg);
+				if (logLevel < 0) {
+					printf("Unknown log level '%s'. " USAGE, optarg);
+					return 0;
+				}
+				break;
+			case 'c':
+				coalesceUs = atoi(optarg);
+				break;
+			case 'b':
+				coalesceBytes = atoi(optarg);
+				break;
+			case 'n':
+				historyMessages = atoi(optarg);
+				break;
+			case 'm':
+				historyBytes = atoi(optarg);
+				break;
+			case 'g':
+				historyBudget = atol(optarg);
+				break;
+			case 'd':
+				historyDir = optarg;
+				break;
+			case 's':
+				segmentBytes = atol(optarg);
+				break;
+			case 'r':
+				retainBytes = atol(optarg);
+				break;
+			default:
+				printf(USAGE);
+				return 0;
+		}
+	}
+	argc -= optind - 1;
+	argv += optind - 1;
+
+	if(argc < 2 || argc > 4) {
+		printf(USAGE);
 		return 0;
 	}
 
+	// Thread-per-connection remains the default serving mode
+	int useReactor = 0;
+	int useUring = 0;
+	int workerCount = REACTOR_DEFAULT_WORKERS;
+	if (argc >= 3) {
+		if (strcmp(argv[2], "epoll") == 0) {
+			useReactor = 1;
+		}
+		else if (strcmp(argv[2], "uring") == 0) {
+			useUring = 1;
+		}
+		else if (strcmp(argv[2], "threaded") != 0) {
+			printf("Unknown mode '%s'. " USAGE, argv[2]);
+			return 0;
+		}
+	}
+	if (argc == 4) {
+		workerCount = atoi(argv[3]);
+		if (workerCount <= 0) {
+			workerCount = REACTOR_DEFAULT_WORKERS;
+		}
+	}
+
+	chatServer_configureSendQueue(queueLimit, overflowPolicy);
+
+	// Writes to dropped clients fail with EPIPE instead of killing the server
+	signal(SIGPIPE, SIG_IGN);
+
+	// Every thread inherits the blocked SIGUSR1, only the stats thread waits for it
+	sigset_t statsSignal;
+	sigemptyset(&statsSignal);
+	sigaddset(&statsSignal, SIGUSR1);
+	pthread_sigmask(SIG_BLOCK, &statsSignal, NULL);
+	pthread_t stats;
+	pthread_create(&stats, NULL, statsThread, NULL);
+	pthread_detach(stats);
+
+	// Request handlers log through the writer thread instead of stdio
+	if (logger_start(stdout, logLevel) != 0) {
+		fprintf(stderr, "Error starting the log writer thread\n");
+		return 1;
+	}
+	if (chatServer_configureCoalescing(coalesceUs, coalesceBytes) != 0) {
+		fprintf(stderr, "Error starting the coalescing thread\n");
+		return 1;
+	}
+	chatServer_configureHistory(historyMessages, historyBytes, historyBudget);
+	if (historyDir != NULL && chatServer_configureLog(historyDir, segmentBytes, retainBytes) != 0) {
+		fprintf(stderr, "Error creating the history directory %s\n", historyDir);
+		return 1;
+	}
+
 	int sock = getServerSocket(argv[1]);
 
 	if (sock < 0) {
@@ -63,14 +216,17 @@ int main(int argc, char **argv) {
 	}
 
 	// Init the storage structures
+	threads = ms_init();
 	connections = ll_init();
-	sessions = ht_init(64);
-	users = ht_init(128);
+	sessions = sr_init(REGISTRY_DEFAULT_SHARDS);
+	// User names come from the passwords file, clients only look them up
+	users = ht_initWithHash(128, hf_wyhash);
 
 	// Init the passwords
-	FILE *fp = fopen("passwords.txt", "r");
+	FILE *fp = fopen(usersFile, "r");
 	if(fp == NULL) {
 		printLastError("Error at fopen(): %s\n");
+		return 1;
 	}
 	
 	// Parse the passwords file
@@ -85,7 +241,7 @@ int main(int argc, char **argv) {
 	    char *password = (char *)calloc(strlen(tokens[1]), sizeof(char));
 	    strcpy(username, tokens[0]);
 	    memcpy(password, tokens[1], strlen(tokens[1]) - 1);
-	    password[strlen(tokens[1])] = '\0';
+	    password[strlen(tokens[1]) - 1] = '\0';
 
 	    ht_insert(users, username, password);
 
@@ -94,6 +250,17 @@ int main(int argc, char **argv) {
 	    free(tokens);
 	}
 
+	if (useUring) {
+		if (uring_run(sock, sessions, connections, users) != URING_UNSUPPORTED) {
+			return 1;
+		}
+		logger_log(LOG_LEVEL_WARN, "io_uring is not supported by this kernel, falling back to epoll\n");
+		useReactor = 1;
+	}
+	if (useReactor) {
+		return reactor_run(sock, workerCount, sessions, connections, users) == 0 ? 0 : 1;
+	}
+
 	do {
 		struct sockaddr clientInfo;
 		socklen_t clientLen = sizeof(clientInfo);
@@ -102,9 +269,10 @@ int main(int argc, char **argv) {
 		ThreadInfo *thread = getThreadInfo();
 		thread->clientAddrLen = sizeof(clientInfo);
 		
-		// Block and accept a new client connection
+		// Block and accept a new client connection. Its socket never blocks, the
+		// thread polls it and other threads send to it while holding locks.
 		threadaccept:
-		thread->socket = accept(sock, &clientInfo, &clientLen);
+		thread->socket = accept4(sock, &clientInfo, &clientLen, SOCK_NONBLOCK);
 		if(thread->socket < 0) {
 			//System interrupted go back to accept it
 			if(errno == EINTR) {
@@ -116,8 +284,12 @@ int main(int argc, char **argv) {
 		thread->users = users;
 		// Init the socket's lock
 		pthread_mutex_init(&thread->socketLock, NULL);
+		// Other threads queue data for this client and wake its thread to write it
+		thread->wakeFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+		thread->wantWrite = wakeThread;
+		thread->readStateChanged = wakeThread;
 
-		printf("Connected client on socket: %d\n", thread->socket);
+		logger_log(LOG_LEVEL_INFO, "Connected client on socket: %d\n", thread->socket);
 
 		// Detach the thread
 		pthread_create(&thread->thread, NULL, threadCall, thread);
@@ -129,76 +301,110 @@ int main(int argc, char **argv) {
 
 void* threadCall(void *args) {
 	ThreadInfo *threadInfo = (ThreadInfo *)args;
+	unsigned char buf[RECV_BUFFER_SIZE];
 
 	// Loop until the client exists and handle the command
 	threadInfo->clientConnected = 1;
+	chatServer_connect(threadInfo);
 	while(threadInfo->clientConnected) {
-		// Begin reading from the socket
-		unsigned char buf[MAX_PACKET_SIZE];
-		memset(buf, 0, MAX_PACKET_SIZE);
-		int bytes = recv(threadInfo->socket, buf, MAX_PACKET_SIZE, 0);
+		// Wait for a request, room to write queued data, or a wake up from another thread.
+		// Broadcasts held for coalescing wait for the flusher's wake up.
+		struct pollfd fds[2];
+		fds[0].fd = threadInfo->socket;
+		fds[0].events = threadInfo->readPaused ? 0 : POLLIN;
+		pthread_mutex_lock(&threadInfo->socketLock);
+		if (threadInfo->sendQueue.head != NULL && !threadInfo->coalescing) {
+			fds[0].events |= POLLOUT;
+		}
+		pthread_mutex_unlock(&threadInfo->socketLock);
+		fds[1].fd = threadInfo->wakeFd;
+		fds[1].events = POLLIN;
 
-		if (bytes <= 0) {
-			threadInfo->clientConnected = 0;
+		if (poll(fds, 2, -1) < 0) {
+			if (errno != EINTR) {
+				threadInfo->clientConnected = 0;
+			}
+			continue;
+		}
+		if (fds[1].revents & POLLIN) {
+			uint64_t wakeups;
+			read(threadInfo->wakeFd, &wakeups, sizeof(wakeups));
+		}
+		if (fds[0].revents & POLLOUT) {
+			chatServer_flushSendQueue(threadInfo);
+		}
+		if (!(fds[0].revents & (POLLIN | POLLHUP | POLLERR))) {
 			continue;
 		}
 
-		printf("INFO: RECV %d bytes: %.*s\n", bytes, bytes, buf);
-
-		// Convert the request to a packet
-		Packet *requestPacket = bytesToPacket(buf, bytes);
-		Packet *responsePacket;
+		// One read may hold many packets
+		int bytes = recv(threadInfo->socket, buf, RECV_BUFFER_SIZE, 0);
 
-		fflush(stdout);
-		switch(requestPacket->type) {
-			case LOGIN:
-			    responsePacket = chatServer_login(threadInfo, requestPacket);
-			    break;
-			case EXIT:
-			    responsePacket = chatServer_exit(threadInfo, requestPacket);
-			    break;
-			case JOIN:
-			    responsePacket = chatServer_sessionJoin(threadInfo, requestPacket);
-			    break;
-			case LEAVE_SESS:
-			    responsePacket = chatServer_sessionLeave(threadInfo, requestPacket);
-			    break;
-			case NEW_SESS:
-			    responsePacket = chatServer_sessionCreate(threadInfo, requestPacket);
-			    break;
-			case QUERY:
-				responsePacket = chatServer_sessionQuery(threadInfo, requestPacket);
-				break;
-			case MESSAGE:
-			    responsePacket = chatServer_message(threadInfo, requestPacket, buf, bytes);
-			    break;
-			default:
-				responsePacket = (Packet *)calloc(1, sizeof(Packet));
-				responsePacket->type = UNKNOWN;
-				char* unknownMessage = "Unknown request.";
-				memcpy(responsePacket->data, unknownMessage, strlen(unknownMessage));
-				responsePacket->size = strlen(unknownMessage);
-				break;
+		if (bytes < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+			continue;
+		}
+		if (bytes <= 0) {
+			threadInfo->clientConnected = 0;
+			continue;
 		}
-		free(requestPacket);
 
-		if (responsePacket != NULL) {
-			int responseLength;
-			unsigned char *response = packetToByteArray(responsePacket, &responseLength);
-			send(threadInfo->socket, response, responseLength, 0);
-			free(response);
-			response = NULL;
-			free(responsePacket);
-			responsePacket = NULL;
+		if (chatServer_handleStream(threadInfo, buf, bytes) != 0) {
+			threadInfo->clientConnected = 0;
 		}
 	}
 
+	chatServer_disconnect(threadInfo);
 	close(threadInfo->socket);
+	close(threadInfo->wakeFd);
 
 	releaseThread(args);
 	return NULL;
 }
 
+/**
+ * @brief ThreadInfo hook, wakes the connection's thread to write queued data or
+ * to pick up a changed read state
+ */
+void wakeThread(ThreadInfo *threadInfo) {
+	uint64_t wakeup = 1;
+	write(threadInfo->wakeFd, &wakeup, sizeof(wakeup));
+}
+
+void *statsThread(void *args) {
+	sigset_t statsSignal;
+	sigemptyset(&statsSignal);
+	sigaddset(&statsSignal, SIGUSR1);
+
+	while (1) {
+		int sig;
+		if (sigwait(&statsSignal, &sig) != 0) {
+			continue;
+		}
+
+		SendQueueStats stats;
+		sq_getStats(&stats);
+		printf("Send queues: %ld bytes in %ld packets queued, peak %ld bytes, "
+			   "%ld packets dropped, %ld overflow disconnects, %ld backpressure pauses\n",
+			   stats.queuedBytes, stats.queuedPackets, stats.peakQueuedBytes,
+			   stats.droppedPackets, stats.overflowDisconnects, stats.backpressurePauses);
+
+		PoolStats pool;
+		pool_getStats(&pool);
+		long requests = chatServer_requestCount();
+		printf("Allocations: %ld pooled, %ld from the heap, %.2f per request with %.2f from the heap\n",
+			   pool.allocations, pool.heapAllocations,
+			   requests > 0 ? (double)pool.allocations / requests : 0.0,
+			   requests > 0 ? (double)pool.heapAllocations / requests : 0.0);
+		long copies = payloadCopies();
+		printf("Copies: %ld of packet data, %.2f per request\n", copies,
+			   requests > 0 ? (double)copies / requests : 0.0);
+		printf("Log: %ld records dropped\n", logger_dropped());
+		fflush(stdout);
+	}
+
+	return NULL;
+}
+
 /**
  * @brief Semaphore implementation to prevent the server from exceeding the Maximum
  * number of connections. Server thread sleeps until another thread signals it
@@ -208,7 +414,7 @@ ThreadInfo *getThreadInfo() {
 	pthread_mutex_lock(&connectionsMutex);
 
 	// Wait on the condition if there are no available connections
-	while (connections->count >= MAX_CONNECTIONS) {
+	while (threads->count >= MAX_CONNECTIONS) {
 		pthread_cond_wait(&connectionsCond, &connectionsMutex);
 	}
 
@@ -216,7 +422,7 @@ ThreadInfo *getThreadInfo() {
 	// update the circular buffer
 	ThreadInfo *currInfo = (ThreadInfo *)calloc(1, sizeof(ThreadInfo));
 	//currInfo->sessionIDs = (char **)calloc(MAX_SIMUL_SESSIONS_PER_CLIENT, sizeof(char *));
-	ll_insert(connections, (void *)currInfo);
+	ms_insert(threads, currInfo);
 
 	// Release the mutex lock again so others can enter this critical section
 	pthread_mutex_unlock(&connectionsMutex);
@@ -228,12 +434,10 @@ void releaseThread(ThreadInfo *thread) {
 	// Lock the thread for the critical section
 	pthread_mutex_lock(&connectionsMutex);
 	
-	// Find the current connection in the linked list, remove it
-	Node *elem = ll_find(connections, thread, &threadInfoComparer);
-	ll_remove(connections, elem);
+	// Remove the current connection from the set
+	ms_remove(threads, thread);
 	// Finally free the data
-	free(elem->data);
-	free(elem);
+	free(thread);
 
 	// Signal to other threads
 	pthread_cond_signal(&connectionsCond);
@@ -0,0 +1,575 @@
+//
+// io_uring backend implementation
+//
+// Talks to the kernel through the raw io_uring syscalls so the server has no
+// dependency on liburing. One ring serves every connection from a single thread,
+// so the chatServer_* handlers never run concurrently in this mode.
+
+#include <sys/socket.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/resource.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "utils/transport.h"
+#include "utils/printHelpers.h"
+#include "utils/logger.h"
+#include "chatServer.h"
+#include "uring.h"
+
+#if defined(__linux__) && defined(__NR_io_uring_setup)
+#include <linux/io_uring.h>
+#endif
+
+// Multishot accept and provided buffer rings arrived together in Linux 5.19
+#if defined(__NR_io_uring_setup) && defined(IORING_ACCEPT_MULTISHOT)
+
+/* Operation tags stored in the low bits of the SQE user data */
+#define URING_OP_ACCEPT 0UL
+#define URING_OP_RECV 1UL
+#define URING_OP_SEND 2UL
+#define URING_OP_MASK 3UL
+
+/* Provided buffer group used for every receive */
+#define URING_BUFFER_GROUP 0
+/* Size of each provided receive buffer */
+#define URING_RECV_SIZE RECV_BUFFER_SIZE
+
+/**
+ * @brief Per-connection state, stored in ThreadInfo->backendData. Outgoing data
+ * waits in the ThreadInfo's send queue.
+ */
+typedef struct _UringConnection
+{
+	ThreadInfo *threadInfo;
+	/* Next queued send expected to complete in the chain currently in flight */
+	SendQueueEntry *completing;
+	/* Number of sends submitted and not yet completed */
+	int inflight;
+	/* A receive is submitted */
+	int receiving;
+	/* Connection is closed, released once nothing is in flight */
+	int closing;
+	/* Connection is on the list of connections with sends to submit */
+	int queued;
+	struct _UringConnection *nextQueued;
+} UringConnection;
+
+/**
+ * @brief Memory mapped io_uring instance
+ */
+typedef struct _Uring
+{
+	int fd;
+	/* Submission ring */
+	unsigned *sqHead;
+	unsigned *sqTail;
+	unsigned *sqMask;
+	unsigned sqEntries;
+	unsigned sqLocalTail;
+	unsigned toSubmit;
+	struct io_uring_sqe *sqes;
+	/* Completion ring */
+	unsigned *cqHead;
+	unsigned *cqTail;
+	unsigned *cqMask;
+	struct io_uring_cqe *cqes;
+	void *ringMap;
+	size_t ringMapSize;
+	size_t sqesMapSize;
+	/* Provided receive buffers */
+	struct io_uring_buf_ring *bufRing;
+	unsigned char *bufBase;
+	unsigned short bufTail;
+	/* Connections with sends waiting to be submitted */
+	UringConnection *sendQueue;
+	int listenSocket;
+	SessionRegistry *sessions;
+	LinkedList *connections;
+	HashTable *users;
+} Uring;
+
+/* The backend runs a single ring on the calling thread */
+static Uring ring;
+
+static int uring_setup(unsigned entries, struct io_uring_params *params) {
+	return (int)syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int uring_enter(unsigned toSubmit, unsigned minComplete, unsigned flags) {
+	return (int)syscall(__NR_io_uring_enter, ring.fd, toSubmit, minComplete, flags, NULL, 0);
+}
+
+static int uring_register(unsigned opcode, void *arg, unsigned args) {
+	return (int)syscall(__NR_io_uring_register, ring.fd, opcode, arg, args);
+}
+
+/**
+ * @brief Publishes queued SQEs to the kernel, optionally waiting for completions
+ */
+static int uring_submit(unsigned waitFor) {
+	__atomic_store_n(ring.sqTail, ring.sqLocalTail, __ATOMIC_RELEASE);
+
+	while (1) {
+		int submitted = uring_enter(ring.toSubmit, waitFor,
+									waitFor > 0 ? IORING_ENTER_GETEVENTS : 0);
+		if (submitted >= 0) {
+			ring.toSubmit -= submitted;
+			return submitted;
+		}
+		if (errno != EINTR) {
+			return -1;
+		}
+	}
+}
+
+/**
+ * @brief Returns a zeroed SQE, submitting pending entries if the ring is full
+ */
+static struct io_uring_sqe *uring_getSqe() {
+	unsigned head = __atomic_load_n(ring.sqHead, __ATOMIC_ACQUIRE);
+	if (ring.sqLocalTail - head >= ring.sqEntries) {
+		uring_submit(0);
+	}
+
+	struct io_uring_sqe *sqe = &ring.sqes[ring.sqLocalTail & *ring.sqMask];
+	memset(sqe, 0, sizeof(*sqe));
+	ring.sqLocalTail++;
+	ring.toSubmit++;
+	return sqe;
+}
+
+/**
+ * @brief Hands a provided buffer back to the kernel after its data was handled
+ */
+static void uring_recycleBuffer(unsigned short bid) {
+	struct io_uring_buf *buf = &ring.bufRing->bufs[ring.bufTail & (URING_RECV_BUFFERS - 1)];
+	buf->addr = (unsigned long)(ring.bufBase + (size_t)bid * URING_RECV_SIZE);
+	buf->len = URING_RECV_SIZE;
+	buf->bid = bid;
+	ring.bufTail++;
+	__atomic_store_n(&ring.bufRing->tail, ring.bufTail, __ATOMIC_RELEASE);
+}
+
+static void uring_armAccept() {
+	struct io_uring_sqe *sqe = uring_getSqe();
+	sqe->opcode = IORING_OP_ACCEPT;
+	sqe->fd = ring.listenSocket;
+	sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+	sqe->accept_flags = SOCK_CLOEXEC;
+	sqe->user_data = URING_OP_ACCEPT;
+}
+
+static void uring_armRecv(UringConnection *conn) {
+	if (conn->receiving || conn->closing) {
+		return;
+	}
+	conn->receiving = 1;
+
+	struct io_uring_sqe *sqe = uring_getSqe();
+	sqe->opcode = IORING_OP_RECV;
+	sqe->fd = conn->threadInfo->socket;
+	sqe->len = URING_RECV_SIZE;
+	sqe->flags = IOSQE_BUFFER_SELECT;
+	sqe->buf_group = URING_BUFFER_GROUP;
+	sqe->user_data = (unsigned long)conn | URING_OP_RECV;
+}
+
+/**
+ * @brief Frees a connection once the kernel holds no references to it
+ */
+static void uring_release(UringConnection *conn) {
+	conn->threadInfo->sendQueue.pinned = 0;
+	sq_clear(&conn->threadInfo->sendQueue);
+
+	close(conn->threadInfo->socket);
+	pthread_mutex_destroy(&conn->threadInfo->socketLock);
+	free(conn->threadInfo);
+	free(conn);
+}
+
+/**
+ * @brief Removes the client from its sessions and releases the connection when possible
+ */
+static void uring_close(UringConnection *conn) {
+	if (conn->closing) {
+		return;
+	}
+	conn->closing = 1;
+	chatServer_disconnect(conn->threadInfo);
+
+	if (conn->inflight == 0 && !conn->queued) {
+		uring_release(conn);
+	}
+}
+
+/**
+ * @brief Puts the connection on the list of connections with sends to submit
+ */
+static void uring_queueConnection(UringConnection *conn) {
+	if (!conn->queued) {
+		conn->queued = 1;
+		conn->nextQueued = ring.sendQueue;
+		ring.sendQueue = conn;
+	}
+}
+
+/**
+ * @brief ThreadInfo hook, data was queued on an idle connection. The queue is
+ * submitted after the current batch of completions is handled.
+ */
+static void uring_wantWrite(ThreadInfo *threadInfo) {
+	uring_queueConnection((UringConnection *)threadInfo->backendData);
+}
+
+/**
+ * @brief ThreadInfo hook, backpressure paused or resumed reading from the client
+ */
+static void uring_readStateChanged(ThreadInfo *threadInfo) {
+	if (!threadInfo->readPaused) {
+		uring_armRecv((UringConnection *)threadInfo->backendData);
+	}
+}
+
+/**
+ * @brief Submits the pending sends of every queued connection. Each connection gets
+ * one chain of linked sends so its data goes out in order; a new chain is only
+ * started once the previous one fully completed.
+ */
+static void uring_flushSends() {
+	while (ring.sendQueue != NULL) {
+		UringConnection *conn = ring.sendQueue;
+		ring.sendQueue = conn->nextQueued;
+		conn->queued = 0;
+
+		if (conn->closing) {
+			if (conn->inflight == 0) {
+				uring_release(conn);
+			}
+			continue;
+		}
+		if (conn->inflight > 0) {
+			// Resubmitted from the completion of the current chain
+			continue;
+		}
+
+		SendQueue *queue = &conn->threadInfo->sendQueue;
+		conn->completing = queue->head;
+		SendQueueEntry *send = queue->head;
+		while (send != NULL && conn->inflight < URING_MAX_LINKED_SENDS) {
+			struct io_uring_sqe *sqe = uring_getSqe();
+			sqe->opcode = IORING_OP_SEND;
+			sqe->fd = conn->threadInfo->socket;
+			sqe->addr = (unsigned long)(send->buffer->data + send->offset);
+			sqe->len = send->buffer->len - send->offset;
+			// Without MSG_WAITALL a short send completes and the next link would run
+			sqe->msg_flags = MSG_NOSIGNAL | MSG_WAITALL;
+			sqe->user_data = (unsigned long)conn | URING_OP_SEND;
+
+			send = send->next;
+			conn->inflight++;
+			if (send != NULL && conn->inflight < URING_MAX_LINKED_SENDS) {
+				sqe->flags = IOSQE_IO_LINK;
+			}
+		}
+		// The kernel now points into these entries, overflow must not drop them
+		queue->pinned = conn->inflight;
+	}
+}
+
+static void uring_handleAccept(int res, unsigned flags) {
+	// The multishot accept stops on errors, re-arm it
+	if (!(flags & IORING_CQE_F_MORE)) {
+		uring_armAccept();
+	}
+	if (res < 0) {
+		logger_log(LOG_LEVEL_ERROR, "Error at accept: %s\n", strerror(-res));
+		return;
+	}
+
+	ThreadInfo *threadInfo = (ThreadInfo *)calloc(1, sizeof(ThreadInfo));
+	threadInfo->socket = res;
+	threadInfo->thread = pthread_self();
+	threadInfo->sessions = ring.sessions;
+	threadInfo->connections = ring.connections;
+	threadInfo->users = ring.users;
+	threadInfo->clientConnected = 1;
+	threadInfo->deferredWrites = 1;
+	threadInfo->wantWrite = uring_wantWrite;
+	threadInfo->readStateChanged = uring_readStateChanged;
+	pthread_mutex_init(&threadInfo->socketLock, NULL);
+
+	UringConnection *conn = (UringConnection *)calloc(1, sizeof(UringConnection));
+	conn->threadInfo = threadInfo;
+	threadInfo->backendData = conn;
+	chatServer_connect(threadInfo);
+
+	uring_armRecv(conn);
+}
+
+static void uring_handleRecv(UringConnection *conn, int res, unsigned flags) {
+	conn->receiving = 0;
+	if (res == -ENOBUFS) {
+		// Every buffer is in use, try again after this batch recycled some
+		uring_armRecv(conn);
+		return;
+	}
+	if (res <= 0) {
+		uring_close(conn);
+		return;
+	}
+
+	unsigned short bid = flags >> IORING_CQE_BUFFER_SHIFT;
+	unsigned char *buf = ring.bufBase + (size_t)bid * URING_RECV_SIZE;
+	int streamRes = chatServer_handleStream(conn->threadInfo, buf, res);
+	uring_recycleBuffer(bid);
+
+	if (streamRes == 0 && conn->threadInfo->clientConnected) {
+		// A paused connection is re-armed when it is resumed
+		if (!conn->threadInfo->readPaused) {
+			uring_armRecv(conn);
+		}
+	}
+	else {
+		uring_close(conn);
+	}
+}
+
+static void uring_handleSend(UringConnection *conn, int res) {
+	ThreadInfo *threadInfo = conn->threadInfo;
+	SendQueueEntry *send = conn->completing;
+	conn->inflight--;
+	if (send != NULL) {
+		conn->completing = send->next;
+	}
+
+	pthread_mutex_lock(&threadInfo->socketLock);
+	int before = threadInfo->sendQueue.bytes;
+	if (res > 0 && send != NULL && send == threadInfo->sendQueue.head) {
+		// Short sends break the chain, the rest is resubmitted from the offset
+		sq_consume(&threadInfo->sendQueue, res);
+	}
+	else if (res < 0 && res != -ECANCELED) {
+		threadInfo->sendFailed = 1;
+	}
+	if (conn->inflight == 0) {
+		threadInfo->sendQueue.pinned = 0;
+		if (threadInfo->sendFailed) {
+			// The receive side notices the dead socket and closes the connection
+			sq_clear(&threadInfo->sendQueue);
+		}
+	}
+	int pending = threadInfo->sendQueue.head != NULL;
+	pthread_mutex_unlock(&threadInfo->socketLock);
+
+	chatServer_sendQueueDrained(threadInfo, before);
+	if (conn->inflight > 0) {
+		return;
+	}
+	if (conn->closing) {
+		if (!conn->queued) {
+			uring_release(conn);
+		}
+		return;
+	}
+	if (pending) {
+		uring_queueConnection(conn);
+	}
+}
+
+/**
+ * @brief Tears down a partially initialized ring
+ */
+static void uring_destroy() {
+	if (ring.bufRing != NULL) {
+		munmap(ring.bufRing, URING_RECV_BUFFERS * sizeof(struct io_uring_buf));
+	}
+	free(ring.bufBase);
+	if (ring.sqes != NULL) {
+		munmap(ring.sqes, ring.sqesMapSize);
+	}
+	if (ring.ringMap != NULL) {
+		munmap(ring.ringMap, ring.ringMapSize);
+	}
+	close(ring.fd);
+	memset(&ring, 0, sizeof(ring));
+}
+
+/**
+ * @brief Creates and maps the ring and registers the provided buffers
+ *
+ * @returns 0 on success, URING_UNSUPPORTED if the kernel can't provide the features
+ */
+static int uring_init() {
+	struct io_uring_params params;
+	memset(&params, 0, sizeof(params));
+	memset(&ring, 0, sizeof(ring));
+
+	ring.fd = uring_setup(URING_QUEUE_DEPTH, &params);
+	if (ring.fd < 0) {
+		// ENOSYS on old kernels, EPERM when disabled by sysctl or seccomp
+		return URING_UNSUPPORTED;
+	}
+	if (!(params.features & IORING_FEAT_SINGLE_MMAP) || !(params.features & IORING_FEAT_NODROP)) {
+		close(ring.fd);
+		return URING_UNSUPPORTED;
+	}
+
+	// The SQ and CQ rings share one mapping
+	size_t sqSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+	size_t cqSize = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+	ring.ringMapSize = sqSize > cqSize ? sqSize : cqSize;
+	ring.ringMap = mmap(NULL, ring.ringMapSize, PROT_READ | PROT_WRITE,
+						MAP_SHARED | MAP_POPULATE, ring.fd, IORING_OFF_SQ_RING);
+	if (ring.ringMap == MAP_FAILED) {
+		ring.ringMap = NULL;
+		uring_destroy();
+		return URING_UNSUPPORTED;
+	}
+	ring.sqesMapSize = params.sq_entries * sizeof(struct io_uring_sqe);
+	ring.sqes = (struct io_uring_sqe *)mmap(NULL, ring.sqesMapSize, PROT_READ | PROT_WRITE,
+											MAP_SHARED | MAP_POPULATE, ring.fd, IORING_OFF_SQES);
+	if (ring.sqes == MAP_FAILED) {
+		ring.sqes = NULL;
+		uring_destroy();
+		return URING_UNSUPPORTED;
+	}
+
+	unsigned char *base = (unsigned char *)ring.ringMap;
+	ring.sqHead = (unsigned *)(base + params.sq_off.head);
+	ring.sqTail = (unsigned *)(base + params.sq_off.tail);
+	ring.sqMask = (unsigned *)(base + params.sq_off.ring_mask);
+	ring.sqEntries = params.sq_entries;
+	ring.sqLocalTail = *ring.sqTail;
+	ring.cqHead = (unsigned *)(base + params.cq_off.head);
+	ring.cqTail = (unsigned *)(base + params.cq_off.tail);
+	ring.cqMask = (unsigned *)(base + params.cq_off.ring_mask);
+	ring.cqes = (struct io_uring_cqe *)(base + params.cq_off.cqes);
+
+	// SQE slots are used in ring order, so the index array is the identity
+	unsigned *sqArray = (unsigned *)(base + params.sq_off.array);
+	unsigned i;
+	for (i = 0; i < params.sq_entries; i++) {
+		sqArray[i] = i;
+	}
+
+	// The buffer ring must be page aligned
+	ring.bufRing = (struct io_uring_buf_ring *)mmap(NULL, URING_RECV_BUFFERS * sizeof(struct io_uring_buf),
+													PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (ring.bufRing == MAP_FAILED) {
+		ring.bufRing = NULL;
+		uring_destroy();
+		return -1;
+	}
+	ring.bufBase = (unsigned char *)malloc((size_t)URING_RECV_BUFFERS * URING_RECV_SIZE);
+	if (ring.bufBase == NULL) {
+		uring_destroy();
+		return -1;
+	}
+
+	struct io_uring_buf_reg reg;
+	memset(&reg, 0, sizeof(reg));
+	reg.ring_addr = (unsigned long)ring.bufRing;
+	reg.ring_entries = URING_RECV_BUFFERS;
+	reg.bgid = URING_BUFFER_GROUP;
+	if (uring_register(IORING_REGISTER_PBUF_RING, &reg, 1) != 0) {
+		// Kernel older than 5.19, no buffer rings or multishot accept
+		uring_destroy();
+		return URING_UNSUPPORTED;
+	}
+
+	for (i = 0; i < URING_RECV_BUFFERS; i++) {
+		uring_recycleBuffer(i);
+	}
+
+	return 0;
+}
+
+/**
+ * @brief Runs the server on a single io_uring instance. Connections are accepted with
+ * a multishot accept, received into kernel-selected provided buffers, and outgoing
+ * data for each client is submitted as a chain of linked sends so a broadcast costs
+ * one io_uring_enter() for the whole session. Never returns unless setup fails.
+ *
+ * @params listenSocket Bound and listening server socket
+ * @params sessions Registry of the chat room sessions
+ * @params connections Linked list of logged in clients
+ * @params users Hash table for username/passwords
+ * @returns URING_UNSUPPORTED if the kernel lacks the required io_uring features
+ * before anything was changed, -1 on other errors
+ */
+int uring_run(int listenSocket, SessionRegistry *sessions, LinkedList *connections,
+			  HashTable *users) {
+	int initRes = uring_init();
+	if (initRes != 0) {
+		return initRes;
+	}
+
+	ring.listenSocket = listenSocket;
+	ring.sessions = sessions;
+	ring.connections = connections;
+	ring.users = users;
+
+	// Lift the descriptor limit the same way the epoll reactor does
+	struct rlimit limit;
+	if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < limit.rlim_max) {
+		limit.rlim_cur = limit.rlim_max;
+		setrlimit(RLIMIT_NOFILE, &limit);
+	}
+
+	logger_log(LOG_LEVEL_INFO, "Serving with io_uring\n");
+
+	uring_armAccept();
+	while (1) {
+		uring_flushSends();
+		if (uring_submit(1) < 0) {
+			printLastError("Error at io_uring_enter(): %s\n");
+			break;
+		}
+
+		unsigned head = *ring.cqHead;
+		unsigned tail = __atomic_load_n(ring.cqTail, __ATOMIC_ACQUIRE);
+		while (head != tail) {
+			struct io_uring_cqe *cqe = &ring.cqes[head & *ring.cqMask];
+			unsigned long userData = cqe->user_data;
+			int res = cqe->res;
+			unsigned flags = cqe->flags;
+
+			// Release the slot before handling, handlers may submit and reap more
+			head++;
+			__atomic_store_n(ring.cqHead, head, __ATOMIC_RELEASE);
+
+			UringConnection *conn = (UringConnection *)(userData & ~URING_OP_MASK);
+			switch (userData & URING_OP_MASK) {
+				case URING_OP_ACCEPT:
+					uring_handleAccept(res, flags);
+					break;
+				case URING_OP_RECV:
+					uring_handleRecv(conn, res, flags);
+					break;
+				case URING_OP_SEND:
+					uring_handleSend(conn, res);
+					break;
+			}
+		}
+	}
+
+	uring_destroy();
+	return -1;
+}
+
+#else
+
+/**
+ * @brief Stub for platforms or headers without io_uring support
+ */
+int uring_run(int listenSocket, SessionRegistry *sessions, LinkedList *connections,
+			  HashTable *users) {
+	return URING_UNSUPPORTED;
+}
+
+#endif
@@ -0,0 +1,38 @@
+//
+// io_uring backend header
+
+#pragma once
+#ifndef URING_H_
+#define URING_H_
+
+#include "collections/linkedList.h"
+#include "collections/hashTable.h"
+#include "chatServer.h"
+
+/* Number of submission queue entries */
+#define URING_QUEUE_DEPTH 4096
+/* Number of provided receive buffers, must be a power of two */
+#define URING_RECV_BUFFERS 256
+/* Maximum number of sends linked into one chain per connection */
+#define URING_MAX_LINKED_SENDS 32
+
+/* Returned by uring_run when the kernel cannot run the backend */
+#define URING_UNSUPPORTED -2
+
+/**
+ * @brief Runs the server on a single io_uring instance. Connections are accepted with
+ * a multishot accept, received into kernel-selected provided buffers, and outgoing
+ * data for each client is submitted as a chain of linked sends so a broadcast costs
+ * one io_uring_enter() for the whole session. Never returns unless setup fails.
+ *
+ * @params listenSocket Bound and listening server socket
+ * @params sessions Registry of the chat room sessions
+ * @params connections Linked list of logged in clients
+ * @params users Hash table for username/passwords
+ * @returns URING_UNSUPPORTED if the kernel lacks the required io_uring features
+ * before anything was changed, -1 on other errors
+ */
+int uring_run(int listenSocket, SessionRegistry *sessions, LinkedList *connections,
+			  HashTable *users);
+
+#endif
@@ -0,0 +1,160 @@
+//
+// Streaming compression implementation
+
+#include "compression.h"
+#include <stdlib.h>
+#include <string.h>
+
+/* Empty stored block a sync flush ends with, left out on the wire */
+static const unsigned char flushTail[] = { 0x00, 0x00, 0xff, 0xff };
+
+/**
+ * @brief Creates a stream that compresses messages
+ *
+ * @returns New CompressionStream, NULL if zlib couldn't allocate it
+ */
+CompressionStream *
+compression_createDeflater() {
+	CompressionStream *stream = (CompressionStream *)calloc(1, sizeof(CompressionStream));
+	// Negative window bits give raw deflate, without a header or checksum per stream
+	if (deflateInit2(&stream->z, COMPRESSION_LEVEL, Z_DEFLATED, -COMPRESSION_WINDOW_BITS,
+					 COMPRESSION_MEM_LEVEL, Z_DEFAULT_STRATEGY) != Z_OK) {
+		free(stream);
+		return NULL;
+	}
+	return stream;
+}
+
+/**
+ * @brief Creates a stream that decompresses what a deflater produced
+ *
+ * @returns New CompressionStream, NULL if zlib couldn't allocate it
+ */
+CompressionStream *
+compression_createInflater() {
+	CompressionStream *stream = (CompressionStream *)calloc(1, sizeof(CompressionStream));
+	stream->inflating = 1;
+	if (inflateInit2(&stream->z, -COMPRESSION_WINDOW_BITS) != Z_OK) {
+		free(stream);
+		return NULL;
+	}
+	return stream;
+}
+
+/**
+ * @brief Largest output compressing len bytes can produce
+ */
+int
+compression_bound(int len) {
+	// Stored blocks for incompressible data, plus the sync flush
+	return len + (len >> 12) + (len >> 14) + 13 + sizeof(flushTail) + 6;
+}
+
+/**
+ * @brief Compresses a message and flushes it, so the other side can decompress it
+ * without waiting for more
+ *
+ * @params stream Deflater
+ * @params in Message to compress
+ * @params len Length of the message
+ * @params out Compressed bytes, at least compression_bound(len) long
+ * @returns Length of the compressed bytes, -1 on errors after which the stream was reset
+ */
+int
+compression_deflate(CompressionStream *stream, const unsigned char *in, int len, unsigned char *out) {
+	int capacity = compression_bound(len);
+	stream->z.next_in = (unsigned char *)in;
+	stream->z.avail_in = len;
+	stream->z.next_out = out;
+	stream->z.avail_out = capacity;
+	int result = deflate(&stream->z, Z_SYNC_FLUSH);
+	int written = capacity - stream->z.avail_out;
+
+	// A full output buffer may mean the flush didn't finish
+	if (result != Z_OK || stream->z.avail_in != 0 || stream->z.avail_out == 0 ||
+		written < (int)sizeof(flushTail) ||
+		memcmp(out + written - sizeof(flushTail), flushTail, sizeof(flushTail)) != 0) {
+		deflateReset(&stream->z);
+		return -1;
+	}
+	return written - sizeof(flushTail);
+}
+
+/**
+ * @brief Runs the inflater over bytes until they're consumed
+ *
+ * @returns 0 on success, -1 if they're corrupt or out is full
+ */
+static int compression_inflateBytes(CompressionStream *stream, const unsigned char *in, int len) {
+	stream->z.next_in = (unsigned char *)in;
+	stream->z.avail_in = len;
+	while (stream->z.avail_in > 0) {
+		if (stream->z.avail_out == 0) {
+			return -1;
+		}
+		int result = inflate(&stream->z, Z_SYNC_FLUSH);
+		if (result != Z_OK && result != Z_BUF_ERROR) {
+			return -1;
+		}
+		if (result == Z_BUF_ERROR && stream->z.avail_out > 0) {
+			// No progress with room left, the bytes are corrupt
+			return -1;
+		}
+	}
+	return 0;
+}
+
+/**
+ * @brief Decompresses a message produced by compression_deflate
+ *
+ * @params stream Inflater
+ * @params in Compressed bytes
+ * @params len Length of the compressed bytes
+ * @params out Decompressed message
+ * @params capacity Size of out
+ * @returns Length of the message, -1 if the bytes are corrupt or it doesn't fit
+ */
+int
+compression_inflate(CompressionStream *stream, const unsigned char *in, int len, unsigned char *out, int capacity) {
+	stream->z.next_out = out;
+	stream->z.avail_out = capacity;
+	if (compression_inflateBytes(stream, in, len) < 0 ||
+		compression_inflateBytes(stream, flushTail, sizeof(flushTail)) < 0) {
+		return -1;
+	}
+	return capacity - stream->z.avail_out;
+}
+
+/**
+ * @brief Forgets the stream's history, the next message starts a new stream
+ *
+ * @params stream Deflater or inflater
+ */
+void
+compression_reset(CompressionStream *stream) {
+	if (stream->inflating) {
+		inflateReset(&stream->z);
+	}
+	else {
+		deflateReset(&stream->z);
+	}
+}
+
+/**
+ * @brief Frees a stream
+ *
+ * @params stream Deflater or inflater, may be NULL
+ */
+void
+compression_free(CompressionStream *stream) {
+	if (stream == NULL) {
+		return;
+	}
+	if (stream->inflating) {
+		inflateEnd(&stream->z);
+	}
+	else {
+		deflateEnd(&stream->z);
+	}
+	free(stream);
+}
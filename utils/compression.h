@@ -0,0 +1,93 @@
+//
+// Streaming compression header
+//
+// Raw deflate streams that keep their history across messages, so a short chat line
+// can refer back to the lines before it. Every message is flushed to a byte boundary
+// with a sync flush and the empty block the flush ends with is left out on the wire,
+// the inflating side puts it back.
+
+#pragma once
+#ifndef COMPRESSION_H_
+#define COMPRESSION_H_
+
+#include <zlib.h>
+
+/* 4KB of history and a small hash table keep a stream around 24KB */
+#define COMPRESSION_WINDOW_BITS 12
+#define COMPRESSION_MEM_LEVEL 5
+#define COMPRESSION_LEVEL 6
+
+/**
+ * A deflate or inflate stream
+ */
+typedef struct _CompressionStream
+{
+	z_stream z;
+	int inflating;
+} CompressionStream;
+
+/**
+ * @brief Creates a stream that compresses messages
+ *
+ * @returns New CompressionStream, NULL if zlib couldn't allocate it
+ */
+CompressionStream *
+compression_createDeflater();
+
+/**
+ * @brief Creates a stream that decompresses what a deflater produced
+ *
+ * @returns New CompressionStream, NULL if zlib couldn't allocate it
+ */
+CompressionStream *
+compression_createInflater();
+
+/**
+ * @brief Largest output compressing len bytes can produce
+ */
+int
+compression_bound(int len);
+
+/**
+ * @brief Compresses a message and flushes it, so the other side can decompress it
+ * without waiting for more
+ *
+ * @params stream Deflater
+ * @params in Message to compress
+ * @params len Length of the message
+ * @params out Compressed bytes, at least compression_bound(len) long
+ * @returns Length of the compressed bytes, -1 on errors after which the stream was reset
+ */
+int
+compression_deflate(CompressionStream *stream, const unsigned char *in, int len, unsigned char *out);
+
+/**
+ * @brief Decompresses a message produced by compression_deflate
+ *
+ * @params stream Inflater
+ * @params in Compressed bytes
+ * @params len Length of the compressed bytes
+ * @params out Decompressed message
+ * @params capacity Size of out
+ * @returns Length of the message, -1 if the bytes are corrupt or it doesn't fit
+ */
+int
+compression_inflate(CompressionStream *stream, const unsigned char *in, int len, unsigned char *out, int capacity);
+
+/**
+ * @brief Forgets the stream's history, the next message starts a new stream
+ *
+ * @params stream Deflater or inflater
+ */
+void
+compression_reset(CompressionStream *stream);
+
+/**
+ * @brief Frees a stream
+ *
+ * @params stream Deflater or inflater, may be NULL
+ */
+void
+compression_free(CompressionStream *stream);
+
+#endif
@@ -0,0 +1,134 @@
+//
+// Frame reassembly buffer implementation
+
+#include "frameBuffer.h"
+#include "transport.h"
+#include <stdlib.h>
+#include <string.h>
+
+/**
+ * @brief Appends received bytes to the end of the buffer
+ *
+ * @params buffer FrameBuffer to append to
+ * @params bytes Received bytes
+ * @params len Number of received bytes
+ */
+void
+fb_append(FrameBuffer *buffer, unsigned char *bytes, int len)
+{
+	if (len <= 0) {
+		return;
+	}
+
+	if (buffer->end + len > buffer->capacity) {
+		int pending = buffer->end - buffer->start;
+
+		// Slide the pending bytes to the front before growing
+		if (buffer->start > 0) {
+			memmove(buffer->data, buffer->data + buffer->start, pending);
+			buffer->start = 0;
+			buffer->end = pending;
+		}
+
+		if (pending + len > buffer->capacity) {
+			int capacity = buffer->capacity > 0 ? buffer->capacity : 256;
+			while (capacity < pending + len) {
+				capacity *= 2;
+			}
+			buffer->data = (unsigned char *)realloc(buffer->data, capacity);
+			buffer->capacity = capacity;
+		}
+	}
+
+	memcpy(buffer->data + buffer->end, bytes, len);
+	buffer->end += len;
+}
+
+/**
+ * @brief Takes the next complete packet out of the buffer. The returned pointer
+ * stays valid until the buffer is appended to again.
+ *
+ * @params buffer FrameBuffer to read from
+ * @params len Returns the packet length, or -1 if the stream is malformed
+ * @returns Pointer to the packet, NULL if no complete packet is buffered
+ */
+unsigned char *
+fb_nextFrame(FrameBuffer *buffer, int *len)
+{
+	unsigned char *frame = buffer->data + buffer->start;
+	int frameLen = frameLength(frame, buffer->end - buffer->start);
+
+	*len = frameLen;
+	if (frameLen <= 0) {
+		return NULL;
+	}
+
+	buffer->start += frameLen;
+	if (buffer->start == buffer->end) {
+		// Drained, the next append starts from the front again
+		buffer->start = buffer->end = 0;
+	}
+	return frame;
+}
+
+/**
+ * @brief Cuts freshly received bytes into packets. Pending bytes from earlier reads
+ * are completed first, complete packets are handed to the handler in order, and a
+ * trailing partial packet is kept for the next read. When nothing is pending the
+ * packets are handled straight out of the read buffer without copying.
+ *
+ * @params buffer FrameBuffer of the connection
+ * @params bytes Received bytes
+ * @params len Number of received bytes
+ * @params handler Delegate called for every complete packet
+ * @params context Context passed to the handler
+ * @returns 0 on success, -1 if the stream is malformed
+ */
+int
+fb_feed(FrameBuffer *buffer, unsigned char *bytes, int len, FrameHandler handler, void *context)
+{
+	int frameLen;
+
+	if (buffer->end > buffer->start) {
+		fb_append(buffer, bytes, len);
+
+		unsigned char *frame;
+		while ((frame = fb_nextFrame(buffer, &frameLen)) != NULL) {
+			handler(context, frame, frameLen);
+		}
+	}
+	else {
+		int offset = 0;
+		while ((frameLen = frameLength(bytes + offset, len - offset)) > 0) {
+			handler(context, bytes + offset, frameLen);
+			offset += frameLen;
+		}
+		if (frameLen == 0) {
+			fb_append(buffer, bytes + offset, len - offset);
+		}
+	}
+
+	if (frameLen < 0) {
+		return -1;
+	}
+
+	// Idle connections don't keep a buffer around
+	if (buffer->end == buffer->start) {
+		fb_free(buffer);
+	}
+	return 0;
+}
+
+/**
+ * @brief Releases the buffer's storage
+ *
+ * @params buffer FrameBuffer to free
+ */
+void
+fb_free(FrameBuffer *buffer)
+{
+	free(buffer->data);
+	buffer->data = NULL;
+	buffer->capacity = 0;
+	buffer->start = buffer->end = 0;
+}
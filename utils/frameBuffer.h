@@ -0,0 +1,77 @@
+//
+// Frame reassembly buffer header
+
+#pragma once
+#ifndef FRAMEBUFFER_H_
+#define FRAMEBUFFER_H_
+
+/**
+ * Holds received bytes that don't form a complete packet yet. TCP may split a
+ * packet over several reads or coalesce several packets into one, so every read
+ * is cut into packets with frameLength() and only the unfinished tail is kept.
+ * Storage is only allocated while a partial packet is pending, idle connections
+ * hold no buffer at all.
+ */
+typedef struct _FrameBuffer
+{
+	unsigned char *data;
+	int capacity;
+	int start;
+	int end;
+} FrameBuffer;
+
+/**
+ * @brief Delegate called for every complete packet
+ *
+ * @params context Caller supplied context
+ * @params frame Bytes of one complete packet
+ * @params len Length of the packet
+ */
+typedef void (*FrameHandler)(void *context, unsigned char *frame, int len);
+
+/**
+ * @brief Appends received bytes to the end of the buffer
+ *
+ * @params buffer FrameBuffer to append to
+ * @params bytes Received bytes
+ * @params len Number of received bytes
+ */
+void
+fb_append(FrameBuffer *buffer, unsigned char *bytes, int len);
+
+/**
+ * @brief Takes the next complete packet out of the buffer. The returned pointer
+ * stays valid until the buffer is appended to again.
+ *
+ * @params buffer FrameBuffer to read from
+ * @params len Returns the packet length, or -1 if the stream is malformed
+ * @returns Pointer to the packet, NULL if no complete packet is buffered
+ */
+unsigned char *
+fb_nextFrame(FrameBuffer *buffer, int *len);
+
+/**
+ * @brief Cuts freshly received bytes into packets. Pending bytes from earlier reads
+ * are completed first, complete packets are handed to the handler in order, and a
+ * trailing partial packet is kept for the next read. When nothing is pending the
+ * packets are handled straight out of the read buffer without copying.
+ *
+ * @params buffer FrameBuffer of the connection
+ * @params bytes Received bytes
+ * @params len Number of received bytes
+ * @params handler Delegate called for every complete packet
+ * @params context Context passed to the handler
+ * @returns 0 on success, -1 if the stream is malformed
+ */
+int
+fb_feed(FrameBuffer *buffer, unsigned char *bytes, int len, FrameHandler handler, void *context);
+
+/**
+ * @brief Releases the buffer's storage
+ *
+ * @params buffer FrameBuffer to free
+ */
+void
+fb_free(FrameBuffer *buffer);
+
+#endif
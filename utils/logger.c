@@ -0,0 +1,655 @@
+//
+// Logger implementation
+
+#include "logger.h"
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/* Longest line the writer formats, longer lines are cut off */
+#define LOG_LINE_SIZE 2048
+
+/* The writer sleeps this long after finding every ring empty, doubling while they
+ * stay empty up to LOG_IDLE_NS */
+#define LOG_BUSY_NS 20000
+#define LOG_IDLE_NS 1000000
+
+/* Length modifiers of a conversion */
+#define LENGTH_NONE 0
+#define LENGTH_LONG 1
+#define LENGTH_LONG_LONG 2
+#define LENGTH_LONG_DOUBLE 3
+#define LENGTH_SHORT 4
+#define LENGTH_CHAR 5
+
+/**
+ * A log call, the arguments are copied in the order the format uses them
+ */
+typedef struct _LogRecord
+{
+	struct timespec time;
+	const char *format;
+	short level;
+	/* Set when arguments didn't fit and were cut off */
+	short truncated;
+	int argsLen;
+	unsigned char args[LOG_RECORD_SIZE - sizeof(struct timespec) - sizeof(const char *) - 2 * sizeof(short) - sizeof(int)];
+} LogRecord;
+
+/**
+ * A thread's records. Only the owner moves head and only the writer moves tail, so
+ * neither side needs a lock.
+ */
+typedef struct _LogRing
+{
+	LogRecord records[LOG_RING_RECORDS];
+	/* Next record the owner writes */
+	unsigned long head __attribute__((aligned(64)));
+	/* Records dropped because the ring was full, written by the owner */
+	long dropped;
+	/* Next record the writer reads */
+	unsigned long tail __attribute__((aligned(64)));
+	/* Drops the writer already reported */
+	long reportedDrops;
+	/* Set when the owner exited, the writer frees the ring once it is empty */
+	int retired;
+	struct _LogRing *next;
+} LogRing;
+
+/**
+ * A parsed conversion specification
+ */
+typedef struct _LogSpec
+{
+	char flags[8];
+	int width;
+	int widthStar;
+	int precision;
+	int precisionStar;
+	int length;
+	char conversion;
+} LogSpec;
+
+static int threshold = LOG_LEVEL_OFF;
+static FILE *output;
+
+static __thread LogRing *local;
+static pthread_key_t ringKey;
+static pthread_once_t ringKeyOnce = PTHREAD_ONCE_INIT;
+
+/* Taken when rings are added or freed and by logger_dropped */
+static pthread_mutex_t ringsLock = PTHREAD_MUTEX_INITIALIZER;
+static LogRing *rings;
+/* Drops of the rings already freed */
+static long retiredDrops;
+/* Passes the writer finished over every ring */
+static unsigned long passes;
+
+static const char *levelNames[] = { "DEBUG", "INFO", "WARN", "ERROR" };
+
+/**
+ * @brief Marks an exiting thread's ring for the writer to free
+ */
+static void logger_retireRing(void *arg) {
+	__atomic_store_n(&((LogRing *)arg)->retired, 1, __ATOMIC_RELEASE);
+}
+
+static void logger_createKey() {
+	pthread_key_create(&ringKey, logger_retireRing);
+}
+
+/**
+ * @brief The calling thread's ring, registered on first use
+ */
+static LogRing *logger_local() {
+	if (local == NULL) {
+		pthread_once(&ringKeyOnce, logger_createKey);
+		LogRing *ring = (LogRing *)calloc(1, sizeof(LogRing));
+		if (ring == NULL) {
+			return NULL;
+		}
+		pthread_mutex_lock(&ringsLock);
+		ring->next = rings;
+		__atomic_store_n(&rings, ring, __ATOMIC_RELEASE);
+		pthread_mutex_unlock(&ringsLock);
+		pthread_setspecific(ringKey, ring);
+		local = ring;
+	}
+	return local;
+}
+
+/**
+ * @brief Parses a conversion specification
+ *
+ * @params format Points past the %
+ * @params spec Filled with the parsed specification
+ * @returns Pointer past the conversion character
+ */
+static const char *logger_parseSpec(const char *format, LogSpec *spec) {
+	int flags = 0;
+	memset(spec, 0, sizeof(LogSpec));
+	spec->width = -1;
+	spec->precision = -1;
+
+	while (*format != '\0' && strchr("-+ #0", *format) != NULL && flags < (int)sizeof(spec->flags) - 1) {
+		spec->flags[flags++] = *format++;
+	}
+	if (*format == '*') {
+		spec->widthStar = 1;
+		format++;
+	}
+	else if (*format >= '0' && *format <= '9') {
+		spec->width = strtol(format, (char **)&format, 10);
+	}
+	if (*format == '.') {
+		format++;
+		if (*format == '*') {
+			spec->precisionStar = 1;
+			format++;
+		}
+		else {
+			spec->precision = strtol(format, (char **)&format, 10);
+		}
+	}
+	while (*format != '\0' && strchr("hlLzjt", *format) != NULL) {
+		if (*format == 'l') {
+			spec->length = spec->length == LENGTH_LONG ? LENGTH_LONG_LONG : LENGTH_LONG;
+		}
+		else if (*format == 'L') {
+			spec->length = LENGTH_LONG_DOUBLE;
+		}
+		else if (*format == 'h') {
+			spec->length = spec->length == LENGTH_SHORT ? LENGTH_CHAR : LENGTH_SHORT;
+		}
+		else {
+			// size_t, intmax_t and ptrdiff_t are all long here
+			spec->length = LENGTH_LONG;
+		}
+		format++;
+	}
+	spec->conversion = *format;
+	return *format != '\0' ? format + 1 : format;
+}
+
+/**
+ * @brief Appends an argument to a record
+ *
+ * @returns 0 on success, -1 if it didn't fit
+ */
+static int logger_put(LogRecord *record, const void *value, int size) {
+	if (record->argsLen + size > (int)sizeof(record->args)) {
+		record->truncated = 1;
+		return -1;
+	}
+	memcpy(record->args + record->argsLen, value, size);
+	record->argsLen += size;
+	return 0;
+}
+
+/**
+ * @brief Copies the arguments the format uses into the record
+ */
+static void logger_capture(LogRecord *record, const char *format, va_list args) {
+	while (*format != '\0') {
+		if (*format++ != '%') {
+			continue;
+		}
+		if (*format == '%') {
+			format++;
+			continue;
+		}
+
+		LogSpec spec;
+		format = logger_parseSpec(format, &spec);
+		if (spec.widthStar) {
+			int width = va_arg(args, int);
+			if (logger_put(record, &width, sizeof(width)) != 0) {
+				return;
+			}
+		}
+		if (spec.precisionStar) {
+			spec.precision = va_arg(args, int);
+			if (logger_put(record, &spec.precision, sizeof(spec.precision)) != 0) {
+				return;
+			}
+		}
+
+		long long integer;
+		double real;
+		void *pointer;
+		switch (spec.conversion) {
+			case 'd':
+			case 'i':
+				if (spec.length == LENGTH_LONG_LONG) {
+					integer = va_arg(args, long long);
+				}
+				else if (spec.length == LENGTH_LONG) {
+					integer = va_arg(args, long);
+				}
+				else if (spec.length == LENGTH_SHORT) {
+					integer = (short)va_arg(args, int);
+				}
+				else if (spec.length == LENGTH_CHAR) {
+					integer = (signed char)va_arg(args, int);
+				}
+				else {
+					integer = va_arg(args, int);
+				}
+				if (logger_put(record, &integer, sizeof(integer)) != 0) {
+					return;
+				}
+				break;
+			case 'u':
+			case 'x':
+			case 'X':
+			case 'o':
+				if (spec.length == LENGTH_LONG_LONG) {
+					integer = (long long)va_arg(args, unsigned long long);
+				}
+				else if (spec.length == LENGTH_LONG) {
+					integer = (long long)va_arg(args, unsigned long);
+				}
+				else if (spec.length == LENGTH_SHORT) {
+					integer = (unsigned short)va_arg(args, unsigned int);
+				}
+				else if (spec.length == LENGTH_CHAR) {
+					integer = (unsigned char)va_arg(args, unsigned int);
+				}
+				else {
+					integer = va_arg(args, unsigned int);
+				}
+				if (logger_put(record, &integer, sizeof(integer)) != 0) {
+					return;
+				}
+				break;
+			case 'c':
+				integer = va_arg(args, int);
+				if (logger_put(record, &integer, sizeof(integer)) != 0) {
+					return;
+				}
+				break;
+			case 'p':
+				pointer = va_arg(args, void *);
+				if (logger_put(record, &pointer, sizeof(pointer)) != 0) {
+					return;
+				}
+				break;
+			case 'e':
+			case 'E':
+			case 'f':
+			case 'F':
+			case 'g':
+			case 'G':
+				if (spec.length == LENGTH_LONG_DOUBLE) {
+					real = (double)va_arg(args, long double);
+				}
+				else {
+					real = va_arg(args, double);
+				}
+				if (logger_put(record, &real, sizeof(real)) != 0) {
+					return;
+				}
+				break;
+			case 's':
+				{
+					const char *string = va_arg(args, const char *);
+					if (string == NULL) {
+						string = "(null)";
+					}
+					int len = spec.precision >= 0 ? (int)strnlen(string, spec.precision) : (int)strlen(string);
+					// Long strings are cut to whatever room is left
+					int room = (int)sizeof(record->args) - record->argsLen - (int)sizeof(int);
+					if (room < 0) {
+						record->truncated = 1;
+						return;
+					}
+					if (len > room) {
+						len = room;
+						record->truncated = 1;
+					}
+					logger_put(record, &len, sizeof(len));
+					logger_put(record, string, len);
+				}
+				break;
+			case 'n':
+				va_arg(args, int *);
+				break;
+			default:
+				// The types of the remaining arguments are unknown
+				record->truncated = 1;
+				return;
+		}
+	}
+}
+
+/**
+ * @brief Takes the next argument of a record
+ *
+ * @returns 0 on success, -1 if the record has no more arguments
+ */
+static int logger_take(LogRecord *record, int *offset, void *value, int size) {
+	if (*offset + size > record->argsLen) {
+		return -1;
+	}
+	memcpy(value, record->args + *offset, size);
+	*offset += size;
+	return 0;
+}
+
+/**
+ * @brief Formats a record's message the way printf would have
+ *
+ * @returns Length of the message
+ */
+static int logger_render(LogRecord *record, char *line, int size) {
+	const char *format = record->format;
+	int len = 0, offset = 0;
+
+	while (*format != '\0' && len < size - 1) {
+		if (*format != '%') {
+			line[len++] = *format++;
+			continue;
+		}
+		format++;
+		if (*format == '%') {
+			line[len++] = *format++;
+			continue;
+		}
+
+		LogSpec spec;
+		format = logger_parseSpec(format, &spec);
+		if (spec.widthStar && logger_take(record, &offset, &spec.width, sizeof(int)) != 0) {
+			break;
+		}
+		if (spec.precisionStar && logger_take(record, &offset, &spec.precision, sizeof(int)) != 0) {
+			break;
+		}
+
+		// Rebuild the specification with the captured width and precision
+		char conversion[32];
+		int specLen = snprintf(conversion, sizeof(conversion), "%%%s", spec.flags);
+		if (spec.width >= 0) {
+			specLen += snprintf(conversion + specLen, sizeof(conversion) - specLen, "%d", spec.width);
+		}
+		if (spec.precision >= 0 && spec.conversion != 's') {
+			specLen += snprintf(conversion + specLen, sizeof(conversion) - specLen, ".%d", spec.precision);
+		}
+
+		long long integer;
+		double real;
+		void *pointer;
+		int written = 0;
+		switch (spec.conversion) {
+			case 'd':
+			case 'i':
+			case 'u':
+			case 'x':
+			case 'X':
+			case 'o':
+				if (logger_take(record, &offset, &integer, sizeof(integer)) != 0) {
+					goto cut;
+				}
+				snprintf(conversion + specLen, sizeof(conversion) - specLen, "ll%c", spec.conversion);
+				written = snprintf(line + len, size - len, conversion, integer);
+				break;
+			case 'c':
+				if (logger_take(record, &offset, &integer, sizeof(integer)) != 0) {
+					goto cut;
+				}
+				snprintf(conversion + specLen, sizeof(conversion) - specLen, "c");
+				written = snprintf(line + len, size - len, conversion, (int)integer);
+				break;
+			case 'p':
+				if (logger_take(record, &offset, &pointer, sizeof(pointer)) != 0) {
+					goto cut;
+				}
+				snprintf(conversion + specLen, sizeof(conversion) - specLen, "p");
+				written = snprintf(line + len, size - len, conversion, pointer);
+				break;
+			case 'e':
+			case 'E':
+			case 'f':
+			case 'F':
+			case 'g':
+			case 'G':
+				if (logger_take(record, &offset, &real, sizeof(real)) != 0) {
+					goto cut;
+				}
+				snprintf(conversion + specLen, sizeof(conversion) - specLen, "%c", spec.conversion);
+				written = snprintf(line + len, size - len, conversion, real);
+				break;
+			case 's':
+				{
+					int stringLen;
+					if (logger_take(record, &offset, &stringLen, sizeof(stringLen)) != 0
+						|| offset + stringLen > record->argsLen) {
+						goto cut;
+					}
+					snprintf(conversion + specLen, sizeof(conversion) - specLen, ".*s");
+					written = snprintf(line + len, size - len, conversion, stringLen,
+									   (const char *)record->args + offset);
+					offset += stringLen;
+				}
+				break;
+			default:
+				break;
+		}
+		len += written < size - len ? written : size - len - 1;
+	}
+
+cut:
+	if (record->truncated) {
+		len += snprintf(line + len, size - len, "...");
+		if (len >= size) {
+			len = size - 1;
+		}
+	}
+	return len;
+}
+
+/**
+ * @brief Writes a record as one line with its time and level
+ */
+static void logger_write(LogRecord *record) {
+	// Only the writer thread formats, the time of day only changes once a second
+	static time_t second = -1;
+	static char clock[16];
+	if (record->time.tv_sec != second) {
+		struct tm time;
+		second = record->time.tv_sec;
+		localtime_r(&second, &time);
+		strftime(clock, sizeof(clock), "%H:%M:%S", &time);
+	}
+
+	char line[LOG_LINE_SIZE];
+	int len = snprintf(line, sizeof(line), "%s.%06ld %s: ", clock, record->time.tv_nsec / 1000,
+					   levelNames[record->level]);
+	len += logger_render(record, line + len, sizeof(line) - len - 1);
+	// Formats usually end with a newline, the writer adds it when they don't
+	if (line[len - 1] != '\n') {
+		line[len++] = '\n';
+	}
+	fwrite(line, 1, len, output);
+}
+
+/**
+ * @brief Unlinks and frees a ring whose thread exited
+ */
+static void logger_freeRing(LogRing *ring) {
+	pthread_mutex_lock(&ringsLock);
+	LogRing **link = &rings;
+	while (*link != ring) {
+		link = &(*link)->next;
+	}
+	__atomic_store_n(link, ring->next, __ATOMIC_RELEASE);
+	retiredDrops += ring->dropped;
+	pthread_mutex_unlock(&ringsLock);
+	free(ring);
+}
+
+/**
+ * @brief Writer thread, drains every ring in turn. Records of one thread stay in
+ * order, records of different threads are ordered by their printed times.
+ */
+static void *logger_writer(void *args) {
+	long sleepNs = LOG_BUSY_NS;
+	while (1) {
+		int written = 0;
+		LogRing *ring = __atomic_load_n(&rings, __ATOMIC_ACQUIRE);
+		while (ring != NULL) {
+			LogRing *next = ring->next;
+			// Read before head, so a retired ring is empty once head is reached
+			int retired = __atomic_load_n(&ring->retired, __ATOMIC_ACQUIRE);
+			unsigned long head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+			while (ring->tail != head) {
+				logger_write(&ring->records[ring->tail % LOG_RING_RECORDS]);
+				__atomic_store_n(&ring->tail, ring->tail + 1, __ATOMIC_RELEASE);
+				written++;
+			}
+
+			long dropped = __atomic_load_n(&ring->dropped, __ATOMIC_RELAXED);
+			if (dropped > ring->reportedDrops) {
+				fprintf(output, "WARN: %ld log records dropped, the writer fell behind\n",
+						dropped - ring->reportedDrops);
+				ring->reportedDrops = dropped;
+				written++;
+			}
+			if (retired) {
+				logger_freeRing(ring);
+			}
+			ring = next;
+		}
+
+		if (written > 0) {
+			fflush(output);
+		}
+		__atomic_add_fetch(&passes, 1, __ATOMIC_RELEASE);
+		if (written > 0) {
+			sleepNs = LOG_BUSY_NS;
+		}
+		else {
+			struct timespec idle = { 0, sleepNs };
+			nanosleep(&idle, NULL);
+			sleepNs = sleepNs * 2 < LOG_IDLE_NS ? sleepNs * 2 : LOG_IDLE_NS;
+		}
+	}
+	return NULL;
+}
+
+/**
+ * @brief Starts the writer thread. Until it is started every record is skipped.
+ *
+ * @params out Stream the writer thread writes to
+ * @params level Lowest level written
+ * @returns 0 on success, -1 if the writer thread couldn't be started
+ */
+int
+logger_start(FILE *out, int level) {
+	pthread_t writer;
+	output = out;
+	if (pthread_create(&writer, NULL, logger_writer, NULL) != 0) {
+		return -1;
+	}
+	pthread_detach(writer);
+	__atomic_store_n(&threshold, level, __ATOMIC_RELEASE);
+	return 0;
+}
+
+/**
+ * @brief Records a log line. The format must be a string literal, it is read when
+ * the writer formats the record. Supports the d i u x X o c s p e f g conversions
+ * with the hh h l ll z length modifiers, flags, width and precision.
+ *
+ * @params level Level of the record
+ * @params format printf style format
+ */
+void
+logger_log(int level, const char *format, ...) {
+	if (!logger_enabled(level)) {
+		return;
+	}
+	LogRing *ring = logger_local();
+	if (ring == NULL) {
+		return;
+	}
+
+	unsigned long head = ring->head;
+	if (head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) >= LOG_RING_RECORDS) {
+		__atomic_store_n(&ring->dropped, ring->dropped + 1, __ATOMIC_RELAXED);
+		return;
+	}
+
+	LogRecord *record = &ring->records[head % LOG_RING_RECORDS];
+	clock_gettime(CLOCK_REALTIME, &record->time);
+	record->format = format;
+	record->level = level;
+	record->truncated = 0;
+	record->argsLen = 0;
+	va_list args;
+	va_start(args, format);
+	logger_capture(record, format, args);
+	va_end(args);
+
+	// Publishes the record to the writer
+	__atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+}
+
+/**
+ * @brief Returns 1 if records at the level are written, callers can skip building
+ * their arguments otherwise
+ */
+int
+logger_enabled(int level) {
+	return level >= __atomic_load_n(&threshold, __ATOMIC_RELAXED);
+}
+
+/**
+ * @brief Waits until the writer thread wrote every record logged before the call
+ */
+void
+logger_flush() {
+	if (__atomic_load_n(&threshold, __ATOMIC_ACQUIRE) == LOG_LEVEL_OFF) {
+		return;
+	}
+	// The pass running now may have passed this thread's ring, the next one won't
+	unsigned long target = __atomic_load_n(&passes, __ATOMIC_ACQUIRE) + 2;
+	while (__atomic_load_n(&passes, __ATOMIC_ACQUIRE) < target) {
+		struct timespec wait = { 0, LOG_BUSY_NS };
+		nanosleep(&wait, NULL);
+	}
+}
+
+/**
+ * @brief Returns the number of records dropped because a thread's ring was full
+ */
+long
+logger_dropped() {
+	pthread_mutex_lock(&ringsLock);
+	long dropped = retiredDrops;
+	LogRing *ring;
+	for (ring = rings; ring != NULL; ring = ring->next) {
+		dropped += __atomic_load_n(&ring->dropped, __ATOMIC_RELAXED);
+	}
+	pthread_mutex_unlock(&ringsLock);
+	return dropped;
+}
+
+/**
+ * @brief Parses a level name
+ *
+ * @params name debug, info, warn, error or off
+ * @returns The level, -1 for an unknown name
+ */
+int
+logger_parseLevel(const char *name) {
+	static const char *names[] = { "debug", "info", "warn", "error", "off" };
+	int level;
+	for (level = LOG_LEVEL_DEBUG; level <= LOG_LEVEL_OFF; level++) {
+		if (strcmp(name, names[level]) == 0) {
+			return level;
+		}
+	}
+	return -1;
+}
@@ -0,0 +1,76 @@
+//
+// Logger header
+//
+// Threads log into their own ring of fixed size records without locks or formatting.
+// A record keeps the format string and a copy of the arguments, and a background
+// writer thread formats the records and writes them out. When a thread's ring is
+// full the record is dropped and counted instead of waiting for the writer.
+
+#pragma once
+#ifndef LOGGER_H_
+#define LOGGER_H_
+
+#include <stdio.h>
+
+/* Log levels, records below the configured level are skipped before any work */
+#define LOG_LEVEL_DEBUG 0
+#define LOG_LEVEL_INFO 1
+#define LOG_LEVEL_WARN 2
+#define LOG_LEVEL_ERROR 3
+#define LOG_LEVEL_OFF 4
+
+/* Records in every thread's ring */
+#define LOG_RING_RECORDS 256
+/* Size of a record, arguments that don't fit are cut off */
+#define LOG_RECORD_SIZE 256
+
+/**
+ * @brief Starts the writer thread. Until it is started every record is skipped.
+ *
+ * @params out Stream the writer thread writes to
+ * @params level Lowest level written
+ * @returns 0 on success, -1 if the writer thread couldn't be started
+ */
+int
+logger_start(FILE *out, int level);
+
+/**
+ * @brief Records a log line. The format must be a string literal, it is read when
+ * the writer formats the record. Supports the d i u x X o c s p e f g conversions
+ * with the hh h l ll z length modifiers, flags, width and precision.
+ *
+ * @params level Level of the record
+ * @params format printf style format
+ */
+void
+logger_log(int level, const char *format, ...) __attribute__((format(printf, 2, 3)));
+
+/**
+ * @brief Returns 1 if records at the level are written, callers can skip building
+ * their arguments otherwise
+ */
+int
+logger_enabled(int level);
+
+/**
+ * @brief Waits until the writer thread wrote every record logged before the call
+ */
+void
+logger_flush();
+
+/**
+ * @brief Returns the number of records dropped because a thread's ring was full
+ */
+long
+logger_dropped();
+
+/**
+ * @brief Parses a level name
+ *
+ * @params name debug, info, warn, error or off
+ * @returns The level, -1 for an unknown name
+ */
+int
+logger_parseLevel(const char *name);
+
+#endif
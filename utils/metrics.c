@@ -0,0 +1,266 @@
+//
+// Server metrics implementation
+
+#include "metrics.h"
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+/**
+ * A thread's metrics, linked into the list readers walk
+ */
+typedef struct _MetricsSlot
+{
+	Metrics metrics;
+	struct _MetricsSlot *next;
+	struct _MetricsSlot *prev;
+} MetricsSlot;
+
+static __thread MetricsSlot *local;
+static pthread_key_t slotKey;
+static pthread_once_t slotKeyOnce = PTHREAD_ONCE_INIT;
+
+/* Only taken when a thread starts or stops recording and by readers */
+static pthread_mutex_t slotsLock = PTHREAD_MUTEX_INITIALIZER;
+static MetricsSlot *slots;
+/* Totals of the threads that exited */
+static Metrics retired;
+
+/**
+ * @brief Adds every counter of a block to the totals
+ */
+static void metrics_add(Metrics *totals, Metrics *metrics) {
+	long *sum = (long *)totals;
+	long *counters = (long *)metrics;
+	size_t i;
+	for (i = 0; i < sizeof(Metrics) / sizeof(long); i++) {
+		sum[i] += __atomic_load_n(&counters[i], __ATOMIC_RELAXED);
+	}
+}
+
+/**
+ * @brief Folds an exiting thread's metrics into the retired totals
+ */
+static void metrics_releaseSlot(void *arg) {
+	MetricsSlot *slot = (MetricsSlot *)arg;
+	pthread_mutex_lock(&slotsLock);
+	metrics_add(&retired, &slot->metrics);
+	if (slot->prev != NULL) {
+		slot->prev->next = slot->next;
+	}
+	else {
+		slots = slot->next;
+	}
+	if (slot->next != NULL) {
+		slot->next->prev = slot->prev;
+	}
+	pthread_mutex_unlock(&slotsLock);
+	free(slot);
+}
+
+static void metrics_createKey() {
+	pthread_key_create(&slotKey, metrics_releaseSlot);
+}
+
+/**
+ * @brief The calling thread's metrics, registered on first use
+ */
+static Metrics *metrics_local() {
+	if (local == NULL) {
+		pthread_once(&slotKeyOnce, metrics_createKey);
+		local = (MetricsSlot *)calloc(1, sizeof(MetricsSlot));
+		pthread_mutex_lock(&slotsLock);
+		local->next = slots;
+		if (slots != NULL) {
+			slots->prev = local;
+		}
+		slots = local;
+		pthread_mutex_unlock(&slotsLock);
+		pthread_setspecific(slotKey, local);
+	}
+	return &local->metrics;
+}
+
+/**
+ * @brief Adds to a counter only the calling thread writes, readers may load it any time
+ */
+static void metrics_bump(long *counter, long amount) {
+	__atomic_store_n(counter, *counter + amount, __ATOMIC_RELAXED);
+}
+
+/**
+ * @brief Power of two bucket of a value
+ */
+static int metrics_bucket(unsigned long value) {
+	int bucket = value == 0 ? 0 : 64 - __builtin_clzl(value);
+	return bucket < METRICS_BUCKETS ? bucket : METRICS_BUCKETS - 1;
+}
+
+static int metrics_typeSlot(unsigned int type) {
+	return type < METRICS_PACKET_TYPES ? (int)type : METRICS_PACKET_TYPES - 1;
+}
+
+/**
+ * @brief Counts a received request
+ *
+ * @params type Packet type
+ * @params bytes Length of the serialized request
+ */
+void
+metrics_recordReceived(unsigned int type, int bytes) {
+	Metrics *metrics = metrics_local();
+	metrics_bump(&metrics->packetsIn[metrics_typeSlot(type)], 1);
+	metrics_bump(&metrics->bytesIn, bytes);
+}
+
+/**
+ * @brief Counts a packet handed to a connection's send path
+ *
+ * @params type Packet type
+ * @params bytes Length of the serialized packet
+ */
+void
+metrics_recordSent(unsigned int type, int bytes) {
+	Metrics *metrics = metrics_local();
+	metrics_bump(&metrics->packetsOut[metrics_typeSlot(type)], 1);
+	metrics_bump(&metrics->bytesOut, bytes);
+}
+
+/**
+ * @brief Counts packets of one type handed to a connection's send path together
+ *
+ * @params type Packet type
+ * @params packets Number of packets
+ * @params bytes Length of the serialized packets
+ */
+void
+metrics_recordSentPackets(unsigned int type, long packets, long bytes) {
+	Metrics *metrics = metrics_local();
+	metrics_bump(&metrics->packetsOut[metrics_typeSlot(type)], packets);
+	metrics_bump(&metrics->bytesOut, bytes);
+}
+
+/**
+ * @brief Counts an accepted connection
+ */
+void
+metrics_recordConnect() {
+	metrics_bump(&metrics_local()->connectionsOpened, 1);
+}
+
+/**
+ * @brief Counts a closed connection
+ */
+void
+metrics_recordDisconnect() {
+	metrics_bump(&metrics_local()->connectionsClosed, 1);
+}
+
+/**
+ * @brief Records the number of recipients of a broadcast
+ *
+ * @params recipients Members the message was forwarded to
+ */
+void
+metrics_recordFanOut(int recipients) {
+	metrics_bump(&metrics_local()->fanOut[metrics_bucket(recipients)], 1);
+}
+
+/**
+ * @brief Records how deep a send queue was after a packet had to wait in it
+ *
+ * @params bytes Bytes queued on the connection
+ */
+void
+metrics_recordQueueDepth(int bytes) {
+	metrics_bump(&metrics_local()->queueDepth[metrics_bucket(bytes)], 1);
+}
+
+/**
+ * @brief Records a message compressed for a session
+ *
+ * @params bytesIn Length of the text
+ * @params bytesOut Length of the compressed text
+ * @params ns Time compressing took
+ */
+void
+metrics_recordCompression(int bytesIn, int bytesOut, long ns) {
+	Metrics *metrics = metrics_local();
+	metrics_bump(&metrics->compressedMessages, 1);
+	metrics_bump(&metrics->compressionBytesIn, bytesIn);
+	metrics_bump(&metrics->compressionBytesOut, bytesOut);
+	metrics_bump(&metrics->compressionNs, ns);
+}
+
+/**
+ * @brief Records the bytes a compressed message saved over all of its recipients
+ *
+ * @params bytes Bytes saved, negative if compressing cost more than it saved
+ */
+void
+metrics_recordCompressionSaved(long bytes) {
+	metrics_bump(&metrics_local()->compressionSaved, bytes);
+}
+
+/**
+ * @brief Records the time a request handler took
+ *
+ * @params handler One of the HANDLER_* values
+ * @params ns Time spent in the handler
+ */
+void
+metrics_recordHandler(int handler, long ns) {
+	metrics_bump(&metrics_local()->handlerLatency[handler][metrics_bucket(ns > 0 ? ns : 0)], 1);
+}
+
+/**
+ * @brief Adds up the metrics of every thread. Threads keep recording meanwhile, so
+ * the totals are a close snapshot rather than an exact one.
+ *
+ * @params totals Filled with the sums
+ */
+void
+metrics_collect(Metrics *totals) {
+	memset(totals, 0, sizeof(Metrics));
+	pthread_mutex_lock(&slotsLock);
+	metrics_add(totals, &retired);
+	MetricsSlot *slot;
+	for (slot = slots; slot != NULL; slot = slot->next) {
+		metrics_add(totals, &slot->metrics);
+	}
+	pthread_mutex_unlock(&slotsLock);
+}
+
+/**
+ * @brief Finds the bucket below which the given fraction of a histogram's values fall
+ *
+ * @params histogram Histogram of METRICS_BUCKETS buckets
+ * @params fraction Fraction of the values, 0.5 for the median
+ * @returns Upper bound of the bucket, 0 for an empty histogram
+ */
+unsigned long
+metrics_percentile(long *histogram, double fraction) {
+	long target = (long)(metrics_count(histogram) * fraction);
+	long seen = 0;
+	int bucket;
+	for (bucket = 0; bucket < METRICS_BUCKETS; bucket++) {
+		seen += histogram[bucket];
+		if (seen > target) {
+			return bucket == 0 ? 0 : (1UL << bucket) - 1;
+		}
+	}
+	return 0;
+}
+
+/**
+ * @brief Number of values in a histogram
+ */
+long
+metrics_count(long *histogram) {
+	long count = 0;
+	int bucket;
+	for (bucket = 0; bucket < METRICS_BUCKETS; bucket++) {
+		count += histogram[bucket];
+	}
+	return count;
+}
@@ -0,0 +1,165 @@
+//
+// Server metrics header
+//
+// Every thread counts into its own Metrics block, so recording never takes a lock
+// or shares a cache line with another thread. Readers add up the blocks of all live
+// threads and the totals left behind by threads that exited.
+
+#pragma once
+#ifndef METRICS_H_
+#define METRICS_H_
+
+/* Packet types counted, larger types share the last slot */
+#define METRICS_PACKET_TYPES 32
+
+/* Histograms use power of two buckets, bucket i counts values below 2^i */
+#define METRICS_BUCKETS 32
+
+/* Request handlers with a latency histogram, one per chatServer_* handler */
+#define HANDLER_LOGIN 0
+#define HANDLER_EXIT 1
+#define HANDLER_JOIN 2
+#define HANDLER_LEAVE 3
+#define HANDLER_CREATE 4
+#define HANDLER_QUERY 5
+#define HANDLER_MESSAGE 6
+#define HANDLER_STATS 7
+#define HANDLER_UNKNOWN 8
+#define METRICS_HANDLERS 9
+
+/**
+ * Counters and histograms, all plain longs so blocks can be added up element-wise
+ */
+typedef struct _Metrics
+{
+	/* Requests received and packets sent, by type */
+	long packetsIn[METRICS_PACKET_TYPES];
+	long packetsOut[METRICS_PACKET_TYPES];
+	long bytesIn;
+	long bytesOut;
+	long connectionsOpened;
+	long connectionsClosed;
+	/* Recipients of every MESSAGE broadcast */
+	long fanOut[METRICS_BUCKETS];
+	/* Bytes in a send queue after a packet had to be queued */
+	long queueDepth[METRICS_BUCKETS];
+	/* Compressed broadcasts, their text before and after compression, the time
+	 * compressing took in ns, and the bytes saved over all of their recipients */
+	long compressedMessages;
+	long compressionBytesIn;
+	long compressionBytesOut;
+	long compressionNs;
+	long compressionSaved;
+	/* Time spent in each handler, in ns */
+	long handlerLatency[METRICS_HANDLERS][METRICS_BUCKETS];
+} Metrics;
+
+/**
+ * @brief Counts a received request
+ *
+ * @params type Packet type
+ * @params bytes Length of the serialized request
+ */
+void
+metrics_recordReceived(unsigned int type, int bytes);
+
+/**
+ * @brief Counts a packet handed to a connection's send path
+ *
+ * @params type Packet type
+ * @params bytes Length of the serialized packet
+ */
+void
+metrics_recordSent(unsigned int type, int bytes);
+
+/**
+ * @brief Counts packets of one type handed to a connection's send path together
+ *
+ * @params type Packet type
+ * @params packets Number of packets
+ * @params bytes Length of the serialized packets
+ */
+void
+metrics_recordSentPackets(unsigned int type, long packets, long bytes);
+
+/**
+ * @brief Counts an accepted connection
+ */
+void
+metrics_recordConnect();
+
+/**
+ * @brief Counts a closed connection
+ */
+void
+metrics_recordDisconnect();
+
+/**
+ * @brief Records the number of recipients of a broadcast
+ *
+ * @params recipients Members the message was forwarded to
+ */
+void
+metrics_recordFanOut(int recipients);
+
+/**
+ * @brief Records how deep a send queue was after a packet had to wait in it
+ *
+ * @params bytes Bytes queued on the connection
+ */
+void
+metrics_recordQueueDepth(int bytes);
+
+/**
+ * @brief Records a message compressed for a session
+ *
+ * @params bytesIn Length of the text
+ * @params bytesOut Length of the compressed text
+ * @params ns Time compressing took
+ */
+void
+metrics_recordCompression(int bytesIn, int bytesOut, long ns);
+
+/**
+ * @brief Records the bytes a compressed message saved over all of its recipients
+ *
+ * @params bytes Bytes saved, negative if compressing cost more than it saved
+ */
+void
+metrics_recordCompressionSaved(long bytes);
+
+/**
+ * @brief Records the time a request handler took
+ *
+ * @params handler One of the HANDLER_* values
+ * @params ns Time spent in the handler
+ */
+void
+metrics_recordHandler(int handler, long ns);
+
+/**
+ * @brief Adds up the metrics of every thread. Threads keep recording meanwhile, so
+ * the totals are a close snapshot rather than an exact one.
+ *
+ * @params totals Filled with the sums
+ */
+void
+metrics_collect(Metrics *totals);
+
+/**
+ * @brief Finds the bucket below which the given fraction of a histogram's values fall
+ *
+ * @params histogram Histogram of METRICS_BUCKETS buckets
+ * @params fraction Fraction of the values, 0.5 for the median
+ * @returns Upper bound of the bucket, 0 for an empty histogram
+ */
+unsigned long
+metrics_percentile(long *histogram, double fraction);
+
+/**
+ * @brief Number of values in a histogram
+ */
+long
+metrics_count(long *histogram);
+
+#endif
@@ -13,7 +13,8 @@
 #include <stdio.h>
 #include "printHelpers.h"
 
-#define LISTEN_QUEUE_DEPTH 16
+/* Event-loop mode accepts in bursts, let the kernel queue as many as allowed */
+#define LISTEN_QUEUE_DEPTH SOMAXCONN
 
 /** 
  * @brief Helper function to create a server socket, bind to it, and beginning
@@ -0,0 +1,203 @@
+//
+// Thread-local pool allocator implementation
+
+#include "pool.h"
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+/* Size class stored in the header of blocks that bypass the pool */
+#define POOL_HEAP_CLASS -1
+
+/* Allocations and frees a thread counts before adding them to the shared totals */
+#define POOL_STATS_BATCH 64
+
+/* Most free blocks one thread keeps per class, so idle threads hold little memory */
+static const int classLimits[POOL_CLASSES] = { 64, 64, 32, 16, 16 };
+static const size_t classSizes[POOL_CLASSES] = POOL_CLASS_SIZES;
+
+/**
+ * Precedes every block, keeps the payload 16 byte aligned like malloc
+ */
+typedef union _PoolHeader
+{
+	int sizeClass;
+	/* Link while the block sits on a free list */
+	union _PoolHeader *next;
+	max_align_t align;
+} PoolHeader;
+
+/**
+ * A thread's free lists
+ */
+typedef struct _PoolCache
+{
+	PoolHeader *free[POOL_CLASSES];
+	int count[POOL_CLASSES];
+	int registered;
+	/* Counts not yet added to poolStats, kept local so threads don't share a line */
+	long allocations;
+	long frees;
+} PoolCache;
+
+static __thread PoolCache cache;
+static pthread_key_t cacheKey;
+static pthread_once_t cacheKeyOnce = PTHREAD_ONCE_INIT;
+static int cachingEnabled = 1;
+static PoolStats poolStats;
+
+/**
+ * @brief Adds the thread's pending counts to the shared totals
+ */
+static void pool_flushStats(PoolCache *threadCache) {
+	__atomic_add_fetch(&poolStats.allocations, threadCache->allocations, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&poolStats.frees, threadCache->frees, __ATOMIC_RELAXED);
+	threadCache->allocations = threadCache->frees = 0;
+}
+
+/**
+ * @brief Hands a thread's free blocks back to the heap when it exits
+ */
+static void pool_releaseCache(void *arg) {
+	PoolCache *threadCache = (PoolCache *)arg;
+	int sizeClass;
+	pool_flushStats(threadCache);
+	for (sizeClass = 0; sizeClass < POOL_CLASSES; sizeClass++) {
+		while (threadCache->free[sizeClass] != NULL) {
+			PoolHeader *header = threadCache->free[sizeClass];
+			threadCache->free[sizeClass] = header->next;
+			free(header);
+		}
+		threadCache->count[sizeClass] = 0;
+	}
+}
+
+static void pool_createKey() {
+	pthread_key_create(&cacheKey, pool_releaseCache);
+}
+
+/**
+ * @brief Smallest class holding size bytes, POOL_HEAP_CLASS if none does
+ */
+static inline int pool_classFor(size_t size) {
+	int sizeClass;
+	for (sizeClass = 0; sizeClass < POOL_CLASSES; sizeClass++) {
+		if (size <= classSizes[sizeClass]) {
+			return sizeClass;
+		}
+	}
+	return POOL_HEAP_CLASS;
+}
+
+/**
+ * @brief Allocates an uninitialized block
+ *
+ * @params size Bytes needed, sizes past the largest class come from malloc directly
+ * @returns Block to release with pool_free, never with free
+ */
+void *
+pool_alloc(size_t size) {
+	int sizeClass = pool_classFor(size);
+	PoolHeader *header;
+
+	if (++cache.allocations == POOL_STATS_BATCH) {
+		pool_flushStats(&cache);
+	}
+	if (sizeClass != POOL_HEAP_CLASS && cache.free[sizeClass] != NULL) {
+		header = cache.free[sizeClass];
+		cache.free[sizeClass] = header->next;
+		cache.count[sizeClass]--;
+	}
+	else {
+		// Round up to the class so the block can serve any request of its class later
+		size_t blockSize = sizeClass != POOL_HEAP_CLASS ? classSizes[sizeClass] : size;
+		header = (PoolHeader *)malloc(sizeof(PoolHeader) + blockSize);
+		if (header == NULL) {
+			return NULL;
+		}
+		__atomic_add_fetch(&poolStats.heapAllocations, 1, __ATOMIC_RELAXED);
+	}
+
+	header->sizeClass = sizeClass;
+	return header + 1;
+}
+
+/**
+ * @brief Allocates a zeroed block
+ *
+ * @params size Bytes needed
+ * @returns Block to release with pool_free
+ */
+void *
+pool_calloc(size_t size) {
+	void *ptr = pool_alloc(size);
+	if (ptr != NULL) {
+		memset(ptr, 0, size);
+	}
+	return ptr;
+}
+
+/**
+ * @brief Returns a block to the calling thread's free list
+ *
+ * @params ptr Block from pool_alloc or pool_calloc, NULL is ignored
+ */
+void
+pool_free(void *ptr) {
+	if (ptr == NULL) {
+		return;
+	}
+
+	PoolHeader *header = (PoolHeader *)ptr - 1;
+	int sizeClass = header->sizeClass;
+	if (++cache.frees == POOL_STATS_BATCH) {
+		pool_flushStats(&cache);
+	}
+
+	if (sizeClass == POOL_HEAP_CLASS || !__atomic_load_n(&cachingEnabled, __ATOMIC_RELAXED) ||
+		cache.count[sizeClass] >= classLimits[sizeClass]) {
+		__atomic_add_fetch(&poolStats.heapFrees, 1, __ATOMIC_RELAXED);
+		free(header);
+		return;
+	}
+
+	// The first cached block registers the thread so its cache is freed on exit
+	if (!cache.registered) {
+		pthread_once(&cacheKeyOnce, pool_createKey);
+		pthread_setspecific(cacheKey, &cache);
+		cache.registered = 1;
+	}
+
+	header->next = cache.free[sizeClass];
+	cache.free[sizeClass] = header;
+	cache.count[sizeClass]++;
+}
+
+/**
+ * @brief Turns the free lists on or off for the whole process, so every allocation
+ * goes to the heap like before the pool. Meant for benchmarks.
+ *
+ * @params enabled 0 to bypass the free lists
+ */
+void
+pool_setCaching(int enabled) {
+	__atomic_store_n(&cachingEnabled, enabled, __ATOMIC_RELAXED);
+	if (!enabled) {
+		pool_releaseCache(&cache);
+	}
+}
+
+/**
+ * @brief Reads the process wide allocator metrics. Other threads' latest allocations
+ * and frees may not be counted yet, each adds them in batches.
+ *
+ * @params stats Filled with the current values
+ */
+void
+pool_getStats(PoolStats *stats) {
+	pool_flushStats(&cache);
+	stats->allocations = __atomic_load_n(&poolStats.allocations, __ATOMIC_RELAXED);
+	stats->heapAllocations = __atomic_load_n(&poolStats.heapAllocations, __ATOMIC_RELAXED);
+	stats->frees = __atomic_load_n(&poolStats.frees, __ATOMIC_RELAXED);
+	stats->heapFrees = __atomic_load_n(&poolStats.heapFrees, __ATOMIC_RELAXED);
+}
@@ -0,0 +1,78 @@
+//
+// Thread-local pool allocator header
+//
+// Packets, serialized frames and queue entries are allocated and freed for every
+// request. Each thread keeps a short free list per size class and reuses blocks from
+// it, only going to malloc when the list is empty and to free when it's full. Blocks
+// carry their size class, so any thread may free them.
+
+#pragma once
+#ifndef POOL_H_
+#define POOL_H_
+
+#include <stddef.h>
+
+/* Usable sizes of the pooled classes. 128 holds an empty Packet, the largest a full
+ * Packet or frame. */
+#define POOL_CLASS_SIZES { 64, 128, 256, 1024, 2176 }
+#define POOL_CLASSES 5
+
+/**
+ * Process wide allocator metrics
+ */
+typedef struct _PoolStats
+{
+	/* Calls to pool_alloc, each was a malloc or calloc before the pool */
+	long allocations;
+	/* Allocations the thread's free lists couldn't serve */
+	long heapAllocations;
+	long frees;
+	/* Frees that went back to the heap because the free list was full */
+	long heapFrees;
+} PoolStats;
+
+/**
+ * @brief Allocates an uninitialized block
+ *
+ * @params size Bytes needed, sizes past the largest class come from malloc directly
+ * @returns Block to release with pool_free, never with free
+ */
+void *
+pool_alloc(size_t size);
+
+/**
+ * @brief Allocates a zeroed block
+ *
+ * @params size Bytes needed
+ * @returns Block to release with pool_free
+ */
+void *
+pool_calloc(size_t size);
+
+/**
+ * @brief Returns a block to the calling thread's free list
+ *
+ * @params ptr Block from pool_alloc or pool_calloc, NULL is ignored
+ */
+void
+pool_free(void *ptr);
+
+/**
+ * @brief Turns the free lists on or off for the whole process, so every allocation
+ * goes to the heap like before the pool. Meant for benchmarks.
+ *
+ * @params enabled 0 to bypass the free lists
+ */
+void
+pool_setCaching(int enabled);
+
+/**
+ * @brief Reads the process wide allocator metrics. Other threads' latest allocations
+ * and frees may not be counted yet, each adds them in batches.
+ *
+ * @params stats Filled with the current values
+ */
+void
+pool_getStats(PoolStats *stats);
+
+#endif
@@ -0,0 +1,284 @@
+//
+// Outbound send queue implementation
+
+#include "sendQueue.h"
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* Process wide metrics, updated atomically from every connection */
+static SendQueueStats queueStats;
+
+/**
+ * @brief Adjusts the global byte and packet gauges, tracking the peak
+ */
+static void sq_account(long bytes, long packets) {
+	long total = __atomic_add_fetch(&queueStats.queuedBytes, bytes, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&queueStats.queuedPackets, packets, __ATOMIC_RELAXED);
+
+	long peak = __atomic_load_n(&queueStats.peakQueuedBytes, __ATOMIC_RELAXED);
+	while (total > peak &&
+		   !__atomic_compare_exchange_n(&queueStats.peakQueuedBytes, &peak, total, 1,
+										__ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+	}
+}
+
+/**
+ * @brief Appends a reference to the buffer to the end of the queue
+ *
+ * @params queue SendQueue to append to
+ * @params buffer Serialized packet, retained by the queue
+ * @params offset Bytes of the buffer already sent
+ */
+void
+sq_push(SendQueue *queue, SharedBuffer *buffer, int offset)
+{
+	SendQueueEntry *entry = (SendQueueEntry *)pool_alloc(sizeof(SendQueueEntry));
+	entry->next = NULL;
+	entry->buffer = sb_retain(buffer);
+	entry->offset = offset;
+
+	if (queue->tail == NULL) {
+		queue->head = queue->tail = entry;
+	}
+	else {
+		queue->tail->next = entry;
+		queue->tail = entry;
+	}
+
+	queue->count++;
+	queue->bytes += buffer->len - offset;
+	sq_account(buffer->len - offset, 1);
+}
+
+/**
+ * @brief Moves every entry of another queue to the end of the queue
+ *
+ * @params queue SendQueue to append to
+ * @params other SendQueue to empty, none of its entries may be pinned
+ */
+void
+sq_append(SendQueue *queue, SendQueue *other)
+{
+	if (other->head == NULL) {
+		return;
+	}
+	if (queue->tail == NULL) {
+		queue->head = other->head;
+	}
+	else {
+		queue->tail->next = other->head;
+	}
+	queue->tail = other->tail;
+	queue->count += other->count;
+	queue->bytes += other->bytes;
+	memset(other, 0, sizeof(SendQueue));
+}
+
+/**
+ * @brief Unlinks and frees an entry, prev is NULL for the head
+ */
+static void sq_unlink(SendQueue *queue, SendQueueEntry *prev, SendQueueEntry *entry) {
+	if (prev == NULL) {
+		queue->head = entry->next;
+	}
+	else {
+		prev->next = entry->next;
+	}
+	if (queue->tail == entry) {
+		queue->tail = prev;
+	}
+
+	int remaining = entry->buffer->len - entry->offset;
+	queue->count--;
+	queue->bytes -= remaining;
+	sq_account(-remaining, -1);
+
+	sb_release(entry->buffer);
+	pool_free(entry);
+}
+
+/**
+ * @brief Removes the head entry and releases its buffer
+ *
+ * @params queue SendQueue to pop from
+ */
+void
+sq_pop(SendQueue *queue)
+{
+	if (queue->head == NULL) {
+		return;
+	}
+	if (queue->pinned > 0) {
+		queue->pinned--;
+	}
+	sq_unlink(queue, NULL, queue->head);
+}
+
+/**
+ * @brief Records that the head entry's bytes were partly or fully sent, popping it
+ * once complete
+ *
+ * @params queue SendQueue to update
+ * @params sent Number of bytes of the head entry that were sent
+ */
+void
+sq_consume(SendQueue *queue, int sent)
+{
+	SendQueueEntry *entry = queue->head;
+	if (entry == NULL || sent <= 0) {
+		return;
+	}
+
+	if (entry->offset + sent >= entry->buffer->len) {
+		sq_pop(queue);
+		return;
+	}
+	entry->offset += sent;
+	queue->bytes -= sent;
+	sq_account(-sent, 0);
+}
+
+/**
+ * @brief Drops the oldest entries that were not started or handed to the kernel
+ * until the queue holds at most maxBytes
+ *
+ * @params queue SendQueue to trim
+ * @params maxBytes Size the queue must fit into
+ * @returns Number of dropped packets
+ */
+int
+sq_dropOldest(SendQueue *queue, int maxBytes)
+{
+	SendQueueEntry *prev = NULL;
+	SendQueueEntry *entry = queue->head;
+	int skipped = 0, dropped = 0;
+
+	// Pinned entries and a partly written head must go out whole
+	while (entry != NULL && (skipped < queue->pinned || entry->offset > 0)) {
+		prev = entry;
+		entry = entry->next;
+		skipped++;
+	}
+
+	while (entry != NULL && queue->bytes > maxBytes) {
+		SendQueueEntry *next = entry->next;
+		sq_unlink(queue, prev, entry);
+		entry = next;
+		dropped++;
+	}
+
+	return dropped;
+}
+
+/**
+ * @brief Writes as much of the queue as the socket accepts without blocking
+ *
+ * @params queue SendQueue to write
+ * @params socket Socket to write to
+ * @returns 1 if the queue was drained, 0 if data remains, -1 if the socket failed
+ */
+int
+sq_write(SendQueue *queue, int socket)
+{
+	while (queue->head != NULL) {
+		struct iovec iov[SEND_QUEUE_MAX_IOV];
+		int count = 0;
+		SendQueueEntry *entry = queue->head;
+		while (entry != NULL && count < SEND_QUEUE_MAX_IOV) {
+			iov[count].iov_base = entry->buffer->data + entry->offset;
+			iov[count].iov_len = entry->buffer->len - entry->offset;
+			count++;
+			entry = entry->next;
+		}
+
+		struct msghdr msg;
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_iov = iov;
+		msg.msg_iovlen = count;
+
+		ssize_t sent = sendmsg(socket, &msg, MSG_DONTWAIT | MSG_NOSIGNAL);
+		if (sent < 0) {
+			if (errno == EINTR) continue;
+			if (errno == EAGAIN || errno == EWOULDBLOCK) return 0;
+			return -1;
+		}
+
+		// Pop every fully written entry, advance into the partial one
+		while (sent > 0 && queue->head != NULL) {
+			int remaining = queue->head->buffer->len - queue->head->offset;
+			int step = sent < remaining ? (int)sent : remaining;
+			sq_consume(queue, step);
+			sent -= step;
+		}
+	}
+
+	return 1;
+}
+
+/**
+ * @brief Releases every entry that isn't pinned
+ *
+ * @params queue SendQueue to clear
+ */
+void
+sq_clear(SendQueue *queue)
+{
+	SendQueueEntry *prev = NULL;
+	SendQueueEntry *entry = queue->head;
+	int skipped = 0;
+
+	while (entry != NULL && skipped < queue->pinned) {
+		prev = entry;
+		entry = entry->next;
+		skipped++;
+	}
+	while (entry != NULL) {
+		SendQueueEntry *next = entry->next;
+		sq_unlink(queue, prev, entry);
+		entry = next;
+	}
+}
+
+/**
+ * @brief Counts a packet lost to the overflow policy
+ *
+ * @params disconnect 1 if the connection was dropped, 0 if the packet was dropped
+ */
+void
+sq_recordOverflow(int disconnect)
+{
+	if (disconnect) {
+		__atomic_add_fetch(&queueStats.overflowDisconnects, 1, __ATOMIC_RELAXED);
+	}
+	else {
+		__atomic_add_fetch(&queueStats.droppedPackets, 1, __ATOMIC_RELAXED);
+	}
+}
+
+/**
+ * @brief Counts a sender paused by backpressure
+ */
+void
+sq_recordPause()
+{
+	__atomic_add_fetch(&queueStats.backpressurePauses, 1, __ATOMIC_RELAXED);
+}
+
+/**
+ * @brief Copies the process wide queue metrics
+ *
+ * @params stats Returns the metrics
+ */
+void
+sq_getStats(SendQueueStats *stats)
+{
+	stats->queuedBytes = __atomic_load_n(&queueStats.queuedBytes, __ATOMIC_RELAXED);
+	stats->queuedPackets = __atomic_load_n(&queueStats.queuedPackets, __ATOMIC_RELAXED);
+	stats->peakQueuedBytes = __atomic_load_n(&queueStats.peakQueuedBytes, __ATOMIC_RELAXED);
+	stats->droppedPackets = __atomic_load_n(&queueStats.droppedPackets, __ATOMIC_RELAXED);
+	stats->overflowDisconnects = __atomic_load_n(&queueStats.overflowDisconnects, __ATOMIC_RELAXED);
+	stats->backpressurePauses = __atomic_load_n(&queueStats.backpressurePauses, __ATOMIC_RELAXED);
+}
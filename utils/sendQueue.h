@@ -0,0 +1,145 @@
+//
+// Outbound send queue header
+
+#pragma once
+#ifndef SENDQUEUE_H_
+#define SENDQUEUE_H_
+
+#include "sharedBuffer.h"
+
+/* What happens when a packet doesn't fit a connection's send queue */
+#define OVERFLOW_DROP_OLDEST 0
+#define OVERFLOW_DISCONNECT 1
+#define OVERFLOW_BACKPRESSURE 2
+
+/* Default per-connection send queue limit in bytes */
+#define SEND_QUEUE_DEFAULT_LIMIT (1024*1024)
+
+/* Maximum number of queued packets written with one writev() */
+#define SEND_QUEUE_MAX_IOV 64
+
+typedef struct _SendQueueEntry
+{
+	struct _SendQueueEntry *next;
+	SharedBuffer *buffer;
+	/* Bytes of the buffer already written */
+	int offset;
+} SendQueueEntry;
+
+/**
+ * FIFO of references to serialized packets waiting for the socket to become
+ * writable. Guarded by the owning connection's socketLock.
+ */
+typedef struct _SendQueue
+{
+	SendQueueEntry *head;
+	SendQueueEntry *tail;
+	int count;
+	/* Unsent bytes across all entries */
+	int bytes;
+	/* Entries at the head handed to the kernel, they can't be dropped */
+	int pinned;
+} SendQueue;
+
+/**
+ * Process wide queue metrics
+ */
+typedef struct _SendQueueStats
+{
+	long queuedBytes;
+	long queuedPackets;
+	long peakQueuedBytes;
+	long droppedPackets;
+	long overflowDisconnects;
+	long backpressurePauses;
+} SendQueueStats;
+
+/**
+ * @brief Appends a reference to the buffer to the end of the queue
+ *
+ * @params queue SendQueue to append to
+ * @params buffer Serialized packet, retained by the queue
+ * @params offset Bytes of the buffer already sent
+ */
+void
+sq_push(SendQueue *queue, SharedBuffer *buffer, int offset);
+
+/**
+ * @brief Moves every entry of another queue to the end of the queue
+ *
+ * @params queue SendQueue to append to
+ * @params other SendQueue to empty, none of its entries may be pinned
+ */
+void
+sq_append(SendQueue *queue, SendQueue *other);
+
+/**
+ * @brief Removes the head entry and releases its buffer
+ *
+ * @params queue SendQueue to pop from
+ */
+void
+sq_pop(SendQueue *queue);
+
+/**
+ * @brief Records that the head entry's bytes were partly or fully sent, popping it
+ * once complete
+ *
+ * @params queue SendQueue to update
+ * @params sent Number of bytes of the head entry that were sent
+ */
+void
+sq_consume(SendQueue *queue, int sent);
+
+/**
+ * @brief Drops the oldest entries that were not started or handed to the kernel
+ * until the queue holds at most maxBytes
+ *
+ * @params queue SendQueue to trim
+ * @params maxBytes Size the queue must fit into
+ * @returns Number of dropped packets
+ */
+int
+sq_dropOldest(SendQueue *queue, int maxBytes);
+
+/**
+ * @brief Writes as much of the queue as the socket accepts without blocking
+ *
+ * @params queue SendQueue to write
+ * @params socket Socket to write to
+ * @returns 1 if the queue was drained, 0 if data remains, -1 if the socket failed
+ */
+int
+sq_write(SendQueue *queue, int socket);
+
+/**
+ * @brief Releases every entry that isn't pinned
+ *
+ * @params queue SendQueue to clear
+ */
+void
+sq_clear(SendQueue *queue);
+
+/**
+ * @brief Counts a packet lost to the overflow policy
+ *
+ * @params disconnect 1 if the connection was dropped, 0 if the packet was dropped
+ */
+void
+sq_recordOverflow(int disconnect);
+
+/**
+ * @brief Counts a sender paused by backpressure
+ */
+void
+sq_recordPause();
+
+/**
+ * @brief Copies the process wide queue metrics
+ *
+ * @params stats Returns the metrics
+ */
+void
+sq_getStats(SendQueueStats *stats);
+
+#endif
@@ -0,0 +1,443 @@
+//
+// Session log implementation
+
+#include "sessionLog.h"
+#include "transport.h"
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+/* Process wide metrics, updated atomically from every log */
+static SessionLogStats logStats;
+
+/**
+ * @brief Writes the path of a segment file, buf holds at least
+ * strlen(log->path) + LOG_SEGMENT_NAME_LEN + 2 bytes
+ */
+static void sessionLog_segmentPath(SessionLog *log, unsigned long firstSeq, char *buf) {
+	sprintf(buf, "%s/%020lu.log", log->path, firstSeq);
+}
+
+/**
+ * @brief Adds an index entry for the message about to be written at offset
+ */
+static void sessionLog_indexMessage(LogSegment *segment, unsigned long seq, long offset) {
+	if (segment->indexCount == segment->indexCapacity) {
+		segment->indexCapacity = segment->indexCapacity > 0 ? segment->indexCapacity * 2 : 16;
+		segment->index = (LogIndexEntry *)realloc(segment->index, segment->indexCapacity * sizeof(LogIndexEntry));
+	}
+	segment->index[segment->indexCount].seq = seq;
+	segment->index[segment->indexCount].offset = offset;
+	segment->indexCount++;
+}
+
+/**
+ * @brief Unmaps and frees a segment, closing its file if it's still open
+ */
+static void sessionLog_freeSegment(LogSegment *segment) {
+	if (segment->map != NULL) {
+		munmap(segment->map, segment->mapLen);
+	}
+	if (segment->fd >= 0) {
+		close(segment->fd);
+	}
+	free(segment->index);
+	free(segment);
+}
+
+/**
+ * @brief Maps an open segment file. Segments still appended to are mapped at their
+ * full size up front, the mapping shows what's written to the file later.
+ *
+ * @returns 0 on success, -1 if it couldn't be mapped
+ */
+static int sessionLog_mapSegment(LogSegment *segment, long mapLen) {
+	segment->mapLen = mapLen;
+	segment->map = (unsigned char *)mmap(NULL, mapLen, PROT_READ, MAP_SHARED, segment->fd, 0);
+	if (segment->map == MAP_FAILED) {
+		segment->map = NULL;
+		return -1;
+	}
+	return 0;
+}
+
+/**
+ * @brief Adds a segment to the end of the log
+ */
+static void sessionLog_linkSegment(SessionLog *log, LogSegment *segment) {
+	if (log->tail == NULL) {
+		log->head = log->tail = segment;
+	}
+	else {
+		log->tail->next = segment;
+		log->tail = segment;
+	}
+	log->bytes += segment->size;
+}
+
+/**
+ * @brief Starts a new, empty segment at the end of the log
+ *
+ * @returns 0 on success, -1 if the file couldn't be created
+ */
+static int sessionLog_createSegment(SessionLog *log, unsigned long firstSeq) {
+	char path[strlen(log->path) + LOG_SEGMENT_NAME_LEN + 2];
+	sessionLog_segmentPath(log, firstSeq, path);
+
+	LogSegment *segment = (LogSegment *)calloc(1, sizeof(LogSegment));
+	segment->firstSeq = firstSeq;
+	segment->fd = open(path, O_RDWR | O_CREAT | O_TRUNC | O_APPEND, 0644);
+	if (segment->fd < 0 || sessionLog_mapSegment(segment, log->segmentBytes) != 0) {
+		sessionLog_freeSegment(segment);
+		return -1;
+	}
+	sessionLog_linkSegment(log, segment);
+	__atomic_add_fetch(&logStats.segmentsCreated, 1, __ATOMIC_RELAXED);
+	return 0;
+}
+
+/**
+ * @brief Opens a segment found on disk, indexing its messages and cutting off a
+ * message a crash left half written
+ *
+ * @params last 1 for the newest segment, which stays open for appending
+ * @returns 0 on success, -1 if it couldn't be opened
+ */
+static int sessionLog_recoverSegment(SessionLog *log, unsigned long firstSeq, int last) {
+	char path[strlen(log->path) + LOG_SEGMENT_NAME_LEN + 2];
+	sessionLog_segmentPath(log, firstSeq, path);
+
+	LogSegment *segment = (LogSegment *)calloc(1, sizeof(LogSegment));
+	segment->firstSeq = firstSeq;
+	segment->fd = open(path, O_RDWR | O_APPEND);
+	struct stat st;
+	if (segment->fd < 0 || fstat(segment->fd, &st) != 0) {
+		sessionLog_freeSegment(segment);
+		return -1;
+	}
+	if (st.st_size == 0 && !last) {
+		sessionLog_freeSegment(segment);
+		unlink(path);
+		return 0;
+	}
+	long mapLen = st.st_size;
+	if (last && mapLen < log->segmentBytes) {
+		mapLen = log->segmentBytes;
+	}
+	if (sessionLog_mapSegment(segment, mapLen) != 0) {
+		sessionLog_freeSegment(segment);
+		return -1;
+	}
+
+	long offset = 0;
+	while (offset < st.st_size) {
+		long remaining = st.st_size - offset;
+		int len = frameLength(segment->map + offset, remaining < INT_MAX ? (int)remaining : INT_MAX);
+		if (len <= 0) {
+			break;
+		}
+		if (segment->count % LOG_INDEX_INTERVAL == 0) {
+			sessionLog_indexMessage(segment, firstSeq + segment->count, offset);
+		}
+		offset += len;
+		segment->count++;
+	}
+	if (offset < st.st_size && ftruncate(segment->fd, offset) != 0) {
+		sessionLog_freeSegment(segment);
+		return -1;
+	}
+	segment->size = offset;
+
+	if (!last) {
+		close(segment->fd);
+		segment->fd = -1;
+	}
+	sessionLog_linkSegment(log, segment);
+	return 0;
+}
+
+/**
+ * @brief Orders sequence numbers for qsort
+ */
+static int sessionLog_compareSeq(const void *a, const void *b) {
+	unsigned long x = *(const unsigned long *)a, y = *(const unsigned long *)b;
+	return x < y ? -1 : x > y;
+}
+
+/**
+ * @brief Opens the segments in the log's directory, oldest first
+ *
+ * @returns 0 on success, -1 if one couldn't be opened
+ */
+static int sessionLog_recover(SessionLog *log) {
+	DIR *dir = opendir(log->path);
+	if (dir == NULL) {
+		return -1;
+	}
+	unsigned long *seqs = NULL;
+	int count = 0, capacity = 0;
+	struct dirent *entry;
+	while ((entry = readdir(dir)) != NULL) {
+		char *end;
+		unsigned long seq = strtoul(entry->d_name, &end, 10);
+		if (strlen(entry->d_name) != LOG_SEGMENT_NAME_LEN || strcmp(end, ".log") != 0) {
+			continue;
+		}
+		if (count == capacity) {
+			capacity = capacity > 0 ? capacity * 2 : 16;
+			seqs = (unsigned long *)realloc(seqs, capacity * sizeof(unsigned long));
+		}
+		seqs[count++] = seq;
+	}
+	closedir(dir);
+
+	if (count > 0) {
+		qsort(seqs, count, sizeof(unsigned long), &sessionLog_compareSeq);
+	}
+	int i, result = 0;
+	for (i = 0; i < count && result == 0; i++) {
+		result = sessionLog_recoverSegment(log, seqs[i], i == count - 1);
+	}
+	free(seqs);
+	return result;
+}
+
+/**
+ * @brief Opens a session's log, creating it if it doesn't exist. Messages a crash
+ * left half written at the end of a segment are cut off.
+ *
+ * @params directory Directory holding the logs of all sessions
+ * @params name Session name
+ * @params segmentBytes Size a segment rolls over at, at least LOG_MIN_SEGMENT_BYTES
+ * @params retainBytes Size the oldest segments are deleted above
+ * @returns New SessionLog, NULL if the directory or a segment can't be opened
+ */
+SessionLog *
+sessionLog_open(const char *directory, const char *name, long segmentBytes, long retainBytes) {
+	if (mkdir(directory, 0755) != 0 && errno != EEXIST) {
+		return NULL;
+	}
+
+	// Session names are chosen by clients, the directory is named after their hex
+	int nameLen = strlen(name), i;
+	SessionLog *log = (SessionLog *)calloc(1, sizeof(SessionLog));
+	log->path = (char *)malloc(strlen(directory) + 2 * nameLen + 2);
+	char *hex = log->path + sprintf(log->path, "%s/", directory);
+	for (i = 0; i < nameLen; i++) {
+		sprintf(hex + 2 * i, "%02x", (unsigned char)name[i]);
+	}
+	log->segmentBytes = segmentBytes > LOG_MIN_SEGMENT_BYTES ? segmentBytes : LOG_MIN_SEGMENT_BYTES;
+	log->retainBytes = retainBytes;
+
+	if ((mkdir(log->path, 0755) != 0 && errno != EEXIST) || sessionLog_recover(log) != 0) {
+		sessionLog_close(log);
+		return NULL;
+	}
+	if (log->tail == NULL) {
+		if (sessionLog_createSegment(log, 0) != 0) {
+			sessionLog_close(log);
+			return NULL;
+		}
+	}
+	log->nextSeq = log->tail->firstSeq + log->tail->count;
+	return log;
+}
+
+/**
+ * @brief Deletes the oldest segments until the log fits its retention limit. The
+ * segment appended to is always kept.
+ */
+static void sessionLog_retain(SessionLog *log) {
+	while (log->bytes > log->retainBytes && log->head != log->tail) {
+		LogSegment *oldest = log->head;
+		char path[strlen(log->path) + LOG_SEGMENT_NAME_LEN + 2];
+		sessionLog_segmentPath(log, oldest->firstSeq, path);
+		unlink(path);
+		log->head = oldest->next;
+		log->bytes -= oldest->size;
+		sessionLog_freeSegment(oldest);
+		__atomic_add_fetch(&logStats.segmentsDeleted, 1, __ATOMIC_RELAXED);
+	}
+}
+
+/**
+ * @brief Appends a serialized packet, rolling over to a new segment if it doesn't fit
+ *
+ * @params log SessionLog to append to
+ * @params parts Pieces of the packet, written with one writev
+ * @params count Number of pieces
+ * @returns Sequence number of the message, -1 if it couldn't be written
+ */
+long
+sessionLog_append(SessionLog *log, const struct iovec *parts, int count) {
+	long len = 0;
+	int i;
+	for (i = 0; i < count; i++) {
+		len += parts[i].iov_len;
+	}
+	if (len > log->segmentBytes) {
+		return -1;
+	}
+
+	LogSegment *segment = log->tail;
+	if (segment->size + len > segment->mapLen ||
+		(segment->size > 0 && segment->size + len > log->segmentBytes)) {
+		// Sealed segments are only read, through their mapping or a file opened for a replay
+		close(segment->fd);
+		segment->fd = -1;
+		if (sessionLog_createSegment(log, log->nextSeq) != 0) {
+			return -1;
+		}
+		sessionLog_retain(log);
+		segment = log->tail;
+	}
+
+	ssize_t written = writev(segment->fd, parts, count);
+	if (written != len) {
+		// Leave no half written message behind, recovery would cut off everything after it
+		if (written > 0) {
+			int truncated = ftruncate(segment->fd, segment->size);
+			(void)truncated;
+		}
+		return -1;
+	}
+	if (segment->count % LOG_INDEX_INTERVAL == 0) {
+		sessionLog_indexMessage(segment, log->nextSeq, segment->size);
+	}
+	segment->size += len;
+	segment->count++;
+	log->bytes += len;
+	__atomic_add_fetch(&logStats.appendedMessages, 1, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&logStats.appendedBytes, len, __ATOMIC_RELAXED);
+	return (long)log->nextSeq++;
+}
+
+/**
+ * @brief Sequence number of the oldest message the log still holds
+ */
+unsigned long
+sessionLog_first(SessionLog *log) {
+	return log->head->firstSeq;
+}
+
+/**
+ * @brief Finds a message's offset in its segment, from the closest index entry
+ * before it
+ */
+static long sessionLog_offsetOf(LogSegment *segment, unsigned long seq) {
+	int low = 0, high = segment->indexCount - 1;
+	while (low < high) {
+		int mid = (low + high + 1) / 2;
+		if (segment->index[mid].seq <= seq) {
+			low = mid;
+		}
+		else {
+			high = mid - 1;
+		}
+	}
+
+	// The mapping is only read up to the next indexed message
+	unsigned long current = segment->index[low].seq;
+	long offset = segment->index[low].offset;
+	while (current < seq) {
+		long remaining = segment->size - offset;
+		offset += frameLength(segment->map + offset, remaining < INT_MAX ? (int)remaining : INT_MAX);
+		current++;
+	}
+	return offset;
+}
+
+/**
+ * @brief Hands the messages between two sequence numbers to the visitor, one range
+ * per segment, without reading them
+ *
+ * @params log SessionLog to replay
+ * @params fromSeq First message to replay, older ones than the log holds are skipped
+ * @params toSeq Message to stop before
+ * @params visitor Called for every range
+ * @params context Passed through to the visitor
+ * @returns Number of messages replayed, -1 if a segment couldn't be opened or the
+ * visitor stopped
+ */
+long
+sessionLog_replay(SessionLog *log, unsigned long fromSeq, unsigned long toSeq, LogReplayVisitor visitor,
+				  void *context) {
+	long replayed = 0, replayedBytes = 0;
+	LogSegment *segment;
+	for (segment = log->head; segment != NULL && segment->firstSeq < toSeq; segment = segment->next) {
+		unsigned long endSeq = segment->firstSeq + segment->count;
+		if (segment->count == 0 || endSeq <= fromSeq) {
+			continue;
+		}
+		unsigned long startSeq = fromSeq > segment->firstSeq ? fromSeq : segment->firstSeq;
+		long offset = sessionLog_offsetOf(segment, startSeq);
+		long endOffset = segment->size;
+		if (endSeq > toSeq) {
+			endSeq = toSeq;
+			endOffset = sessionLog_offsetOf(segment, toSeq);
+		}
+
+		int fd = segment->fd;
+		if (fd < 0) {
+			char path[strlen(log->path) + LOG_SEGMENT_NAME_LEN + 2];
+			sessionLog_segmentPath(log, segment->firstSeq, path);
+			fd = open(path, O_RDONLY);
+			if (fd < 0) {
+				return -1;
+			}
+		}
+		int result = visitor(fd, offset, endOffset - offset, endSeq - startSeq, segment->map + offset, context);
+		if (fd != segment->fd) {
+			close(fd);
+		}
+		if (result != 0) {
+			return -1;
+		}
+		replayed += endSeq - startSeq;
+		replayedBytes += endOffset - offset;
+	}
+	__atomic_add_fetch(&logStats.replayedMessages, replayed, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&logStats.replayedBytes, replayedBytes, __ATOMIC_RELAXED);
+	return replayed;
+}
+
+/**
+ * @brief Closes the log, the segment files stay
+ *
+ * @params log SessionLog to close, may be NULL
+ */
+void
+sessionLog_close(SessionLog *log) {
+	if (log == NULL) {
+		return;
+	}
+	while (log->head != NULL) {
+		LogSegment *next = log->head->next;
+		sessionLog_freeSegment(log->head);
+		log->head = next;
+	}
+	free(log->path);
+	free(log);
+}
+
+/**
+ * @brief Copies the process wide log metrics
+ *
+ * @params stats Returns the metrics
+ */
+void
+sessionLog_getStats(SessionLogStats *stats) {
+	stats->appendedMessages = __atomic_load_n(&logStats.appendedMessages, __ATOMIC_RELAXED);
+	stats->appendedBytes = __atomic_load_n(&logStats.appendedBytes, __ATOMIC_RELAXED);
+	stats->segmentsCreated = __atomic_load_n(&logStats.segmentsCreated, __ATOMIC_RELAXED);
+	stats->segmentsDeleted = __atomic_load_n(&logStats.segmentsDeleted, __ATOMIC_RELAXED);
+	stats->replayedMessages = __atomic_load_n(&logStats.replayedMessages, __ATOMIC_RELAXED);
+	stats->replayedBytes = __atomic_load_n(&logStats.replayedBytes, __ATOMIC_RELAXED);
+}
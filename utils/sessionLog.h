@@ -0,0 +1,162 @@
+//
+// Session log header
+//
+// Append-only log of a session's messages that outlives the server. Messages are
+// stored as serialized packets, back to back, in segment files named after the
+// sequence number of their first message. A segment is memory mapped, so finding a
+// message only touches the page cache, and a range of messages can be handed to
+// sendfile as it is. A sparse index per segment maps every LOG_INDEX_INTERVAL-th
+// sequence number to its file offset. Once a segment is full the log rolls over to
+// a new one, and the oldest segments are deleted when the log outgrows its
+// retention limit. The log is not thread safe, callers serialize access to it.
+
+#pragma once
+#ifndef SESSIONLOG_H_
+#define SESSIONLOG_H_
+
+#include <sys/uio.h>
+
+/* Messages between entries of a segment's index */
+#define LOG_INDEX_INTERVAL 64
+
+/* Smallest segment size, every message has to fit a segment */
+#define LOG_MIN_SEGMENT_BYTES (64*1024)
+
+/* File name length of a segment, its first sequence number in 20 digits */
+#define LOG_SEGMENT_NAME_LEN 24
+
+/**
+ * Offset of a message in a segment file
+ */
+typedef struct _LogIndexEntry
+{
+	unsigned long seq;
+	long offset;
+} LogIndexEntry;
+
+/**
+ * A segment file and its mapping
+ */
+typedef struct _LogSegment
+{
+	struct _LogSegment *next;
+	/* Sequence number of the first message, also the file name */
+	unsigned long firstSeq;
+	/* Messages and bytes in the file */
+	unsigned long count;
+	long size;
+	/* Open while the segment is appended to, -1 once it's sealed */
+	int fd;
+	/* Read only mapping of mapLen bytes, only the first size of them are read */
+	unsigned char *map;
+	long mapLen;
+	LogIndexEntry *index;
+	int indexCount;
+	int indexCapacity;
+} LogSegment;
+
+typedef struct _SessionLog
+{
+	/* Directory of the session's segments */
+	char *path;
+	/* Oldest segment first, the last one is appended to */
+	LogSegment *head;
+	LogSegment *tail;
+	/* Sequence number of the next message */
+	unsigned long nextSeq;
+	/* Bytes in all segments */
+	long bytes;
+	long segmentBytes;
+	long retainBytes;
+} SessionLog;
+
+/**
+ * Process wide log metrics
+ */
+typedef struct _SessionLogStats
+{
+	long appendedMessages;
+	long appendedBytes;
+	long segmentsCreated;
+	long segmentsDeleted;
+	long replayedMessages;
+	long replayedBytes;
+} SessionLogStats;
+
+/**
+ * @brief Called for every range of messages a replay covers, in order
+ *
+ * @params fd Segment file, open for reading until the call returns
+ * @params offset Offset of the range in the file
+ * @params len Length of the range
+ * @params messages Number of messages in the range
+ * @params mapped The range in the segment's mapping
+ * @params context Passed through from sessionLog_replay
+ * @returns 0 to go on, -1 to stop the replay
+ */
+typedef int (*LogReplayVisitor)(int fd, long offset, long len, unsigned long messages,
+								const unsigned char *mapped, void *context);
+
+/**
+ * @brief Opens a session's log, creating it if it doesn't exist. Messages a crash
+ * left half written at the end of a segment are cut off.
+ *
+ * @params directory Directory holding the logs of all sessions
+ * @params name Session name
+ * @params segmentBytes Size a segment rolls over at, at least LOG_MIN_SEGMENT_BYTES
+ * @params retainBytes Size the oldest segments are deleted above
+ * @returns New SessionLog, NULL if the directory or a segment can't be opened
+ */
+SessionLog *
+sessionLog_open(const char *directory, const char *name, long segmentBytes, long retainBytes);
+
+/**
+ * @brief Appends a serialized packet, rolling over to a new segment if it doesn't fit
+ *
+ * @params log SessionLog to append to
+ * @params parts Pieces of the packet, written with one writev
+ * @params count Number of pieces
+ * @returns Sequence number of the message, -1 if it couldn't be written
+ */
+long
+sessionLog_append(SessionLog *log, const struct iovec *parts, int count);
+
+/**
+ * @brief Sequence number of the oldest message the log still holds
+ */
+unsigned long
+sessionLog_first(SessionLog *log);
+
+/**
+ * @brief Hands the messages between two sequence numbers to the visitor, one range
+ * per segment, without reading them
+ *
+ * @params log SessionLog to replay
+ * @params fromSeq First message to replay, older ones than the log holds are skipped
+ * @params toSeq Message to stop before
+ * @params visitor Called for every range
+ * @params context Passed through to the visitor
+ * @returns Number of messages replayed, -1 if a segment couldn't be opened or the
+ * visitor stopped
+ */
+long
+sessionLog_replay(SessionLog *log, unsigned long fromSeq, unsigned long toSeq, LogReplayVisitor visitor,
+				  void *context);
+
+/**
+ * @brief Closes the log, the segment files stay
+ *
+ * @params log SessionLog to close, may be NULL
+ */
+void
+sessionLog_close(SessionLog *log);
+
+/**
+ * @brief Copies the process wide log metrics
+ *
+ * @params stats Returns the metrics
+ */
+void
+sessionLog_getStats(SessionLogStats *stats);
+
+#endif
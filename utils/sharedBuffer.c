@@ -0,0 +1,98 @@
+//
+// Reference counted buffer implementation
+
+#include "sharedBuffer.h"
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+/**
+ * @brief Creates a shared buffer holding a copy of the bytes, with one reference
+ *
+ * @params bytes Bytes to copy
+ * @params len Number of bytes
+ * @returns New SharedBuffer
+ */
+SharedBuffer *
+sb_create(unsigned char *bytes, int len)
+{
+	SharedBuffer *buffer = (SharedBuffer *)pool_alloc(sizeof(SharedBuffer) + len);
+	buffer->refCount = 1;
+	buffer->len = len;
+	memcpy(buffer->data, bytes, len);
+	recordPayloadCopy();
+
+	return buffer;
+}
+
+/**
+ * @brief Serializes the packet into a new shared buffer, with one reference
+ *
+ * @params packet Packet to serialize
+ * @params format WIRE_ASCII or WIRE_BINARY
+ * @returns New SharedBuffer
+ */
+SharedBuffer *
+sb_fromPacket(Packet *packet, int format)
+{
+	int len;
+	unsigned char *bytes = encodePacket(packet, format, &len);
+	SharedBuffer *buffer = sb_create(bytes, len);
+	pool_free(bytes);
+
+	return buffer;
+}
+
+/**
+ * @brief Creates a shared buffer holding bytes read from a file, with one reference
+ *
+ * @params fd File to read
+ * @params offset Offset of the bytes in the file
+ * @params len Number of bytes
+ * @returns New SharedBuffer, NULL if the file couldn't be read
+ */
+SharedBuffer *
+sb_fromFile(int fd, long offset, int len)
+{
+	SharedBuffer *buffer = (SharedBuffer *)pool_alloc(sizeof(SharedBuffer) + len);
+	buffer->refCount = 1;
+	buffer->len = len;
+	int read = 0;
+	while (read < len) {
+		ssize_t result = pread(fd, buffer->data + read, len - read, offset + read);
+		if (result <= 0) {
+			pool_free(buffer);
+			return NULL;
+		}
+		read += result;
+	}
+	recordPayloadCopy();
+
+	return buffer;
+}
+
+/**
+ * @brief Takes another reference to the buffer
+ *
+ * @params buffer SharedBuffer to retain
+ * @returns The same buffer
+ */
+SharedBuffer *
+sb_retain(SharedBuffer *buffer)
+{
+	__atomic_add_fetch(&buffer->refCount, 1, __ATOMIC_RELAXED);
+	return buffer;
+}
+
+/**
+ * @brief Drops a reference, freeing the buffer when it was the last one
+ *
+ * @params buffer SharedBuffer to release
+ */
+void
+sb_release(SharedBuffer *buffer)
+{
+	if (buffer != NULL && __atomic_sub_fetch(&buffer->refCount, 1, __ATOMIC_ACQ_REL) == 0) {
+		pool_free(buffer);
+	}
+}
@@ -0,0 +1,70 @@
+//
+// Reference counted buffer header
+
+#pragma once
+#ifndef SHAREDBUFFER_H_
+#define SHAREDBUFFER_H_
+
+#include "transport.h"
+
+/**
+ * Immutable, reference counted serialized packet. A broadcast is encoded once into
+ * a SharedBuffer and every recipient's send path holds a reference to it; the
+ * buffer is freed when the last reference is released.
+ */
+typedef struct _SharedBuffer
+{
+	int refCount;
+	int len;
+	unsigned char data[];
+} SharedBuffer;
+
+/**
+ * @brief Creates a shared buffer holding a copy of the bytes, with one reference
+ *
+ * @params bytes Bytes to copy
+ * @params len Number of bytes
+ * @returns New SharedBuffer
+ */
+SharedBuffer *
+sb_create(unsigned char *bytes, int len);
+
+/**
+ * @brief Serializes the packet into a new shared buffer, with one reference
+ *
+ * @params packet Packet to serialize
+ * @params format WIRE_ASCII or WIRE_BINARY
+ * @returns New SharedBuffer
+ */
+SharedBuffer *
+sb_fromPacket(Packet *packet, int format);
+
+/**
+ * @brief Creates a shared buffer holding bytes read from a file, with one reference
+ *
+ * @params fd File to read
+ * @params offset Offset of the bytes in the file
+ * @params len Number of bytes
+ * @returns New SharedBuffer, NULL if the file couldn't be read
+ */
+SharedBuffer *
+sb_fromFile(int fd, long offset, int len);
+
+/**
+ * @brief Takes another reference to the buffer
+ *
+ * @params buffer SharedBuffer to retain
+ * @returns The same buffer
+ */
+SharedBuffer *
+sb_retain(SharedBuffer *buffer);
+
+/**
+ * @brief Drops a reference, freeing the buffer when it was the last one
+ *
+ * @params buffer SharedBuffer to release
+ */
+void
+sb_release(SharedBuffer *buffer);
+
+#endif
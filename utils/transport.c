@@ -3,10 +3,54 @@
 
 
 #include "transport.h"
+#include "pool.h"
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
 
+/* Copies of packet data, see recordPayloadCopy */
+static long copies;
+
+/**
+ * @brief Allocates a packet from the pool with an empty header and room for
+ * capacity bytes of data. The data isn't zeroed, only its first size bytes are
+ * ever read.
+ *
+ * @params capacity Payload bytes the packet can hold, at most MAX_DATA
+ * @returns Packet to release with pool_free
+ */
+Packet *
+allocPacket(unsigned int capacity)
+{
+	Packet *packet = (Packet *)pool_alloc(sizeof(Packet) + capacity);
+	packet->type = 0;
+	packet->size = 0;
+	packet->capacity = capacity;
+	packet->id = 0;
+	memset(packet->source, 0, MAX_NAME);
+	return packet;
+}
+
+/**
+ * @brief Allocates a packet holding a copy of the given data
+ *
+ * @params type Packet type
+ * @params data Payload to copy
+ * @params size Length of the payload, at most MAX_DATA
+ * @returns Packet to release with pool_free
+ */
+Packet *
+allocDataPacket(unsigned int type, const void *data, unsigned int size)
+{
+	Packet *packet = allocPacket(size);
+	packet->type = type;
+	packet->size = size;
+	if (size > 0) {
+		memcpy(packet->data, data, size);
+	}
+	return packet;
+}
+
 /** 
  * @brief Converts a Packet into a serialized byte array for transport
  *
@@ -20,11 +64,21 @@ packetToByteArray(Packet *packet, int *len)
 
 	// sprintf always adds a null, causing size issues, but it returns the
 	// actual number of bytes written. Write to a temporary buffer. 
-	int chars = sprintf(sprintfBuf, "%d:%d:%s:", packet->type, packet->size,
+	int chars;
+	if (packet->id != 0) {
+		chars = sprintf(sprintfBuf, "%d.%u:%d:%s:", packet->type, packet->id, packet->size,
 						(char *)packet->source);
-	unsigned char *buf = (unsigned char *)calloc(packet->size, sizeof(unsigned char) + chars);
+	}
+	else {
+		chars = sprintf(sprintfBuf, "%d:%d:%s:", packet->type, packet->size,
+						(char *)packet->source);
+	}
+	unsigned char *buf = (unsigned char *)pool_alloc(chars + packet->size);
 	memcpy(buf, sprintfBuf, chars);
 	memcpy(buf + chars, packet->data, packet->size);
+	if (packet->size > 0) {
+		recordPayloadCopy();
+	}
 
 	*len = chars + packet->size;
 
@@ -40,13 +94,12 @@ packetToByteArray(Packet *packet, int *len)
 Packet *
 bytesToPacket(unsigned char *string, int packetLength)
 {
-	Packet *packet = (Packet *)calloc(1, sizeof(Packet));
-	char content[MAX_DATA];
+	Packet *packet;
 	char clientId[MAX_NAME];
 	int colon_counter = 0, i = 0, content_start = 0, content_size = 0;
 
 	if (packetLength == 0) {
-		return packet;
+		return allocPacket(0);
 	}
 
 	while (1) {
@@ -58,53 +111,416 @@ bytesToPacket(unsigned char *string, int packetLength)
 		if (colon_counter == 3) {
 			content_start = i;
 			content_size = packetLength - i;
-			memcpy(content, string + i, content_size);
 			break;
 		}
 	}
 		
 	// Parse the header
-	int type, size;
-	// Create a temporary header
-	char *header = (char *)calloc(content_start+1, sizeof(char));
-	memcpy(header, string, content_start - 1);
-	header[content_start] = '\0';
-
-	// Parse out the type, size, and clientId strings	
-	sscanf(header, "%d:%d:%s:%*s", &type, &size, clientId);
+	int type = 0, size = 0;
+	// Copy the header without its last colon so it can be scanned as a string
+	char header[ASCII_MAX_HEADER + 1];
+	int headerLen = content_start - 1 < ASCII_MAX_HEADER ? content_start - 1 : ASCII_MAX_HEADER;
+	memcpy(header, string, headerLen);
+	header[headerLen] = '\0';
+
+	// Parse out the type, id, size, and clientId strings
+	clientId[0] = '\0';
+	unsigned int id = 0;
+	int fieldLen = 0;
+	sscanf(header, "%d%n", &type, &fieldLen);
+	if (header[fieldLen] == '.') {
+		int idLen = 0;
+		sscanf(header + fieldLen + 1, "%u%n", &id, &idLen);
+		fieldLen += 1 + idLen;
+	}
+	sscanf(header + fieldLen, ":%d:%63s", &size, clientId);
 	int clientIdLen = strlen(clientId);
 
-	// Free allocated header
-	free(header);
-
-	// Build the packet
+	// Build the packet, the data is copied straight out of the frame
+	if (content_size > MAX_DATA) {
+		content_size = MAX_DATA;
+	}
+	if (size < 0 || size > content_size) {
+		size = content_size;
+	}
+	packet = allocPacket(content_size);
 	packet->type = type;
 	packet->size = size;
+	packet->id = id;
 	memcpy(packet->source, clientId, clientIdLen);
-	memcpy(packet->data, content, size);
+	memcpy(packet->data, string + content_start, content_size);
+	if (content_size > 0) {
+		recordPayloadCopy();
+	}
 
 	return packet;
 }
 
+/**
+ * @brief Writes a little-endian 32 bit integer
+ */
+static void
+binaryPutInt(unsigned char *bytes, unsigned int value)
+{
+	bytes[0] = value & 0xFF;
+	bytes[1] = (value >> 8) & 0xFF;
+	bytes[2] = (value >> 16) & 0xFF;
+	bytes[3] = (value >> 24) & 0xFF;
+}
+
+/**
+ * @brief Reads a little-endian 32 bit integer
+ */
+static unsigned int
+binaryGetInt(const unsigned char *bytes)
+{
+	return bytes[0] | (bytes[1] << 8) | (bytes[2] << 16) | ((unsigned int)bytes[3] << 24);
+}
+
+/**
+ * @brief Length of a binary frame's header, including the request id if it has one.
+ * Needs the first BINARY_HEADER_SIZE bytes of the frame.
+ */
+static unsigned int
+binaryHeaderLength(const unsigned char *bytes)
+{
+	return BINARY_HEADER_SIZE + ((bytes[3] & BINARY_FLAG_REQUEST_ID) ? BINARY_REQUEST_ID_SIZE : 0);
+}
+
+/**
+ * @brief Converts a Packet into a binary frame for transport
+ *
+ * @param packet Packet to Convert
+ * @param len Returns the length of the byte array created
+ */
+unsigned char *
+packetToBinary(Packet *packet, int *len)
+{
+	int sourceLen = strnlen((char *)packet->source, MAX_NAME);
+	int headerLen = BINARY_HEADER_SIZE + (packet->id != 0 ? BINARY_REQUEST_ID_SIZE : 0);
+	int total = headerLen + sourceLen + packet->size;
+	unsigned char *buf = (unsigned char *)pool_alloc(total);
+
+	buf[0] = BINARY_MAGIC;
+	buf[1] = (unsigned char)packet->type;
+	buf[2] = (unsigned char)sourceLen;
+	buf[3] = packet->id != 0 ? BINARY_FLAG_REQUEST_ID : 0;
+	binaryPutInt(buf + 4, packet->size);
+	if (packet->id != 0) {
+		binaryPutInt(buf + BINARY_HEADER_SIZE, packet->id);
+	}
+	memcpy(buf + headerLen, packet->source, sourceLen);
+	memcpy(buf + headerLen + sourceLen, packet->data, packet->size);
+	if (packet->size > 0) {
+		recordPayloadCopy();
+	}
+
+	*len = total;
+	return buf;
+}
+
+/**
+ * @brief Convert a binary frame back into a Packet. Malformed frames produce an
+ * empty packet, the same as an empty ASCII frame.
+ *
+ * @param bytes Byte array of the frame
+ * @param packetLength Length of the byte array
+ */
+Packet *
+binaryToPacket(unsigned char *bytes, int packetLength)
+{
+	Packet *packet;
+
+	if (packetLength < BINARY_HEADER_SIZE || bytes[0] != BINARY_MAGIC) {
+		return allocPacket(0);
+	}
+
+	unsigned int headerLen = binaryHeaderLength(bytes);
+	unsigned int sourceLen = bytes[2];
+	unsigned int size = binaryGetInt(bytes + 4);
+
+	// Leave room for the source's null terminator
+	if (sourceLen >= MAX_NAME || size > MAX_DATA ||
+		headerLen + sourceLen + size > (unsigned int)packetLength) {
+		return allocPacket(0);
+	}
+
+	packet = allocPacket(size);
+	packet->type = bytes[1];
+	packet->size = size;
+	if (headerLen > BINARY_HEADER_SIZE) {
+		packet->id = binaryGetInt(bytes + BINARY_HEADER_SIZE);
+	}
+	memcpy(packet->source, bytes + headerLen, sourceLen);
+	memcpy(packet->data, bytes + headerLen + sourceLen, size);
+	if (size > 0) {
+		recordPayloadCopy();
+	}
+
+	return packet;
+}
+
+/**
+ * @brief Detects the wire format of a serialized packet from its first byte
+ *
+ * @param bytes Byte array of the packet
+ * @param packetLength Length of the byte array
+ * @returns WIRE_BINARY or WIRE_ASCII
+ */
+int
+packetFormat(unsigned char *bytes, int packetLength)
+{
+	if (packetLength > 0 && bytes[0] == BINARY_MAGIC) {
+		return WIRE_BINARY;
+	}
+	return WIRE_ASCII;
+}
+
+/**
+ * @brief Serializes a Packet in the given wire format
+ *
+ * @param packet Packet to Convert
+ * @param format WIRE_ASCII or WIRE_BINARY
+ * @param len Returns the length of the byte array created
+ */
+unsigned char *
+encodePacket(Packet *packet, int format, int *len)
+{
+	if (format == WIRE_BINARY) {
+		return packetToBinary(packet, len);
+	}
+	return packetToByteArray(packet, len);
+}
+
+/**
+ * @brief Converts a serialized packet of either wire format back into a Packet
+ *
+ * @param bytes Byte array of the packet
+ * @param packetLength Length of the byte array
+ */
+Packet *
+decodePacket(unsigned char *bytes, int packetLength)
+{
+	if (packetFormat(bytes, packetLength) == WIRE_BINARY) {
+		return binaryToPacket(bytes, packetLength);
+	}
+	return bytesToPacket(bytes, packetLength);
+}
+
+/**
+ * @brief Parses the header of a complete serialized packet of either wire format
+ * without copying anything. Frames the view can't represent exactly the way
+ * decodePacket would are refused, callers fall back to decoding them.
+ *
+ * @param bytes Byte array of the packet
+ * @param packetLength Length of the byte array
+ * @param view Returns the parsed packet
+ * @returns 0 on success, -1 if the packet has to be decoded instead
+ */
+int
+viewPacket(unsigned char *bytes, int packetLength, PacketView *view)
+{
+	if (packetLength <= 0) {
+		return -1;
+	}
+
+	if (bytes[0] == BINARY_MAGIC) {
+		if (packetLength < BINARY_HEADER_SIZE) {
+			return -1;
+		}
+		unsigned int headerLen = binaryHeaderLength(bytes);
+		unsigned int sourceLen = bytes[2];
+		unsigned int size = binaryGetInt(bytes + 4);
+		if (sourceLen >= MAX_NAME || size > MAX_DATA ||
+			headerLen + sourceLen + size > (unsigned int)packetLength) {
+			return -1;
+		}
+		view->type = bytes[1];
+		view->size = size;
+		view->id = headerLen > BINARY_HEADER_SIZE ? binaryGetInt(bytes + BINARY_HEADER_SIZE) : 0;
+		view->source = bytes + headerLen;
+		view->sourceLen = sourceLen;
+		view->data = bytes + headerLen + sourceLen;
+		return 0;
+	}
+
+	// ASCII "type[.id]:size:source:data", only plain decimal fields and sources that
+	// sscanf would read whole are taken
+	unsigned int fields[3] = { 0, 0, 0 };
+	int i = 0, field;
+	for (field = 0; field < 3; field++) {
+		int start = i;
+		while (i < packetLength && bytes[i] >= '0' && bytes[i] <= '9' && i - start < 9) {
+			fields[field] = fields[field] * 10 + (bytes[i] - '0');
+			i++;
+		}
+		if (i == start || i >= packetLength) {
+			return -1;
+		}
+		// The id follows the type after a dot
+		if (field == 0 && bytes[i] == '.') {
+			i++;
+			continue;
+		}
+		if (bytes[i] != ':') {
+			return -1;
+		}
+		i++;
+		if (field == 0) {
+			field++;
+		}
+	}
+
+	int sourceStart = i;
+	while (i < packetLength && bytes[i] != ':') {
+		if (bytes[i] <= ' ') {
+			return -1;
+		}
+		i++;
+	}
+	int sourceLen = i - sourceStart;
+	if (i >= packetLength || sourceLen >= MAX_NAME) {
+		return -1;
+	}
+	i++;
+
+	int contentSize = packetLength - i;
+	if (contentSize > MAX_DATA) {
+		return -1;
+	}
+	view->type = fields[0];
+	view->id = fields[1];
+	view->size = fields[2] <= (unsigned int)contentSize ? fields[2] : (unsigned int)contentSize;
+	view->source = bytes + sourceStart;
+	view->sourceLen = sourceLen;
+	view->data = bytes + i;
+	return 0;
+}
+
+/**
+ * @brief Counts one copy of a packet's data made by the codec or the send path
+ */
+void
+recordPayloadCopy()
+{
+	__atomic_add_fetch(&copies, 1, __ATOMIC_RELAXED);
+}
+
+/**
+ * @brief Returns the number of times packet data was copied since the process started
+ */
+long
+payloadCopies()
+{
+	return __atomic_load_n(&copies, __ATOMIC_RELAXED);
+}
+
+/**
+ * @brief Determines the length of the serialized packet at the start of a byte stream
+ *
+ * @param bytes Received bytes, starting at a packet boundary
+ * @param available Number of received bytes
+ * @returns Length of the complete packet, 0 if more bytes are needed to know or
+ * complete it, -1 if the bytes can't be the start of a packet
+ */
+int
+frameLength(unsigned char *bytes, int available)
+{
+	if (available <= 0) {
+		return 0;
+	}
+
+	if (bytes[0] == BINARY_MAGIC) {
+		if (available < BINARY_HEADER_SIZE) {
+			return 0;
+		}
+		unsigned int sourceLen = bytes[2];
+		unsigned int size = binaryGetInt(bytes + 4);
+		if (sourceLen >= MAX_NAME || size > MAX_DATA) {
+			return -1;
+		}
+		int total = binaryHeaderLength(bytes) + sourceLen + size;
+		return total <= available ? total : 0;
+	}
+
+	// ASCII "type[.id]:size:source:" header, type, id and size must be decimal numbers
+	int i, colons = 0, dots = 0;
+	long size = 0;
+	int limit = available < ASCII_MAX_HEADER ? available : ASCII_MAX_HEADER;
+	for (i = 0; i < limit; i++) {
+		unsigned char c = bytes[i];
+		if (c == ':') {
+			colons++;
+			if (colons == 1 && i == 0) {
+				return -1;
+			}
+			if (colons == 3) {
+				int total = i + 1 + size;
+				return total <= available ? total : 0;
+			}
+		}
+		else if (colons == 0 && c == '.' && i > 0 && dots == 0) {
+			dots++;
+		}
+		else if (colons < 2) {
+			if (c < '0' || c > '9') {
+				return -1;
+			}
+			if (colons == 1) {
+				size = size * 10 + (c - '0');
+				if (size > MAX_DATA) {
+					return -1;
+				}
+			}
+		}
+	}
+
+	// No third colon within the longest possible header
+	return limit == ASCII_MAX_HEADER ? -1 : 0;
+}
+
+/**
+ * @brief Copies a client ID into a packet's source, cut off at MAX_NAME - 1 bytes
+ * so the source stays null terminated
+ *
+ * @param packet Packet to fill in
+ * @param clientID ClientID string
+ */
+static void
+setPacketSource(Packet *packet, const char *clientID)
+{
+	memcpy(packet->source, clientID, strnlen(clientID, MAX_NAME - 1));
+}
+
 /**
  * @brief Helper to create a login packet
  *
  * @param clientID ClientID string
  * @param password Password string
+ * @param wireFormat Wire format to request from the server
+ * @param requestIds 1 to offer tagging requests with ids
+ * @param compression 1 to offer receiving compressed messages
  * @returns Formatted login packet
  */
 Packet *
-getLoginPacket(char *clientID, char *password)
+getLoginPacket(char *clientID, char *password, int wireFormat, int requestIds, int compression)
 {
-	Packet *packet = (Packet *)calloc(1, sizeof(Packet));
+	Packet *packet;
 	char buf[MAX_NAME+MAX_DATA+2];
-	int bytes = sprintf(buf, "%s,%s", clientID, password);
-	int clientIdLen = strlen(clientID);
-
-	packet->type = LOGIN;
-	packet->size = bytes;
-	memcpy(packet->source, clientID, clientIdLen);
-	memcpy(packet->data, buf, bytes);
+	int bytes;
+	// Servers that don't know the capabilities only read the first two fields
+	bytes = snprintf(buf, sizeof(buf), "%s,%s", clientID, password);
+	if (wireFormat == WIRE_BINARY) {
+		bytes += snprintf(buf + bytes, sizeof(buf) - bytes, ",%s", WIRE_BINARY_CAPABILITY);
+	}
+	if (requestIds) {
+		bytes += snprintf(buf + bytes, sizeof(buf) - bytes, ",%s", REQUEST_IDS_CAPABILITY);
+	}
+	if (compression) {
+		bytes += snprintf(buf + bytes, sizeof(buf) - bytes, ",%s", COMPRESSION_CAPABILITY);
+	}
+	packet = allocDataPacket(LOGIN, buf, bytes);
+	setPacketSource(packet, clientID);
 
 	return packet;
 }
@@ -118,13 +534,11 @@ getLoginPacket(char *clientID, char *password)
 Packet *
 getLogoutPacket(char *clientID)
 {
-	Packet *packet = (Packet *)calloc(1, sizeof(Packet));
-	int clientIdLen = strlen(clientID);
+	Packet *packet = allocPacket(0);
 
 	packet->type = EXIT;
 	packet->size = 0;
-	memcpy(packet->source, clientID, clientIdLen);
-	memset(packet->data, 0, MAX_DATA);
+	setPacketSource(packet, clientID);
 
 	return packet;
 }
@@ -138,19 +552,49 @@ getLogoutPacket(char *clientID)
 Packet *
 getListPacket(char *clientID)
 {
-	Packet *packet = (Packet *)calloc(1, sizeof(Packet));
-	char buf[MAX_NAME+MAX_DATA+2];
-	int bytes = sprintf(buf, "%s", clientID);
 	int clientIdLen = strlen(clientID);
+	Packet *packet = allocDataPacket(QUERY, clientID, clientIdLen);
+
+	setPacketSource(packet, clientID);
+
+	return packet;
+}
+
+/**
+ * @brief Helper to create a stats packet
+ *
+ * @param clientID ClientID string
+ * @returns Formatted stats packet
+ */
+Packet *
+getStatsPacket(char *clientID)
+{
+	Packet *packet = allocPacket(0);
 
-	packet->type = QUERY;
-	packet->size = bytes;
-	memcpy(packet->source, clientID, clientIdLen);
-	memcpy(packet->data, buf, bytes);
+	packet->type = STATS;
+	setPacketSource(packet, clientID);
 
 	return packet;
 }
 
+/**
+ * @brief Name of a packet type, for logs and metrics
+ *
+ * @param type Packet type
+ * @returns Static name, "?" for types this build doesn't know
+ */
+const char *
+packetTypeName(unsigned int type)
+{
+	static const char *names[] = {
+		"?", "LOGIN", "LO_ACK", "LO_NAK", "EXIT", "JOIN", "JN_ACK", "JN_NAK",
+		"LEAVE_SESS", "LS_ACK", "LS_NACK", "NEW_SESS", "NS_ACK", "NS_NAK", "MESSAGE",
+		"MESSAGE_ACK", "MESSAGE_NCK", "QUERY", "QU_ACK", "QU_NACK", "UNKNOWN", "STATS",
+		"ST_ACK", "ST_NACK", "MESSAGE_DEFLATE", "MESSAGE_CHUNK"
+	};
+	return type < sizeof(names) / sizeof(names[0]) ? names[type] : "?";
+}
+
 /**
  * @brief Helper to create a message packet
  *
@@ -161,23 +605,72 @@ getListPacket(char *clientID)
 Packet *
 getMessagePacket(char *clientID, char *sessionName, char *contents)
 {
-	Packet *packet = (Packet *)calloc(1, sizeof(Packet));
-
-	int size = strlen(contents) + 1 + strlen(sessionName);
-	char *buf = (char *)calloc(size, sizeof(char));
+	// Contents that don't fit are cut off at MAX_DATA
+	int size = snprintf(NULL, 0, "%s;%s", sessionName, contents);
+	if (size >= MAX_DATA) {
+		size = MAX_DATA - 1;
+	}
 
-	sprintf(buf, "%s;%s", sessionName, contents);
+	// Room for the null snprintf writes after the data
+	Packet *packet = allocPacket(size + 1);
+	snprintf((char *)packet->data, size + 1, "%s;%s", sessionName, contents);
 
 	packet->type = MESSAGE;
 	packet->size = size;
-	memcpy(packet->source, clientID, strlen(clientID));
-	memcpy(packet->data, buf, packet->size);
+	setPacketSource(packet, clientID);
+
+	return packet;
+}
+
+/**
+ * @brief Helper to create a packet carrying a piece of a message larger than
+ * MAX_DATA. The data is "session;transfer;last;text", where transfer numbers the
+ * sender's chunked messages and last is 1 on the final chunk. The server forwards
+ * every chunk as it arrives like a MESSAGE, recipients put the pieces together.
+ *
+ * @param clientID ClientID string
+ * @param sessionName Session the message goes to
+ * @param transfer Number of the chunked message
+ * @param last 1 for the final chunk
+ * @param text Piece of the message
+ * @param len Length of the piece, at most messageChunkCapacity(sessionName)
+ * @returns Formatted message chunk packet
+ */
+Packet *
+getMessageChunkPacket(char *clientID, char *sessionName, unsigned int transfer, int last, const char *text, int len)
+{
+	char header[MAX_DATA];
+	int headerLen = snprintf(header, sizeof(header), "%s;%u;%d;", sessionName, transfer, last ? 1 : 0);
+	if (headerLen >= MAX_DATA) {
+		headerLen = MAX_DATA - 1;
+	}
+	if (len > MAX_DATA - headerLen) {
+		len = MAX_DATA - headerLen;
+	}
 
-	free(buf);
+	Packet *packet = allocPacket(headerLen + len);
+	packet->type = MESSAGE_CHUNK;
+	packet->size = headerLen + len;
+	memcpy(packet->data, header, headerLen);
+	memcpy(packet->data + headerLen, text, len);
+	setPacketSource(packet, clientID);
 
 	return packet;
 }
 
+/**
+ * @brief Most text a chunk for the session can carry
+ *
+ * @param sessionName Session the message goes to
+ * @returns Bytes of text per chunk, 0 or less if the name leaves no room
+ */
+int
+messageChunkCapacity(char *sessionName)
+{
+	// The largest transfer number and the two separators after it
+	return MAX_DATA - (int)strlen(sessionName) - (int)strlen(";4294967295;1;");
+}
+
 /**
  * @brief Helper to create a new session packet
  *
@@ -188,12 +681,9 @@ getMessagePacket(char *clientID, char *sessionName, char *contents)
 Packet *
 getNewSessionPacket(char *clientID, char *sessionID) 
 {
-	Packet *packet = (Packet *)calloc(1, sizeof(Packet));
+	Packet *packet = allocDataPacket(NEW_SESS, sessionID, strlen(sessionID));
 
-	packet->type = NEW_SESS;
-	packet->size = strlen(sessionID);
-	memcpy(packet->source, clientID, strlen(clientID));
-	memcpy(packet->data, sessionID, strlen(sessionID));
+	setPacketSource(packet, clientID);
 
 	return packet;
 }
@@ -208,12 +698,9 @@ getNewSessionPacket(char *clientID, char *sessionID)
 Packet *
 getJoinSessionPacket(char *clientID, char *sessionID) 
 {
-    Packet *packet = (Packet *)calloc(1, sizeof(Packet));
+    Packet *packet = allocDataPacket(JOIN, sessionID, strlen(sessionID));
 
-    packet->type = JOIN;
-    packet->size = strlen(sessionID);
-    memcpy(packet->source, clientID, strlen(clientID));
-    memcpy(packet->data, sessionID, strlen(sessionID));
+    setPacketSource(packet, clientID);
 
 	return packet;
 }
@@ -228,13 +715,9 @@ getJoinSessionPacket(char *clientID, char *sessionID)
 Packet *
 getLeaveSessionPacket(char *clientID, char *sessionID) 
 {
-	Packet *packet = (Packet *)calloc(1, sizeof(Packet));
-	int len = strlen(sessionID);
+	Packet *packet = allocDataPacket(LEAVE_SESS, sessionID, strlen(sessionID));
 
-	packet->type = LEAVE_SESS;
-	packet->size = len;
-	memcpy(packet->source, clientID, strlen(clientID));
-	memcpy(packet->data, sessionID, len);	
+	setPacketSource(packet, clientID);
 	
 	return packet;
 }
\ No newline at end of file
@@ -5,10 +5,15 @@
 #ifndef TRANSPORT_H_
 #define TRANSPORT_H_
 
+/* Packets and byte arrays returned here come from the pool, release them with pool_free */
+#include "pool.h"
+
 /* Configurable Packet Dimensions */
 #define MAX_NAME 64
 #define MAX_DATA 2048
-#define MAX_PACKET_SIZE MAX_NAME+MAX_DATA+3*sizeof(unsigned int)
+/* Longest session name, the server refuses to create or join longer ones */
+#define MAX_SESSION_NAME (MAX_NAME - 1)
+#define MAX_PACKET_SIZE MAX_NAME+MAX_DATA+4*sizeof(unsigned int)
 
 /* Packet Type Definitions */
 #define LOGIN 1
@@ -31,18 +36,108 @@
 #define QU_ACK 18
 #define QU_NACK 19
 #define UNKNOWN 20
+#define STATS 21
+#define ST_ACK 22
+#define ST_NACK 23
+/* MESSAGE whose text is compressed, see COMPRESSION_CAPABILITY */
+#define MESSAGE_DEFLATE 24
+/* Piece of a message too large for one packet, see getMessageChunkPacket */
+#define MESSAGE_CHUNK 25
+
+/* Wire formats */
+#define WIRE_ASCII 0
+#define WIRE_BINARY 1
+#define WIRE_FORMATS 2
+
+/* Capability appended to the LOGIN data by clients that speak the binary format */
+#define WIRE_BINARY_CAPABILITY "binary"
+
+/* Capability appended to the LOGIN data by clients that tag requests with ids.
+ * Servers that accept it append it to the LO_ACK data after the client name and
+ * copy the id of every request into its response. */
+#define REQUEST_IDS_CAPABILITY "ids"
+
+/* Capability appended to the LOGIN data by clients that can inflate messages.
+ * Servers that accept it append it to the LO_ACK data too, comma separated from
+ * the other accepted capabilities, and forward messages to the client as
+ * MESSAGE_DEFLATE: "session;" followed by the text compressed with the session's
+ * deflate stream. The stream restarts whenever a client joins the session. */
+#define COMPRESSION_CAPABILITY "deflate"
+
+/*
+ * Binary frame layout, all integers little-endian:
+ *   magic(1) type(1) sourceLen(1) flags(1) size(4) [id(4)] source(sourceLen) data(size)
+ * The magic byte is never an ASCII digit, so the first byte of a frame tells the
+ * two formats apart. The id is only there when flags has BINARY_FLAG_REQUEST_ID.
+ */
+#define BINARY_MAGIC 0xC7
+#define BINARY_HEADER_SIZE 8
+#define BINARY_FLAG_REQUEST_ID 0x01
+#define BINARY_REQUEST_ID_SIZE 4
+
+/*
+ * ASCII frames are "type:size:source:data", or "type.id:size:source:data" for
+ * requests with an id. Longest possible header: three 10 digit numbers, a source,
+ * the dot and three colons.
+ */
+#define ASCII_MAX_HEADER (3*10+MAX_NAME+4)
+
+/* Bytes read from a socket at once, may hold many packets */
+#define RECV_BUFFER_SIZE 65536
 
 /**
- * Transport packet, used to represent data sent via TCP
+ * Transport packet, used to represent data sent via TCP. The payload is stored
+ * inline right after the header and only as large as the packet was allocated
+ * for, so empty ACKs and short chat lines fit the small pool classes instead of
+ * always carrying MAX_DATA bytes.
  */
 typedef struct _Packet
 {
 	unsigned int type;
 	unsigned int size;
+	unsigned int capacity;
+	/* Request id, copied from a request into its response, 0 for none */
+	unsigned int id;
 	unsigned char source[MAX_NAME];
-	unsigned char data[MAX_DATA];
+	unsigned char data[];
 } Packet;
 
+/**
+ * Packet parsed in place, its source and data point into the serialized bytes
+ * and stay valid only as long as they do
+ */
+typedef struct _PacketView
+{
+	unsigned int type;
+	unsigned int size;
+	unsigned int id;
+	const unsigned char *source;
+	int sourceLen;
+	const unsigned char *data;
+} PacketView;
+
+/**
+ * @brief Allocates a packet from the pool with an empty header and room for
+ * capacity bytes of data. The data isn't zeroed, only its first size bytes are
+ * ever read.
+ *
+ * @params capacity Payload bytes the packet can hold, at most MAX_DATA
+ * @returns Packet to release with pool_free
+ */
+Packet *
+allocPacket(unsigned int capacity);
+
+/**
+ * @brief Allocates a packet holding a copy of the given data
+ *
+ * @params type Packet type
+ * @params data Payload to copy
+ * @params size Length of the payload, at most MAX_DATA
+ * @returns Packet to release with pool_free
+ */
+Packet *
+allocDataPacket(unsigned int type, const void *data, unsigned int size);
+
 /** 
  * @brief Converts a Packet into a serialized byte array for transport
  *
@@ -61,15 +156,102 @@ packetToByteArray(Packet *packet, int* len);
 Packet *
 bytesToPacket(unsigned char *string, int packetLength);
 
+/**
+ * @brief Converts a Packet into a binary frame for transport
+ *
+ * @param packet Packet to Convert
+ * @param len Returns the length of the byte array created
+ */
+unsigned char *
+packetToBinary(Packet *packet, int *len);
+
+/**
+ * @brief Convert a binary frame back into a Packet. Malformed frames produce an
+ * empty packet, the same as an empty ASCII frame.
+ *
+ * @param bytes Byte array of the frame
+ * @param packetLength Length of the byte array
+ */
+Packet *
+binaryToPacket(unsigned char *bytes, int packetLength);
+
+/**
+ * @brief Detects the wire format of a serialized packet from its first byte
+ *
+ * @param bytes Byte array of the packet
+ * @param packetLength Length of the byte array
+ * @returns WIRE_BINARY or WIRE_ASCII
+ */
+int
+packetFormat(unsigned char *bytes, int packetLength);
+
+/**
+ * @brief Serializes a Packet in the given wire format
+ *
+ * @param packet Packet to Convert
+ * @param format WIRE_ASCII or WIRE_BINARY
+ * @param len Returns the length of the byte array created
+ */
+unsigned char *
+encodePacket(Packet *packet, int format, int *len);
+
+/**
+ * @brief Converts a serialized packet of either wire format back into a Packet
+ *
+ * @param bytes Byte array of the packet
+ * @param packetLength Length of the byte array
+ */
+Packet *
+decodePacket(unsigned char *bytes, int packetLength);
+
+/**
+ * @brief Parses the header of a complete serialized packet of either wire format
+ * without copying anything. Frames the view can't represent exactly the way
+ * decodePacket would are refused, callers fall back to decoding them.
+ *
+ * @param bytes Byte array of the packet
+ * @param packetLength Length of the byte array
+ * @param view Returns the parsed packet
+ * @returns 0 on success, -1 if the packet has to be decoded instead
+ */
+int
+viewPacket(unsigned char *bytes, int packetLength, PacketView *view);
+
+/**
+ * @brief Counts one copy of a packet's data made by the codec or the send path
+ */
+void
+recordPayloadCopy();
+
+/**
+ * @brief Returns the number of times packet data was copied since the process started
+ */
+long
+payloadCopies();
+
+/**
+ * @brief Determines the length of the serialized packet at the start of a byte stream
+ *
+ * @param bytes Received bytes, starting at a packet boundary
+ * @param available Number of received bytes
+ * @returns Length of the complete packet, 0 if more bytes are needed to know or
+ * complete it, -1 if the bytes can't be the start of a packet
+ */
+int
+frameLength(unsigned char *bytes, int available);
+
 /**
  * @brief Helper to create a login packet
  *
  * @param clientID ClientID string
  * @param password Password string
+ * @param wireFormat Wire format to request from the server
+ * @param requestIds 1 to offer tagging requests with ids
+ * @param compression 1 to offer receiving compressed messages
  * @returns Formatted login packet
  */
 Packet *
-getLoginPacket(char *clientID, char *password);
+getLoginPacket(char *clientID, char *password, int wireFormat, int requestIds, int compression);
 
 /**
  * @brief Helper to create a logout packet
@@ -89,6 +271,24 @@ getLogoutPacket(char *clientID);
 Packet *
 getListPacket(char *clientID);
 
+/**
+ * @brief Helper to create a stats packet
+ *
+ * @param clientID ClientID string
+ * @returns Formatted stats packet
+ */
+Packet *
+getStatsPacket(char *clientID);
+
+/**
+ * @brief Name of a packet type, for logs and metrics
+ *
+ * @param type Packet type
+ * @returns Static name, "?" for types this build doesn't know
+ */
+const char *
+packetTypeName(unsigned int type);
+
 /**
  * @brief Helper to create a message packet
  *
@@ -99,6 +299,32 @@ getListPacket(char *clientID);
 Packet *
 getMessagePacket(char *clientID, char *sessionName, char *contents);
 
+/**
+ * @brief Helper to create a packet carrying a piece of a message larger than
+ * MAX_DATA. The data is "session;transfer;last;text", where transfer numbers the
+ * sender's chunked messages and last is 1 on the final chunk. The server forwards
+ * every chunk as it arrives like a MESSAGE, recipients put the pieces together.
+ *
+ * @param clientID ClientID string
+ * @param sessionName Session the message goes to
+ * @param transfer Number of the chunked message
+ * @param last 1 for the final chunk
+ * @param text Piece of the message
+ * @param len Length of the piece, at most messageChunkCapacity(sessionName)
+ * @returns Formatted message chunk packet
+ */
+Packet *
+getMessageChunkPacket(char *clientID, char *sessionName, unsigned int transfer, int last, const char *text, int len);
+
+/**
+ * @brief Most text a chunk for the session can carry
+ *
+ * @param sessionName Session the message goes to
+ * @returns Bytes of text per chunk, 0 or less if the name leaves no room
+ */
+int
+messageChunkCapacity(char *sessionName);
+
 /**
  * @brief Helper to create a new session packet
  *